@@ -0,0 +1,529 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    accuracysketch.cpp
+
+Abstract:
+
+    Keeps per server, per hour quantile sketches of the offset from the
+    reference clock (and the RTT) on disk, so accuracy percentiles over a
+    day or a week come from merging a few hundred small sketches instead of
+    rescanning the raw monitoring logs.
+
+    ingest  adds the output of TimeSampleCorrelation (optionally through
+            MedianFilter) for one server to the store. Lines are
+            "date, offset, rtt[, ...]" in us; the absolute offset is kept,
+            as Show-Percentiles.ps1 does.
+    report  prints the 68th, 95th and 99.7th offset percentiles of every
+            server (or one) over a range of hours.
+    series  prints the same percentiles per hour, day or week for one
+            server, in a form gnuplot reads directly.
+
+    The store holds STORE/<server>/<yyyyMMddHH>.sketch, each an offset and
+    an RTT DDSketch with 1% relative accuracy, and STORE/<server>/ingested,
+    the time range of every file ingested for the server. Merged samples
+    can't be taken back out of a sketch, so a file overlapping a range
+    already ingested is refused rather than counted twice.
+
+--*/
+
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <map>
+#include "CommandLine/CommandLine.h"
+#include "TimeSamples/TimeSamples.h"
+#include "Sketch/DDSketch.h"
+
+static const double Percentiles[] = { 0.68, 0.95, 0.997 };
+
+enum Period {
+    Hour,
+    Day,
+    Week
+};
+
+struct HourSketch
+{
+    DDSketch Offset = DDSketch(0.01, 0.01);
+    DDSketch Rtt = DDSketch(0.01, 0.01);
+
+    bool Merge(const HourSketch & Other)
+    {
+        return Offset.Merge(Other.Offset) && Rtt.Merge(Other.Rtt);
+    }
+};
+
+// Days since 1970-01-01 of a civil date
+long long DaysFromCivil(long long Year, unsigned Month, unsigned Day)
+{
+    Year -= Month <= 2;
+    long long era = (Year >= 0 ? Year : Year - 399) / 400;
+    unsigned yoe = static_cast<unsigned>(Year - era * 400);
+    unsigned doy = (153 * (Month + (Month > 2 ? -3 : 9)) + 2) / 5 + Day - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<long long>(doe) - 719468;
+}
+
+void CivilFromDays(long long Days, int & Year, int & Month, int & Day)
+{
+    Days += 719468;
+    long long era = (Days >= 0 ? Days : Days - 146096) / 146097;
+    unsigned doe = static_cast<unsigned>(Days - era * 146097);
+    unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    unsigned mp = (5 * doy + 2) / 153;
+    Day = static_cast<int>(doy - (153 * mp + 2) / 5 + 1);
+    Month = static_cast<int>(mp < 10 ? mp + 3 : mp - 9);
+    Year = static_cast<int>(yoe + era * 400 + (Month <= 2));
+}
+
+// Hours since 1970-01-01 00:00 in the time zone the dates were written in
+typedef long long THour;
+
+inline THour HourFromKey(long long Key)
+{
+    return DaysFromCivil(Key / 1000000, (Key / 10000) % 100, (Key / 100) % 100) * 24 + Key % 100;
+}
+
+inline long long KeyFromHour(THour Hour)
+{
+    int year;
+    int month;
+    int day;
+    CivilFromDays(Hour / 24, year, month, day);
+    return ((year * 100ll + month) * 100 + day) * 100 + Hour % 24;
+}
+
+// Parse the date DateTime.ToString() writes in the en-US culture, e.g.
+// "10/19/2026 3:04:05 PM", or an ISO 8601 date such as "2026-10-19 15:04:05",
+// to its hour and the second within the hour
+bool ParseDate(const char * p, const char * End, THour & Hour, int & Second)
+{
+    int numbers[6] = { 0 };
+    int count = 0;
+    bool pm = false;
+    bool am = false;
+    while (p < End && count < 6)
+    {
+        if (*p >= '0' && *p <= '9')
+        {
+            int v = 0;
+            for (; p < End && *p >= '0' && *p <= '9'; p++)
+            {
+                v = v * 10 + (*p - '0');
+            }
+            numbers[count++] = v;
+            continue;
+        }
+        p++;
+    }
+    for (; p < End; p++)
+    {
+        pm |= *p == 'P' || *p == 'p';
+        am |= *p == 'A' || *p == 'a';
+    }
+    if (count < 4)
+    {
+        return false;
+    }
+
+    int year;
+    int month;
+    int day;
+    if (numbers[0] > 31)
+    {
+        year = numbers[0];
+        month = numbers[1];
+        day = numbers[2];
+    }
+    else
+    {
+        month = numbers[0];
+        day = numbers[1];
+        year = numbers[2];
+    }
+    int hour = numbers[3];
+    if (pm && hour < 12)
+    {
+        hour += 12;
+    }
+    else if (am && hour == 12)
+    {
+        hour = 0;
+    }
+    if (month < 1 || month > 12 || day < 1 || day > 31 || hour > 23)
+    {
+        return false;
+    }
+    Hour = DaysFromCivil(year, month, day) * 24 + hour;
+    Second = numbers[4] * 60 + numbers[5];
+    return true;
+}
+
+std::string SketchPath(const std::string & Store, const std::string & Server, THour Hour)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%010lld.sketch", KeyFromHour(Hour));
+    return Store + "/" + Server + name;
+}
+
+bool ReadSketch(const std::string & Path, HourSketch & Sketch)
+{
+    FILE * input = fopen(Path.c_str(), "rb");
+    if (input == nullptr)
+    {
+        return false;
+    }
+    bool ok = Sketch.Offset.Read(input) && Sketch.Rtt.Read(input);
+    fclose(input);
+    return ok;
+}
+
+// Write through a temporary file so a reader never sees half a sketch
+bool WriteSketch(const std::string & Path, const HourSketch & Sketch)
+{
+    std::string temp = Path + ".tmp";
+    FILE * output = fopen(temp.c_str(), "wb");
+    if (output == nullptr)
+    {
+        return false;
+    }
+    bool ok = Sketch.Offset.Write(output) && Sketch.Rtt.Write(output);
+    ok = fclose(output) == 0 && ok;
+    return ok && rename(temp.c_str(), Path.c_str()) == 0;
+}
+
+// One line of the ingested list: the first and last sample of a file, in
+// seconds since 1970 in the time zone of the dates, and the file's name
+struct IngestedRange
+{
+    long long First;
+    long long Last;
+    std::string FileName;
+};
+
+std::vector<IngestedRange> ReadIngested(const std::string & Path)
+{
+    std::vector<IngestedRange> ranges;
+    FILE * input = fopen(Path.c_str(), "r");
+    if (input == nullptr)
+    {
+        return ranges;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), input))
+    {
+        IngestedRange range;
+        int name = 0;
+        if (sscanf(line, "%lld %lld %n", &range.First, &range.Last, &name) >= 2 && name > 0)
+        {
+            range.FileName = line + name;
+            range.FileName.erase(range.FileName.find_last_not_of("\r\n") + 1);
+            ranges.push_back(range);
+        }
+    }
+    fclose(input);
+    return ranges;
+}
+
+bool WriteIngested(const std::string & Path, const std::vector<IngestedRange> & Ranges)
+{
+    std::string temp = Path + ".tmp";
+    FILE * output = fopen(temp.c_str(), "w");
+    if (output == nullptr)
+    {
+        return false;
+    }
+    for (auto & range : Ranges)
+    {
+        fprintf(output, "%lld %lld %s\n", range.First, range.Last, range.FileName.c_str());
+    }
+    bool ok = fclose(output) == 0;
+    return ok && rename(temp.c_str(), Path.c_str()) == 0;
+}
+
+int Ingest(const std::string & Store, const std::string & Server, const std::string & FileName, size_t OffsetColumn, size_t RttColumn)
+{
+    MappedFile file(FileName);
+    if (!file.IsOpen())
+    {
+        printf("unable to read %s\n", FileName.c_str());
+        return -1;
+    }
+
+    std::map<THour, HourSketch> hours;
+    IngestedRange range = { LLONG_MAX, LLONG_MIN, FileName };
+    const char * end = file.Data() + file.Length();
+    const char * fields[16];
+    size_t samples = 0;
+    for (const char * p = file.Data(); p < end; )
+    {
+        const char * eol = static_cast<const char *>(memchr(p, '\n', end - p));
+        eol = eol == nullptr ? end : eol;
+        size_t count = 0;
+        fields[count++] = p;
+        for (const char * c = p; count < 16 && (c = static_cast<const char *>(memchr(c, ',', eol - c))) != nullptr; c++)
+        {
+            fields[count++] = c + 1;
+        }
+        const char * line = p;
+        p = eol + 1;
+
+        if (count <= std::max(OffsetColumn, RttColumn))
+        {
+            continue;
+        }
+
+        THour hour;
+        int second;
+        double offset;
+        double rtt;
+        const char * o = fields[OffsetColumn];
+        const char * r = fields[RttColumn];
+        if (!ParseDate(line, fields[1] - 1, hour, second) ||
+            !ParseDouble(o, eol, offset) ||
+            !ParseDouble(r, eol, rtt))
+        {
+            continue;
+        }
+        range.First = std::min(range.First, hour * 3600 + second);
+        range.Last = std::max(range.Last, hour * 3600 + second);
+        HourSketch & sketch = hours[hour];
+        sketch.Offset.Add(fabs(offset));
+        sketch.Rtt.Add(fabs(rtt));
+        samples++;
+    }
+
+    if (samples == 0)
+    {
+        fprintf(stderr, "%s: no samples in %s\n", Server.c_str(), FileName.c_str());
+        return 0;
+    }
+
+    // Refuse a file whose samples overlap a file already ingested. The
+    // range is recorded before the sketches are updated, so a failure in
+    // between leaves hours short of samples rather than counting any twice.
+    std::string folder = Store + "/" + Server;
+    std::string ingestedPath = folder + "/ingested";
+    std::vector<IngestedRange> ingested = ReadIngested(ingestedPath);
+    for (auto & other : ingested)
+    {
+        if (range.First <= other.Last && other.First <= range.Last)
+        {
+            printf("%s overlaps %s, already ingested for %s; not ingested\n", FileName.c_str(), other.FileName.c_str(), Server.c_str());
+            return -1;
+        }
+    }
+    ingested.push_back(range);
+    mkdir(Store.c_str(), 0755);
+    mkdir(folder.c_str(), 0755);
+    if (!WriteIngested(ingestedPath, ingested))
+    {
+        printf("unable to write %s\n", ingestedPath.c_str());
+        return -1;
+    }
+    for (auto & h : hours)
+    {
+        std::string path = SketchPath(Store, Server, h.first);
+        HourSketch existing;
+        if (ReadSketch(path, existing))
+        {
+            h.second.Merge(existing);
+        }
+        if (!WriteSketch(path, h.second))
+        {
+            printf("unable to write %s\n", path.c_str());
+            return -1;
+        }
+    }
+    fprintf(stderr, "%s: %zu samples in %zu hours\n", Server.c_str(), samples, hours.size());
+    return 0;
+}
+
+// Merge the sketches of Server for hours [From, To], keyed by the period
+// they fall in
+std::map<THour, HourSketch> MergeRange(const std::string & Store, const std::string & Server, THour From, THour To, Period Grouping)
+{
+    std::map<THour, HourSketch> periods;
+    for (THour h = From; h <= To; h++)
+    {
+        HourSketch sketch;
+        if (!ReadSketch(SketchPath(Store, Server, h), sketch))
+        {
+            continue;
+        }
+        THour key = h;
+        if (Grouping == Day)
+        {
+            key = h - h % 24;
+        }
+        else if (Grouping == Week)
+        {
+            // Weeks start on Monday; 1970-01-01 was a Thursday
+            long long days = h / 24;
+            key = (days - (days + 3) % 7) * 24;
+        }
+        periods[key].Merge(sketch);
+    }
+    return periods;
+}
+
+void PrintPercentiles(char * Line, size_t Length, const HourSketch & Sketch)
+{
+    snprintf(Line, Length, "%llu, %.1f, %.1f, %.1f, %.1f",
+        Sketch.Offset.Count(),
+        Sketch.Offset.Quantile(Percentiles[0]),
+        Sketch.Offset.Quantile(Percentiles[1]),
+        Sketch.Offset.Quantile(Percentiles[2]),
+        Sketch.Rtt.Quantile(0.5));
+}
+
+std::vector<std::string> ListServers(const std::string & Store)
+{
+    std::vector<std::string> servers;
+    DIR * dir = opendir(Store.c_str());
+    if (dir == nullptr)
+    {
+        return servers;
+    }
+    for (dirent * entry = readdir(dir); entry != nullptr; entry = readdir(dir))
+    {
+        if (entry->d_name[0] != '.')
+        {
+            servers.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(servers.begin(), servers.end());
+    return servers;
+}
+
+int Report(const std::string & Store, const std::string & Server, THour From, THour To, size_t Threads)
+{
+    std::vector<std::string> servers = Server.empty() ? ListServers(Store) : std::vector<std::string>(1, Server);
+    std::vector<std::string> lines(servers.size());
+    std::vector<std::thread> workers;
+    std::atomic<size_t> next(0);
+    for (size_t t = 0; t < Threads; t++)
+    {
+        workers.push_back(std::thread([&]()
+        {
+            for (size_t i = next++; i < servers.size(); i = next++)
+            {
+                HourSketch total;
+                for (auto & p : MergeRange(Store, servers[i], From, To, Hour))
+                {
+                    total.Merge(p.second);
+                }
+                if (total.Offset.Count() == 0)
+                {
+                    continue;
+                }
+                char line[256];
+                PrintPercentiles(line, sizeof(line), total);
+                lines[i] = servers[i] + ", " + line;
+            }
+        }));
+    }
+    for (auto & w : workers)
+    {
+        w.join();
+    }
+
+    printf("SERVER, SAMPLES, P68, P95, P99.7, RTT_P50\n");
+    for (auto & line : lines)
+    {
+        if (!line.empty())
+        {
+            printf("%s\n", line.c_str());
+        }
+    }
+    return 0;
+}
+
+int Series(const std::string & Store, const std::string & Server, THour From, THour To, Period Grouping)
+{
+    // gnuplot: set datafile separator ","; set xdata time;
+    // set timefmt "%Y-%m-%d %H:%M:%S"; plot "file" using 1:3 with lines
+    printf("# TIME, SAMPLES, P68, P95, P99.7, RTT_P50 (us)\n");
+    for (auto & p : MergeRange(Store, Server, From, To, Grouping))
+    {
+        int year;
+        int month;
+        int day;
+        char line[256];
+        CivilFromDays(p.first / 24, year, month, day);
+        PrintPercentiles(line, sizeof(line), p.second);
+        printf("%04d-%02d-%02d %02lld:00:00, %s\n", year, month, day, p.first % 24, line);
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::map<std::string, std::string> args = ParseCommandLine(argc, argv, 2);
+    std::string command = argc > 1 ? argv[1] : "";
+    if (args.find("store") == args.end() ||
+        (command != "ingest" && command != "report" && command != "series"))
+    {
+        printf("usage: %s ingest -store <dir> -server <name> -file <correlation.csv> [-offset <column>] [-rtt <column>]\n", argv[0]);
+        printf("       %s report -store <dir> [-server <name>] -from <yyyyMMddHH> -to <yyyyMMddHH> [-threads <count>]\n", argv[0]);
+        printf("       %s series -store <dir> -server <name> -from <yyyyMMddHH> -to <yyyyMMddHH> [-period <hour/day/week>]\n", argv[0]);
+        return -1;
+    }
+    std::string store = args["store"];
+    std::string server = args.find("server") != args.end() ? args["server"] : "";
+    if (args.find("threads") != args.end())
+    {
+        threads = std::max(1, atoi(args["threads"].c_str()));
+    }
+
+    if (command == "ingest")
+    {
+        if (server.empty() || args.find("file") == args.end())
+        {
+            printf("ingest needs -server and -file\n");
+            return -1;
+        }
+        size_t offset = args.find("offset") != args.end() ? strtoul(args["offset"].c_str(), nullptr, 10) : 1;
+        size_t rtt = args.find("rtt") != args.end() ? strtoul(args["rtt"].c_str(), nullptr, 10) : 2;
+        if (offset == 0 || rtt == 0 || offset >= 16 || rtt >= 16)
+        {
+            printf("offset and rtt columns must be between 1 and 15\n");
+            return -1;
+        }
+        return Ingest(store, server, args["file"], offset, rtt);
+    }
+
+    if (args.find("from") == args.end() || args.find("to") == args.end())
+    {
+        printf("%s needs -from and -to\n", command.c_str());
+        return -1;
+    }
+    THour from = HourFromKey(strtoll(args["from"].c_str(), nullptr, 10));
+    THour to = HourFromKey(strtoll(args["to"].c_str(), nullptr, 10));
+
+    if (command == "report")
+    {
+        return Report(store, server, from, to, threads);
+    }
+
+    Period grouping = Hour;
+    if (args.find("period") != args.end())
+    {
+        grouping = args["period"] == "day" ? Day : args["period"] == "week" ? Week : Hour;
+    }
+    if (server.empty())
+    {
+        printf("series needs -server\n");
+        return -1;
+    }
+    return Series(store, server, from, to, grouping);
+}
@@ -0,0 +1,589 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    hiccup.cpp
+
+Abstract:
+
+    Finds the times a CPU stops running the program: SMIs, interrupts,
+    preemption and, in a VM, the host descheduling the vCPU. A thread
+    pinned to each CPU spins reading the TSC and every gap between two
+    reads above the threshold is queued, without locks, for the main
+    thread. Once per interval the main thread collects the gaps and the
+    per CPU /proc/interrupts and /proc/stat steal counts, so each CPU's
+    summary shows how often and how long it stalled, which interrupt
+    sources and how much steal time moved with the stalls, and, with access
+    to /dev/cpu/N/msr, how many SMIs ran. A machine whose CPUs stall for
+    tens of microseconds can't bracket clock reads tightly.
+
+--*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <x86intrin.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "CommandLine/CommandLine.h"
+#include "Ring/SpscRing.h"
+#include "TscCalibration/TscCalibration.h"
+
+// CPU list in the sysfs format, e.g. 0-3,8,10-11
+std::vector<int> ParseCpuList(const std::string & List)
+{
+    std::vector<int> cpus;
+    std::stringstream stream(List);
+    std::string range;
+    while (std::getline(stream, range, ','))
+    {
+        int first;
+        int last;
+        int fields = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (fields == 1)
+        {
+            cpus.push_back(first);
+        }
+        else if (fields == 2)
+        {
+            for (int cpu = first; cpu <= last; cpu++)
+            {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+
+std::vector<int> OnlineCpus()
+{
+    FILE * file = fopen("/sys/devices/system/cpu/online", "r");
+    char line[4096] = { 0 };
+    if (file != nullptr)
+    {
+        if (fgets(line, sizeof(line), file) == nullptr)
+        {
+            line[0] = 0;
+        }
+        fclose(file);
+    }
+    std::vector<int> cpus = ParseCpuList(line);
+    if (cpus.empty())
+    {
+        for (unsigned int cpu = 0; cpu < std::thread::hardware_concurrency(); cpu++)
+        {
+            cpus.push_back(static_cast<int>(cpu));
+        }
+    }
+    return cpus;
+}
+
+// Per CPU columns of /proc/interrupts by source, e.g. "LOC" or "24"
+std::map<std::string, std::vector<unsigned long long>> ReadInterrupts(const std::vector<int> & Cpus)
+{
+    std::map<std::string, std::vector<unsigned long long>> counts;
+    FILE * file = fopen("/proc/interrupts", "r");
+    if (file == nullptr)
+    {
+        return counts;
+    }
+
+    // The header names the CPU of each column
+    char line[65536];
+    std::vector<int> column(Cpus.size(), -1);
+    if (fgets(line, sizeof(line), file) != nullptr)
+    {
+        std::stringstream header(line);
+        std::string name;
+        for (int index = 0; header >> name; index++)
+        {
+            int cpu;
+            if (sscanf(name.c_str(), "CPU%d", &cpu) != 1)
+            {
+                continue;
+            }
+            for (size_t i = 0; i < Cpus.size(); i++)
+            {
+                if (Cpus[i] == cpu)
+                {
+                    column[i] = index;
+                }
+            }
+        }
+    }
+    while (fgets(line, sizeof(line), file) != nullptr)
+    {
+        char * colon = strchr(line, ':');
+        if (colon == nullptr)
+        {
+            continue;
+        }
+        *colon = 0;
+        std::string source = line;
+        source.erase(0, source.find_first_not_of(' '));
+
+        // Counts come first, one per CPU, then the description
+        std::vector<unsigned long long> values;
+        char * cursor = colon + 1;
+        for (;;)
+        {
+            char * end;
+            unsigned long long value = strtoull(cursor, &end, 10);
+            if (end == cursor)
+            {
+                break;
+            }
+            values.push_back(value);
+            cursor = end;
+        }
+        std::vector<unsigned long long> & cpuCounts = counts[source];
+        cpuCounts.assign(Cpus.size(), 0);
+        for (size_t i = 0; i < Cpus.size(); i++)
+        {
+            if (column[i] >= 0 && static_cast<size_t>(column[i]) < values.size())
+            {
+                cpuCounts[i] = values[column[i]];
+            }
+        }
+    }
+    fclose(file);
+    return counts;
+}
+
+// Steal time of each CPU from /proc/stat, in microseconds
+std::vector<double> ReadSteal(const std::vector<int> & Cpus)
+{
+    std::vector<double> steal(Cpus.size(), 0);
+    FILE * file = fopen("/proc/stat", "r");
+    if (file == nullptr)
+    {
+        return steal;
+    }
+    double tick = 1e6 / sysconf(_SC_CLK_TCK);
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != nullptr)
+    {
+        int cpu;
+        unsigned long long user, nice, system, idle, iowait, irq, softirq, stolen;
+        if (sscanf(line, "cpu%d %llu %llu %llu %llu %llu %llu %llu %llu",
+            &cpu, &user, &nice, &system, &idle, &iowait, &irq, &softirq, &stolen) != 9)
+        {
+            continue;
+        }
+        for (size_t i = 0; i < Cpus.size(); i++)
+        {
+            if (Cpus[i] == cpu)
+            {
+                steal[i] = stolen * tick;
+            }
+        }
+    }
+    fclose(file);
+    return steal;
+}
+
+// MSR_SMI_COUNT (0x34) of Intel CPUs, -1 without the msr driver or access
+long long ReadSmiCount(int Cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/cpu/%d/msr", Cpu);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    unsigned long long value;
+    bool ok = pread(fd, &value, sizeof(value), 0x34) == sizeof(value);
+    close(fd);
+    return ok ? static_cast<long long>(value & 0xffffffff) : -1;
+}
+
+struct Gap
+{
+    unsigned long long Tsc;     // Last read before the gap
+    unsigned long long Length;  // In TSC ticks
+};
+
+// Spins on one CPU, queueing every gap above the threshold
+class Spinner
+{
+public:
+    Spinner(int Cpu, unsigned long long Threshold, size_t Capacity) :
+        Ring(Capacity),
+        Dropped(0),
+        Pinned(false),
+        cpu(Cpu),
+        threshold(Threshold),
+        stop(false)
+    {
+    }
+
+    // The ring's indices are on their own cache lines, which plain new
+    // doesn't honor before C++17
+    static void * operator new(size_t Size)
+    {
+        void * memory = nullptr;
+        if (posix_memalign(&memory, alignof(Spinner), Size) != 0)
+        {
+            throw std::bad_alloc();
+        }
+        return memory;
+    }
+
+    static void operator delete(void * Memory)
+    {
+        free(Memory);
+    }
+
+    void Start()
+    {
+        thread = std::thread([this]() { Spin(); });
+    }
+
+    void Stop()
+    {
+        stop.store(true, std::memory_order_relaxed);
+        thread.join();
+    }
+
+    SpscRing<Gap> Ring;
+    std::atomic<unsigned long long> Dropped;
+    std::atomic<bool> Pinned;
+
+private:
+    void Spin()
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        Pinned.store(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0);
+
+        unsigned long long last = __rdtsc();
+        while (!stop.load(std::memory_order_relaxed))
+        {
+            unsigned long long now = __rdtsc();
+            if (now - last > threshold && !Ring.Push({ last, now - last }))
+            {
+                Dropped.fetch_add(1, std::memory_order_relaxed);
+            }
+            last = now;
+        }
+    }
+
+    int cpu;
+    unsigned long long threshold;
+    std::atomic<bool> stop;
+    std::thread thread;
+};
+
+// Gap durations in octaves from the threshold, the last bucket open ended
+const size_t DurationBuckets = 12;
+
+struct CpuSummary
+{
+    unsigned long long Gaps = 0;
+    double Total = 0;   // us
+    double Worst = 0;   // us
+    unsigned long long Durations[DurationBuckets] = { 0 };
+
+    // Per interval series for the frequency histogram and correlations
+    std::vector<double> IntervalGaps;
+    std::vector<double> IntervalTime;
+    std::vector<double> IntervalSteal;
+    std::map<std::string, std::vector<double>> IntervalInterrupts;
+};
+
+double Correlation(const std::vector<double> & A, const std::vector<double> & B)
+{
+    size_t n = std::min(A.size(), B.size());
+    double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        sa += A[i];
+        sb += B[i];
+        saa += A[i] * A[i];
+        sbb += B[i] * B[i];
+        sab += A[i] * B[i];
+    }
+    double va = saa - sa * sa / n;
+    double vb = sbb - sb * sb / n;
+    return n > 2 && va > 0 && vb > 0 ? (sab - sa * sb / n) / sqrt(va * vb) : 0;
+}
+
+void PrintSummary(int Cpu, const CpuSummary & Summary, double Threshold, double Interval, double Seconds,
+    long long Smis, unsigned long long Dropped, bool Pinned)
+{
+    printf("CPU %d%s: %llu gaps, %.1f/s, worst %.1fus, %.4f%% of the time lost",
+        Cpu,
+        Pinned ? "" : " (not pinned)",
+        Summary.Gaps,
+        Summary.Gaps / Seconds,
+        Summary.Worst,
+        Summary.Total / (Seconds * 1e4));
+    if (Smis >= 0)
+    {
+        printf(", %lld SMIs", Smis);
+    }
+    if (Dropped > 0)
+    {
+        printf(", %llu gaps dropped", Dropped);
+    }
+    printf("\n");
+
+    printf("  Duration:");
+    for (size_t b = 0; b < DurationBuckets; b++)
+    {
+        if (Summary.Durations[b] == 0)
+        {
+            continue;
+        }
+        double low = Threshold * ldexp(1.0, static_cast<int>(b));
+        if (b + 1 < DurationBuckets)
+        {
+            printf(" %.0f-%.0fus:%llu", low, 2 * low, Summary.Durations[b]);
+        }
+        else
+        {
+            printf(" >%.0fus:%llu", low, Summary.Durations[b]);
+        }
+    }
+    printf("\n");
+
+    // Gaps per interval: 0, 1, 2-3, 4-7, ...
+    std::map<int, size_t> frequency;
+    for (double count : Summary.IntervalGaps)
+    {
+        frequency[count == 0 ? -1 : static_cast<int>(log2(count))]++;
+    }
+    printf("  Gaps per %.0fms interval:", Interval * 1e3);
+    for (auto & f : frequency)
+    {
+        if (f.first < 0)
+        {
+            printf(" 0:%zu", f.second);
+        }
+        else if (f.first == 0)
+        {
+            printf(" 1:%zu", f.second);
+        }
+        else
+        {
+            printf(" %d-%d:%zu", 1 << f.first, (2 << f.first) - 1, f.second);
+        }
+    }
+    printf("\n");
+
+    // What moved with the lost time, the busiest sources first
+    double steal = 0;
+    for (double s : Summary.IntervalSteal)
+    {
+        steal += s;
+    }
+    printf("  Steal %.0fus, correlation with lost time %.2f\n", steal, Correlation(Summary.IntervalTime, Summary.IntervalSteal));
+    std::vector<std::pair<double, std::string>> sources;
+    for (auto & source : Summary.IntervalInterrupts)
+    {
+        double total = 0;
+        for (double count : source.second)
+        {
+            total += count;
+        }
+        if (total > 0)
+        {
+            sources.push_back(std::make_pair(total, source.first));
+        }
+    }
+    std::sort(sources.rbegin(), sources.rend());
+    for (size_t i = 0; i < sources.size() && i < 8; i++)
+    {
+        printf("  Interrupts %s: %.0f, correlation with gaps %.2f\n",
+            sources[i].second.c_str(),
+            sources[i].first,
+            Correlation(Summary.IntervalGaps, Summary.IntervalInterrupts.at(sources[i].second)));
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    std::map<std::string, std::string> args = ParseCommandLine(argc, argv);
+    if (args.find("help") != args.end() || args.find("?") != args.end())
+    {
+        printf("usage: %s [-cpus <list, e.g. 0-3,8>] [-threshold <us>] [-duration <s>] [-interval <ms>] [-gaps <csv file>]\n", argv[0]);
+        exit(-1);
+    }
+    std::vector<int> online = OnlineCpus();
+    std::vector<int> cpus = args.find("cpus") != args.end() ? ParseCpuList(args["cpus"]) : online;
+
+    // The main thread wakes every 10ms to drain the rings, which preempts
+    // the spinner of its CPU, so it runs on a CPU outside the watched set:
+    // the first online CPU, left out of the default set when there are others
+    if (args.find("cpus") == args.end() && online.size() > 1)
+    {
+        cpus.erase(cpus.begin());
+    }
+    int mainCpu = -1;
+    for (int cpu : online)
+    {
+        if (std::find(cpus.begin(), cpus.end(), cpu) == cpus.end())
+        {
+            mainCpu = cpu;
+            break;
+        }
+    }
+    double threshold = args.find("threshold") != args.end() ? std::max(0.1, atof(args["threshold"].c_str())) : 10;
+    double duration = args.find("duration") != args.end() ? std::max(1.0, atof(args["duration"].c_str())) : 10;
+    double interval = args.find("interval") != args.end() ? std::max(10.0, atof(args["interval"].c_str())) / 1e3 : 1;
+    FILE * gapFile = nullptr;
+    if (args.find("gaps") != args.end())
+    {
+        gapFile = fopen(args["gaps"].c_str(), "w");
+        if (gapFile == nullptr)
+        {
+            printf("can't write %s: %s\n", args["gaps"].c_str(), strerror(errno));
+            exit(-1);
+        }
+        fprintf(gapFile, "CPU, TSC, SECONDS, GAP_US\n");
+    }
+    if (cpus.empty())
+    {
+        printf("no CPUs to watch\n");
+        exit(-1);
+    }
+
+    if (mainCpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(mainCpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        {
+            mainCpu = -1;
+        }
+    }
+    if (mainCpu < 0)
+    {
+        printf("every CPU is watched, so the main thread's wakeups show as gaps on one of them\n");
+    }
+
+    TscFrequency tsc = TscCalibration::Calibrate();
+    double ticksPerUs = tsc.Frequency / 1e6;
+    printf("TSC %.0f Hz (%s), threshold %.1fus, %zu CPUs for %.0fs\n", tsc.Frequency, tsc.Source, threshold, cpus.size(), duration);
+
+    // Each watched CPU runs only its spinner, unless the main thread had
+    // nowhere else to go
+    std::vector<std::unique_ptr<Spinner>> spinners;
+    std::vector<CpuSummary> summaries(cpus.size());
+    std::vector<long long> smis(cpus.size());
+    for (size_t i = 0; i < cpus.size(); i++)
+    {
+        smis[i] = ReadSmiCount(cpus[i]);
+        spinners.emplace_back(new Spinner(cpus[i], static_cast<unsigned long long>(threshold * ticksPerUs), 1 << 16));
+    }
+    auto interrupts = ReadInterrupts(cpus);
+    std::vector<double> steal = ReadSteal(cpus);
+    unsigned long long start = __rdtsc();
+    for (auto & spinner : spinners)
+    {
+        spinner->Start();
+    }
+
+    auto drain = [&]()
+    {
+        for (size_t i = 0; i < cpus.size(); i++)
+        {
+            Gap gap;
+            CpuSummary & summary = summaries[i];
+            while (spinners[i]->Ring.Pop(gap))
+            {
+                double us = gap.Length / ticksPerUs;
+                size_t bucket = static_cast<size_t>(std::max(0.0, log2(us / threshold)));
+                summary.Gaps++;
+                summary.Total += us;
+                summary.Worst = std::max(summary.Worst, us);
+                summary.Durations[std::min(bucket, DurationBuckets - 1)]++;
+                summary.IntervalGaps.back()++;
+                summary.IntervalTime.back() += us;
+                if (gapFile != nullptr)
+                {
+                    fprintf(gapFile, "%d, %llu, %.6f, %.1f\n", cpus[i], gap.Tsc, (gap.Tsc - start) / tsc.Frequency, us);
+                }
+            }
+        }
+    };
+
+    auto next = std::chrono::steady_clock::now();
+    size_t intervals = static_cast<size_t>(ceil(duration / interval));
+    for (size_t k = 0; k < intervals; k++)
+    {
+        for (CpuSummary & summary : summaries)
+        {
+            summary.IntervalGaps.push_back(0);
+            summary.IntervalTime.push_back(0);
+        }
+        next += std::chrono::microseconds(static_cast<long long>(interval * 1e6));
+        while (std::chrono::steady_clock::now() < next)
+        {
+            std::this_thread::sleep_until(std::min(next, std::chrono::steady_clock::now() + std::chrono::milliseconds(10)));
+            drain();
+        }
+        drain();
+
+        auto nowInterrupts = ReadInterrupts(cpus);
+        std::vector<double> nowSteal = ReadSteal(cpus);
+        for (size_t i = 0; i < cpus.size(); i++)
+        {
+            CpuSummary & summary = summaries[i];
+            summary.IntervalSteal.push_back(nowSteal[i] - steal[i]);
+            for (auto & source : nowInterrupts)
+            {
+                auto previous = interrupts.find(source.first);
+                double delta = previous == interrupts.end() ? 0 : static_cast<double>(source.second[i] - previous->second[i]);
+                std::vector<double> & series = summary.IntervalInterrupts[source.first];
+                series.resize(k, 0);
+                series.push_back(delta);
+            }
+        }
+        interrupts.swap(nowInterrupts);
+        steal.swap(nowSteal);
+    }
+    for (auto & spinner : spinners)
+    {
+        spinner->Stop();
+    }
+    drain();
+    double seconds = (__rdtsc() - start) / tsc.Frequency;
+    if (gapFile != nullptr)
+    {
+        fclose(gapFile);
+    }
+
+    for (size_t i = 0; i < cpus.size(); i++)
+    {
+        long long now = ReadSmiCount(cpus[i]);
+        PrintSummary(cpus[i],
+            summaries[i],
+            threshold,
+            interval,
+            seconds,
+            smis[i] >= 0 && now >= 0 ? now - smis[i] : -1,
+            spinners[i]->Dropped.load(),
+            spinners[i]->Pinned.load());
+    }
+    return 0;
+}
@@ -0,0 +1,553 @@
+#pragma once
+// Block codec for columns of 64 bit integers that change almost linearly,
+// such as TSC readings and file times taken at a fixed interval.
+//
+// Rows are cut into blocks and every column of a block is stored as its
+// first value and first delta, zigzag varints, followed by the zigzag delta
+// of each delta (delta-of-delta) bit packed at a width chosen per block. A
+// sampler's TSC and time columns need a few bits per value and constant or
+// perfectly linear columns none, but a sleep that overslept makes one
+// value much wider than the rest, so the width is the one giving the
+// smallest block and wider values keep their high bits in a list of
+// exceptions after the packed ones. A column may also be stored relative
+// to the one before it, and as plain deltas rather than delta-of-deltas;
+// the encoder picks the smallest of the four per block, which turns a
+// TSC_END column into the deltas of the read window, noise that second
+// differences would only amplify.
+//
+// Fixed widths keep the decoder free of the per byte branches of varints:
+// a value is one unaligned 64 bit load, a shift and a mask, and with AVX2
+// four values are gathered, unzigzagged and prefix summed per step. Blocks
+// are independent and listed in an index at the end of the data, so any
+// row is reached by decoding one block.
+//
+//   "SERIES01" varint columns, varint block rows
+//   blocks     per column: mode byte (width up to 63, 0x80 relative to
+//              the column before, 0x40 deltas), zigzag first, zigzag
+//              first delta (two or more rows), then with three or more
+//              rows the packed values, varint exceptions and per exception
+//              varint index gap and varint high bits; 8 zero bytes after
+//              the block
+//   index      varint rows, varint blocks, 8 byte offset of every block
+//   trailer    8 byte offset of the index
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "Codec/Varint.h"
+
+// The AVX2 decoder is compiled in regardless of the compiler flags and
+// chosen at run time, as in TimeSamples.h
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#include "CpuInfo/CpuInfo.h"
+#define SERIES_CODEC_AVX2
+#if defined(_MSC_VER)
+#define SERIES_CODEC_TARGET_AVX2
+#else
+#define SERIES_CODEC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+const char SeriesMagic[] = "SERIES01";
+const unsigned char SeriesRelative = 0x80;
+const unsigned char SeriesDeltas = 0x40;
+const unsigned char SeriesWidth = 0x3f;
+
+class SeriesEncoder
+{
+public:
+    SeriesEncoder(size_t Columns, size_t BlockRows = 1024) :
+        columns(Columns),
+        blockRows(BlockRows < 3 ? 3 : BlockRows),
+        rows(0),
+        pending(Columns)
+    {
+        data.append(SeriesMagic, sizeof(SeriesMagic) - 1);
+        WriteVarint(data, columns);
+        WriteVarint(data, blockRows);
+    }
+
+    void Add(const int64_t * Row)
+    {
+        for (size_t c = 0; c < columns; c++)
+        {
+            pending[c].push_back(static_cast<uint64_t>(Row[c]));
+        }
+        rows++;
+        if (pending[0].size() == blockRows)
+        {
+            Flush();
+        }
+    }
+
+    // The encoded series; the encoder is spent afterwards
+    std::string Finish()
+    {
+        if (columns > 0 && !pending[0].empty())
+        {
+            Flush();
+        }
+        uint64_t indexOffset = data.size();
+        WriteVarint(data, rows);
+        WriteVarint(data, offsets.size());
+        for (uint64_t offset : offsets)
+        {
+            WriteFixed(offset);
+        }
+        WriteFixed(indexOffset);
+        return std::move(data);
+    }
+
+private:
+    void WriteFixed(uint64_t Value)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            data.push_back(static_cast<char>(Value >> (8 * i)));
+        }
+    }
+
+    static unsigned int BitLength(uint64_t Value)
+    {
+        unsigned int length = 0;
+        while (length < 64 && (Value >> length) != 0)
+        {
+            length++;
+        }
+        return length;
+    }
+
+    // One column of a block as Mode, without its width, to Out
+    static void EncodeColumn(const std::vector<uint64_t> & Values, unsigned char Mode, std::string & Out)
+    {
+        size_t n = Values.size();
+        std::string first;
+        WriteVarint(first, ZigZag(static_cast<int64_t>(Values[0])));
+        if (n > 1)
+        {
+            WriteVarint(first, ZigZag(static_cast<int64_t>(Values[1] - Values[0])));
+        }
+        if (n < 3)
+        {
+            Out.push_back(static_cast<char>(Mode));
+            Out += first;
+            return;
+        }
+
+        // Unsigned arithmetic wraps, so any series round trips
+        std::vector<uint64_t> zigzags(n - 2);
+        std::vector<size_t> lengths(65, 0);
+        for (size_t i = 2; i < n; i++)
+        {
+            uint64_t difference = Values[i] - Values[i - 1];
+            if ((Mode & SeriesDeltas) == 0)
+            {
+                difference -= Values[i - 1] - Values[i - 2];
+            }
+            zigzags[i - 2] = ZigZag(static_cast<int64_t>(difference));
+            lengths[BitLength(zigzags[i - 2])]++;
+        }
+
+        // Bits of the block at each width, an exception costing about a
+        // byte of index gap and its high bits in varint bytes
+        unsigned int width = SeriesWidth;
+        size_t best = ~static_cast<size_t>(0);
+        for (unsigned int w = 0; w <= SeriesWidth; w++)
+        {
+            size_t bits = zigzags.size() * w;
+            for (unsigned int length = w + 1; length <= 64; length++)
+            {
+                bits += lengths[length] * 8 * ((length - w - 1) / 7 + 2);
+            }
+            if (bits < best)
+            {
+                best = bits;
+                width = w;
+            }
+        }
+
+        Out.push_back(static_cast<char>(Mode | width));
+        Out += first;
+        std::vector<unsigned char> packed((zigzags.size() * width + 7) / 8, 0);
+        std::string exceptions;
+        size_t count = 0;
+        size_t last = 0;
+        for (size_t i = 0; i < zigzags.size(); i++)
+        {
+            size_t bit = i * width;
+            for (unsigned int b = 0; b < width; b++, bit++)
+            {
+                packed[bit >> 3] |= static_cast<unsigned char>(((zigzags[i] >> b) & 1) << (bit & 7));
+            }
+            uint64_t high = zigzags[i] >> width;
+            if (high != 0)
+            {
+                WriteVarint(exceptions, i - last);
+                WriteVarint(exceptions, high);
+                last = i;
+                count++;
+            }
+        }
+        Out.append(reinterpret_cast<const char *>(packed.data()), packed.size());
+        WriteVarint(Out, count);
+        Out += exceptions;
+    }
+
+    void Flush()
+    {
+        offsets.push_back(data.size());
+        std::string best;
+        std::string candidate;
+        std::vector<uint64_t> differences;
+        for (size_t c = 0; c < columns; c++)
+        {
+            if (c > 0)
+            {
+                differences.resize(pending[c].size());
+                for (size_t i = 0; i < differences.size(); i++)
+                {
+                    differences[i] = pending[c][i] - pending[c - 1][i];
+                }
+            }
+            best.clear();
+            const unsigned char modes[] = { 0, SeriesDeltas, SeriesRelative, SeriesRelative | SeriesDeltas };
+            for (unsigned char mode : modes)
+            {
+                if (c == 0 && (mode & SeriesRelative) != 0)
+                {
+                    break;
+                }
+                candidate.clear();
+                EncodeColumn((mode & SeriesRelative) != 0 ? differences : pending[c], mode, candidate);
+                if (best.empty() || candidate.size() < best.size())
+                {
+                    best.swap(candidate);
+                }
+            }
+            data += best;
+        }
+        for (std::vector<uint64_t> & values : pending)
+        {
+            values.clear();
+        }
+        data.append(8, '\0');
+    }
+
+    size_t columns;
+    size_t blockRows;
+    uint64_t rows;
+    std::vector<std::vector<uint64_t>> pending;
+    std::vector<uint64_t> offsets;
+    std::string data;
+};
+
+class SeriesReader
+{
+public:
+    // Data must outlive the reader
+    SeriesReader(const void * Data, size_t Size) :
+        data(static_cast<const unsigned char *>(Data)),
+        size(Size),
+        columns(0),
+        blockRows(0),
+        rows(0),
+        valid(false),
+        cachedBlock(~static_cast<size_t>(0)),
+        cachedCount(0)
+    {
+        size_t position = sizeof(SeriesMagic) - 1;
+        uint64_t value;
+        if (size < position + 8 || memcmp(data, SeriesMagic, position) != 0 ||
+            !ReadVarint(data, size, position, value))
+        {
+            return;
+        }
+        columns = static_cast<size_t>(value);
+        if (!ReadVarint(data, size, position, value) || columns == 0 || value < 3)
+        {
+            return;
+        }
+        blockRows = static_cast<size_t>(value);
+
+        position = static_cast<size_t>(ReadFixed(size - 8));
+        uint64_t blocks;
+        if (position >= size - 8 || !ReadVarint(data, size, position, value) || !ReadVarint(data, size, position, blocks) ||
+            blocks > (size - 8 - position) / 8 || blocks != (value + blockRows - 1) / blockRows)
+        {
+            return;
+        }
+        rows = value;
+        for (uint64_t b = 0; b < blocks; b++)
+        {
+            offsets.push_back(ReadFixed(position + 8 * static_cast<size_t>(b)));
+        }
+        valid = true;
+    }
+
+    bool IsValid() const
+    {
+        return valid;
+    }
+
+    size_t Columns() const
+    {
+        return columns;
+    }
+
+    uint64_t Rows() const
+    {
+        return rows;
+    }
+
+    size_t BlockRows() const
+    {
+        return blockRows;
+    }
+
+    size_t Blocks() const
+    {
+        return offsets.size();
+    }
+
+    // Decodes a block column by column, Out[c * count + i] for its count
+    // rows; returns count, 0 for a damaged block
+    size_t DecodeBlock(size_t Block, std::vector<int64_t> & Out) const
+    {
+        if (Block >= offsets.size())
+        {
+            return 0;
+        }
+        size_t count = static_cast<size_t>(Block + 1 < offsets.size() ? blockRows : rows - Block * blockRows);
+        size_t end = Block + 1 < offsets.size() ? static_cast<size_t>(offsets[Block + 1]) : size - 8;
+        Out.resize(columns * count);
+        std::vector<uint64_t> zigzags(count);
+        size_t position = static_cast<size_t>(offsets[Block]);
+        for (size_t c = 0; c < columns; c++)
+        {
+            uint64_t first;
+            uint64_t delta = 0;
+            if (position >= end)
+            {
+                return 0;
+            }
+            unsigned char mode = data[position++];
+            unsigned int width = mode & SeriesWidth;
+            if (((mode & SeriesRelative) != 0 && c == 0) ||
+                !ReadVarint(data, end, position, first) || (count > 1 && !ReadVarint(data, end, position, delta)))
+            {
+                return 0;
+            }
+            if (count > 2)
+            {
+                // The 8 bytes after every block make the last loads safe
+                size_t bytes = ((count - 2) * width + 7) / 8;
+                if (position + bytes + 8 > end)
+                {
+                    return 0;
+                }
+                Unpack(data + position, width, count - 2, zigzags.data());
+                position += bytes;
+
+                uint64_t exceptions;
+                if (!ReadVarint(data, end, position, exceptions))
+                {
+                    return 0;
+                }
+                size_t index = 0;
+                for (uint64_t e = 0; e < exceptions; e++)
+                {
+                    uint64_t gap;
+                    uint64_t high;
+                    if (!ReadVarint(data, end, position, gap) || !ReadVarint(data, end, position, high) ||
+                        gap >= count - 2 - index)
+                    {
+                        return 0;
+                    }
+                    index += static_cast<size_t>(gap);
+                    zigzags[index] |= high << width;
+                }
+            }
+
+            int64_t * out = &Out[c * count];
+            Integrate(zigzags.data(), count, (mode & SeriesDeltas) != 0, static_cast<uint64_t>(UnZigZag(first)), static_cast<uint64_t>(UnZigZag(delta)), out);
+            if ((mode & SeriesRelative) != 0)
+            {
+                const int64_t * before = out - count;
+                for (size_t i = 0; i < count; i++)
+                {
+                    out[i] = static_cast<int64_t>(static_cast<uint64_t>(out[i]) + static_cast<uint64_t>(before[i]));
+                }
+            }
+        }
+        return count;
+    }
+
+    // One row, decoding its block unless it was the last one decoded
+    bool Row(uint64_t Index, int64_t * Out)
+    {
+        if (Index >= rows)
+        {
+            return false;
+        }
+        size_t block = static_cast<size_t>(Index / blockRows);
+        if (block != cachedBlock)
+        {
+            cachedCount = DecodeBlock(block, cached);
+            cachedBlock = cachedCount > 0 ? block : ~static_cast<size_t>(0);
+            if (cachedCount == 0)
+            {
+                return false;
+            }
+        }
+        size_t i = static_cast<size_t>(Index % blockRows);
+        for (size_t c = 0; c < columns; c++)
+        {
+            Out[c] = cached[c * cachedCount + i];
+        }
+        return true;
+    }
+
+private:
+    uint64_t ReadFixed(size_t Position) const
+    {
+        uint64_t value = 0;
+        for (int i = 0; i < 8; i++)
+        {
+            value |= static_cast<uint64_t>(data[Position + i]) << (8 * i);
+        }
+        return value;
+    }
+
+    // Count values of Width bits, the low bits of each zigzag delta-of-delta
+    static void Unpack(const unsigned char * Packed, unsigned int Width, size_t Count, uint64_t * Out)
+    {
+        size_t i = 0;
+        if (Width == 0)
+        {
+            memset(Out, 0, Count * sizeof(uint64_t));
+            return;
+        }
+#if defined(SERIES_CODEC_AVX2)
+        if (Width <= 56 && UseAvx2())
+        {
+            i = UnpackAvx2(Packed, Width, Count, Out);
+        }
+#endif
+        uint64_t mask = (1ull << Width) - 1;
+        for (; i < Count; i++)
+        {
+            size_t bit = i * Width;
+            uint64_t word;
+            memcpy(&word, Packed + (bit >> 3), sizeof(word));
+            word >>= bit & 7;
+
+            // Wider than 56 bits may straddle nine bytes
+            if (Width > 56 && (bit & 7) != 0)
+            {
+                word |= static_cast<uint64_t>(Packed[(bit >> 3) + 8]) << (64 - (bit & 7));
+            }
+            Out[i] = word & mask;
+        }
+    }
+
+    // The values from the first value and delta and the zigzag deltas or
+    // delta-of-deltas of the rows after them
+    static void Integrate(const uint64_t * ZigZags, size_t Count, bool Deltas, uint64_t First, uint64_t Delta, int64_t * Out)
+    {
+        Out[0] = static_cast<int64_t>(First);
+        if (Count < 2)
+        {
+            return;
+        }
+        uint64_t value = First + Delta;
+        Out[1] = static_cast<int64_t>(value);
+        size_t i = 2;
+#if defined(SERIES_CODEC_AVX2)
+        if (UseAvx2())
+        {
+            i = IntegrateAvx2(ZigZags, Count, Deltas, value, Delta, Out);
+        }
+#endif
+        for (; i < Count; i++)
+        {
+            uint64_t difference = static_cast<uint64_t>(UnZigZag(ZigZags[i - 2]));
+            Delta = Deltas ? difference : Delta + difference;
+            value += Delta;
+            Out[i] = static_cast<int64_t>(value);
+        }
+    }
+
+#if defined(SERIES_CODEC_AVX2)
+    static bool UseAvx2()
+    {
+        static const bool avx2 = InstructionSet::AVX2Usable();
+        return avx2;
+    }
+
+    // Four values per step, gathered from their byte offsets; returns the
+    // next value
+    SERIES_CODEC_TARGET_AVX2
+    static size_t UnpackAvx2(const unsigned char * Packed, unsigned int Width, size_t Count, uint64_t * Out)
+    {
+        const __m256i mask = _mm256_set1_epi64x(static_cast<long long>((1ull << Width) - 1));
+        const __m256i seven = _mm256_set1_epi64x(7);
+        const __m256i step = _mm256_set1_epi64x(static_cast<long long>(4 * Width));
+        __m256i bits = _mm256_setr_epi64x(0, Width, 2 * Width, 3 * Width);
+        size_t i = 0;
+        for (; i + 4 <= Count; i += 4)
+        {
+            __m256i words = _mm256_i64gather_epi64(reinterpret_cast<const long long *>(Packed), _mm256_srli_epi64(bits, 3), 1);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(Out + i), _mm256_and_si256(_mm256_srlv_epi64(words, _mm256_and_si256(bits, seven)), mask));
+            bits = _mm256_add_epi64(bits, step);
+        }
+        return i;
+    }
+
+    // Inclusive prefix sum of the four lanes
+    SERIES_CODEC_TARGET_AVX2
+    static __m256i PrefixSum(__m256i X)
+    {
+        // Lanes shifted up by one and by two, zeros shifted in
+        X = _mm256_add_epi64(X, _mm256_blend_epi32(_mm256_permute4x64_epi64(X, 0x90), _mm256_setzero_si256(), 0x03));
+        return _mm256_add_epi64(X, _mm256_blend_epi32(_mm256_permute4x64_epi64(X, 0x40), _mm256_setzero_si256(), 0x0f));
+    }
+
+    // Unzigzag, then the running sums carried from lane 3 of the previous
+    // step, one for deltas and two for delta-of-deltas; returns the next row
+    SERIES_CODEC_TARGET_AVX2
+    static size_t IntegrateAvx2(const uint64_t * ZigZags, size_t Count, bool Deltas, uint64_t & Value, uint64_t & Delta, int64_t * Out)
+    {
+        const __m256i one = _mm256_set1_epi64x(1);
+        __m256i delta = _mm256_set1_epi64x(static_cast<long long>(Delta));
+        __m256i value = _mm256_set1_epi64x(static_cast<long long>(Value));
+        size_t i = 2;
+        for (; i + 4 <= Count; i += 4)
+        {
+            __m256i zigzag = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ZigZags + i - 2));
+            __m256i difference = _mm256_xor_si256(_mm256_srli_epi64(zigzag, 1), _mm256_sub_epi64(_mm256_setzero_si256(), _mm256_and_si256(zigzag, one)));
+            delta = Deltas ? difference : _mm256_add_epi64(PrefixSum(difference), delta);
+            value = _mm256_add_epi64(PrefixSum(delta), value);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(Out + i), value);
+            delta = _mm256_permute4x64_epi64(delta, 0xff);
+            value = _mm256_permute4x64_epi64(value, 0xff);
+        }
+        Delta = static_cast<uint64_t>(_mm256_extract_epi64(delta, 0));
+        Value = static_cast<uint64_t>(_mm256_extract_epi64(value, 0));
+        return i;
+    }
+#endif
+
+    const unsigned char * data;
+    size_t size;
+    size_t columns;
+    size_t blockRows;
+    uint64_t rows;
+    bool valid;
+    std::vector<uint64_t> offsets;
+    std::vector<int64_t> cached;
+    size_t cachedBlock;
+    size_t cachedCount;
+};
@@ -0,0 +1,47 @@
+#pragma once
+// Zigzag and LEB128 variable length integers, the building blocks of the
+// delta encoded series the tools store. Zigzag maps small negative and
+// positive numbers to small unsigned ones (0, -1, 1, -2 to 0, 1, 2, 3), and
+// LEB128 stores seven bits per byte, the high bit marking that more follow,
+// so a delta under 64 in magnitude takes one byte.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+inline uint64_t ZigZag(int64_t Value)
+{
+    return (static_cast<uint64_t>(Value) << 1) ^ static_cast<uint64_t>(Value >> 63);
+}
+
+inline int64_t UnZigZag(uint64_t Value)
+{
+    return static_cast<int64_t>(Value >> 1) ^ -static_cast<int64_t>(Value & 1);
+}
+
+inline void WriteVarint(std::string & Out, uint64_t Value)
+{
+    while (Value >= 0x80)
+    {
+        Out.push_back(static_cast<char>(Value | 0x80));
+        Value >>= 7;
+    }
+    Out.push_back(static_cast<char>(Value));
+}
+
+// Reads one value at Position and advances it, false at the end of the
+// data or on a value longer than ten bytes
+inline bool ReadVarint(const unsigned char * Data, size_t Size, size_t & Position, uint64_t & Value)
+{
+    Value = 0;
+    for (unsigned int shift = 0; shift < 70 && Position < Size; shift += 7)
+    {
+        unsigned char byte = Data[Position++];
+        Value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
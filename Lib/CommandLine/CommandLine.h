@@ -0,0 +1,34 @@
+#pragma once
+// Command lines of the form "-name value -name value". Only '-' introduces
+// an option, so '/' can start an absolute path, and '-' followed by a digit
+// is a negative value, such as a TSC delta, rather than an option. Names are
+// lower cased; values are kept as typed, they may be file or server names.
+// Options without a value are dropped and the first value given for a name
+// is kept. Tools with a mode as their first argument start at First = 2.
+
+#include <ctype.h>
+#include <map>
+#include <string>
+
+inline std::map<std::string, std::string> ParseCommandLine(int argc, char ** argv, int First = 1)
+{
+    std::map<std::string, std::string> argPairs;
+    std::string argName;
+    for (int i = First; i < argc; i++)
+    {
+        if (argv[i][0] == '-' && !isdigit(static_cast<unsigned char>(argv[i][1])))
+        {
+            argName = argv[i] + 1;
+            for (auto & c : argName)
+            {
+                c = static_cast<char>(tolower(c));
+            }
+        }
+        else if (argName.length() > 0)
+        {
+            argPairs.insert(std::make_pair(argName, std::string(argv[i])));
+            argName.clear();
+        }
+    }
+    return argPairs;
+}
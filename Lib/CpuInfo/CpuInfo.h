@@ -0,0 +1,365 @@
+#pragma once
+// CPU capabilities from CPUID, shared by the native tools.
+// From the MSDN sample code at: https://msdn.microsoft.com/en-us/library/hskdteyh.aspx
+// extended with the TSC frequency leaves (0x15, 0x16), the hypervisor leaves
+// (0x40000000 and up) and whether the OS has enabled the AVX register state.
+
+#include <string.h>
+#include <vector>
+#include <bitset>
+#include <array>
+#include <string>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+
+inline void cpuid(int CPUInfo[4], int InfoType)
+{
+    __cpuid(CPUInfo, InfoType);
+}
+
+inline void cpuidex(int CPUInfo[4], int InfoType, int ECXValue)
+{
+    __cpuidex(CPUInfo, InfoType, ECXValue);
+}
+
+inline unsigned long long xgetbv(unsigned int Register)
+{
+    return _xgetbv(Register);
+}
+#else
+#include <cpuid.h>
+
+inline void cpuid(int CPUInfo[4], int InfoType)
+{
+    __cpuid(InfoType, CPUInfo[0], CPUInfo[1], CPUInfo[2], CPUInfo[3]);
+}
+
+inline void cpuidex(int CPUInfo[4], int InfoType, int ECXValue)
+{
+    __cpuid_count(InfoType, ECXValue, CPUInfo[0], CPUInfo[1], CPUInfo[2], CPUInfo[3]);
+}
+
+inline unsigned long long xgetbv(unsigned int Register)
+{
+    unsigned int low;
+    unsigned int high;
+    asm volatile("xgetbv" : "=a" (low), "=d" (high) : "c" (Register));
+    return low | (static_cast<unsigned long long>(high) << 32);
+}
+#endif
+
+class InstructionSet
+{
+    // forward declarations
+    class InstructionSet_Internal;
+
+public:
+    // getters
+    static std::string Vendor(void) { return CPU_Rep().vendor_; }
+    static std::string Brand(void) { return CPU_Rep().brand_; }
+
+    static bool SSE3(void) { return CPU_Rep().f_1_ECX_[0]; }
+    static bool PCLMULQDQ(void) { return CPU_Rep().f_1_ECX_[1]; }
+    static bool MONITOR(void) { return CPU_Rep().f_1_ECX_[3]; }
+    static bool SSSE3(void) { return CPU_Rep().f_1_ECX_[9]; }
+    static bool FMA(void) { return CPU_Rep().f_1_ECX_[12]; }
+    static bool CMPXCHG16B(void) { return CPU_Rep().f_1_ECX_[13]; }
+    static bool SSE41(void) { return CPU_Rep().f_1_ECX_[19]; }
+    static bool SSE42(void) { return CPU_Rep().f_1_ECX_[20]; }
+    static bool MOVBE(void) { return CPU_Rep().f_1_ECX_[22]; }
+    static bool POPCNT(void) { return CPU_Rep().f_1_ECX_[23]; }
+    static bool AES(void) { return CPU_Rep().f_1_ECX_[25]; }
+    static bool XSAVE(void) { return CPU_Rep().f_1_ECX_[26]; }
+    static bool OSXSAVE(void) { return CPU_Rep().f_1_ECX_[27]; }
+    static bool AVX(void) { return CPU_Rep().f_1_ECX_[28]; }
+    static bool F16C(void) { return CPU_Rep().f_1_ECX_[29]; }
+    static bool RDRAND(void) { return CPU_Rep().f_1_ECX_[30]; }
+    static bool Hypervisor(void) { return CPU_Rep().f_1_ECX_[31]; }
+
+    static bool MSR(void) { return CPU_Rep().f_1_EDX_[5]; }
+    static bool CX8(void) { return CPU_Rep().f_1_EDX_[8]; }
+    static bool SEP(void) { return CPU_Rep().f_1_EDX_[11]; }
+    static bool CMOV(void) { return CPU_Rep().f_1_EDX_[15]; }
+    static bool CLFSH(void) { return CPU_Rep().f_1_EDX_[19]; }
+    static bool MMX(void) { return CPU_Rep().f_1_EDX_[23]; }
+    static bool FXSR(void) { return CPU_Rep().f_1_EDX_[24]; }
+    static bool SSE(void) { return CPU_Rep().f_1_EDX_[25]; }
+    static bool SSE2(void) { return CPU_Rep().f_1_EDX_[26]; }
+
+    static bool FSGSBASE(void) { return CPU_Rep().f_7_EBX_[0]; }
+    static bool BMI1(void) { return CPU_Rep().f_7_EBX_[3]; }
+    static bool HLE(void) { return CPU_Rep().isIntel_ && CPU_Rep().f_7_EBX_[4]; }
+    static bool AVX2(void) { return CPU_Rep().f_7_EBX_[5]; }
+    static bool BMI2(void) { return CPU_Rep().f_7_EBX_[8]; }
+    static bool ERMS(void) { return CPU_Rep().f_7_EBX_[9]; }
+    static bool INVPCID(void) { return CPU_Rep().f_7_EBX_[10]; }
+    static bool RTM(void) { return CPU_Rep().isIntel_ && CPU_Rep().f_7_EBX_[11]; }
+    static bool AVX512F(void) { return CPU_Rep().f_7_EBX_[16]; }
+    static bool RDSEED(void) { return CPU_Rep().f_7_EBX_[18]; }
+    static bool ADX(void) { return CPU_Rep().f_7_EBX_[19]; }
+    static bool AVX512PF(void) { return CPU_Rep().f_7_EBX_[26]; }
+    static bool AVX512ER(void) { return CPU_Rep().f_7_EBX_[27]; }
+    static bool AVX512CD(void) { return CPU_Rep().f_7_EBX_[28]; }
+    static bool SHA(void) { return CPU_Rep().f_7_EBX_[29]; }
+    static bool AVX512BW(void) { return CPU_Rep().f_7_EBX_[30]; }
+    static bool AVX512VL(void) { return CPU_Rep().f_7_EBX_[31]; }
+
+    static bool PREFETCHWT1(void) { return CPU_Rep().f_7_ECX_[0]; }
+
+    static bool LAHF(void) { return CPU_Rep().f_81_ECX_[0]; }
+    static bool LZCNT(void) { return CPU_Rep().isIntel_ && CPU_Rep().f_81_ECX_[5]; }
+    static bool ABM(void) { return CPU_Rep().isAMD_ && CPU_Rep().f_81_ECX_[5]; }
+    static bool SSE4a(void) { return CPU_Rep().isAMD_ && CPU_Rep().f_81_ECX_[6]; }
+    static bool XOP(void) { return CPU_Rep().isAMD_ && CPU_Rep().f_81_ECX_[11]; }
+    static bool TBM(void) { return CPU_Rep().isAMD_ && CPU_Rep().f_81_ECX_[21]; }
+
+    static bool SYSCALL(void) { return CPU_Rep().isIntel_ && CPU_Rep().f_81_EDX_[11]; }
+    static bool MMXEXT(void) { return CPU_Rep().isAMD_ && CPU_Rep().f_81_EDX_[22]; }
+    static bool RDTSCP(void) { return CPU_Rep().f_81_EDX_[27]; }
+    static bool _3DNOWEXT(void) { return CPU_Rep().isAMD_ && CPU_Rep().f_81_EDX_[30]; }
+    static bool _3DNOW(void) { return CPU_Rep().isAMD_ && CPU_Rep().f_81_EDX_[31]; }
+    static bool TscInvariant(void) { return CPU_Rep().f_87_EDX_[8]; }
+
+    // The instructions can be used only when the OS also saves the wider
+    // registers on a context switch, as XCR0 reports
+    static bool AVX2Usable(void) { return AVX2() && (CPU_Rep().xcr0_ & 0x06) == 0x06; }
+    static bool AVX512Usable(void) { return AVX512F() && AVX512BW() && (CPU_Rep().xcr0_ & 0xe6) == 0xe6; }
+
+    // Leaf 0x15: TSC frequency = crystal frequency * numerator / denominator.
+    // Leaf 0x16: nominal base, maximum and bus frequencies in MHz.
+    static unsigned int TscRatioDenominator(void) { return CPU_Rep().leaf15_[0]; }
+    static unsigned int TscRatioNumerator(void) { return CPU_Rep().leaf15_[1]; }
+    static unsigned int CrystalFrequency(void) { return CPU_Rep().leaf15_[2]; }
+    static unsigned int BaseFrequencyMhz(void) { return CPU_Rep().leaf16_[0] & 0xffff; }
+    static unsigned int MaxFrequencyMhz(void) { return CPU_Rep().leaf16_[1] & 0xffff; }
+    static unsigned int BusFrequencyMhz(void) { return CPU_Rep().leaf16_[2] & 0xffff; }
+
+    // Hypervisor identity, e.g. "Microsoft Hv" or "KVMKVMKVM", and the TSC
+    // frequency in kHz that KVM and VMware report in leaf 0x40000010
+    static std::string HypervisorVendor(void) { return CPU_Rep().hypervisorVendor_; }
+    static unsigned int HypervisorMaxLeaf(void) { return CPU_Rep().hypervisorMaxLeaf_; }
+    static unsigned int HypervisorTscKhz(void) { return CPU_Rep().hypervisorTscKhz_; }
+
+    // Hyper-V partition privileges (leaf 0x40000003 EAX): the reference TSC
+    // page and the TSC/APIC frequency MSRs
+    static bool HyperVReferenceTsc(void) { return CPU_Rep().hyperVPrivileges_[9]; }
+    static bool HyperVFrequencyMsrs(void) { return CPU_Rep().hyperVPrivileges_[11]; }
+
+    // TSC frequency in Hz the CPU or hypervisor states, or 0 when it states
+    // none and the frequency has to be measured. Source names where it came
+    // from.
+    static double NominalTscFrequency(const char ** Source = nullptr)
+    {
+        const char * source = "none";
+        double frequency = 0;
+        if (TscRatioDenominator() != 0 && TscRatioNumerator() != 0 && CrystalFrequency() != 0)
+        {
+            source = "cpuid 0x15";
+            frequency = static_cast<double>(CrystalFrequency()) * TscRatioNumerator() / TscRatioDenominator();
+        }
+        else if (HypervisorTscKhz() != 0)
+        {
+            source = "hypervisor";
+            frequency = HypervisorTscKhz() * 1000.0;
+        }
+        else if (CPU_Rep().isIntel_ && BaseFrequencyMhz() != 0)
+        {
+            // Without the crystal frequency the TSC runs at the base frequency
+            source = "cpuid 0x16";
+            frequency = BaseFrequencyMhz() * 1e6;
+        }
+        if (Source != nullptr)
+        {
+            *Source = source;
+        }
+        return frequency;
+    }
+
+private:
+    static const InstructionSet_Internal & CPU_Rep()
+    {
+        static const InstructionSet_Internal rep;
+        return rep;
+    }
+
+    class InstructionSet_Internal
+    {
+    public:
+        InstructionSet_Internal()
+            : nIds_{ 0 },
+            nExIds_{ 0 },
+            isIntel_{ false },
+            isAMD_{ false },
+            f_1_ECX_{ 0 },
+            f_1_EDX_{ 0 },
+            f_7_EBX_{ 0 },
+            f_7_ECX_{ 0 },
+            f_81_ECX_{ 0 },
+            f_81_EDX_{ 0 },
+            f_87_ECX_{ 0 },
+            f_87_EDX_{ 0 },
+            xcr0_{ 0 },
+            leaf15_{},
+            leaf16_{},
+            hypervisorMaxLeaf_{ 0 },
+            hypervisorTscKhz_{ 0 },
+            hyperVPrivileges_{ 0 },
+            data_{},
+            extdata_{}
+        {
+            std::array<int, 4> cpui;
+
+            // Calling cpuid with 0x0 as the function_id argument
+            // gets the number of the highest valid function ID.
+            cpuid(cpui.data(), 0);
+            nIds_ = cpui[0];
+
+            for (int i = 0; i <= nIds_; ++i)
+            {
+                cpuidex(cpui.data(), i, 0);
+                data_.push_back(cpui);
+            }
+
+            // Capture vendor string
+            char vendor[0x20];
+            memset(vendor, 0, sizeof(vendor));
+            *reinterpret_cast<int*>(vendor) = data_[0][1];
+            *reinterpret_cast<int*>(vendor + 4) = data_[0][3];
+            *reinterpret_cast<int*>(vendor + 8) = data_[0][2];
+            vendor_ = vendor;
+            if (vendor_ == "GenuineIntel")
+            {
+                isIntel_ = true;
+            }
+            else if (vendor_ == "AuthenticAMD")
+            {
+                isAMD_ = true;
+            }
+
+            // load bitset with flags for function 0x00000001
+            if (nIds_ >= 1)
+            {
+                f_1_ECX_ = data_[1][2];
+                f_1_EDX_ = data_[1][3];
+            }
+
+            // load bitset with flags for function 0x00000007
+            if (nIds_ >= 7)
+            {
+                f_7_EBX_ = data_[7][1];
+                f_7_ECX_ = data_[7][2];
+            }
+
+            // Register state the OS saves, only readable when it enabled XSAVE
+            if (f_1_ECX_[27])
+            {
+                xcr0_ = xgetbv(0);
+            }
+
+            // TSC and crystal clock ratio, processor frequencies
+            if (nIds_ >= 0x15)
+            {
+                for (int i = 0; i < 4; i++)
+                {
+                    leaf15_[i] = static_cast<unsigned int>(data_[0x15][i]);
+                }
+            }
+            if (nIds_ >= 0x16)
+            {
+                for (int i = 0; i < 4; i++)
+                {
+                    leaf16_[i] = static_cast<unsigned int>(data_[0x16][i]);
+                }
+            }
+
+            // Calling cpuid with 0x80000000 as the function_id argument
+            // gets the number of the highest valid extended ID.
+            cpuid(cpui.data(), 0x80000000);
+            nExIds_ = cpui[0];
+
+            char brand[0x40];
+            memset(brand, 0, sizeof(brand));
+
+            for (int i = 0x80000000; i <= nExIds_; ++i)
+            {
+                cpuidex(cpui.data(), i, 0);
+                extdata_.push_back(cpui);
+            }
+
+            // load bitset with flags for function 0x80000001
+            if (nExIds_ >= static_cast<int>(0x80000001))
+            {
+                f_81_ECX_ = extdata_[1][2];
+                f_81_EDX_ = extdata_[1][3];
+            }
+
+            // Interpret CPU brand string if reported
+            if (nExIds_ >= static_cast<int>(0x80000004))
+            {
+                memcpy(brand, extdata_[2].data(), sizeof(cpui));
+                memcpy(brand + 16, extdata_[3].data(), sizeof(cpui));
+                memcpy(brand + 32, extdata_[4].data(), sizeof(cpui));
+                brand_ = brand;
+            }
+
+            // load bitset with flags for function 0x80000007
+            if (nExIds_ >= static_cast<int>(0x80000007))
+            {
+                f_87_ECX_ = extdata_[7][2];
+                f_87_EDX_ = extdata_[7][3];
+            }
+
+            // The hypervisor leaves only mean something when the hypervisor
+            // bit is set, bare metal returns unrelated data for them
+            if (f_1_ECX_[31])
+            {
+                cpuid(cpui.data(), 0x40000000);
+                hypervisorMaxLeaf_ = static_cast<unsigned int>(cpui[0]);
+                char signature[13];
+                memcpy(signature, &cpui[1], 4);
+                memcpy(signature + 4, &cpui[2], 4);
+                memcpy(signature + 8, &cpui[3], 4);
+                signature[12] = 0;
+                hypervisorVendor_ = signature;
+
+                if (hypervisorVendor_ == "Microsoft Hv" && hypervisorMaxLeaf_ >= 0x40000003)
+                {
+                    cpuid(cpui.data(), 0x40000003);
+                    hyperVPrivileges_ = cpui[0];
+                }
+                if ((hypervisorVendor_ == "KVMKVMKVM" || hypervisorVendor_ == "VMwareVMware") &&
+                    hypervisorMaxLeaf_ >= 0x40000010)
+                {
+                    cpuid(cpui.data(), 0x40000010);
+                    hypervisorTscKhz_ = static_cast<unsigned int>(cpui[0]);
+                }
+            }
+        };
+
+        int nIds_;
+        int nExIds_;
+        std::string vendor_;
+        std::string brand_;
+        bool isIntel_;
+        bool isAMD_;
+        std::bitset<32> f_1_ECX_;
+        std::bitset<32> f_1_EDX_;
+        std::bitset<32> f_7_EBX_;
+        std::bitset<32> f_7_ECX_;
+        std::bitset<32> f_81_ECX_;
+        std::bitset<32> f_81_EDX_;
+        std::bitset<32> f_87_ECX_;
+        std::bitset<32> f_87_EDX_;
+        unsigned long long xcr0_;
+        std::array<unsigned int, 4> leaf15_;
+        std::array<unsigned int, 4> leaf16_;
+        std::string hypervisorVendor_;
+        unsigned int hypervisorMaxLeaf_;
+        unsigned int hypervisorTscKhz_;
+        std::bitset<32> hyperVPrivileges_;
+        std::vector<std::array<int, 4>> data_;
+        std::vector<std::array<int, 4>> extdata_;
+    };
+};
@@ -0,0 +1,161 @@
+#pragma once
+// Shared memory mailbox for two threads exchanging TSC readings.
+//
+// A ping-pong between two CPUs is as fast as the cache lines it moves. The
+// layouts trade the number of lines against false sharing:
+//
+//   SingleLine  state and both sides' slots in one 64 byte line, one line
+//               moves per hop but every write by one side steals it from
+//               the other
+//   SplitLine   state and each side's slots on their own 64 byte lines, as
+//               TscOffset lays out its message
+//   Padded128   the same on 128 byte boundaries, so the adjacent line
+//               prefetcher of Intel CPUs doesn't drag a neighbour along
+//
+// The memory comes straight from the OS untouched and is first written by
+// a thread pinned to the home CPU, so the default local allocation policy
+// puts it on that CPU's NUMA node.
+
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+#include <new>
+#include <string>
+#include <thread>
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+enum class MailboxLayout
+{
+    SingleLine,
+    SplitLine,
+    Padded128,
+};
+
+inline const char * MailboxLayoutName(MailboxLayout Layout)
+{
+    return Layout == MailboxLayout::SingleLine ? "single" : Layout == MailboxLayout::SplitLine ? "split" : "128";
+}
+
+inline bool ParseMailboxLayout(const std::string & Name, MailboxLayout & Layout)
+{
+    for (MailboxLayout layout : { MailboxLayout::SingleLine, MailboxLayout::SplitLine, MailboxLayout::Padded128 })
+    {
+        if (Name == MailboxLayoutName(layout))
+        {
+            Layout = layout;
+            return true;
+        }
+    }
+    return false;
+}
+
+class Mailbox
+{
+public:
+    // Sides of the exchange
+    static const int Client = 0;
+    static const int Server = 1;
+
+    // HomeCpu < 0 leaves the placement to whichever thread touches it first
+    Mailbox(MailboxLayout Layout, int HomeCpu) :
+        layout(Layout)
+    {
+        size_t stride = Layout == MailboxLayout::SingleLine ? 8 : Layout == MailboxLayout::SplitLine ? 64 : 128;
+#if defined(_MSC_VER)
+        memory = static_cast<char *>(VirtualAlloc(nullptr, Size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+#else
+        void * mapping = mmap(nullptr, Size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        memory = mapping == MAP_FAILED ? nullptr : static_cast<char *>(mapping);
+#endif
+        if (memory == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+
+        // Single line: state, client 0, client 1, server 0, server 1 in
+        // consecutive words; otherwise each of state, client and server
+        // starts a stride of its own
+        state = reinterpret_cast<std::atomic<unsigned long long> *>(memory);
+        for (int side = Client; side <= Server; side++)
+        {
+            for (int slot = 0; slot < 2; slot++)
+            {
+                size_t offset = Layout == MailboxLayout::SingleLine ? 8 * (1 + 2 * side + slot) : stride * (1 + side) + 8 * slot;
+                slots[side][slot] = reinterpret_cast<std::atomic<unsigned long long> *>(memory + offset);
+            }
+        }
+
+        std::thread toucher([this, HomeCpu]()
+        {
+            if (HomeCpu >= 0)
+            {
+                Pin(HomeCpu);
+            }
+            memset(memory, 0, Size);
+            new (state) std::atomic<unsigned long long>(0);
+            for (auto & side : slots)
+            {
+                for (auto slot : side)
+                {
+                    new (slot) std::atomic<unsigned long long>(0);
+                }
+            }
+        });
+        toucher.join();
+    }
+
+    ~Mailbox()
+    {
+#if defined(_MSC_VER)
+        VirtualFree(memory, 0, MEM_RELEASE);
+#else
+        munmap(memory, Size);
+#endif
+    }
+
+    Mailbox(const Mailbox &) = delete;
+    Mailbox & operator=(const Mailbox &) = delete;
+
+    MailboxLayout Layout() const
+    {
+        return layout;
+    }
+
+    std::atomic<unsigned long long> & State()
+    {
+        return *state;
+    }
+
+    std::atomic<unsigned long long> & Slot(int Side, int Index)
+    {
+        return *slots[Side][Index];
+    }
+
+    // Pins the calling thread to Cpu
+    static bool Pin(int Cpu)
+    {
+#if defined(_MSC_VER)
+        return SetThreadAffinityMask(GetCurrentThread(), 1ull << Cpu) != 0;
+#else
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(Cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#endif
+    }
+
+private:
+    static const size_t Size = 4096;
+
+    MailboxLayout layout;
+    char * memory;
+    std::atomic<unsigned long long> * state;
+    std::atomic<unsigned long long> * slots[2][2];
+};
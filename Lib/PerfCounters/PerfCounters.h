@@ -0,0 +1,193 @@
+#pragma once
+// Hardware and software event counts around a measured block, to explain
+// where the time of a slow clock read goes.
+//
+// Each counter is a separate perf_event_open counter of the calling thread:
+// cycles, instructions, branch misses and cache misses, reported per
+// operation, and context switches, reported as a total. On a KVM host the
+// kvm:kvm_exit tracepoint is also counted on the CPU the thread runs on, so
+// exits of guests sharing it show up; guests can't see their own exits.
+// Counters the kernel refuses are left out, user space only counts are used
+// when kernel ones are not allowed (marked ":u"), and without perf_event at
+// all, or on Windows, Format reports why instead of numbers.
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#if !defined(_MSC_VER)
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+class PerfCounters
+{
+public:
+    PerfCounters()
+    {
+#if defined(_MSC_VER)
+        reason = "perf_event is Linux only";
+#else
+        Open("cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, true);
+        Open("instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, true);
+        Open("branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, true);
+        Open("cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, true);
+        Open("context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, false);
+        OpenVmExits();
+#endif
+    }
+
+    ~PerfCounters()
+    {
+#if !defined(_MSC_VER)
+        for (const Counter & counter : counters)
+        {
+            close(counter.Fd);
+        }
+#endif
+    }
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters & operator=(const PerfCounters &) = delete;
+
+    bool Available() const
+    {
+        return !counters.empty();
+    }
+
+    void Start()
+    {
+#if !defined(_MSC_VER)
+        for (Counter & counter : counters)
+        {
+            ioctl(counter.Fd, PERF_EVENT_IOC_RESET, 0);
+        }
+        for (Counter & counter : counters)
+        {
+            ioctl(counter.Fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    void Stop()
+    {
+#if !defined(_MSC_VER)
+        for (Counter & counter : counters)
+        {
+            ioctl(counter.Fd, PERF_EVENT_IOC_DISABLE, 0);
+        }
+        for (Counter & counter : counters)
+        {
+            // Value, time enabled and time running, scaled up when the
+            // counter was multiplexed with others
+            unsigned long long values[3] = { 0, 0, 0 };
+            counter.Value = 0;
+            if (read(counter.Fd, values, sizeof(values)) == sizeof(values) && values[2] != 0)
+            {
+                counter.Value = static_cast<double>(values[0]) * values[1] / values[2];
+            }
+        }
+#endif
+    }
+
+    // The counts of the last Start/Stop, per operation where it applies
+    std::string Format(double Operations) const
+    {
+        if (counters.empty())
+        {
+            return "perf counters unavailable (" + reason + ")";
+        }
+        std::string text;
+        char buffer[128];
+        for (const Counter & counter : counters)
+        {
+            snprintf(buffer, sizeof(buffer), "%s%s %.*f%s",
+                text.empty() ? "" : ", ",
+                counter.Name.c_str(),
+                counter.PerOperation ? 2 : 0,
+                counter.PerOperation && Operations > 0 ? counter.Value / Operations : counter.Value,
+                counter.PerOperation ? "/op" : "");
+            text += buffer;
+        }
+        return reason.empty() ? text : text + ", others unavailable (" + reason + ")";
+    }
+
+private:
+    struct Counter
+    {
+        std::string Name;
+        int Fd;
+        bool PerOperation;
+        double Value;
+    };
+
+#if !defined(_MSC_VER)
+    int OpenCounter(unsigned int Type, unsigned long long Config, bool ExcludeKernel, int Pid, int Cpu)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = Type;
+        attr.config = Config;
+        attr.disabled = 1;
+        attr.exclude_kernel = ExcludeKernel ? 1 : 0;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, Pid, Cpu, -1, 0));
+    }
+
+    void Open(const char * Name, unsigned int Type, unsigned long long Config, bool PerOperation)
+    {
+        std::string name = Name;
+        int fd = OpenCounter(Type, Config, false, 0, -1);
+        if (fd < 0 && (errno == EACCES || errno == EPERM))
+        {
+            fd = OpenCounter(Type, Config, true, 0, -1);
+            name += ":u";
+        }
+        if (fd < 0)
+        {
+            if (reason.empty())
+            {
+                reason = std::string("perf_event_open: ") + strerror(errno);
+            }
+            return;
+        }
+        counters.push_back({ name, fd, PerOperation, 0 });
+    }
+
+    void OpenVmExits()
+    {
+        const char * paths[] =
+        {
+            "/sys/kernel/tracing/events/kvm/kvm_exit/id",
+            "/sys/kernel/debug/tracing/events/kvm/kvm_exit/id",
+        };
+        for (const char * path : paths)
+        {
+            FILE * file = fopen(path, "r");
+            unsigned long long id;
+            if (file == nullptr)
+            {
+                continue;
+            }
+            bool ok = fscanf(file, "%llu", &id) == 1;
+            fclose(file);
+            int cpu = sched_getcpu();
+            int fd = ok && cpu >= 0 ? OpenCounter(PERF_TYPE_TRACEPOINT, id, false, -1, cpu) : -1;
+            if (fd >= 0)
+            {
+                counters.push_back({ "vm-exits", fd, false, 0 });
+            }
+            return;
+        }
+    }
+#endif
+
+    std::vector<Counter> counters;
+    std::string reason;
+};
@@ -0,0 +1,80 @@
+#pragma once
+// Bounded single producer, single consumer queue without locks.
+//
+// The producer owns head and the consumer tail; each only reads the other's
+// index, with acquire/release ordering so an element is complete before it
+// is seen. The indexes sit on separate cache lines and each side keeps a
+// cached copy of the other's, so a busy producer doesn't pull the consumer's
+// line on every push. Pushes fail instead of blocking when the ring is full,
+// which suits producers that must not stall (a spinning sampler, a receive
+// loop); the caller counts the loss.
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+template <typename T>
+class SpscRing
+{
+public:
+    // Capacity is rounded up to a power of two
+    explicit SpscRing(size_t Capacity) :
+        head(0),
+        tail(0),
+        cachedTail(0),
+        cachedHead(0)
+    {
+        size_t size = 2;
+        while (size < Capacity)
+        {
+            size *= 2;
+        }
+        items.resize(size);
+        mask = size - 1;
+    }
+
+    SpscRing(const SpscRing &) = delete;
+    SpscRing & operator=(const SpscRing &) = delete;
+
+    // Producer side
+    bool Push(const T & Item)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h - cachedTail > mask)
+        {
+            cachedTail = tail.load(std::memory_order_acquire);
+            if (h - cachedTail > mask)
+            {
+                return false;
+            }
+        }
+        items[h & mask] = Item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side
+    bool Pop(T & Item)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t == cachedHead)
+        {
+            cachedHead = head.load(std::memory_order_acquire);
+            if (t == cachedHead)
+            {
+                return false;
+            }
+        }
+        Item = items[t & mask];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::vector<T> items;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+    alignas(64) size_t cachedTail;  // Producer's copy
+    alignas(64) size_t cachedHead;  // Consumer's copy
+};
@@ -0,0 +1,376 @@
+#pragma once
+// Robust straight line fits y = Beta * x + Alpha for time samples.
+//
+// A least squares fit, as LinearRegression computes, is pulled far off by
+// the few NTP samples that were delayed in the network. These estimators
+// are not:
+//
+//   TheilSenFit       the median slope over pairs of samples. For large n a
+//                     random subset of pairs is used, drawn across threads.
+//   ReweightedFit     iteratively reweighted least squares with Tukey's
+//                     biweight, starting from the Theil-Sen line.
+//   MinimumDelayFit   the lower envelope: in each of a number of x bins only
+//                     the sample with the smallest round trip delay is kept,
+//                     since it saw the least queuing, and those are fitted
+//                     with Theil-Sen.
+//
+// Samples are passed as parallel arrays and shifted to the first sample
+// before fitting, which keeps the products precise. Pass raw TSC and
+// FILETIME values as integers: the shift then happens before they become
+// doubles, which at FILETIME magnitudes (1e17) would round them to 16
+// units. The Alpha returned is at x = 0 and only as precise as a double of
+// Y's magnitude.
+
+#include <math.h>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <vector>
+
+struct LineFit
+{
+    double Alpha = 0;
+    double Beta = 0;
+    double Rms = 0;
+    size_t Used = 0;
+};
+
+class RobustFit
+{
+public:
+    RobustFit(const double * X, const double * Y, size_t Count, size_t Threads) :
+        x0(Count > 0 ? X[0] : 0),
+        y0(Count > 0 ? Y[0] : 0),
+        threads(std::max<size_t>(1, Threads)),
+        x(Count),
+        y(Count)
+    {
+        Shift(X, Y);
+    }
+
+    RobustFit(const long long * X, const long long * Y, size_t Count, size_t Threads) :
+        x0(Count > 0 ? static_cast<double>(X[0]) : 0),
+        y0(Count > 0 ? static_cast<double>(Y[0]) : 0),
+        threads(std::max<size_t>(1, Threads)),
+        x(Count),
+        y(Count)
+    {
+        Shift(X, Y);
+    }
+
+    size_t Size() const
+    {
+        return x.size();
+    }
+
+    // Ordinary least squares over all samples
+    LineFit LeastSquaresFit() const
+    {
+        std::vector<double> w;
+        return Result(WeightedFit(w));
+    }
+
+    // Median of pairwise slopes. All pairs are used up to MaxPairs of them;
+    // beyond that MaxPairs random pairs are drawn.
+    LineFit TheilSenFit(size_t MaxPairs = 4000000) const
+    {
+        return Result(TheilSen(x, y, MaxPairs));
+    }
+
+    // Tukey biweight IRLS, stopping when the slope changes by less than a
+    // part in 10^12 or after Iterations rounds
+    LineFit ReweightedFit(size_t Iterations = 20) const
+    {
+        Line line = TheilSen(x, y, 1000000);
+        std::vector<double> w(x.size());
+        const double c = 4.685;
+        for (size_t iteration = 0; iteration < Iterations; iteration++)
+        {
+            double scale = ResidualScale(line);
+            if (scale == 0)
+            {
+                break;
+            }
+            ParallelFor(x.size(), [&](size_t Begin, size_t End, size_t)
+            {
+                for (size_t i = Begin; i < End; i++)
+                {
+                    double u = (y[i] - (line.Beta * x[i] + line.Alpha)) / (c * scale);
+                    w[i] = fabs(u) < 1 ? (1 - u * u) * (1 - u * u) : 0;
+                }
+            });
+            Line next = WeightedFit(w);
+            bool converged = fabs(next.Beta - line.Beta) <= fabs(line.Beta) * 1e-12;
+            line = next;
+            if (converged)
+            {
+                break;
+            }
+        }
+        return Result(line);
+    }
+
+    // Lower envelope fit on the minimum delay sample of each of Bins equal
+    // width x bins. Delay is any per sample measure of path delay, e.g. the
+    // NTP round trip time or the TSC window of a time sample.
+    LineFit MinimumDelayFit(const double * Delay, size_t Bins = 1000) const
+    {
+        if (x.empty())
+        {
+            return LineFit();
+        }
+        double low = *std::min_element(x.begin(), x.end());
+        double high = *std::max_element(x.begin(), x.end());
+        double width = (high - low) / Bins;
+        Bins = width > 0 ? Bins : 1;
+
+        // Each thread finds the minimum of every bin over its range, then
+        // the per thread minimums are combined
+        std::vector<std::vector<size_t>> best(threads, std::vector<size_t>(Bins, SIZE_MAX));
+        ParallelFor(x.size(), [&](size_t Begin, size_t End, size_t Thread)
+        {
+            std::vector<size_t> & b = best[Thread];
+            for (size_t i = Begin; i < End; i++)
+            {
+                size_t bin = width > 0 ? std::min(Bins - 1, static_cast<size_t>((x[i] - low) / width)) : 0;
+                if (b[bin] == SIZE_MAX || Delay[i] < Delay[b[bin]])
+                {
+                    b[bin] = i;
+                }
+            }
+        });
+
+        std::vector<double> ex;
+        std::vector<double> ey;
+        for (size_t bin = 0; bin < Bins; bin++)
+        {
+            size_t pick = SIZE_MAX;
+            for (size_t t = 0; t < threads; t++)
+            {
+                size_t i = best[t][bin];
+                if (i != SIZE_MAX && (pick == SIZE_MAX || Delay[i] < Delay[pick]))
+                {
+                    pick = i;
+                }
+            }
+            if (pick != SIZE_MAX)
+            {
+                ex.push_back(x[pick]);
+                ey.push_back(y[pick]);
+            }
+        }
+        LineFit fit = Result(TheilSen(ex, ey, SIZE_MAX));
+        fit.Used = ex.size();
+        return fit;
+    }
+
+private:
+    struct Line
+    {
+        double Alpha;
+        double Beta;
+        size_t Used;
+    };
+
+    template<typename TBody>
+    void ParallelFor(size_t Count, TBody Body) const
+    {
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; t++)
+        {
+            size_t begin = Count * t / threads;
+            size_t end = Count * (t + 1) / threads;
+            workers.push_back(std::thread([=, &Body]() { Body(begin, end, t); }));
+        }
+        for (auto & w : workers)
+        {
+            w.join();
+        }
+    }
+
+    static double Median(std::vector<double> & Values)
+    {
+        if (Values.empty())
+        {
+            return 0;
+        }
+        std::nth_element(Values.begin(), Values.begin() + Values.size() / 2, Values.end());
+        return Values[Values.size() / 2];
+    }
+
+    Line TheilSen(const std::vector<double> & X, const std::vector<double> & Y, size_t MaxPairs) const
+    {
+        size_t n = X.size();
+        Line line = { 0, 0, n };
+        if (n < 2)
+        {
+            return line;
+        }
+
+        std::vector<double> slopes;
+        double allPairs = 0.5 * n * (n - 1);
+        if (allPairs <= MaxPairs)
+        {
+            slopes.reserve(static_cast<size_t>(allPairs));
+            for (size_t i = 0; i < n; i++)
+            {
+                for (size_t j = i + 1; j < n; j++)
+                {
+                    if (X[j] != X[i])
+                    {
+                        slopes.push_back((Y[j] - Y[i]) / (X[j] - X[i]));
+                    }
+                }
+            }
+        }
+        else
+        {
+            std::vector<std::vector<double>> partial(threads);
+            ParallelFor(MaxPairs, [&](size_t Begin, size_t End, size_t Thread)
+            {
+                std::mt19937_64 random(0x5eed + Thread);
+                std::uniform_int_distribution<size_t> pick(0, n - 1);
+                std::vector<double> & s = partial[Thread];
+                s.reserve(End - Begin);
+                for (size_t k = Begin; k < End; k++)
+                {
+                    size_t i = pick(random);
+                    size_t j = pick(random);
+                    if (X[j] != X[i])
+                    {
+                        s.push_back((Y[j] - Y[i]) / (X[j] - X[i]));
+                    }
+                }
+            });
+            for (auto & s : partial)
+            {
+                slopes.insert(slopes.end(), s.begin(), s.end());
+            }
+        }
+        line.Beta = Median(slopes);
+
+        // The intercept is the median residual, from up to a million evenly
+        // spaced samples
+        size_t stride = std::max<size_t>(1, n / 1000000);
+        std::vector<double> intercepts;
+        intercepts.reserve(n / stride + 1);
+        for (size_t i = 0; i < n; i += stride)
+        {
+            intercepts.push_back(Y[i] - line.Beta * X[i]);
+        }
+        line.Alpha = Median(intercepts);
+        return line;
+    }
+
+    // Robust scale of the residuals, 1.4826 * MAD, from up to a million
+    // evenly spaced samples
+    double ResidualScale(const Line & L) const
+    {
+        size_t stride = std::max<size_t>(1, x.size() / 1000000);
+        std::vector<double> r;
+        r.reserve(x.size() / stride + 1);
+        for (size_t i = 0; i < x.size(); i += stride)
+        {
+            r.push_back(fabs(y[i] - (L.Beta * x[i] + L.Alpha)));
+        }
+        return 1.4826 * Median(r);
+    }
+
+    // Weighted least squares; an empty W weights every sample equally
+    Line WeightedFit(const std::vector<double> & W) const
+    {
+        struct Sums
+        {
+            long double W, X, Y, XX, XY;
+            size_t Used;
+        };
+        std::vector<Sums> partial(threads);
+        ParallelFor(x.size(), [&](size_t Begin, size_t End, size_t Thread)
+        {
+            Sums s = { 0, 0, 0, 0, 0, 0 };
+            for (size_t i = Begin; i < End; i++)
+            {
+                double w = W.empty() ? 1 : W[i];
+                if (w == 0)
+                {
+                    continue;
+                }
+                s.W += w;
+                s.X += w * x[i];
+                s.Y += w * y[i];
+                s.XX += static_cast<long double>(w * x[i]) * x[i];
+                s.XY += static_cast<long double>(w * x[i]) * y[i];
+                s.Used++;
+            }
+            partial[Thread] = s;
+        });
+
+        Sums s = { 0, 0, 0, 0, 0, 0 };
+        for (auto & p : partial)
+        {
+            s.W += p.W;
+            s.X += p.X;
+            s.Y += p.Y;
+            s.XX += p.XX;
+            s.XY += p.XY;
+            s.Used += p.Used;
+        }
+        Line line = { 0, 0, s.Used };
+        long double d = s.W * s.XX - s.X * s.X;
+        if (s.W == 0 || d == 0)
+        {
+            return line;
+        }
+        line.Beta = static_cast<double>((s.W * s.XY - s.X * s.Y) / d);
+        line.Alpha = static_cast<double>((s.Y - line.Beta * s.X) / s.W);
+        return line;
+    }
+
+    // Report a line in the caller's coordinates with the RMS of all samples
+    LineFit Result(const Line & L) const
+    {
+        std::vector<double> partial(threads);
+        ParallelFor(x.size(), [&](size_t Begin, size_t End, size_t Thread)
+        {
+            double sum = 0;
+            for (size_t i = Begin; i < End; i++)
+            {
+                double r = y[i] - (L.Beta * x[i] + L.Alpha);
+                sum += r * r;
+            }
+            partial[Thread] = sum;
+        });
+        double sum = 0;
+        for (double p : partial)
+        {
+            sum += p;
+        }
+
+        LineFit fit;
+        fit.Beta = L.Beta;
+        fit.Alpha = y0 + L.Alpha - L.Beta * x0;
+        fit.Rms = x.empty() ? 0 : sqrt(sum / x.size());
+        fit.Used = L.Used;
+        return fit;
+    }
+
+    // Coordinates relative to the first sample, subtracted in the type given
+    template <typename T>
+    void Shift(const T * X, const T * Y)
+    {
+        ParallelFor(x.size(), [&](size_t Begin, size_t End, size_t)
+        {
+            for (size_t i = Begin; i < End; i++)
+            {
+                x[i] = static_cast<double>(X[i] - X[0]);
+                y[i] = static_cast<double>(Y[i] - Y[0]);
+            }
+        });
+    }
+
+    double x0;
+    double y0;
+    size_t threads;
+    std::vector<double> x;
+    std::vector<double> y;
+};
@@ -0,0 +1,209 @@
+#pragma once
+// Mergeable quantile sketch with relative accuracy (DDSketch).
+//
+// Positive values are counted in logarithmic buckets whose bounds grow by
+// Gamma = (1 + Alpha) / (1 - Alpha), so any quantile read back is within
+// Alpha of the true value relative to it. Values at or below ZeroLimit share
+// a single bucket. Two sketches with the same Alpha merge exactly by adding
+// bucket counts, which is what lets hourly sketches be combined into daily
+// or weekly percentiles without going back to the samples.
+
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+class DDSketch
+{
+public:
+    DDSketch(double Alpha = 0.01, double ZeroLimit = 1e-3) :
+        alpha(Alpha),
+        zeroLimit(ZeroLimit),
+        logGamma(log((1 + Alpha) / (1 - Alpha))),
+        firstIndex(0),
+        zeroCount(0),
+        count(0),
+        sum(0),
+        min(0),
+        max(0)
+    {
+    }
+
+    void Add(double Value, unsigned long long Count = 1)
+    {
+        if (count == 0)
+        {
+            min = max = Value;
+        }
+        min = std::min(min, Value);
+        max = std::max(max, Value);
+        sum += Value * Count;
+        count += Count;
+
+        if (Value <= zeroLimit)
+        {
+            zeroCount += Count;
+            return;
+        }
+        Bucket(static_cast<int>(ceil(log(Value) / logGamma))) += Count;
+    }
+
+    // Add the counts of Other, which must use the same Alpha and ZeroLimit
+    bool Merge(const DDSketch & Other)
+    {
+        if (Other.alpha != alpha || Other.zeroLimit != zeroLimit)
+        {
+            return false;
+        }
+        if (Other.count == 0)
+        {
+            return true;
+        }
+        if (count == 0)
+        {
+            min = Other.min;
+            max = Other.max;
+        }
+        min = std::min(min, Other.min);
+        max = std::max(max, Other.max);
+        sum += Other.sum;
+        count += Other.count;
+        zeroCount += Other.zeroCount;
+        for (size_t i = 0; i < Other.buckets.size(); i++)
+        {
+            if (Other.buckets[i] != 0)
+            {
+                Bucket(Other.firstIndex + static_cast<int>(i)) += Other.buckets[i];
+            }
+        }
+        return true;
+    }
+
+    // Value at quantile Q (0 to 1), using the same rank as sorting the
+    // samples and taking element floor(Q * (Count - 1))
+    double Quantile(double Q) const
+    {
+        if (count == 0)
+        {
+            return 0;
+        }
+        unsigned long long rank = static_cast<unsigned long long>(Q * (count - 1));
+        if (rank < zeroCount)
+        {
+            return std::max(min, 0.0);
+        }
+        unsigned long long seen = zeroCount;
+        for (size_t i = 0; i < buckets.size(); i++)
+        {
+            seen += buckets[i];
+            if (seen > rank)
+            {
+                // Midpoint of the bucket in relative terms
+                double value = 2 * exp((firstIndex + static_cast<int>(i)) * logGamma) / (1 + exp(logGamma));
+                return std::min(std::max(value, min), max);
+            }
+        }
+        return max;
+    }
+
+    unsigned long long Count() const
+    {
+        return count;
+    }
+
+    double Mean() const
+    {
+        return count == 0 ? 0 : sum / count;
+    }
+
+    double Min() const
+    {
+        return min;
+    }
+
+    double Max() const
+    {
+        return max;
+    }
+
+    // Binary form: magic, parameters, totals, then the dense bucket range
+    bool Write(FILE * Output) const
+    {
+        unsigned int buckets32 = static_cast<unsigned int>(buckets.size());
+        return fwrite(Magic(), 1, MagicLength, Output) == MagicLength &&
+            fwrite(&alpha, sizeof(alpha), 1, Output) == 1 &&
+            fwrite(&zeroLimit, sizeof(zeroLimit), 1, Output) == 1 &&
+            fwrite(&count, sizeof(count), 1, Output) == 1 &&
+            fwrite(&zeroCount, sizeof(zeroCount), 1, Output) == 1 &&
+            fwrite(&sum, sizeof(sum), 1, Output) == 1 &&
+            fwrite(&min, sizeof(min), 1, Output) == 1 &&
+            fwrite(&max, sizeof(max), 1, Output) == 1 &&
+            fwrite(&firstIndex, sizeof(firstIndex), 1, Output) == 1 &&
+            fwrite(&buckets32, sizeof(buckets32), 1, Output) == 1 &&
+            fwrite(buckets.data(), sizeof(buckets[0]), buckets.size(), Output) == buckets.size();
+    }
+
+    bool Read(FILE * Input)
+    {
+        char magic[MagicLength];
+        unsigned int buckets32;
+        if (fread(magic, 1, MagicLength, Input) != MagicLength ||
+            memcmp(magic, Magic(), MagicLength) != 0 ||
+            fread(&alpha, sizeof(alpha), 1, Input) != 1 ||
+            fread(&zeroLimit, sizeof(zeroLimit), 1, Input) != 1 ||
+            fread(&count, sizeof(count), 1, Input) != 1 ||
+            fread(&zeroCount, sizeof(zeroCount), 1, Input) != 1 ||
+            fread(&sum, sizeof(sum), 1, Input) != 1 ||
+            fread(&min, sizeof(min), 1, Input) != 1 ||
+            fread(&max, sizeof(max), 1, Input) != 1 ||
+            fread(&firstIndex, sizeof(firstIndex), 1, Input) != 1 ||
+            fread(&buckets32, sizeof(buckets32), 1, Input) != 1 ||
+            buckets32 > MaxBuckets)
+        {
+            return false;
+        }
+        logGamma = log((1 + alpha) / (1 - alpha));
+        buckets.resize(buckets32);
+        return fread(buckets.data(), sizeof(buckets[0]), buckets.size(), Input) == buckets.size();
+    }
+
+private:
+    static const unsigned int MaxBuckets = 1 << 20;
+    static const size_t MagicLength = 8;
+    static const char * Magic()
+    {
+        return "DDSKETC1";
+    }
+
+    // Counter for bucket Index, growing the dense range to include it
+    unsigned long long & Bucket(int Index)
+    {
+        if (buckets.empty())
+        {
+            firstIndex = Index;
+            buckets.resize(1);
+        }
+        else if (Index < firstIndex)
+        {
+            buckets.insert(buckets.begin(), firstIndex - Index, 0);
+            firstIndex = Index;
+        }
+        else if (Index >= firstIndex + static_cast<int>(buckets.size()))
+        {
+            buckets.resize(Index - firstIndex + 1);
+        }
+        return buckets[Index - firstIndex];
+    }
+
+    double alpha;
+    double zeroLimit;
+    double logGamma;
+    int firstIndex;
+    std::vector<unsigned long long> buckets;
+    unsigned long long zeroCount;
+    unsigned long long count;
+    double sum;
+    double min;
+    double max;
+};
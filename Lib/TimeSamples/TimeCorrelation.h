@@ -0,0 +1,261 @@
+#pragma once
+// A C++ port of the comparison TimeSampleCorrelation makes between two
+// clocks keyed on TSC: the time of one sample set at a TSC value of the
+// other is taken from a Lagrange polynomial through the five nearest
+// samples. Correlator applies it to root and guest samples as they come,
+// for LiveCorrelation's streams and TscDelta's files alike, and prints the
+// date, skew and rtt lines TimeSampleCorrelation prints.
+
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <deque>
+
+struct CorrelationPoint
+{
+    double X;
+    double Y;
+};
+
+static const size_t CorrelationPoints = 5;
+
+// Value at X of the Lagrange polynomial through Points
+inline double Interpolate(const CorrelationPoint * Points, size_t Count, double X)
+{
+    double y = 0;
+    for (size_t i = 0; i < Count; i++)
+    {
+        double c = 1;
+        for (size_t j = 0; j < Count; j++)
+        {
+            if (i != j)
+            {
+                c *= (X - Points[j].X) / (Points[i].X - Points[j].X);
+            }
+        }
+        y += Points[i].Y * c;
+    }
+    return y;
+}
+
+// Reject point sets whose x spacing varies more than it averages, where a
+// polynomial through them would swing wildly
+inline bool ValidatePoints(const CorrelationPoint * Points, size_t Count)
+{
+    if (Count < 2)
+    {
+        return false;
+    }
+    double mean = (Points[Count - 1].X - Points[0].X) / (Count - 1);
+    double rms = 0;
+    for (size_t i = 1; i < Count; i++)
+    {
+        double d = Points[i].X - Points[i - 1].X - mean;
+        rms += d * d;
+    }
+    return mean > sqrt(rms / (Count - 1));
+}
+
+// Index of the last sample of a TSC ordered sequence with Tsc(i) < Tsc, or
+// -1 when there is none. Samples may be any random access container.
+template<typename TSamples, typename TTscOf>
+ptrdiff_t LowerSample(const TSamples & Samples, size_t Count, double Tsc, TTscOf TscOf)
+{
+    ptrdiff_t low = -1;
+    ptrdiff_t high = static_cast<ptrdiff_t>(Count);
+    while (high - low > 1)
+    {
+        ptrdiff_t mid = low + (high - low) / 2;
+        if (TscOf(Samples[mid]) < Tsc)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// One TSC bracketed reading of a clock, the time in FILETIME units
+struct TimeSample
+{
+    long long TscStart;
+    long long TscEnd;
+    long long TimeStamp;
+
+    double Tsc() const
+    {
+        return 0.5 * (static_cast<double>(TscStart) + static_cast<double>(TscEnd));
+    }
+};
+
+// Compares every root sample to the guest time interpolated at its TSC as
+// soon as the guest has sampled past it. TSample is a TimeSample or derived
+// from one; Correlate takes a predicate that says when a root sample waiting
+// for the guest has waited too long and is dropped.
+template<typename TSample>
+class Correlator
+{
+public:
+    Correlator(long long Delta) :
+        delta(Delta),
+        haveEpoch(false),
+        emitted(0),
+        dropped(0)
+    {
+    }
+
+    template<typename TExpired>
+    void AddRoot(const TSample & Root, TExpired Expired)
+    {
+        SetEpoch(Root);
+        roots.push_back(Root);
+        Correlate(Expired);
+    }
+
+    template<typename TExpired>
+    void AddGuest(TSample Guest, TExpired Expired)
+    {
+        Guest.TscStart -= delta;
+        Guest.TscEnd -= delta;
+        SetEpoch(Guest);
+        if (!guests.empty() && Guest.Tsc() <= guests.back().Tsc())
+        {
+            // The guest sampler restarted or went backwards, start over
+            guests.clear();
+        }
+        guests.push_back(Guest);
+        Correlate(Expired);
+    }
+
+    // Correlate what can be, dropping root samples the guest can never or
+    // not soon enough cover
+    template<typename TExpired>
+    void Correlate(TExpired Expired)
+    {
+        while (!roots.empty())
+        {
+            const TSample & root = roots.front();
+            double tsc = root.Tsc() - tscEpoch;
+
+            // Guest samples before the five used for this root are done with
+            while (guests.size() > CorrelationPoints && guests[3].Tsc() - tscEpoch < tsc)
+            {
+                guests.pop_front();
+            }
+
+            ptrdiff_t low = LowerSample(guests, guests.size(), tsc + tscEpoch, [](const TSample & s) { return s.Tsc(); });
+            if (low < 2)
+            {
+                // Without three guest samples before it once the guest has
+                // sampled past it, it never will have
+                if (static_cast<size_t>(low + 1) < guests.size())
+                {
+                    Drop();
+                    continue;
+                }
+            }
+            else if (static_cast<size_t>(low + 2) < guests.size())
+            {
+                Emit(low);
+                roots.pop_front();
+                continue;
+            }
+
+            if (Expired(root))
+            {
+                Drop();
+                continue;
+            }
+            break;
+        }
+
+        // Without root samples keep only the recent guest samples
+        while (roots.empty() && guests.size() > MaxGuests)
+        {
+            guests.pop_front();
+        }
+    }
+
+    size_t Emitted() const
+    {
+        return emitted;
+    }
+
+    size_t Dropped() const
+    {
+        return dropped;
+    }
+
+private:
+    static const size_t MaxGuests = 4096;
+
+    // Samples are rebased to the first one seen so doubles hold them exactly
+    void SetEpoch(const TSample & First)
+    {
+        if (!haveEpoch)
+        {
+            tscEpoch = First.TscStart;
+            timeEpoch = First.TimeStamp;
+            haveEpoch = true;
+        }
+    }
+
+    void Drop()
+    {
+        roots.pop_front();
+        dropped++;
+    }
+
+    void Emit(ptrdiff_t Low)
+    {
+        const TSample & root = roots.front();
+        CorrelationPoint points[CorrelationPoints];
+        for (size_t i = 0; i < CorrelationPoints; i++)
+        {
+            const TSample & guest = guests[Low - 2 + i];
+            points[i].X = guest.Tsc() - tscEpoch;
+            points[i].Y = static_cast<double>(guest.TimeStamp - timeEpoch);
+        }
+        if (!ValidatePoints(points, CorrelationPoints))
+        {
+            dropped++;
+            return;
+        }
+
+        double skew = Interpolate(points, CorrelationPoints, root.Tsc() - tscEpoch) - (root.TimeStamp - timeEpoch);
+        double rtt = Interpolate(points, CorrelationPoints, static_cast<double>(root.TscEnd - tscEpoch)) -
+            Interpolate(points, CorrelationPoints, static_cast<double>(root.TscStart - tscEpoch));
+
+        // Date of the root sample in local time, as DateTime.ToString()
+        // prints it ("M/d/yyyy h:mm:ss tt", no leading zeros on the month,
+        // day and hour), then skew and window in us
+        time_t seconds = static_cast<time_t>((root.TimeStamp - 116444736000000000ll) / 10000000);
+        tm local;
+        localtime_r(&seconds, &local);
+        printf("%d/%d/%d %d:%02d:%02d %s,%.1f,%.1f\n",
+            local.tm_mon + 1,
+            local.tm_mday,
+            local.tm_year + 1900,
+            local.tm_hour % 12 == 0 ? 12 : local.tm_hour % 12,
+            local.tm_min,
+            local.tm_sec,
+            local.tm_hour < 12 ? "AM" : "PM",
+            round(skew) / 10,
+            round(rtt) / 10);
+        fflush(stdout);
+        emitted++;
+    }
+
+    long long delta;
+    bool haveEpoch;
+    long long tscEpoch;
+    long long timeEpoch;
+    std::deque<TSample> roots;
+    std::deque<TSample> guests;
+    size_t emitted;
+    size_t dropped;
+};
@@ -0,0 +1,736 @@
+#pragma once
+// Fast reader for the time sample files the tools in this repository share.
+//
+// Samples come in one of three formats, as described in TimeCorrelation.cs:
+//
+//     Format 1: start_tsc, end_tsc, os time [, extra columns]   (OsTimeSampler)
+//     Format 2: start_tsc, end_tsc, os time, ntpRTT, ntpTimeOffset (w32tm /stripchart /rdtsc)
+//     Format 3: start_tsc, os time
+//
+// The format is detected from the first data line, and lines that don't
+// parse (headers, w32tm banners) are skipped. Files are memory mapped and
+// split at line boundaries into one chunk per thread. Within a chunk the
+// ',' and '\n' delimiters are located 64 bytes at a time with SSE2 compares
+// and walked as a bit mask, and integers are converted eight digits at a
+// time, so there is no per-byte loop on the common path.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_IX86)
+#include <emmintrin.h>
+#define TIME_SAMPLES_SSE2
+#endif
+
+// The AVX2 delimiter scan is compiled in regardless of the compiler flags
+// and chosen at run time when the CPU and OS support it
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#include "CpuInfo/CpuInfo.h"
+#define TIME_SAMPLES_AVX2
+#if defined(_MSC_VER)
+#define TIME_SAMPLES_TARGET_AVX2
+#else
+#define TIME_SAMPLES_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+enum SampleFormat {
+    UnknownFormat,
+    StartEndOsFormat,
+    StripchartFormat,
+    StartOsFormat
+};
+
+inline const char * SampleFormatName(SampleFormat Format)
+{
+    switch (Format)
+    {
+    case StartEndOsFormat:
+        return "start_tsc,end_tsc,os_time";
+    case StripchartFormat:
+        return "start_tsc,end_tsc,os_time,rtt,offset";
+    case StartOsFormat:
+        return "start_tsc,os_time";
+    default:
+        return "unknown";
+    }
+}
+
+// Parsed samples as one array per column. For format 3 TscEnd is a copy of
+// TscStart; Rtt and Offset (in seconds) are only filled in for format 2.
+struct SampleColumns
+{
+    SampleFormat Format = UnknownFormat;
+    std::vector<long long> TscStart;
+    std::vector<long long> TscEnd;
+    std::vector<long long> OsTime;
+    std::vector<double> Rtt;
+    std::vector<double> Offset;
+
+    size_t Size() const
+    {
+        return TscStart.size();
+    }
+
+    void Reserve(size_t Count)
+    {
+        TscStart.reserve(Count);
+        TscEnd.reserve(Count);
+        OsTime.reserve(Count);
+        if (Format == StripchartFormat)
+        {
+            Rtt.reserve(Count);
+            Offset.reserve(Count);
+        }
+    }
+
+    void Append(const SampleColumns & Other)
+    {
+        TscStart.insert(TscStart.end(), Other.TscStart.begin(), Other.TscStart.end());
+        TscEnd.insert(TscEnd.end(), Other.TscEnd.begin(), Other.TscEnd.end());
+        OsTime.insert(OsTime.end(), Other.OsTime.begin(), Other.OsTime.end());
+        Rtt.insert(Rtt.end(), Other.Rtt.begin(), Other.Rtt.end());
+        Offset.insert(Offset.end(), Other.Offset.begin(), Other.Offset.end());
+    }
+};
+
+// Read only view of a whole file
+class MappedFile
+{
+public:
+    MappedFile(const std::string & FileName) :
+        data(nullptr),
+        length(0)
+    {
+#if defined(_MSC_VER)
+        file = CreateFileA(FileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        mapping = nullptr;
+        LARGE_INTEGER size;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size) || size.QuadPart == 0)
+        {
+            return;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr)
+        {
+            return;
+        }
+        data = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        length = data == nullptr ? 0 : static_cast<size_t>(size.QuadPart);
+#else
+        fd = open(FileName.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1 || st.st_size == 0)
+        {
+            return;
+        }
+        void * view = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view == MAP_FAILED)
+        {
+            return;
+        }
+        data = static_cast<const char *>(view);
+        length = static_cast<size_t>(st.st_size);
+        madvise(view, length, MADV_SEQUENTIAL);
+#endif
+    }
+
+    ~MappedFile()
+    {
+#if defined(_MSC_VER)
+        if (data != nullptr)
+        {
+            UnmapViewOfFile(data);
+        }
+        if (mapping != nullptr)
+        {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(file);
+        }
+#else
+        if (data != nullptr)
+        {
+            munmap(const_cast<char *>(data), length);
+        }
+        if (fd != -1)
+        {
+            close(fd);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    bool IsOpen() const
+    {
+        return data != nullptr;
+    }
+
+    const char * Data() const
+    {
+        return data;
+    }
+
+    size_t Length() const
+    {
+        return length;
+    }
+
+private:
+    const char * data;
+    size_t length;
+#if defined(_MSC_VER)
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+};
+
+inline unsigned int LowestBit(unsigned long long Mask)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, Mask);
+    return index;
+#else
+    return static_cast<unsigned int>(__builtin_ctzll(Mask));
+#endif
+}
+
+// Bit i is set when Data[i] is ',' or '\n', for the Length (at most 64)
+// bytes at Data
+inline unsigned long long DelimiterMask(const char * Data, size_t Length)
+{
+    unsigned long long mask = 0;
+#if defined(TIME_SAMPLES_SSE2)
+    if (Length == 64)
+    {
+        const __m128i comma = _mm_set1_epi8(',');
+        const __m128i newline = _mm_set1_epi8('\n');
+        for (int i = 0; i < 4; i++)
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(Data + 16 * i));
+            __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, newline));
+            mask |= static_cast<unsigned long long>(static_cast<unsigned int>(_mm_movemask_epi8(hit))) << (16 * i);
+        }
+        return mask;
+    }
+#endif
+    for (size_t i = 0; i < Length; i++)
+    {
+        if (Data[i] == ',' || Data[i] == '\n')
+        {
+            mask |= 1ull << i;
+        }
+    }
+    return mask;
+}
+
+#if defined(TIME_SAMPLES_AVX2)
+// DelimiterMask of 64 bytes in two 32 byte compares
+TIME_SAMPLES_TARGET_AVX2 inline unsigned long long DelimiterMaskAvx2(const char * Data)
+{
+    const __m256i comma = _mm256_set1_epi8(',');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(Data));
+    __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(Data + 32));
+    unsigned int lowMask = static_cast<unsigned int>(_mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(low, comma), _mm256_cmpeq_epi8(low, newline))));
+    unsigned int highMask = static_cast<unsigned int>(_mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(high, comma), _mm256_cmpeq_epi8(high, newline))));
+    return lowMask | (static_cast<unsigned long long>(highMask) << 32);
+}
+
+// Decided once per process
+inline bool UseAvx2Delimiters()
+{
+    static const bool avx2 = InstructionSet::AVX2Usable();
+    return avx2;
+}
+#endif
+
+// Hands out the positions of successive delimiters in [Begin, End)
+class DelimiterScanner
+{
+public:
+    DelimiterScanner(const char * Begin, const char * End) :
+        block(Begin),
+        end(End),
+#if defined(TIME_SAMPLES_AVX2)
+        avx2(UseAvx2Delimiters())
+#else
+        avx2(false)
+#endif
+    {
+        mask = Mask();
+    }
+
+    // Position of the next delimiter, or End once there are no more
+    const char * Next()
+    {
+        while (mask == 0)
+        {
+            block += 64;
+            if (block >= end)
+            {
+                block = end;
+                return end;
+            }
+            mask = Mask();
+        }
+        const char * p = block + LowestBit(mask);
+        mask &= mask - 1;
+        return p;
+    }
+
+private:
+    unsigned long long Mask() const
+    {
+#if defined(TIME_SAMPLES_AVX2)
+        if (avx2 && end - block >= 64)
+        {
+            return DelimiterMaskAvx2(block);
+        }
+#endif
+        return DelimiterMask(block, std::min<size_t>(64, end - block));
+    }
+
+    const char * block;
+    const char * end;
+    bool avx2;
+    unsigned long long mask;
+};
+
+inline bool IsBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Value of the 8 ASCII digits at p, combining digit pairs, then pairs of
+// pairs, with multiplies instead of a serial multiply-add per digit.
+inline unsigned long long ParseEightDigits(const char * p)
+{
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v));
+    v -= 0x3030303030303030ull;
+    v = (v * 10) + (v >> 8);
+    return (((v & 0x000000FF000000FFull) * (100 + (1000000ull << 32))) +
+        (((v >> 16) & 0x000000FF000000FFull) * (1 + (10000ull << 32)))) >> 32;
+}
+
+inline bool AreEightDigits(const char * p)
+{
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v));
+    return (((v + 0x4646464646464646ull) | (v - 0x3030303030303030ull)) & 0x8080808080808080ull) == 0;
+}
+
+// Parse a field holding only an integer, allowing surrounding blanks.
+// Floor, when given, is the lowest address that may be read; it lets the
+// leading digits that don't fill a group of eight be converted with one
+// load ending at the group instead of a loop.
+inline bool ParseInteger(const char * p, const char * End, long long & Value, const char * Floor = nullptr)
+{
+    unsigned long long v = 0;
+    bool negative = false;
+    while (p < End && IsBlank(*p))
+    {
+        p++;
+    }
+    while (p < End && IsBlank(End[-1]))
+    {
+        End--;
+    }
+    if (p < End && (*p == '-' || *p == '+'))
+    {
+        negative = *p++ == '-';
+    }
+    size_t digits = End - p;
+    if (digits == 0 || digits > 19)
+    {
+        return false;
+    }
+
+    size_t lead = digits % 8;
+    if (lead != 0)
+    {
+        if (Floor != nullptr && p + lead - 8 >= Floor)
+        {
+            // Load the 8 bytes ending after the leading digits and replace
+            // the bytes before them with '0'
+            unsigned long long group;
+            unsigned long long keep = ~0ull << (8 * (8 - lead));
+            memcpy(&group, p + lead - 8, sizeof(group));
+            group = (group & keep) | (0x3030303030303030ull & ~keep);
+            if (!AreEightDigits(reinterpret_cast<const char *>(&group)))
+            {
+                return false;
+            }
+            v = ParseEightDigits(reinterpret_cast<const char *>(&group));
+            p += lead;
+        }
+        else
+        {
+            for (; (End - p) % 8 != 0; p++)
+            {
+                if (static_cast<unsigned char>(*p - '0') >= 10)
+                {
+                    return false;
+                }
+                v = v * 10 + static_cast<unsigned char>(*p - '0');
+            }
+        }
+    }
+    for (; p < End; p += 8)
+    {
+        if (!AreEightDigits(p))
+        {
+            return false;
+        }
+        v = v * 100000000ull + ParseEightDigits(p);
+    }
+
+    // 19 digits can't wrap the unsigned accumulator but can pass LLONG_MAX
+    if (v > static_cast<unsigned long long>(LLONG_MAX) + (negative ? 1 : 0))
+    {
+        return false;
+    }
+    Value = negative ? static_cast<long long>(0 - v) : static_cast<long long>(v);
+    return true;
+}
+
+// Parse a decimal number at p without relying on a terminator, since the
+// input is usually a memory mapped file. p is left after the number.
+// Returns false if there is no number here.
+inline bool ParseDouble(const char * & p, const char * End, double & Value)
+{
+    static const double powers[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    unsigned long long mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    bool negative = false;
+
+    while (p < End && IsBlank(*p))
+    {
+        p++;
+    }
+    if (p < End && (*p == '-' || *p == '+'))
+    {
+        negative = *p++ == '-';
+    }
+    for (; p < End && *p >= '0' && *p <= '9'; p++, digits++)
+    {
+        if (mantissa < 1000000000000000000ull)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+        }
+        else
+        {
+            exponent++;
+        }
+    }
+    if (p < End && *p == '.')
+    {
+        for (p++; p < End && *p >= '0' && *p <= '9'; p++, digits++)
+        {
+            if (mantissa < 1000000000000000000ull)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                exponent--;
+            }
+        }
+    }
+    if (digits == 0)
+    {
+        return false;
+    }
+    if (p < End && (*p == 'e' || *p == 'E'))
+    {
+        const char * e = p + 1;
+        bool negativeExponent = false;
+        int value = 0;
+        if (e < End && (*e == '-' || *e == '+'))
+        {
+            negativeExponent = *e++ == '-';
+        }
+        if (e < End && *e >= '0' && *e <= '9')
+        {
+            for (; e < End && *e >= '0' && *e <= '9'; e++)
+            {
+                value = std::min(value * 10 + (*e - '0'), 1000);
+            }
+            exponent += negativeExponent ? -value : value;
+            p = e;
+        }
+    }
+
+    Value = static_cast<double>(mantissa);
+    if (exponent < 0)
+    {
+        Value = -exponent <= 22 ? Value / powers[-exponent] : Value * pow(10.0, exponent);
+    }
+    else if (exponent > 0)
+    {
+        Value = exponent <= 22 ? Value * powers[exponent] : Value * pow(10.0, exponent);
+    }
+    Value = negative ? -Value : Value;
+    return true;
+}
+
+// w32tm writes RTT and offset in seconds with a trailing 's', e.g. "+00.0012345s"
+inline bool ParseSeconds(const char * p, const char * End, double & Value)
+{
+    if (!ParseDouble(p, End, Value))
+    {
+        return false;
+    }
+    if (p < End && *p == 's')
+    {
+        p++;
+    }
+    while (p < End && IsBlank(*p))
+    {
+        p++;
+    }
+    return p == End;
+}
+
+class SampleParser
+{
+public:
+    // FirstColumn skips leading columns, e.g. the server address in the
+    // per server files written by SplitRecords.
+    SampleParser(size_t FirstColumn = 0) :
+        firstColumn(FirstColumn)
+    {
+    }
+
+    // Guess the format from the first line whose first two sample columns
+    // are integers
+    SampleFormat DetectFormat(const char * Data, size_t Length) const
+    {
+        const char * end = Data + Length;
+        DelimiterScanner scanner(Data, end);
+        Line line;
+        for (const char * p = Data; p < end; )
+        {
+            p = ReadLine(scanner, p, end, line);
+            if (line.Count < firstColumn + 2)
+            {
+                continue;
+            }
+            long long a;
+            long long b;
+            if (!ParseInteger(line.Start[firstColumn], line.End[firstColumn], a) ||
+                !ParseInteger(line.Start[firstColumn + 1], line.End[firstColumn + 1], b))
+            {
+                continue;
+            }
+            size_t columns = line.Count - firstColumn;
+            if (columns == 2)
+            {
+                return StartOsFormat;
+            }
+            double rtt;
+            double offset;
+            if (columns == 5 &&
+                ParseSeconds(line.Start[firstColumn + 3], line.End[firstColumn + 3], rtt) &&
+                ParseSeconds(line.Start[firstColumn + 4], line.End[firstColumn + 4], offset) &&
+                !ParseInteger(line.Start[firstColumn + 3], line.End[firstColumn + 3], a))
+            {
+                return StripchartFormat;
+            }
+            return StartEndOsFormat;
+        }
+        return UnknownFormat;
+    }
+
+    // Parse every sample in [Data, Data + Length) into Samples, using
+    // Threads threads. The format is detected unless Samples.Format is set.
+    bool Parse(const char * Data, size_t Length, size_t Threads, SampleColumns & Samples) const
+    {
+        if (Samples.Format == UnknownFormat)
+        {
+            Samples.Format = DetectFormat(Data, Length);
+            if (Samples.Format == UnknownFormat)
+            {
+                return false;
+            }
+        }
+
+        Threads = std::max<size_t>(1, std::min(Threads, Length / (1 << 20) + 1));
+        std::vector<const char *> bounds(Threads + 1);
+        bounds[0] = Data;
+        for (size_t t = 1; t <= Threads; t++)
+        {
+            const char * b = Data + Length;
+            if (t < Threads)
+            {
+                // Start each chunk at the beginning of a line
+                b = Data + Length * t / Threads;
+                const char * eol = static_cast<const char *>(memchr(b, '\n', Data + Length - b));
+                b = eol == nullptr ? Data + Length : eol + 1;
+            }
+            bounds[t] = std::max(b, bounds[t - 1]);
+        }
+
+        std::vector<SampleColumns> chunks(Threads);
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < Threads; t++)
+        {
+            chunks[t].Format = Samples.Format;
+            workers.push_back(std::thread([&, t]()
+            {
+                ParseChunk(bounds[t], bounds[t + 1], chunks[t]);
+            }));
+        }
+        for (auto & w : workers)
+        {
+            w.join();
+        }
+
+        if (Samples.Size() == 0 && Threads == 1)
+        {
+            SampleFormat format = Samples.Format;
+            Samples = std::move(chunks[0]);
+            Samples.Format = format;
+            return true;
+        }
+        size_t total = Samples.Size();
+        for (auto & c : chunks)
+        {
+            total += c.Size();
+        }
+        Samples.Reserve(total);
+        for (auto & c : chunks)
+        {
+            Samples.Append(c);
+        }
+        return true;
+    }
+
+    bool Parse(const MappedFile & File, size_t Threads, SampleColumns & Samples) const
+    {
+        return File.IsOpen() && Parse(File.Data(), File.Length(), Threads, Samples);
+    }
+
+private:
+    static const size_t MaxColumns = 16;
+
+    struct Line
+    {
+        const char * Start[MaxColumns];
+        const char * End[MaxColumns];
+        size_t Count;
+    };
+
+    // Split the line at p into fields, returning the start of the next line.
+    // Fields past MaxColumns are counted but not recorded.
+    static const char * ReadLine(DelimiterScanner & Scanner, const char * p, const char * End, Line & Fields)
+    {
+        Fields.Count = 0;
+        for (;;)
+        {
+            const char * d = Scanner.Next();
+            if (Fields.Count < MaxColumns)
+            {
+                Fields.Start[Fields.Count] = p;
+                Fields.End[Fields.Count] = d;
+            }
+            Fields.Count++;
+            if (d == End || *d == '\n')
+            {
+                return d == End ? End : d + 1;
+            }
+            p = d + 1;
+        }
+    }
+
+    void ParseChunk(const char * Begin, const char * End, SampleColumns & Samples) const
+    {
+        // Assume around 48 bytes per line to avoid most regrowth
+        Samples.Reserve((End - Begin) / 48);
+
+        DelimiterScanner scanner(Begin, End);
+        Line line;
+        size_t columns = Samples.Format == StartOsFormat ? 2 : Samples.Format == StripchartFormat ? 5 : 3;
+        for (const char * p = Begin; p < End; )
+        {
+            p = ReadLine(scanner, p, End, line);
+            if (line.Count < firstColumn + columns)
+            {
+                continue;
+            }
+
+            const char * const * s = line.Start + firstColumn;
+            const char * const * e = line.End + firstColumn;
+            long long tscStart;
+            long long tscEnd;
+            long long osTime;
+            double rtt;
+            double offset;
+            switch (Samples.Format)
+            {
+            case StartOsFormat:
+                if (!ParseInteger(s[0], e[0], tscStart, Begin) ||
+                    !ParseInteger(s[1], e[1], osTime, Begin))
+                {
+                    continue;
+                }
+                tscEnd = tscStart;
+                break;
+            case StripchartFormat:
+                if (!ParseInteger(s[0], e[0], tscStart, Begin) ||
+                    !ParseInteger(s[1], e[1], tscEnd, Begin) ||
+                    !ParseInteger(s[2], e[2], osTime, Begin) ||
+                    !ParseSeconds(s[3], e[3], rtt) ||
+                    !ParseSeconds(s[4], e[4], offset))
+                {
+                    continue;
+                }
+                Samples.Rtt.push_back(rtt);
+                Samples.Offset.push_back(offset);
+                break;
+            default:
+                if (!ParseInteger(s[0], e[0], tscStart, Begin) ||
+                    !ParseInteger(s[1], e[1], tscEnd, Begin) ||
+                    !ParseInteger(s[2], e[2], osTime, Begin))
+                {
+                    continue;
+                }
+                break;
+            }
+            Samples.TscStart.push_back(tscStart);
+            Samples.TscEnd.push_back(tscEnd);
+            Samples.OsTime.push_back(osTime);
+        }
+    }
+
+    size_t firstColumn;
+};
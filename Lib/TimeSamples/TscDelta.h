@@ -0,0 +1,363 @@
+#pragma once
+// Estimate of the TSC offset between a root and a guest sample set, the
+// delta TimeSampleCorrelation subtracts from guest TSC values.
+//
+// Both sets are first fitted with a straight line of OS time against TSC.
+// Where the two lines reach the same OS time their TSC values differ by the
+// delta plus whatever offset the guest clock has from the root clock, which
+// gives the coarse estimate. The guest clock follows the root one, so the
+// steps in the wander of each clock around its line show up in both sets,
+// displaced by exactly the delta. Each set only places a step between two
+// of its samples, so a root step and the matching guest step bound the
+// delta to an interval about two sample spacings wide; the refined estimate
+// is the middle of the interval the most step pairs agree on. Steps at many
+// phases relative to the samples narrow that interval, steps all at one
+// phase (once a second, say) don't, and the bounds reported are never
+// narrower than the sample spacing. Without enough matching steps, or with
+// a second lag the steps agree on as well, the coarse estimate stands.
+
+#include <math.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+#include "TimeSamples/TimeSamples.h"
+#include "Robust/RobustFit.h"
+
+struct TscDeltaEstimate
+{
+    double Delta = 0;       // Guest TSC minus root TSC
+    double Low = 0;         // Confidence bounds of Delta
+    double High = 0;
+    double Coarse = 0;      // Estimate from the fitted lines alone
+    double Correlation = 0; // Residual correlation at Delta
+    size_t Steps = 0;       // Step pairs agreeing on Delta
+    bool Refined = false;   // False when the steps didn't pin Delta down
+};
+
+class TscDeltaEstimator
+{
+public:
+    TscDeltaEstimator(const SampleColumns & Root, const SampleColumns & Guest, size_t Threads) :
+        root(Root, Root.OsTime.empty() ? 0 : Root.OsTime[0], Threads),
+        guest(Guest, Root.OsTime.empty() ? 0 : Root.OsTime[0], Threads),
+        threads(std::max<size_t>(1, Threads))
+    {
+    }
+
+    // Range bounds the search around the coarse estimate. It should cover
+    // the possible offset between the two clocks, in OS time units (100ns).
+    TscDeltaEstimate Estimate(double Range, size_t MinimumSteps = 3, double MinimumCorrelation = 0.5) const
+    {
+        TscDeltaEstimate estimate;
+        if (root.Size() < 16 || guest.Size() < 16 || root.Beta <= 0 || guest.Beta <= 0)
+        {
+            return estimate;
+        }
+        double rangeTicks = Range / root.Beta;
+
+        // Coarse: the TSC values of both lines at the middle of the common time
+        double first = std::max(root.Time.front(), guest.Time.front());
+        double last = std::min(root.Time.back(), guest.Time.back());
+        double middle = 0.5 * (first + last);
+        estimate.Coarse = guest.TscAt(middle) - root.TscAt(middle);
+        estimate.Delta = estimate.Coarse;
+        estimate.Low = estimate.Coarse - rangeTicks;
+        estimate.High = estimate.Coarse + rangeTicks;
+
+        // Every pairing of a root and a guest step of about the same size
+        // within the range gives an interval the delta lies in, if they are
+        // the same step
+        double rootThreshold;
+        double guestThreshold;
+        std::vector<Step> rootSteps = root.Steps(threads, rootThreshold);
+        std::vector<Step> guestSteps = guest.Steps(threads, guestThreshold);
+        double lowest = estimate.Coarse - rangeTicks;
+        double highest = estimate.Coarse + rangeTicks;
+        std::vector<std::pair<double, int>> bounds;
+        for (const Step & r : rootSteps)
+        {
+            auto g = std::lower_bound(guestSteps.begin(), guestSteps.end(), r.Begin + lowest,
+                [](const Step & s, double Tsc) { return s.End < Tsc; });
+            for (; g != guestSteps.end() && g->Begin - r.End <= highest; ++g)
+            {
+                double tolerance = 0.25 * std::max(fabs(r.Size), fabs(g->Size)) + 0.5 * (rootThreshold + guestThreshold);
+                if ((r.Size > 0) != (g->Size > 0) || fabs(r.Size - g->Size) > tolerance)
+                {
+                    continue;
+                }
+                double low = std::max(lowest, g->Begin - r.End);
+                double high = std::min(highest, g->End - r.Begin);
+                if (low < high)
+                {
+                    bounds.push_back(std::make_pair(low, 1));
+                    bounds.push_back(std::make_pair(high, -1));
+                }
+            }
+        }
+
+        // Sweep the interval ends for the stretch the most pairs cover, and
+        // the best count anywhere clear of it
+        std::sort(bounds.begin(), bounds.end(), [](const std::pair<double, int> & a, const std::pair<double, int> & b)
+        {
+            return a.first < b.first || (a.first == b.first && a.second > b.second);
+        });
+        struct Stretch
+        {
+            double Low;
+            double High;
+            size_t Count;
+        };
+        std::vector<Stretch> stretches;
+        size_t count = 0;
+        for (size_t k = 0; k + 1 < bounds.size(); k++)
+        {
+            count += bounds[k].second;
+            if (count > 0 && bounds[k + 1].first > bounds[k].first)
+            {
+                stretches.push_back(Stretch{ bounds[k].first, bounds[k + 1].first, count });
+            }
+        }
+        if (stretches.empty())
+        {
+            return estimate;
+        }
+        size_t peak = std::max_element(stretches.begin(), stretches.end(),
+            [](const Stretch & a, const Stretch & b) { return a.Count < b.Count; }) - stretches.begin();
+
+        // A stray pair, a spurious step or one misplaced by noise, only
+        // trims the peak, so the region extends over the neighbouring
+        // stretches nearly all the pairs still cover
+        Stretch best = stretches[peak];
+        for (size_t k = peak; k > 0 && stretches[k - 1].High == best.Low && 10 * stretches[k - 1].Count >= 9 * best.Count; k--)
+        {
+            best.Low = stretches[k - 1].Low;
+        }
+        for (size_t k = peak + 1; k < stretches.size() && stretches[k].Low == best.High && 10 * stretches[k].Count >= 9 * best.Count; k++)
+        {
+            best.High = stretches[k].High;
+        }
+        double spacing = std::max(root.Spacing(), guest.Spacing());
+        size_t rival = 0;
+        for (const Stretch & s : stretches)
+        {
+            if (s.High < best.Low - 2 * spacing || s.Low > best.High + 2 * spacing)
+            {
+                rival = std::max(rival, s.Count);
+            }
+        }
+        estimate.Steps = best.Count;
+        if (best.Count < MinimumSteps || 2 * rival > best.Count)
+        {
+            return estimate;
+        }
+
+        double delta = 0.5 * (best.Low + best.High);
+        estimate.Correlation = Compare(delta, root.Tsc.front(), root.Tsc.back() + 1);
+        if (estimate.Correlation < MinimumCorrelation)
+        {
+            return estimate;
+        }
+        estimate.Delta = delta;
+        estimate.Low = std::min(best.Low, delta - 0.5 * spacing);
+        estimate.High = std::max(best.High, delta + 0.5 * spacing);
+        estimate.Refined = true;
+        return estimate;
+    }
+
+private:
+    // A change of the residual between two samples well beyond the noise,
+    // bracketed in absolute TSC by the reads on either side
+    struct Step
+    {
+        double Begin;
+        double End;
+        double Size;
+    };
+
+    // One sample set as TSC midpoints and OS times, both as doubles relative
+    // to the set's first TSC and the root's first OS time, with the residual
+    // of each time from the fitted line and half the TSC window of each read
+    class SampleSet
+    {
+    public:
+        SampleSet(const SampleColumns & Samples, long long TimeEpoch, size_t Threads) :
+            Alpha(0),
+            Beta(0),
+            epoch(Samples.Size() > 0 ? Samples.TscStart[0] : 0)
+        {
+            for (size_t i = 0; i < Samples.Size(); i++)
+            {
+                double tsc = static_cast<double>(Samples.TscStart[i] - epoch) + 0.5 * (Samples.TscEnd[i] - Samples.TscStart[i]);
+                if (!Tsc.empty() && tsc <= Tsc.back())
+                {
+                    continue;
+                }
+                Tsc.push_back(tsc);
+                HalfWindow.push_back(0.5 * (Samples.TscEnd[i] - Samples.TscStart[i]));
+                Time.push_back(static_cast<double>(Samples.OsTime[i] - TimeEpoch));
+            }
+            if (Tsc.size() < 2)
+            {
+                return;
+            }
+
+            RobustFit fit(Tsc.data(), Time.data(), Tsc.size(), Threads);
+            LineFit line = fit.TheilSenFit();
+            Alpha = line.Alpha;
+            Beta = line.Beta;
+            Residual.resize(Tsc.size());
+            for (size_t i = 0; i < Tsc.size(); i++)
+            {
+                Residual[i] = Time[i] - (Beta * Tsc[i] + Alpha);
+            }
+        }
+
+        size_t Size() const
+        {
+            return Tsc.size();
+        }
+
+        // Absolute TSC at which the fitted line reaches Time
+        double TscAt(double T) const
+        {
+            return (T - Alpha) / Beta + static_cast<double>(epoch);
+        }
+
+        double Epoch() const
+        {
+            return static_cast<double>(epoch);
+        }
+
+        double Spacing() const
+        {
+            return (Tsc.back() - Tsc.front()) / (Tsc.size() - 1);
+        }
+
+        // The steps of the residual, in TSC order. Each change between
+        // neighbouring samples is taken relative to the median change
+        // around it, so a slewing clock's slope doesn't count, and is a step
+        // when it exceeds eight times the noise of those changes (estimated
+        // from their median absolute value). Runs of such changes merge into
+        // one step bracketed by the reads before and after the run.
+        std::vector<Step> Steps(size_t Threads, double & Threshold) const
+        {
+            std::vector<Step> steps;
+            size_t n = Size();
+            Threshold = 0;
+            if (n < 16)
+            {
+                return steps;
+            }
+            const ptrdiff_t Half = 7;
+            std::vector<double> change(n - 1);
+            for (size_t i = 0; i + 1 < n; i++)
+            {
+                change[i] = Residual[i + 1] - Residual[i];
+            }
+            std::vector<double> excess(n - 1);
+            std::vector<std::thread> workers;
+            size_t chunk = (excess.size() + Threads - 1) / Threads;
+            for (size_t t = 0; t < Threads; t++)
+            {
+                workers.push_back(std::thread([&, t]()
+                {
+                    double window[2 * Half + 1];
+                    ptrdiff_t last = static_cast<ptrdiff_t>(change.size()) - 1;
+                    for (size_t i = t * chunk; i < std::min(excess.size(), (t + 1) * chunk); i++)
+                    {
+                        ptrdiff_t begin = std::max<ptrdiff_t>(0, std::min<ptrdiff_t>(i - Half, last - 2 * Half));
+                        std::copy(&change[begin], &change[begin] + 2 * Half + 1, window);
+                        std::nth_element(window, window + Half, window + 2 * Half + 1);
+                        excess[i] = change[i] - window[Half];
+                    }
+                }));
+            }
+            for (auto & w : workers)
+            {
+                w.join();
+            }
+
+            std::vector<double> magnitude(excess.size());
+            for (size_t i = 0; i < excess.size(); i++)
+            {
+                magnitude[i] = fabs(excess[i]);
+            }
+            std::nth_element(magnitude.begin(), magnitude.begin() + magnitude.size() / 2, magnitude.end());
+            // At least two OS time units, the clock ticks of a noise free set
+            Threshold = std::max(2.0, 8 * 1.4826 * magnitude[magnitude.size() / 2]);
+
+            double base = static_cast<double>(epoch);
+            for (size_t i = 0; i < excess.size(); )
+            {
+                if (fabs(excess[i]) <= Threshold)
+                {
+                    i++;
+                    continue;
+                }
+                Step step = { base + Tsc[i] - HalfWindow[i], 0, 0 };
+                for (; i < excess.size() && fabs(excess[i]) > Threshold; i++)
+                {
+                    step.Size += excess[i];
+                }
+                step.End = base + Tsc[i] + HalfWindow[i];
+                steps.push_back(step);
+            }
+            return steps;
+        }
+
+        std::vector<double> Tsc;
+        std::vector<double> HalfWindow;
+        std::vector<double> Time;
+        std::vector<double> Residual;
+        double Alpha;
+        double Beta;
+
+    private:
+        long long epoch;
+    };
+
+    // Correlation of the root residuals between root TSC Begin and End with
+    // the guest residuals, linearly interpolated, at the same TSC plus Delta.
+    // Both sets are sorted by TSC so one sweep pairs them up.
+    double Compare(double Delta, double Begin, double End) const
+    {
+        double offset = guest.Epoch() - root.Epoch() - Delta;
+        size_t i = std::lower_bound(root.Tsc.begin(), root.Tsc.end(), Begin) - root.Tsc.begin();
+        size_t j = 0;
+        double sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+        size_t n = 0;
+        for (; i < root.Size() && root.Tsc[i] < End; i++)
+        {
+            double x = root.Tsc[i] - offset;
+            while (j + 1 < guest.Size() && guest.Tsc[j + 1] < x)
+            {
+                j++;
+            }
+            if (j + 1 >= guest.Size() || guest.Tsc[j] > x)
+            {
+                continue;
+            }
+            double f = (x - guest.Tsc[j]) / (guest.Tsc[j + 1] - guest.Tsc[j]);
+            double a = root.Residual[i];
+            double b = guest.Residual[j] + f * (guest.Residual[j + 1] - guest.Residual[j]);
+            sa += a;
+            sb += b;
+            saa += a * a;
+            sbb += b * b;
+            sab += a * b;
+            n++;
+        }
+        if (n < 8)
+        {
+            return 0;
+        }
+        double va = saa - sa * sa / n;
+        double vb = sbb - sb * sb / n;
+        double cov = sab - sa * sb / n;
+        return va > 0 && vb > 0 ? cov / sqrt(va * vb) : 0;
+    }
+
+    SampleSet root;
+    SampleSet guest;
+    size_t threads;
+};
@@ -0,0 +1,450 @@
+#pragma once
+// Which CPUs share a core, an L3 cache, a die and a socket, and the few CPU
+// pairs that cover every latency class between them.
+//
+// Cache line transfers between two CPUs cost distinctly more at each level
+// they don't share: SMT siblings share L1, cores of a CCX or a monolithic
+// die share L3, dies of a package share its fabric, and sockets talk over
+// the interconnect. One pair per class, and one per pair of sockets since
+// those links differ, measures a machine as well as a sweep of all N^2
+// pairs. The topology comes from sysfs on Linux, from
+// GetLogicalProcessorInformationEx on Windows, or from an hwloc XML export
+// (lstopo topology.xml) of another machine.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+struct CpuLocation
+{
+    int Cpu = -1;
+    int Package = 0;
+    int Die = 0;    // Unique across packages
+    int L3 = -1;    // Unique, -1 without a shared L3
+    int Core = 0;   // Unique across packages
+    int Node = 0;
+};
+
+enum class PairClass
+{
+    SameCore,
+    SameL3,
+    SameDie,
+    CrossDie,
+    CrossSocket,
+};
+
+inline const char * PairClassName(PairClass Class)
+{
+    switch (Class)
+    {
+    case PairClass::SameCore: return "same-core";
+    case PairClass::SameL3: return "same-l3";
+    case PairClass::SameDie: return "same-die";
+    case PairClass::CrossDie: return "cross-die";
+    default: return "cross-socket";
+    }
+}
+
+struct CpuPair
+{
+    int First;
+    int Second;
+    PairClass Class;
+};
+
+class Topology
+{
+public:
+    // The machine this runs on
+    static Topology FromSystem()
+    {
+        Topology topology;
+#if defined(_MSC_VER)
+        topology.ReadWindows();
+#else
+        topology.ReadSysfs();
+#endif
+        return topology;
+    }
+
+    // An hwloc XML export; PUs become CPUs by os_index
+    static Topology FromHwlocXml(const std::string & FileName)
+    {
+        Topology topology;
+        topology.ReadHwlocXml(FileName);
+        return topology;
+    }
+
+    const std::vector<CpuLocation> & Cpus() const
+    {
+        return cpus;
+    }
+
+    const CpuLocation * Find(int Cpu) const
+    {
+        for (const CpuLocation & location : cpus)
+        {
+            if (location.Cpu == Cpu)
+            {
+                return &location;
+            }
+        }
+        return nullptr;
+    }
+
+    static PairClass Classify(const CpuLocation & A, const CpuLocation & B)
+    {
+        if (A.Package != B.Package)
+        {
+            return PairClass::CrossSocket;
+        }
+        if (A.Core == B.Core)
+        {
+            return PairClass::SameCore;
+        }
+        if (A.L3 >= 0 && A.L3 == B.L3)
+        {
+            return PairClass::SameL3;
+        }
+        return A.Die == B.Die ? PairClass::SameDie : PairClass::CrossDie;
+    }
+
+    // One pair of each class present, the lowest numbered, plus one pair
+    // for every further pair of sockets
+    std::vector<CpuPair> RepresentativePairs() const
+    {
+        std::vector<CpuPair> pairs;
+        std::set<PairClass> found;
+        std::set<std::pair<int, int>> sockets;
+        for (size_t i = 0; i < cpus.size(); i++)
+        {
+            for (size_t j = i + 1; j < cpus.size(); j++)
+            {
+                PairClass pairClass = Classify(cpus[i], cpus[j]);
+                bool add = found.insert(pairClass).second;
+                if (pairClass == PairClass::CrossSocket)
+                {
+                    // Either order of the two packages is the same pair,
+                    // whichever way the sockets are numbered
+                    add = sockets.insert(std::make_pair(
+                        std::min(cpus[i].Package, cpus[j].Package),
+                        std::max(cpus[i].Package, cpus[j].Package))).second;
+                }
+                if (add)
+                {
+                    pairs.push_back({ cpus[i].Cpu, cpus[j].Cpu, pairClass });
+                }
+            }
+        }
+        std::stable_sort(pairs.begin(), pairs.end(), [](const CpuPair & a, const CpuPair & b)
+        {
+            return a.Class < b.Class;
+        });
+        return pairs;
+    }
+
+private:
+    void Sort()
+    {
+        std::sort(cpus.begin(), cpus.end(), [](const CpuLocation & a, const CpuLocation & b)
+        {
+            return a.Cpu < b.Cpu;
+        });
+    }
+
+#if defined(_MSC_VER)
+    void ReadWindows()
+    {
+        DWORD length = 0;
+        GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+        std::vector<char> buffer(length);
+        if (length == 0 ||
+            !GetLogicalProcessorInformationEx(RelationAll, reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer.data()), &length))
+        {
+            return;
+        }
+
+        // CPU numbers are group * 64 + bit; dies aren't reported, so each
+        // package is one die
+        std::map<int, CpuLocation> locations;
+        auto forEach = [&](const GROUP_AFFINITY * Masks, WORD Count, int CpuLocation::* Field, int Value)
+        {
+            for (WORD g = 0; g < Count; g++)
+            {
+                for (int bit = 0; bit < 64; bit++)
+                {
+                    if (Masks[g].Mask & (1ull << bit))
+                    {
+                        int cpu = Masks[g].Group * 64 + bit;
+                        locations[cpu].Cpu = cpu;
+                        locations[cpu].*Field = Value;
+                    }
+                }
+            }
+        };
+        int cores = 0;
+        int packages = 0;
+        int caches = 0;
+        for (DWORD offset = 0; offset < length;)
+        {
+            auto info = reinterpret_cast<PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX>(buffer.data() + offset);
+            switch (info->Relationship)
+            {
+            case RelationProcessorCore:
+                forEach(info->Processor.GroupMask, info->Processor.GroupCount, &CpuLocation::Core, cores++);
+                break;
+            case RelationProcessorPackage:
+                forEach(info->Processor.GroupMask, info->Processor.GroupCount, &CpuLocation::Package, packages);
+                forEach(info->Processor.GroupMask, info->Processor.GroupCount, &CpuLocation::Die, packages++);
+                break;
+            case RelationCache:
+                if (info->Cache.Level == 3)
+                {
+                    forEach(&info->Cache.GroupMask, 1, &CpuLocation::L3, caches++);
+                }
+                break;
+            case RelationNumaNode:
+                forEach(&info->NumaNode.GroupMask, 1, &CpuLocation::Node, static_cast<int>(info->NumaNode.NodeNumber));
+                break;
+            default:
+                break;
+            }
+            offset += info->Size;
+        }
+        for (auto & location : locations)
+        {
+            cpus.push_back(location.second);
+        }
+        Sort();
+    }
+#else
+    static bool ReadInt(const std::string & Path, int & Value)
+    {
+        FILE * file = fopen(Path.c_str(), "r");
+        if (file == nullptr)
+        {
+            return false;
+        }
+        bool ok = fscanf(file, "%d", &Value) == 1;
+        fclose(file);
+        return ok;
+    }
+
+    // First CPU of a list such as 0-3,8, used as the id of what shares it
+    static int FirstOfList(const std::string & Path)
+    {
+        int first = -1;
+        return ReadInt(Path, first) ? first : -1;
+    }
+
+    void ReadSysfs()
+    {
+        const std::string root = "/sys/devices/system/cpu/";
+        DIR * directory = opendir(root.c_str());
+        if (directory == nullptr)
+        {
+            return;
+        }
+        std::vector<int> online;
+        for (dirent * entry = readdir(directory); entry != nullptr; entry = readdir(directory))
+        {
+            int cpu;
+            char tail;
+            if (sscanf(entry->d_name, "cpu%d%c", &cpu, &tail) == 1)
+            {
+                int isOnline = 1;
+                ReadInt(root + entry->d_name + "/online", isOnline);
+                if (isOnline)
+                {
+                    online.push_back(cpu);
+                }
+            }
+        }
+        closedir(directory);
+
+        for (int cpu : online)
+        {
+            std::string path = root + "cpu" + std::to_string(cpu) + "/";
+            CpuLocation location;
+            location.Cpu = cpu;
+            ReadInt(path + "topology/physical_package_id", location.Package);
+
+            // Ids of dies and cores repeat across packages, the first CPU
+            // sharing them doesn't
+            location.Die = FirstOfList(path + "topology/die_cpus_list");
+            if (location.Die < 0)
+            {
+                location.Die = FirstOfList(path + "topology/package_cpus_list");
+            }
+            if (location.Die < 0)
+            {
+                location.Die = location.Package;
+            }
+            location.Core = FirstOfList(path + "topology/thread_siblings_list");
+            if (location.Core < 0)
+            {
+                location.Core = cpu;
+            }
+            for (int index = 0;; index++)
+            {
+                std::string cache = path + "cache/index" + std::to_string(index) + "/";
+                int level;
+                if (!ReadInt(cache + "level", level))
+                {
+                    break;
+                }
+                if (level == 3)
+                {
+                    location.L3 = FirstOfList(cache + "shared_cpu_list");
+                }
+            }
+
+            DIR * cpuDirectory = opendir(path.c_str());
+            if (cpuDirectory != nullptr)
+            {
+                for (dirent * entry = readdir(cpuDirectory); entry != nullptr; entry = readdir(cpuDirectory))
+                {
+                    int node;
+                    if (sscanf(entry->d_name, "node%d", &node) == 1)
+                    {
+                        location.Node = node;
+                    }
+                }
+                closedir(cpuDirectory);
+            }
+            cpus.push_back(location);
+        }
+        Sort();
+    }
+#endif
+
+    // Value of Name="..." in an XML start tag, empty when absent
+    static std::string Attribute(const std::string & Tag, const char * Name)
+    {
+        std::string key = std::string(" ") + Name + "=\"";
+        size_t start = Tag.find(key);
+        if (start == std::string::npos)
+        {
+            return std::string();
+        }
+        start += key.size();
+        return Tag.substr(start, Tag.find('"', start) - start);
+    }
+
+    // hwloc nests Package, Die, L3Cache, Core and PU objects; NUMANode
+    // objects are ancestors of the PUs in hwloc 1.x and memory children
+    // listed first in their parent in 2.x, so a node applies to what
+    // follows it in the parent either way. Objects missing from the export
+    // (no Die level, no L3) are filled in the way sysfs would.
+    void ReadHwlocXml(const std::string & FileName)
+    {
+        FILE * file = fopen(FileName.c_str(), "rb");
+        if (file == nullptr)
+        {
+            return;
+        }
+        std::string xml;
+        char chunk[65536];
+        for (size_t read; (read = fread(chunk, 1, sizeof(chunk), file)) > 0;)
+        {
+            xml.append(chunk, read);
+        }
+        fclose(file);
+
+        struct Level
+        {
+            std::string Type;
+            int Id;
+            int Node;
+        };
+        std::vector<Level> stack;
+        std::map<std::string, int> counts;
+        for (size_t position = xml.find('<'); position != std::string::npos; position = xml.find('<', position + 1))
+        {
+            size_t end = xml.find('>', position);
+            if (end == std::string::npos)
+            {
+                break;
+            }
+            std::string tag = xml.substr(position, end - position + 1);
+            if (tag.compare(0, 9, "</object>") == 0)
+            {
+                if (!stack.empty())
+                {
+                    stack.pop_back();
+                }
+                continue;
+            }
+            if (tag.compare(0, 8, "<object ") != 0)
+            {
+                continue;
+            }
+
+            std::string type = Attribute(tag, "type");
+            std::string cacheDepth = Attribute(tag, "depth");
+            if (type == "Cache" && cacheDepth == "3")
+            {
+                type = "L3Cache";
+            }
+            int id = counts[type]++;
+            int node = stack.empty() ? 0 : stack.back().Node;
+            if (type == "NUMANode")
+            {
+                node = atoi(Attribute(tag, "os_index").c_str());
+                if (!stack.empty())
+                {
+                    stack.back().Node = node;
+                }
+            }
+            if (type == "PU")
+            {
+                CpuLocation location;
+                location.Cpu = atoi(Attribute(tag, "os_index").c_str());
+                location.Node = node;
+                location.Die = -1;
+                location.Core = -1;
+                for (const Level & level : stack)
+                {
+                    if (level.Type == "Package" || level.Type == "Socket")
+                    {
+                        location.Package = level.Id;
+                    }
+                    else if (level.Type == "Die")
+                    {
+                        location.Die = level.Id;
+                    }
+                    else if (level.Type == "L3Cache")
+                    {
+                        location.L3 = level.Id;
+                    }
+                    else if (level.Type == "Core")
+                    {
+                        location.Core = level.Id;
+                    }
+                }
+                location.Die = location.Die < 0 ? location.Package : location.Die;
+                location.Core = location.Core < 0 ? -2 - location.Cpu : location.Core;
+                cpus.push_back(location);
+            }
+            if (tag[tag.size() - 2] != '/')
+            {
+                stack.push_back({ type, id, node });
+            }
+        }
+        Sort();
+    }
+
+    std::vector<CpuLocation> cpus;
+};
@@ -0,0 +1,280 @@
+#pragma once
+// TSC frequency with an uncertainty, in well under 100ms.
+//
+// The frequency is measured by bracketing reads of the OS monotonic raw
+// clock (QueryPerformanceCounter on Windows) with TSC reads every quarter
+// millisecond and fitting a line through them; the measurement stops as soon
+// as the slope's 95% confidence interval is within the requested ppm. The
+// frequencies the CPU, hypervisor or kernel state are read as well (CPUID
+// 0x15/0x16 and the hypervisor leaves through CpuInfo.h, the sysfs tsc_freq_khz
+// some kernels export, and the perf_event time conversion of the running
+// kernel). When one of those agrees with the measurement and is more precise
+// it is returned instead, so the answer has the resolution of the stated
+// value but is checked against the clock the samples are compared with.
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "CpuInfo/CpuInfo.h"
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <x86intrin.h>
+#endif
+
+struct TscFrequency
+{
+    double Frequency = 0;   // Hz, 0 when unknown
+    double Uncertainty = 0; // Hz, 95% confidence for measurements, the
+                            // resolution of the value for stated ones
+    const char * Source = "none";
+    double Milliseconds = 0; // Time spent measuring
+};
+
+class TscCalibration
+{
+public:
+    // Measure until the 95% interval is within TargetPpm or MaxMilliseconds
+    // have passed, then prefer an agreeing stated frequency
+    static TscFrequency Calibrate(double TargetPpm = 0.5, double MaxMilliseconds = 80)
+    {
+        TscFrequency measured = Measure(TargetPpm, MaxMilliseconds);
+        TscFrequency best = measured;
+        for (const TscFrequency & stated : Stated())
+        {
+            bool agrees = measured.Frequency == 0 ||
+                fabs(stated.Frequency - measured.Frequency) <= measured.Uncertainty + stated.Uncertainty;
+            if (agrees && (best.Frequency == 0 || stated.Uncertainty < best.Uncertainty))
+            {
+                best = stated;
+            }
+        }
+        best.Milliseconds = measured.Milliseconds;
+        return best;
+    }
+
+    // The frequencies the platform states, most precise first
+    static std::vector<TscFrequency> Stated()
+    {
+        std::vector<TscFrequency> stated;
+        TscFrequency f;
+        const char * source;
+        f.Frequency = InstructionSet::NominalTscFrequency(&source);
+        if (f.Frequency != 0)
+        {
+            // Leaf 0x15 is exact in whole Hz, the others are kHz or MHz
+            f.Source = source;
+            f.Uncertainty = strcmp(source, "cpuid 0x15") == 0 ? 0.5 : strcmp(source, "hypervisor") == 0 ? 500 : 5e5;
+            stated.push_back(f);
+        }
+#if !defined(_MSC_VER)
+        if (ReadSysfs(f))
+        {
+            stated.push_back(f);
+        }
+        if (ReadPerfConversion(f))
+        {
+            stated.push_back(f);
+        }
+#endif
+        std::sort(stated.begin(), stated.end(), [](const TscFrequency & a, const TscFrequency & b)
+        {
+            return a.Uncertainty < b.Uncertainty;
+        });
+        return stated;
+    }
+
+    static TscFrequency Measure(double TargetPpm, double MaxMilliseconds)
+    {
+        const long long pointSpacing = 250000;
+        const double minimumMilliseconds = 5;
+        TscFrequency f;
+        f.Source = "measured";
+
+        // Sums of the points relative to the first, ref in ns and TSC in ticks
+        long double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0, syy = 0;
+        long long ref0 = 0;
+        unsigned long long tsc0 = 0;
+        unsigned long long narrowest = ~0ull;
+        long long next = 0;
+        for (;;)
+        {
+            long long ref = 0;
+            unsigned long long tsc = 0;
+            unsigned long long window = Point(ref, tsc);
+            if (n == 0)
+            {
+                ref0 = ref;
+                tsc0 = tsc;
+                next = ref;
+            }
+            narrowest = window < narrowest ? window : narrowest;
+
+            // Points taken across an interrupt or a reschedule are skipped
+            if (window <= 4 * narrowest)
+            {
+                long double x = ref - ref0;
+                long double y = static_cast<long double>(tsc - tsc0);
+                n++;
+                sx += x;
+                sy += y;
+                sxx += x * x;
+                sxy += x * y;
+                syy += y * y;
+            }
+
+            double elapsed = (ref - ref0) / 1e6;
+            long double dxx = sxx - sx * sx / n;
+            if (n >= 8 && dxx > 0)
+            {
+                long double slope = (sxy - sx * sy / n) / dxx;
+                long double residual = (syy - sy * sy / n) - slope * (sxy - sx * sy / n);
+                double se = static_cast<double>(sqrtl(std::max<long double>(0, residual) / (n - 2) / dxx));
+                f.Frequency = static_cast<double>(slope) * 1e9;
+                f.Uncertainty = 2 * se * 1e9;
+                f.Milliseconds = elapsed;
+                if ((elapsed >= minimumMilliseconds && f.Uncertainty <= f.Frequency * TargetPpm * 1e-6) ||
+                    elapsed >= MaxMilliseconds)
+                {
+                    return f;
+                }
+            }
+            else if (elapsed >= MaxMilliseconds)
+            {
+                return f;
+            }
+
+            next += pointSpacing;
+            while (ReadReference() < next)
+            {
+            }
+        }
+    }
+
+private:
+    static unsigned long long ReadTsc()
+    {
+        _mm_lfence();
+        unsigned long long tsc = __rdtsc();
+        _mm_lfence();
+        return tsc;
+    }
+
+#if defined(_MSC_VER)
+    static long long ReadReference()
+    {
+        LARGE_INTEGER count;
+        static LARGE_INTEGER freq = { 0 };
+        if (freq.QuadPart == 0)
+        {
+            QueryPerformanceFrequency(&freq);
+        }
+        QueryPerformanceCounter(&count);
+        return static_cast<long long>(count.QuadPart / freq.QuadPart) * 1000000000ll +
+            (count.QuadPart % freq.QuadPart) * 1000000000ll / freq.QuadPart;
+    }
+#else
+    static long long ReadReference()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+        return static_cast<long long>(ts.tv_sec) * 1000000000ll + ts.tv_nsec;
+    }
+
+    // tsc_freq_khz is exported by some kernels for the TSC clocksource
+    static bool ReadSysfs(TscFrequency & F)
+    {
+        FILE * file = fopen("/sys/devices/system/cpu/cpu0/tsc_freq_khz", "r");
+        unsigned long long khz = 0;
+        if (file == nullptr)
+        {
+            return false;
+        }
+        bool ok = fscanf(file, "%llu", &khz) == 1 && khz != 0;
+        fclose(file);
+        F.Frequency = khz * 1000.0;
+        F.Uncertainty = 500;
+        F.Source = "sysfs tsc_freq_khz";
+        return ok;
+    }
+
+    // The kernel publishes its TSC to ns conversion in the first page of a
+    // perf event mapping, ns = tsc * time_mult >> time_shift, when user space
+    // may use the TSC (cap_user_time)
+    static bool ReadPerfConversion(TscFrequency & F)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_SOFTWARE;
+        attr.config = PERF_COUNT_SW_DUMMY;
+        attr.exclude_kernel = 1;
+        int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        if (fd < 0)
+        {
+            return false;
+        }
+        size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        void * page = mmap(nullptr, pageSize, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (page == MAP_FAILED)
+        {
+            return false;
+        }
+
+        const volatile perf_event_mmap_page * pc = static_cast<const volatile perf_event_mmap_page *>(page);
+        unsigned int sequence;
+        bool capable;
+        unsigned int mult;
+        unsigned int shift;
+        do
+        {
+            sequence = pc->lock;
+            __sync_synchronize();
+            capable = pc->cap_user_time;
+            mult = pc->time_mult;
+            shift = pc->time_shift;
+            __sync_synchronize();
+        } while (pc->lock != sequence);
+        munmap(page, pageSize);
+
+        if (!capable || mult == 0)
+        {
+            return false;
+        }
+        F.Frequency = ldexp(1e9, shift) / mult;
+        F.Uncertainty = F.Frequency / mult / 2;
+        F.Source = "perf_event";
+        return true;
+    }
+#endif
+
+    // A reference read bracketed by the narrowest of three TSC windows,
+    // returning the window width
+    static unsigned long long Point(long long & Reference, unsigned long long & Tsc)
+    {
+        unsigned long long narrowest = ~0ull;
+        for (int i = 0; i < 3; i++)
+        {
+            unsigned long long start = ReadTsc();
+            long long reference = ReadReference();
+            unsigned long long end = ReadTsc();
+            if (end - start < narrowest)
+            {
+                narrowest = end - start;
+                Reference = reference;
+                Tsc = start + (end - start) / 2;
+            }
+        }
+        return narrowest;
+    }
+};
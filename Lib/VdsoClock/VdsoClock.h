@@ -0,0 +1,339 @@
+#pragma once
+// Linux clocks read straight from the TSC, without the vDSO call.
+//
+// clock_gettime in the vDSO reads the kernel's timekeeping data from the
+// vvar page under a sequence lock and scales the TSC delta since the last
+// tick with the clocksource's mult and shift. VdsoClock locates that page
+// through /proc/self/maps and does the same inline, so a time costs an
+// ordered rdtsc and a few loads. The layout of the page is private to the
+// kernel, so the known layouts are tried against clock_gettime and one is
+// used only when it reproduces the clocks; the clock mode is checked on
+// every read and a reader falls back to clock_gettime as soon as the kernel
+// stops using the TSC, e.g. kvm-clock or Hyper-V reference time guests, a
+// clocksource change or a time namespace.
+//
+// When the vvar page can't be used the TSC conversion the kernel publishes
+// in a perf_event mapping (time_zero, time_mult, time_shift) is used with
+// per clock offsets taken at construction. That conversion is the kernel's
+// sched_clock, which follows neither NTP slewing nor steps, so the offsets
+// have to be renewed with Anchor() for long runs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <x86intrin.h>
+
+class VdsoClock
+{
+public:
+    VdsoClock() :
+        hres(nullptr),
+        raw(nullptr),
+        page(nullptr)
+    {
+        memset(offset, 0, sizeof(offset));
+        if (!FindVvar())
+        {
+            MapPerfPage();
+        }
+    }
+
+    ~VdsoClock()
+    {
+        if (page != nullptr)
+        {
+            munmap(const_cast<perf_event_mmap_page *>(page), static_cast<size_t>(sysconf(_SC_PAGESIZE)));
+        }
+    }
+
+    VdsoClock(const VdsoClock &) = delete;
+    VdsoClock & operator=(const VdsoClock &) = delete;
+
+    // "vvar", "perf_event" or "clock_gettime"
+    const char * Source() const
+    {
+        return hres != nullptr ? "vvar" : page != nullptr ? "perf_event" : "clock_gettime";
+    }
+
+    // Nanoseconds of CLOCK_REALTIME, CLOCK_MONOTONIC, CLOCK_MONOTONIC_RAW,
+    // CLOCK_BOOTTIME or CLOCK_TAI, other clocks go to clock_gettime
+    long long Read(clockid_t Clock) const
+    {
+        unsigned long long tsc;
+        return Read(Clock, tsc);
+    }
+
+    // Also returns the TSC the time was derived from, 0 when clock_gettime
+    // was used
+    long long Read(clockid_t Clock, unsigned long long & Tsc) const
+    {
+        long long ns;
+        if (hres != nullptr && ReadVvar(Clock, ns, Tsc))
+        {
+            return ns;
+        }
+        if (page != nullptr && Clock >= 0 && Clock < Clocks && ReadPerf(ns, Tsc))
+        {
+            return ns + offset[Clock];
+        }
+        Tsc = 0;
+        return ReadSystem(Clock);
+    }
+
+    // Renews the perf_event clock offsets from the narrowest of a few
+    // clock_gettime brackets
+    void Anchor()
+    {
+        if (page == nullptr)
+        {
+            return;
+        }
+        for (clockid_t clock = 0; clock < Clocks; clock++)
+        {
+            long long narrowest = -1;
+            for (int i = 0; i < 16; i++)
+            {
+                unsigned long long tsc;
+                long long start;
+                long long end;
+                if (!ReadPerf(start, tsc))
+                {
+                    return;
+                }
+                long long system = ReadSystem(clock);
+                ReadPerf(end, tsc);
+                if (narrowest < 0 || end - start < narrowest)
+                {
+                    narrowest = end - start;
+                    offset[clock] = system - (start + (end - start) / 2);
+                }
+            }
+        }
+    }
+
+private:
+    // Clocks that have a base time in the kernel's data, indexed by id
+    static const clockid_t Clocks = CLOCK_TAI + 1;
+
+    // vdso_clock_mode of a clock read with the TSC
+    static const int ClockModeTsc = 1;
+
+    static long long ReadSystem(clockid_t Clock)
+    {
+        timespec ts;
+        clock_gettime(Clock, &ts);
+        return static_cast<long long>(ts.tv_sec) * 1000000000ll + ts.tv_nsec;
+    }
+
+    // rdtsc_ordered, the read the vDSO uses
+    static unsigned long long ReadTsc()
+    {
+        _mm_lfence();
+        return __rdtsc();
+    }
+
+    template <typename T>
+    static T Load(const volatile char * Base, size_t Offset)
+    {
+        return *reinterpret_cast<const volatile T *>(Base + Offset);
+    }
+
+    // One timekeeping base of the vvar page: seq, clock_mode and cycle_last,
+    // then max_cycles on kernels with overflow protection, then mask, mult,
+    // shift and a sec, shifted nsec pair per clock id
+    struct Layout
+    {
+        size_t Start;   // Of the first base in the page
+        size_t Mask;    // Offset of mask in a base
+        size_t Stride;  // From one base to the next
+    };
+
+    bool ReadVvar(clockid_t Clock, long long & Ns, unsigned long long & Tsc) const
+    {
+        const volatile char * data;
+        if (Clock == CLOCK_MONOTONIC_RAW)
+        {
+            data = raw;
+        }
+        else if (Clock == CLOCK_REALTIME || Clock == CLOCK_MONOTONIC || Clock == CLOCK_BOOTTIME || Clock == CLOCK_TAI)
+        {
+            data = hres;
+        }
+        else
+        {
+            return false;
+        }
+        size_t base = layout.Mask + 16 + 16 * Clock;
+
+        unsigned int sequence;
+        unsigned long long sec;
+        unsigned __int128 ns;
+        do
+        {
+            while ((sequence = Load<unsigned int>(data, 0)) & 1)
+            {
+                _mm_pause();
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (Load<int>(data, 4) != ClockModeTsc)
+            {
+                return false;
+            }
+            Tsc = ReadTsc();
+            unsigned long long last = Load<unsigned long long>(data, 8);
+            unsigned long long delta = Tsc > last ? Tsc - last : 0;
+            unsigned int mult = Load<unsigned int>(data, layout.Mask + 8);
+            unsigned int shift = Load<unsigned int>(data, layout.Mask + 12);
+            sec = Load<unsigned long long>(data, base);
+            ns = (static_cast<unsigned __int128>(delta) * mult + Load<unsigned long long>(data, base + 8)) >> shift;
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while (Load<unsigned int>(data, 0) != sequence);
+
+        Ns = static_cast<long long>(sec * 1000000000ull + static_cast<unsigned long long>(ns));
+        return true;
+    }
+
+    // The perf_event time, ns = time_zero + tsc * time_mult >> time_shift
+    bool ReadPerf(long long & Ns, unsigned long long & Tsc) const
+    {
+        unsigned int sequence;
+        do
+        {
+            sequence = page->lock;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (!page->cap_user_time_zero)
+            {
+                return false;
+            }
+            Tsc = ReadTsc();
+            unsigned long long zero = page->time_zero;
+            unsigned int mult = page->time_mult;
+            unsigned int shift = page->time_shift;
+            unsigned long long quotient = Tsc >> shift;
+            unsigned long long remainder = Tsc & ((1ull << shift) - 1);
+            Ns = static_cast<long long>(zero + quotient * mult + ((remainder * mult) >> shift));
+            std::atomic_thread_fence(std::memory_order_acquire);
+        } while (page->lock != sequence);
+        return true;
+    }
+
+    bool FindVvar()
+    {
+        FILE * maps = fopen("/proc/self/maps", "r");
+        if (maps == nullptr)
+        {
+            return false;
+        }
+        char line[512];
+        const volatile char * vvar = nullptr;
+        while (fgets(line, sizeof(line), maps) != nullptr)
+        {
+            if (strstr(line, "[vvar]") != nullptr)
+            {
+                vvar = reinterpret_cast<const volatile char *>(strtoull(line, nullptr, 16));
+                break;
+            }
+        }
+        fclose(maps);
+        if (vvar == nullptr)
+        {
+            return false;
+        }
+
+        // The data is at the start of the page since the generic vDSO data
+        // store, at 128 on older x86 kernels, and the bases lost the time
+        // zone fields that followed them
+        const size_t basetime = 16 * Clocks;
+        const Layout layouts[] =
+        {
+            { 0, 24, 24 + 16 + basetime },
+            { 0, 16, 16 + 16 + basetime },
+            { 128, 24, 24 + 16 + basetime + 16 },
+            { 128, 16, 16 + 16 + basetime + 16 },
+        };
+        for (const Layout & candidate : layouts)
+        {
+            const volatile char * data = vvar + candidate.Start;
+            if (Load<int>(data, 4) != ClockModeTsc ||
+                Load<unsigned long long>(data, candidate.Mask) != ~0ull ||
+                Load<unsigned int>(data, candidate.Mask + 8) == 0 ||
+                Load<unsigned int>(data, candidate.Mask + 12) >= 64)
+            {
+                continue;
+            }
+            layout = candidate;
+            hres = data;
+            raw = data + candidate.Stride;
+            if (Reproduces(CLOCK_REALTIME) && Reproduces(CLOCK_MONOTONIC) && Reproduces(CLOCK_MONOTONIC_RAW))
+            {
+                return true;
+            }
+        }
+        hres = nullptr;
+        raw = nullptr;
+        return false;
+    }
+
+    // A vvar read lands inside a clock_gettime bracket, give or take a
+    // microsecond for a tick landing between them
+    bool Reproduces(clockid_t Clock) const
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            long long ns;
+            unsigned long long tsc;
+            long long start = ReadSystem(Clock);
+            if (!ReadVvar(Clock, ns, tsc))
+            {
+                return false;
+            }
+            long long end = ReadSystem(Clock);
+            if (ns >= start - 1000 && ns <= end + 1000)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void MapPerfPage()
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_SOFTWARE;
+        attr.config = PERF_COUNT_SW_DUMMY;
+        attr.exclude_kernel = 1;
+        int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        if (fd < 0)
+        {
+            return;
+        }
+        void * mapping = mmap(nullptr, static_cast<size_t>(sysconf(_SC_PAGESIZE)), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            return;
+        }
+        page = static_cast<const volatile perf_event_mmap_page *>(mapping);
+        if (!page->cap_user_time_zero)
+        {
+            munmap(mapping, static_cast<size_t>(sysconf(_SC_PAGESIZE)));
+            page = nullptr;
+            return;
+        }
+        Anchor();
+    }
+
+    Layout layout;
+    const volatile char * hres;
+    const volatile char * raw;
+    const volatile perf_event_mmap_page * page;
+    long long offset[Clocks];
+};
@@ -0,0 +1,397 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    livecorrelation.cpp
+
+Abstract:
+
+    Live version of the OsTimeSampler + TimeSampleCorrelation workflow. A
+    correlator listens on a Unix socket, or a vsock port so guests can reach
+    the host directly, for a root and a guest sample stream. Each stream is
+    OsTimeSampler output (or any start_tsc, end_tsc, os_time lines), sent by
+    the feed mode of this tool:
+
+        OsTimeSampler 1 100000000 | livecorrelation feed -socket vsock:2:5000 -role guest
+
+    The guest TSC delta is applied and every root sample is compared to the
+    guest time interpolated at its TSC, as TimeSampleCorrelation does, as
+    soon as the guest has sampled past it. Root samples the guest doesn't
+    cover within the latency bound are dropped, so output lags the samplers
+    by at most that much.
+
+--*/
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/vm_sockets.h>
+#include <unistd.h>
+#include <chrono>
+#include <map>
+#include "CommandLine/CommandLine.h"
+#include "TimeSamples/TimeSamples.h"
+#include "TimeSamples/TimeCorrelation.h"
+
+// A socket address given as a Unix socket path or vsock:<cid>:<port>. A
+// listener may use vsock:<port> to accept from any context.
+class SocketAddress
+{
+public:
+    SocketAddress(const std::string & Address) :
+        length(0)
+    {
+        memset(&storage, 0, sizeof(storage));
+        if (Address.compare(0, 6, "vsock:") == 0)
+        {
+            sockaddr_vm * vm = reinterpret_cast<sockaddr_vm *>(&storage);
+            std::string rest = Address.substr(6);
+            size_t colon = rest.find(':');
+            vm->svm_family = AF_VSOCK;
+            vm->svm_cid = colon == std::string::npos ? VMADDR_CID_ANY : strtoul(rest.c_str(), nullptr, 10);
+            vm->svm_port = strtoul(colon == std::string::npos ? rest.c_str() : rest.c_str() + colon + 1, nullptr, 10);
+            length = sizeof(*vm);
+        }
+        else if (Address.length() < sizeof(sockaddr_un::sun_path))
+        {
+            sockaddr_un * un = reinterpret_cast<sockaddr_un *>(&storage);
+            un->sun_family = AF_UNIX;
+            strcpy(un->sun_path, Address.c_str());
+            length = sizeof(*un);
+        }
+    }
+
+    bool IsValid() const
+    {
+        return length != 0;
+    }
+
+    int Family() const
+    {
+        return storage.ss_family;
+    }
+
+    const sockaddr * Address() const
+    {
+        return reinterpret_cast<const sockaddr *>(&storage);
+    }
+
+    socklen_t Length() const
+    {
+        return length;
+    }
+
+private:
+    sockaddr_storage storage;
+    socklen_t length;
+};
+
+struct Sample : TimeSample
+{
+    std::chrono::steady_clock::time_point Arrival;
+};
+
+// Lines of one connected sampler
+class Feed
+{
+public:
+    enum Role { Unknown, Root, Guest };
+
+    Feed(int Socket) :
+        socket(Socket),
+        role(Unknown)
+    {
+    }
+
+    int Socket() const
+    {
+        return socket;
+    }
+
+    Role FeedRole() const
+    {
+        return role;
+    }
+
+    void SetRole(Role NewRole)
+    {
+        role = NewRole;
+    }
+
+    // Read what is available and hand back complete lines; false once the
+    // sampler has gone
+    template<typename TLine>
+    bool Receive(TLine OnLine)
+    {
+        char data[1 << 16];
+        ssize_t count = recv(socket, data, sizeof(data), 0);
+        if (count <= 0)
+        {
+            return count < 0 && (errno == EINTR || errno == EAGAIN);
+        }
+        pending.append(data, count);
+        size_t begin = 0;
+        for (size_t eol = pending.find('\n'); eol != std::string::npos; eol = pending.find('\n', begin))
+        {
+            OnLine(pending.data() + begin, pending.data() + eol);
+            begin = eol + 1;
+        }
+        pending.erase(0, begin);
+        return true;
+    }
+
+private:
+    int socket;
+    Role role;
+    std::string pending;
+};
+
+// The correlator of TimeCorrelation.h, dropping root samples the guest
+// hasn't covered within the latency bound
+class LiveCorrelator
+{
+public:
+    LiveCorrelator(long long Delta, std::chrono::milliseconds Latency) :
+        correlator(Delta),
+        latency(Latency)
+    {
+    }
+
+    void AddRoot(const Sample & Root)
+    {
+        correlator.AddRoot(Root, Expired());
+    }
+
+    void AddGuest(const Sample & Guest)
+    {
+        correlator.AddGuest(Guest, Expired());
+    }
+
+    void Correlate()
+    {
+        correlator.Correlate(Expired());
+    }
+
+    size_t Emitted() const
+    {
+        return correlator.Emitted();
+    }
+
+    size_t Dropped() const
+    {
+        return correlator.Dropped();
+    }
+
+private:
+    // True for root samples that arrived longer than the latency bound ago
+    struct Expiry
+    {
+        std::chrono::steady_clock::time_point Now;
+        std::chrono::milliseconds Latency;
+
+        bool operator()(const Sample & Root) const
+        {
+            return Now - Root.Arrival > Latency;
+        }
+    };
+
+    Expiry Expired() const
+    {
+        return Expiry{ std::chrono::steady_clock::now(), latency };
+    }
+
+    Correlator<Sample> correlator;
+    std::chrono::milliseconds latency;
+};
+
+// Parse start_tsc, end_tsc, os_time from the front of a sample line. Other
+// columns, such as the adjustment state OsTimeSampler appends, are ignored.
+bool ParseSample(const char * Begin, const char * End, Sample & Out)
+{
+    const char * field[4] = { Begin };
+    size_t count = 1;
+    for (const char * p = Begin; p < End && count < 4; p++)
+    {
+        if (*p == ',')
+        {
+            field[count++] = p + 1;
+        }
+    }
+    if (count < 3)
+    {
+        return false;
+    }
+    const char * last = count > 3 ? field[3] - 1 : End;
+    return ParseInteger(field[0], field[1] - 1, Out.TscStart) &&
+        ParseInteger(field[1], field[2] - 1, Out.TscEnd) &&
+        ParseInteger(field[2], last, Out.TimeStamp);
+}
+
+int Serve(const SocketAddress & Address, const std::string & Path, long long Delta, std::chrono::milliseconds Latency)
+{
+    int listener = socket(Address.Family(), SOCK_STREAM, 0);
+    if (Address.Family() == AF_UNIX)
+    {
+        unlink(Path.c_str());
+    }
+    if (listener < 0 || bind(listener, Address.Address(), Address.Length()) != 0 || listen(listener, 4) != 0)
+    {
+        fprintf(stderr, "unable to listen on %s: %s\n", Path.c_str(), strerror(errno));
+        return -1;
+    }
+
+    LiveCorrelator correlator(Delta, Latency);
+    std::vector<Feed> feeds;
+    printf("DATE,SKEW_US,RTT_US\n");
+    fflush(stdout);
+    for (;;)
+    {
+        std::vector<pollfd> fds(1, pollfd{ listener, POLLIN, 0 });
+        for (auto & feed : feeds)
+        {
+            fds.push_back(pollfd{ feed.Socket(), POLLIN, 0 });
+        }
+
+        // Wake at least every 100ms so stale root samples are dropped on time
+        if (poll(fds.data(), fds.size(), 100) < 0 && errno != EINTR)
+        {
+            break;
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            int client = accept(listener, nullptr, nullptr);
+            if (client >= 0)
+            {
+                feeds.push_back(Feed(client));
+            }
+        }
+
+        for (size_t i = 1; i < fds.size(); i++)
+        {
+            if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) == 0)
+            {
+                continue;
+            }
+            Feed & feed = feeds[i - 1];
+            bool open = feed.Receive([&](const char * Begin, const char * End)
+            {
+                Sample sample;
+                std::string line(Begin, End);
+                if (feed.FeedRole() == Feed::Unknown)
+                {
+                    // Feeds announce their role on the first line; a bare
+                    // stream is the root if there is none yet
+                    bool haveRoot = false;
+                    for (auto & f : feeds)
+                    {
+                        haveRoot = haveRoot || f.FeedRole() == Feed::Root;
+                    }
+                    feed.SetRole(line.compare(0, 5, "GUEST") == 0 ? Feed::Guest :
+                        line.compare(0, 4, "ROOT") == 0 || !haveRoot ? Feed::Root : Feed::Guest);
+                    fprintf(stderr, "%s sampler connected\n", feed.FeedRole() == Feed::Root ? "root" : "guest");
+                }
+                if (!ParseSample(Begin, End, sample))
+                {
+                    return;
+                }
+                sample.Arrival = std::chrono::steady_clock::now();
+                if (feed.FeedRole() == Feed::Root)
+                {
+                    correlator.AddRoot(sample);
+                }
+                else
+                {
+                    correlator.AddGuest(sample);
+                }
+            });
+            if (!open)
+            {
+                fprintf(stderr, "%s sampler disconnected, %zu samples correlated, %zu dropped\n",
+                    feed.FeedRole() == Feed::Root ? "root" : "guest",
+                    correlator.Emitted(),
+                    correlator.Dropped());
+                close(feed.Socket());
+                feeds.erase(feeds.begin() + (i - 1));
+                fds.erase(fds.begin() + i);
+                i--;
+            }
+        }
+        correlator.Correlate();
+    }
+    return 0;
+}
+
+int FeedSamples(const SocketAddress & Address, const std::string & Path, const std::string & Role)
+{
+    int s = socket(Address.Family(), SOCK_STREAM, 0);
+    if (s < 0 || connect(s, Address.Address(), Address.Length()) != 0)
+    {
+        fprintf(stderr, "unable to connect to %s: %s\n", Path.c_str(), strerror(errno));
+        return -1;
+    }
+
+    std::string hello = Role == "guest" ? "GUEST\n" : "ROOT\n";
+    char data[1 << 16];
+    ssize_t count;
+    if (send(s, hello.data(), hello.size(), MSG_NOSIGNAL) < 0)
+    {
+        return -1;
+    }
+    while ((count = read(STDIN_FILENO, data, sizeof(data))) > 0)
+    {
+        for (ssize_t sent = 0; sent < count; )
+        {
+            ssize_t n = send(s, data + sent, count - sent, MSG_NOSIGNAL);
+            if (n < 0)
+            {
+                fprintf(stderr, "correlator went away: %s\n", strerror(errno));
+                return -1;
+            }
+            sent += n;
+        }
+    }
+    close(s);
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    std::map<std::string, std::string> args = ParseCommandLine(argc, argv, 2);
+    std::string mode = argc > 1 ? argv[1] : "";
+    if ((mode != "serve" && mode != "feed") || args.find("socket") == args.end())
+    {
+        printf("usage: %s serve -socket <path/vsock:port> [-delta <guest TSC offset>] [-latency <ms>]\n", argv[0]);
+        printf("       %s feed -socket <path/vsock:cid:port> -role <root/guest> < samples\n", argv[0]);
+        exit(-1);
+    }
+
+    SocketAddress address(args["socket"]);
+    if (!address.IsValid())
+    {
+        printf("invalid socket %s\n", args["socket"].c_str());
+        exit(-1);
+    }
+    if (mode == "feed")
+    {
+        return FeedSamples(address, args["socket"], args.find("role") != args.end() ? args["role"] : "root");
+    }
+
+    // The TSC delta is often negative but printed unsigned, accept both
+    long long delta = 0;
+    if (args.find("delta") != args.end())
+    {
+        const char * text = args["delta"].c_str();
+        delta = text[0] == '-' ? strtoll(text, nullptr, 10) : static_cast<long long>(strtoull(text, nullptr, 10));
+    }
+    long latency = 1000;
+    if (args.find("latency") != args.end())
+    {
+        latency = std::max(1l, atol(args["latency"].c_str()));
+    }
+    signal(SIGPIPE, SIG_IGN);
+    return Serve(address, args["socket"], delta, std::chrono::milliseconds(latency));
+}
@@ -0,0 +1,393 @@
+#pragma once
+// Live statistics of the polled servers, served as Prometheus text (or
+// OpenMetrics when the scraper asks for it) on a local HTTP port, e.g.
+// curl http://127.0.0.1:9123/metrics.
+//
+// Every receive thread records into its own ServerStats slots and the sender
+// counts its polls in its own counters, so each value has a single writer
+// and the receive path does plain atomic stores without a lock. A scrape sums
+// the counters of all threads and takes the gauges from the thread that heard
+// from a server last; the sequence count around each update lets the scrape
+// retry rather than mix the fields of two responses.
+
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// FILETIME (100ns since 1601) of a high_resolution_clock count, the clock
+// requests and replies are stamped with. That is the system clock with
+// libstdc++ but a steady clock with MSVC, so it is tied to the system clock
+// once, at the first call.
+inline long long ClockToFileTime(long long Count)
+{
+    typedef std::chrono::duration<long long, std::ratio<1, 10000000>> FileTimeUnits;
+    static const long long anchor =
+        std::chrono::duration_cast<FileTimeUnits>(std::chrono::system_clock::now().time_since_epoch()).count() + 116444736000000000ll -
+        std::chrono::duration_cast<FileTimeUnits>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+    return std::chrono::duration_cast<FileTimeUnits>(std::chrono::high_resolution_clock::duration(Count)).count() + anchor;
+}
+
+struct ServerSnapshot
+{
+    unsigned long long Responses;
+    long long Updated;      // FILETIME of the last response
+    double Offset;          // Seconds the server is ahead of this clock
+    double Delay;           // Round trip seconds, less the server's time
+    double Jitter;
+    int Stratum;
+};
+
+// One server as seen by one receive thread
+class ServerStats
+{
+public:
+    // Owner thread only. Jitter is the RMS difference of successive offsets,
+    // averaged over about the last eight responses as the NTP clock filter
+    // does.
+    void Record(double Offset, double Delay, int Stratum, long long Updated)
+    {
+        unsigned long long responses = responsesCount.load(std::memory_order_relaxed);
+        double difference = Offset - lastOffset;
+        jitterSquared = responses == 0 ? 0 : jitterSquared + (difference * difference - jitterSquared) / 8;
+        lastOffset = Offset;
+
+        unsigned long long sequence = sequenceCount.load(std::memory_order_relaxed);
+        sequenceCount.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        responsesCount.store(responses + 1, std::memory_order_relaxed);
+        updated.store(Updated, std::memory_order_relaxed);
+        offset.store(Offset, std::memory_order_relaxed);
+        delay.store(Delay, std::memory_order_relaxed);
+        jitter.store(sqrt(jitterSquared), std::memory_order_relaxed);
+        stratum.store(Stratum, std::memory_order_relaxed);
+        sequenceCount.store(sequence + 2, std::memory_order_release);
+    }
+
+    // Any thread
+    ServerSnapshot Read() const
+    {
+        ServerSnapshot snapshot;
+        for (;;)
+        {
+            unsigned long long sequence = sequenceCount.load(std::memory_order_acquire);
+            snapshot.Responses = responsesCount.load(std::memory_order_relaxed);
+            snapshot.Updated = updated.load(std::memory_order_relaxed);
+            snapshot.Offset = offset.load(std::memory_order_relaxed);
+            snapshot.Delay = delay.load(std::memory_order_relaxed);
+            snapshot.Jitter = jitter.load(std::memory_order_relaxed);
+            snapshot.Stratum = stratum.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if ((sequence & 1) == 0 && sequenceCount.load(std::memory_order_relaxed) == sequence)
+            {
+                return snapshot;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    std::atomic<unsigned long long> sequenceCount{ 0 };
+    std::atomic<unsigned long long> responsesCount{ 0 };
+    std::atomic<long long> updated{ 0 };
+    std::atomic<double> offset{ 0 };
+    std::atomic<double> delay{ 0 };
+    std::atomic<double> jitter{ 0 };
+    std::atomic<int> stratum{ 0 };
+    double lastOffset = 0;
+    double jitterSquared = 0;
+};
+
+// The slots of one receive thread
+struct ReceiveStats
+{
+    ReceiveStats(size_t Servers) :
+        Servers(Servers),
+        Unmatched(0)
+    {
+    }
+
+    // Replies that matched no outstanding request, owner thread only
+    void CountUnmatched()
+    {
+        Unmatched.store(Unmatched.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    std::vector<ServerStats> Servers;
+    std::atomic<unsigned long long> Unmatched;
+};
+
+class Metrics
+{
+public:
+    Metrics(const std::vector<NtpServer> & Servers, size_t Threads) :
+        polls(Servers.size())
+    {
+        ClockToFileTime(0);
+        for (auto & server : Servers)
+        {
+            char ip[INET6_ADDRSTRLEN] = { 0 };
+            const sockaddr * address = reinterpret_cast<const sockaddr *>(&server.Address);
+            if (address->sa_family == AF_INET6)
+            {
+                inet_ntop(AF_INET6, const_cast<in6_addr *>(&reinterpret_cast<const sockaddr_in6 *>(address)->sin6_addr), ip, sizeof(ip));
+            }
+            else
+            {
+                inet_ntop(AF_INET, const_cast<in_addr *>(&reinterpret_cast<const sockaddr_in *>(address)->sin_addr), ip, sizeof(ip));
+            }
+            labels.push_back("server=\"" + Escape(server.Name) + "\",address=\"" + ip + "\"");
+        }
+        for (size_t i = 0; i < Threads; i++)
+        {
+            threads.push_back(std::unique_ptr<ReceiveStats>(new ReceiveStats(Servers.size())));
+        }
+    }
+
+    ReceiveStats & Thread(size_t Index)
+    {
+        return *threads[Index];
+    }
+
+    // Sender thread only
+    void CountPoll(size_t Server)
+    {
+        polls[Server].store(polls[Server].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    // The text exposition of every metric. OpenMetrics names counter
+    // families without _total and ends with # EOF.
+    std::string Format(bool OpenMetrics) const
+    {
+        std::vector<ServerSnapshot> latest(labels.size(), ServerSnapshot());
+        std::vector<unsigned long long> responses(labels.size(), 0);
+        unsigned long long unmatched = 0;
+        for (auto & thread : threads)
+        {
+            for (size_t s = 0; s < labels.size(); s++)
+            {
+                ServerSnapshot snapshot = thread->Servers[s].Read();
+                responses[s] += snapshot.Responses;
+                if (snapshot.Responses > 0 && (latest[s].Responses == 0 || snapshot.Updated > latest[s].Updated))
+                {
+                    latest[s] = snapshot;
+                }
+            }
+            unmatched += thread->Unmatched.load(std::memory_order_relaxed);
+        }
+
+        std::string out;
+        auto family = [&](const char * Name, const char * Type, const char * Help)
+        {
+            std::string name = Name;
+            if (OpenMetrics && strcmp(Type, "counter") == 0)
+            {
+                name.resize(name.size() - strlen("_total"));
+            }
+            out += "# HELP " + name + " " + Help + "\n";
+            out += "# TYPE " + name + " " + Type + "\n";
+        };
+        // Counters and time stamps need more digits than offsets; 17 prints
+        // any integer below 2^53 exactly
+        auto sample = [&](const char * Name, const std::string & Labels, double Value, int Digits = 9)
+        {
+            char value[64];
+            snprintf(value, sizeof(value), "%.*g", Digits, Value);
+            out += std::string(Name) + (Labels.empty() ? "" : "{" + Labels + "}") + " " + value + "\n";
+        };
+        auto gauge = [&](const char * Name, const char * Help, double ServerSnapshot::* Field)
+        {
+            family(Name, "gauge", Help);
+            for (size_t s = 0; s < labels.size(); s++)
+            {
+                if (latest[s].Responses > 0)
+                {
+                    sample(Name, labels[s], latest[s].*Field);
+                }
+            }
+        };
+
+        gauge("ntpcli_offset_seconds", "Offset of the server clock from the local clock in the last response.", &ServerSnapshot::Offset);
+        gauge("ntpcli_rtt_seconds", "Round trip delay of the last response, less the time spent in the server.", &ServerSnapshot::Delay);
+        gauge("ntpcli_jitter_seconds", "RMS difference of successive offsets over about the last eight responses.", &ServerSnapshot::Jitter);
+        family("ntpcli_stratum", "gauge", "Stratum the server reported in the last response.");
+        for (size_t s = 0; s < labels.size(); s++)
+        {
+            if (latest[s].Responses > 0)
+            {
+                sample("ntpcli_stratum", labels[s], latest[s].Stratum);
+            }
+        }
+        family("ntpcli_last_response_timestamp_seconds", "gauge", "Unix time of the last response.");
+        for (size_t s = 0; s < labels.size(); s++)
+        {
+            if (latest[s].Responses > 0)
+            {
+                sample("ntpcli_last_response_timestamp_seconds", labels[s], (latest[s].Updated - 116444736000000000ll) / 1e7, 13);
+            }
+        }
+        family("ntpcli_polls_total", "counter", "Requests sent to the server.");
+        for (size_t s = 0; s < labels.size(); s++)
+        {
+            sample("ntpcli_polls_total", labels[s], static_cast<double>(polls[s].load(std::memory_order_relaxed)), 17);
+        }
+        family("ntpcli_responses_total", "counter", "Responses matched to a request.");
+        for (size_t s = 0; s < labels.size(); s++)
+        {
+            sample("ntpcli_responses_total", labels[s], static_cast<double>(responses[s]), 17);
+        }
+
+        // A request still in flight counts as lost until it is answered
+        family("ntpcli_loss_ratio", "gauge", "Fraction of the requests sent that were not answered.");
+        for (size_t s = 0; s < labels.size(); s++)
+        {
+            double sent = static_cast<double>(polls[s].load(std::memory_order_relaxed));
+            sample("ntpcli_loss_ratio", labels[s], sent > 0 ? std::max(0.0, 1 - responses[s] / sent) : 0);
+        }
+        family("ntpcli_unmatched_responses_total", "counter", "Responses that matched no outstanding request.");
+        sample("ntpcli_unmatched_responses_total", std::string(), static_cast<double>(unmatched), 17);
+        if (OpenMetrics)
+        {
+            out += "# EOF\n";
+        }
+        return out;
+    }
+
+private:
+    static std::string Escape(const std::string & Value)
+    {
+        std::string escaped;
+        for (char c : Value)
+        {
+            if (c == '\\' || c == '"')
+            {
+                escaped += '\\';
+            }
+            escaped += c == '\n' ? std::string("\\n") : std::string(1, c);
+        }
+        return escaped;
+    }
+
+    std::vector<std::string> labels;
+    std::vector<std::unique_ptr<ReceiveStats>> threads;
+    std::vector<std::atomic<unsigned long long>> polls;
+};
+
+// Serves GET /metrics on Listen, a port on 127.0.0.1 or address:port
+// ([address]:port for IPv6), from a thread of its own, one connection at a
+// time.
+class MetricsEndpoint
+{
+public:
+    MetricsEndpoint(const std::string & Listen, const Metrics & Source) :
+        metrics(Source)
+    {
+        std::string host = "127.0.0.1";
+        std::string port = Listen;
+        size_t colon = Listen.rfind(':');
+        if (colon != std::string::npos)
+        {
+            host = Listen.substr(0, colon);
+            port = Listen.substr(colon + 1);
+            if (host.size() > 1 && host.front() == '[' && host.back() == ']')
+            {
+                host = host.substr(1, host.size() - 2);
+            }
+        }
+
+        addrinfo hints = { 0 };
+        addrinfo * addr = nullptr;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
+        int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &addr);
+        if (err != 0)
+        {
+            printf("invalid metrics address %s\n", Listen.c_str());
+            exit(-1);
+        }
+        listener = socket(addr->ai_family, SOCK_STREAM, IPPROTO_TCP);
+        int one = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<char*>(&one), sizeof(one));
+        if (listener == INVALID_SOCKET ||
+            bind(listener, addr->ai_addr, static_cast<int>(addr->ai_addrlen)) == SOCKET_ERROR ||
+            listen(listener, 16) == SOCKET_ERROR)
+        {
+            printf("failed to listen for metrics on %s %d\n", Listen.c_str(), MyGetLastError());
+            exit(-1);
+        }
+        freeaddrinfo(addr);
+        fprintf(stderr, "serving metrics on http://%s/metrics\n", colon == std::string::npos ? ("127.0.0.1:" + port).c_str() : Listen.c_str());
+        server = std::thread([this] { Serve(); });
+        server.detach();
+    }
+
+private:
+    void Serve()
+    {
+        for (;;)
+        {
+            SOCKET client = accept(listener, nullptr, nullptr);
+            if (client == INVALID_SOCKET)
+            {
+                continue;
+            }
+
+            // A client that never finishes its request is dropped after a
+            // second rather than holding up the next scrape
+            SetReceiveTimeout(client, 1000);
+            std::string request;
+            char chunk[1024];
+            while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192)
+            {
+                int received = recv(client, chunk, sizeof(chunk), 0);
+                if (received <= 0)
+                {
+                    break;
+                }
+                request.append(chunk, received);
+            }
+            for (auto & c : request)
+            {
+                c = static_cast<char>(tolower(c));
+            }
+
+            std::string status = "200 OK";
+            std::string type = "text/plain; version=0.0.4; charset=utf-8";
+            std::string body;
+            if (request.compare(0, 13, "get /metrics ") == 0 || request.compare(0, 6, "get / ") == 0)
+            {
+                bool openMetrics = request.find("application/openmetrics-text") != std::string::npos;
+                if (openMetrics)
+                {
+                    type = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+                }
+                body = metrics.Format(openMetrics);
+            }
+            else
+            {
+                status = "404 Not Found";
+                body = "try /metrics\n";
+            }
+            std::string response = "HTTP/1.1 " + status + "\r\nContent-Type: " + type +
+                "\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+            for (size_t sent = 0; sent < response.size();)
+            {
+                int err = send(client, response.data() + sent, static_cast<int>(response.size() - sent), 0);
+                if (err <= 0)
+                {
+                    break;
+                }
+                sent += err;
+            }
+            MyCloseSocket(client);
+        }
+    }
+
+    const Metrics & metrics;
+    SOCKET listener;
+    std::thread server;
+};
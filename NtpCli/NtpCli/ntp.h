@@ -27,6 +27,9 @@ struct NtpPacket {
     NtpTimeStamp Transmit;
 };
 
+// Size of an NTP packet on the wire, without extension fields
+const int NtpPacketSize = 48;
+
 void PushBack(std::vector<unsigned char> & Buffer, unsigned long Value)
 {
     Buffer.push_back((unsigned char)(Value >> 24));
@@ -156,6 +159,16 @@ unsigned long long NtpTimeStampToFileTime(NtpTimeStamp & TimeStamp)
     return seconds * 10000000 + fraction / 100;
 }
 
+// FILETIME of an NTP time stamp. NtpTimeStampToFileTime puts 1900 ten days
+// late (9434620800 rather than 9435484800 seconds after 1601); the NtpCli
+// logs keep that for compatibility, but offsets against the local clock and
+// the monitoring logs can't.
+inline long long NtpToFileTime(const NtpTimeStamp & TimeStamp)
+{
+    unsigned long long seconds = 9435484800ull + TimeStamp.Seconds;
+    return static_cast<long long>(seconds * 10000000 + ((TimeStamp.Fraction * 10000000ull) >> 32));
+}
+
 // Convert NtpShortFormat fraction to ns units
 unsigned long NtpShortFormToNanoSecond(NtpShortFormat ntp)
 {
@@ -5,12 +5,24 @@
 #include <iostream>
 #include <chrono>
 #include <thread>
+#include <atomic>
+#include <memory>
+#include <math.h>
 #include <map>
 #include <string>
 #include <vector>
+#include <algorithm>
 
 #include "platform.h"
 #include "ntp.h"
+#include "transport.h"
+#include "packetring.h"
+#include "metrics.h"
+
+enum Form {
+    Short,
+    Long
+};
 
 std::map<std::string, std::string> ParseCommandLine(int argc, char ** argv)
 {
@@ -42,18 +54,251 @@ std::map<std::string, std::string> ParseCommandLine(int argc, char ** argv)
     return argPairs;
 }
 
-int main(int argc, char ** argv)
+// Round trip times recorded by one receive thread. There is a single
+// writer; the reporting thread only reads entries already published
+// through Count, so recording never takes a lock.
+struct RttLog
 {
+    RttLog(size_t Capacity) :
+        Rtt(Capacity),
+        RttTsc(Capacity),
+        Count(0)
+    {
+    }
 
-    unsigned long interval;
+    void Add(long long Time, long long Tsc)
+    {
+        size_t i = Count.load(std::memory_order_relaxed);
+        if (i < Rtt.size())
+        {
+            Rtt[i] = Time;
+            RttTsc[i] = Tsc;
+            Count.store(i + 1, std::memory_order_release);
+        }
+    }
+
+    std::vector<long long> Rtt;
+    std::vector<long long> RttTsc;
+    std::atomic<size_t> Count;
+};
+
+// Decode one NTP response, match it to its request and log the exchange.
+// Stats is null unless metrics are served.
+void ProcessResponse(std::vector<unsigned char> & Buffer, sockaddr* Address, long long RecvTime, unsigned long long RecvTsc, ExchangeTable & Exchanges, Form Form, RttLog & Log, ReceiveStats * Stats)
+{
+    NtpPacket response{ 0 };
+    char ip[INET6_ADDRSTRLEN] = { 0 };
+    size_t offset = 0;
+    char reference[128] = { 0 };
     long long sendTime;
-    addrinfo * addr = nullptr;
-    int err;
-    SOCKET s;
-    enum {
-        Short,
-        Long
-    } Form = Short;
+    unsigned long long sendTsc;
+    size_t server;
+
+    // Unpack the NTP response
+    Extract(Buffer, offset, response);
+
+    // Match the response to the request it answers
+    if (!Exchanges.Complete(NtpTimeStampToCookie(response.Origin), sendTime, sendTsc, server))
+    {
+        if (Stats != nullptr)
+        {
+            Stats->CountUnmatched();
+        }
+        return;
+    }
+    Log.Add(RecvTime - sendTime, static_cast<long long>(RecvTsc - sendTsc));
+
+    if (Stats != nullptr)
+    {
+        // The on-wire offset and delay of RFC 5905, in 100ns units
+        long long t1 = ClockToFileTime(sendTime);
+        long long t2 = NtpToFileTime(response.Receive);
+        long long t3 = NtpToFileTime(response.Transmit);
+        long long t4 = ClockToFileTime(RecvTime);
+        Stats->Servers[server].Record(((t2 - t1) + (t3 - t4)) / 2e7, ((t4 - t1) - (t3 - t2)) / 1e7, response.Stratum, t4);
+    }
+
+    // Format the reponders IP address as a string
+    switch (Address->sa_family)
+    {
+        case AF_INET:
+        {
+            sockaddr_in* a = reinterpret_cast<sockaddr_in*>(Address);
+            inet_ntop(AF_INET, &a->sin_addr, ip, sizeof(ip));
+        }
+        break;
+        case AF_INET6:
+        {
+            sockaddr_in6* a = reinterpret_cast<sockaddr_in6*>(Address);
+            inet_ntop(AF_INET6, &a->sin6_addr, ip, sizeof(ip));
+        }
+        break;
+    }
+
+    // If this is a straum 1 clock, print the refid as text
+    if (response.Stratum == 1)
+    {
+        reference[0] = response.ReferenceId[0];
+        reference[1] = response.ReferenceId[1];
+        reference[2] = response.ReferenceId[2];
+        reference[3] = response.ReferenceId[3];
+    }
+    else
+    {
+        inet_ntop(AF_INET, &response.ReferenceId, reference, sizeof(reference));
+    }
+
+    switch (Form)
+    {
+    case Short:
+        printf("%llu,%lld,%lld\n",
+            sendTime,
+            RecvTime,
+            NtpTimeStampToFileTime(response.Transmit) / 2 + NtpTimeStampToFileTime(response.Receive) / 2
+        );
+        break;
+    case Long:
+        printf("%s,%llu,%llu,%lu,%lu,%lu,%ld,%ld,0.%.6lu,0.%.6lu,%s,%lld,%lld\n",
+            ip,
+            sendTime,
+            RecvTime,
+            (unsigned long)response.LeapIndicator,
+            (unsigned long)response.Version,
+            (unsigned long)response.Stratum,
+            (unsigned long)response.Poll,
+            (long)response.Precision,
+            NtpShortFormToNanoSecond(response.RootDelay) / 1000,
+            NtpShortFormToNanoSecond(response.RootDispersion) / 1000,
+            reference,
+            NtpTimeStampToFileTime(response.Receive),
+            NtpTimeStampToFileTime(response.Transmit)
+        );
+        break;
+    }
+}
+
+// Receive NTP responses on one socket, blocking until each one arrives
+void ReceiveResponses(SOCKET s, ExchangeTable & Exchanges, Form Form, RttLog & Log, ReceiveStats * Stats)
+{
+    std::vector<unsigned char> buffer(128);
+    for (;;)
+    {
+        sockaddr_storage address;
+        sockaddr* r = reinterpret_cast<sockaddr*>(&address);
+        socklen_t rLen = sizeof(address);
+
+        // Wait for an NTP response packet
+        int err = recvfrom(s, reinterpret_cast<char*>(buffer.data()), static_cast<int>(buffer.size()), 0, r, &rLen);
+        unsigned long long recvTsc = __rdtsc();
+        long long recvTime = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+        if (err == SOCKET_ERROR)
+        {
+            printf("recvfrom failed %d\n", MyGetLastError());
+            exit(-1);
+        }
+        if (err < NtpPacketSize)
+        {
+            continue;
+        }
+        ProcessResponse(buffer, r, recvTime, recvTsc, Exchanges, Form, Log, Stats);
+    }
+}
+
+// Poll every socket from a single spinning thread. The sockets are non
+// blocking, so there is no scheduler wake-up between the packet arriving and
+// the timestamp being taken.
+void SpinReceiveResponses(std::vector<SOCKET> Sockets, ExchangeTable & Exchanges, Form Form, RttLog & Log, ReceiveStats * Stats)
+{
+    std::vector<unsigned char> buffer(128);
+    for (;;)
+    {
+        for (SOCKET s : Sockets)
+        {
+            sockaddr_storage address;
+            sockaddr* r = reinterpret_cast<sockaddr*>(&address);
+            socklen_t rLen = sizeof(address);
+
+            int err = recvfrom(s, reinterpret_cast<char*>(buffer.data()), static_cast<int>(buffer.size()), 0, r, &rLen);
+            unsigned long long recvTsc = __rdtsc();
+            if (err == SOCKET_ERROR)
+            {
+                if (WouldBlock())
+                {
+                    continue;
+                }
+                printf("recvfrom failed %d\n", MyGetLastError());
+                exit(-1);
+            }
+            long long recvTime = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+            if (err < NtpPacketSize)
+            {
+                continue;
+            }
+            ProcessResponse(buffer, r, recvTime, recvTsc, Exchanges, Form, Log, Stats);
+        }
+    }
+}
+
+// Summarize the round trip times seen so far, so blocking and spinning
+// receive modes can be compared run against run.
+void PrintRttReport(const char * Mode, std::vector<std::unique_ptr<RttLog>> & Logs)
+{
+    std::vector<long long> rtt;
+    std::vector<long long> rttTsc;
+    for (auto & log : Logs)
+    {
+        size_t count = log->Count.load(std::memory_order_acquire);
+        rtt.insert(rtt.end(), log->Rtt.begin(), log->Rtt.begin() + count);
+        rttTsc.insert(rttTsc.end(), log->RttTsc.begin(), log->RttTsc.begin() + count);
+    }
+    if (rtt.empty())
+    {
+        fprintf(stderr, "mode %s: no responses\n", Mode);
+        return;
+    }
+    std::sort(rtt.begin(), rtt.end());
+    std::sort(rttTsc.begin(), rttTsc.end());
+
+    double mean = 0;
+    double stdev = 0;
+    for (long long r : rtt)
+    {
+        mean += r;
+    }
+    mean /= rtt.size();
+    for (long long r : rtt)
+    {
+        stdev += (r - mean) * (r - mean);
+    }
+    stdev = sqrt(stdev / rtt.size());
+
+    fprintf(stderr, "Mode\tSamples\tMin\tMedian\tMean\tSTDEV\tP99\tMax\tMedianTsc\n");
+    fprintf(stderr, "%s\t%zu\t%lld\t%lld\t%.0f\t%.0f\t%lld\t%lld\t%lld\n",
+        Mode,
+        rtt.size(),
+        rtt.front(),
+        rtt[rtt.size() / 2],
+        mean,
+        stdev,
+        rtt[(rtt.size() * 99) / 100],
+        rtt.back(),
+        rttTsc[rttTsc.size() / 2]);
+}
+
+int main(int argc, char ** argv)
+{
+    unsigned long interval;
+    unsigned long poll = 5000;
+    size_t shards = 1;
+    int family = AF_UNSPEC;
+    bool allAddresses = false;
+    bool ipv4 = false;
+    bool ipv6 = false;
+    bool spin = false;
+    bool packetRing = false;
+    bool report = false;
+    size_t spinCpu = 0;
+    Form form = Short;
 
     PlatformInit();
 
@@ -63,7 +308,11 @@ int main(int argc, char ** argv)
     if (args.find("host") == args.end() ||
         args.find("interval") == args.end())
     {
-        printf("usage: %s -host <name> -interval <seconds> -form <short/long>\n", argv[0]);
+        printf("usage: %s -host <name>[,<name>...] -interval <seconds> -form <short/long>\n", argv[0]);
+        printf("          [-poll <milliseconds>] [-family <any/ipv4/ipv6>] [-addresses <first/all>]\n");
+        printf("          [-source <address>[,<address>]] [-interface <name>] [-shards <count>]\n");
+        printf("          [-spin <cpu>] [-report <yes/no>] [-transport <socket/mmap>]\n");
+        printf("          [-metrics <port>|<address>:<port>]\n");
         exit(-1);
     }
 
@@ -73,16 +322,71 @@ int main(int argc, char ** argv)
     {
         if (args["form"] == "short")
         {
-            Form = Short;
+            form = Short;
         }
         else if (args["form"] == "long")
         {
-            Form = Long;
+            form = Long;
+        }
+    }
+
+    if (args.find("poll") != args.end())
+    {
+        poll = atoi(args["poll"].c_str());
+    }
+
+    if (args.find("family") != args.end())
+    {
+        if (args["family"] == "ipv4")
+        {
+            family = AF_INET;
+        }
+        else if (args["family"] == "ipv6")
+        {
+            family = AF_INET6;
         }
     }
 
+    if (args.find("addresses") != args.end())
+    {
+        allAddresses = args["addresses"] == "all";
+    }
+
+    if (args.find("shards") != args.end())
+    {
+        shards = std::max(1, atoi(args["shards"].c_str()));
+    }
+
+    if (args.find("spin") != args.end())
+    {
+        spin = true;
+        spinCpu = atoi(args["spin"].c_str());
+    }
+
+    if (args.find("transport") != args.end())
+    {
+        packetRing = args["transport"] == "mmap";
+#if !defined(__linux__)
+        if (packetRing)
+        {
+            printf("the mmap transport is only supported on Linux\n");
+            exit(-1);
+        }
+#endif
+        if (packetRing && args.find("interface") == args.end())
+        {
+            printf("the mmap transport requires -interface\n");
+            exit(-1);
+        }
+    }
+
+    if (args.find("report") != args.end())
+    {
+        report = args["report"] == "yes";
+    }
+
     // Print the header line for the CSV if this is the long form
-    switch (Form)
+    switch (form)
     {
     case Long:
         printf("ip,recvTime,LeapIndicator,Version,Stratum,Poll,Precision,RootDelay,RootDispersion,Reference,ReceiveTx,TransmitTx\n");
@@ -91,133 +395,157 @@ int main(int argc, char ** argv)
         break;
     }
 
-    // Get the list of addresses for this host
-    err = getaddrinfo(args["host"].c_str(), "123", nullptr, &addr);
-    if (err != 0)
+    // Get the list of addresses to poll
+    std::vector<NtpServer> servers = ResolveServers(args["host"], family, allAddresses);
+    if (servers.empty())
+    {
+        printf("no addresses found for %s\n", args["host"].c_str());
+        exit(-1);
+    }
+    for (auto & server : servers)
     {
-        printf("getaddrinfo failed %d\n", err);
-        exit(err);
+        ipv4 |= server.Address.ss_family == AF_INET;
+        ipv6 |= server.Address.ss_family == AF_INET6;
     }
 
-    // Create the socket we send and receive on
-    s = socket(addr->ai_family, SOCK_DGRAM, IPPROTO_UDP);
-    if (s == INVALID_SOCKET)
+    // Create the sockets we send and receive on
+    Transport transport(shards, ipv4, ipv6, args["source"], args["interface"]);
+    ExchangeTable exchanges;
+
+    // Each receive thread records round trip times for the final report
+    std::vector<std::unique_ptr<RttLog>> logs;
+    std::vector<std::thread> recvThreads;
+    std::vector<SOCKET> sockets = transport.Sockets();
+    size_t capacity = (1000ull * interval / std::max(1ul, poll) + 1) * servers.size();
+
+    // And, when metrics are served, the statistics of each server in slots
+    // of its own
+    std::unique_ptr<Metrics> metrics;
+    std::unique_ptr<MetricsEndpoint> endpoint;
+    if (args.find("metrics") != args.end())
     {
-        printf("socket failed %d\n", MyGetLastError());
-        exit(err);
+        metrics.reset(new Metrics(servers, packetRing || spin ? 1 : sockets.size()));
+        endpoint.reset(new MetricsEndpoint(args["metrics"], *metrics));
     }
+    auto stats = [&metrics](size_t Thread) -> ReceiveStats *
+    {
+        return metrics ? &metrics->Thread(Thread) : nullptr;
+    };
 
-    // Start sending NTP request
-    auto senderThread = std::thread([&] {
-        int err;
-        NtpPacket request{ 0 };
-        request.Version = 4;
-        request.Mode = 3;
-        std::vector<unsigned char> buffer;
-        PushBack(buffer, request);
-        for (;;)
+    if (packetRing)
+    {
+#if defined(__linux__)
+        // Replies are read from the packet ring; the UDP sockets only send.
+        // The ring is opened before any request goes out.
+        std::shared_ptr<PacketRing> ring = std::make_shared<PacketRing>(args["interface"]);
+        for (SOCKET s : sockets)
         {
-            sendTime = std::chrono::high_resolution_clock::now().time_since_epoch().count();
-            err = sendto(s, (char*)buffer.data(), static_cast<int>(buffer.size()), 0, addr->ai_addr, static_cast<int>(addr->ai_addrlen));
-            if (err == SOCKET_ERROR)
+            DiscardReceives(s);
+        }
+        std::vector<unsigned short> ports = transport.LocalPorts();
+        logs.push_back(std::unique_ptr<RttLog>(new RttLog(capacity)));
+        RttLog & log = *logs.back();
+        ReceiveStats * threadStats = stats(0);
+        recvThreads.push_back(std::thread([&exchanges, &log, threadStats, form, ring, ports, spin, spinCpu] {
+            std::vector<unsigned char> buffer(NtpPacketSize);
+            if (spin && !SetThreadAffinity(spinCpu))
             {
-                printf("sendto failed %d\n", MyGetLastError());
+                printf("failed to pin receive thread to cpu %zu\n", spinCpu);
                 exit(-1);
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(5000));
-        }
-    });
-
-    std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-
-    // Start receiving NTP responses
-    auto recvThread = std::thread([&] {
-        for (;;)
+            ring->Receive(ports, spin, [&](const unsigned char* Payload, sockaddr* Address, long long RecvTime) {
+                unsigned long long recvTsc = __rdtsc();
+                buffer.assign(Payload, Payload + NtpPacketSize);
+                ProcessResponse(buffer, Address, RecvTime, recvTsc, exchanges, form, log, threadStats);
+            });
+        }));
+#endif
+    }
+    else if (spin)
+    {
+        // Dedicate one core to polling all of the sockets
+        for (SOCKET s : sockets)
         {
-            NtpPacket response{ 0 };
-            std::vector<unsigned char> buffer(128);
-            char addressBuffer[128];
-            sockaddr* r = (sockaddr*)addressBuffer;
-            socklen_t rLen = sizeof(buffer);
-            char ip[50] = { 0 };
-            size_t offset = 0;
-            char reference[128] = { 0 };
-
-            // Wait for an NTP response packet
-            int err = recvfrom(s, reinterpret_cast<char*>(buffer.data()), static_cast<int>(buffer.size()), 0, r, &rLen);
-            long long recvTime = std::chrono::high_resolution_clock::now().time_since_epoch().count();
-            if (err == SOCKET_ERROR)
+            if (!SetNonBlocking(s))
             {
-                printf("recvfrom failed %d\n", MyGetLastError());
+                printf("failed to make socket non blocking %d\n", MyGetLastError());
                 exit(-1);
             }
-
-            // Unpack the NTP response
-            Extract(buffer, offset, response);
-
-            // Format the reponders IP address as a string
-            switch (r->sa_family)
+            EnableBusyPoll(s);
+        }
+        logs.push_back(std::unique_ptr<RttLog>(new RttLog(capacity)));
+        RttLog & log = *logs.back();
+        ReceiveStats * threadStats = stats(0);
+        recvThreads.push_back(std::thread([&exchanges, &log, threadStats, form, sockets, spinCpu] {
+            if (!SetThreadAffinity(spinCpu))
             {
-                case AF_INET:
-                {
-                    sockaddr_in* a = reinterpret_cast<sockaddr_in*>(r);
-                    inet_ntop(AF_INET, &a->sin_addr, ip, sizeof(ip));
-                }
-                break;
-                case AF_INET6:
+                printf("failed to pin receive thread to cpu %zu\n", spinCpu);
+                exit(-1);
+            }
+            SpinReceiveResponses(sockets, exchanges, form, log, threadStats);
+        }));
+    }
+    else
+    {
+        // One blocking thread per socket. When sharded, spread the receive
+        // threads across the available cores.
+        size_t cpus = std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < sockets.size(); i++)
+        {
+            SOCKET s = sockets[i];
+            logs.push_back(std::unique_ptr<RttLog>(new RttLog(capacity)));
+            RttLog & log = *logs.back();
+            ReceiveStats * threadStats = stats(i);
+            recvThreads.push_back(std::thread([&exchanges, &log, threadStats, form, shards, cpus, s, i] {
+                if (shards > 1)
                 {
-                    sockaddr_in6* a = reinterpret_cast<sockaddr_in6*>(r);
-                    inet_ntop(AF_INET6, &a->sin6_addr, ip, sizeof(ip));
+                    SetThreadAffinity(i % cpus);
                 }
-                break;
-            }
+                ReceiveResponses(s, exchanges, form, log, threadStats);
+            }));
+        }
+    }
 
-            // If this is a straum 1 clock, print the refid as text
-            if (response.Stratum == 1)
-            {
-                reference[0] = response.ReferenceId[0];
-                reference[1] = response.ReferenceId[1];
-                reference[2] = response.ReferenceId[2];
-                reference[3] = response.ReferenceId[3];
-            }
-            else
+    // Start sending NTP requests, spreading the polls of all servers evenly
+    // over the poll interval.
+    auto senderThread = std::thread([&] {
+        int err;
+        NtpPacket request{ 0 };
+        request.Version = 4;
+        request.Mode = 3;
+        std::vector<unsigned char> buffer;
+        auto spacing = std::chrono::microseconds(1000ull * poll / servers.size());
+        for (size_t next = 0;; next = (next + 1) % servers.size())
+        {
+            const NtpServer & server = servers[next];
+            SOCKET s = transport.Socket(next % transport.Shards(), server.Address.ss_family);
+            unsigned long long cookie = exchanges.Begin(next);
+            request.Transmit = CookieToNtpTimeStamp(cookie);
+            buffer.clear();
+            PushBack(buffer, request);
+            exchanges.Stamp(cookie, std::chrono::high_resolution_clock::now().time_since_epoch().count(), __rdtsc());
+            err = sendto(s, (char*)buffer.data(), static_cast<int>(buffer.size()), 0, reinterpret_cast<const sockaddr*>(&server.Address), server.AddressLength);
+            if (err == SOCKET_ERROR)
             {
-                inet_ntop(AF_INET, &response.ReferenceId, reference, sizeof(reference));
+                printf("sendto failed %d\n", MyGetLastError());
+                exit(-1);
             }
-
-            switch (Form)
+            if (metrics)
             {
-            case Short:
-                printf("%llu,%lld,%lld\n",
-                    sendTime,
-                    recvTime,
-                    NtpTimeStampToFileTime(response.Transmit) / 2 + NtpTimeStampToFileTime(response.Receive) / 2
-                );
-                break;
-            case Long:
-                printf("%s,%llu,%llu,%lu,%lu,%lu,%ld,%ld,0.%.6lu,0.%.6lu,%s,%lld,%lld\n",
-                    ip,
-                    sendTime,
-                    recvTime,
-                    (unsigned long)response.LeapIndicator,
-                    (unsigned long)response.Version,
-                    (unsigned long)response.Stratum,
-                    (unsigned long)response.Poll,
-                    (long)response.Precision,
-                    NtpShortFormToNanoSecond(response.RootDelay) / 1000,
-                    NtpShortFormToNanoSecond(response.RootDispersion) / 1000,
-                    reference,
-                    NtpTimeStampToFileTime(response.Receive),
-                    NtpTimeStampToFileTime(response.Transmit)
-                );
-                break;
+                metrics->CountPoll(next);
             }
+            std::this_thread::sleep_for(spacing);
         }
     });
+
     std::this_thread::sleep_for(std::chrono::seconds(interval));
 
+    if (report)
+    {
+        PrintRttReport(packetRing ? (spin ? "mmap-spin" : "mmap") : (spin ? "spin" : "blocking"), logs);
+    }
+
     exit(0);
 
     return 0;
 }
-
@@ -0,0 +1,56 @@
+#!/bin/bash
+# Checks the PACKET_MMAP receive path (-transport mmap) end to end: a veth
+# pair into a network namespace, a scripted NTP responder inside it, and
+# ntpcli polling it through the ring. Needs root and a built ntpcli. Fails
+# unless replies arrive, their receive stamps are on the send clock (the
+# round trip is positive and under a second), and the UDP sockets that only
+# send keep an empty receive queue.
+
+NTPCLI=${1:-./ntpcli}
+NS=ntpring$$
+HOST=ntpr$$a
+PEER=ntpr$$b
+OUT=$(mktemp)
+
+cleanup()
+{
+    ip netns pids $NS 2>/dev/null | xargs -r kill
+    ip link del $HOST 2>/dev/null
+    ip netns del $NS 2>/dev/null
+    rm -f $OUT
+}
+trap cleanup EXIT
+
+ip netns add $NS || exit 1
+ip link add $HOST type veth peer name $PEER
+ip link set $PEER netns $NS
+ip addr add 10.231.0.1/24 dev $HOST
+ip link set $HOST up
+ip netns exec $NS ip addr add 10.231.0.2/24 dev $PEER
+ip netns exec $NS ip link set $PEER up
+ip netns exec $NS ip link set lo up
+
+# Answers every request with the current time as receive and transmit
+ip netns exec $NS python3 -c '
+import socket, struct, time
+s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+s.bind(("10.231.0.2", 123))
+while True:
+    d, a = s.recvfrom(512)
+    if len(d) < 48: continue
+    now = time.time() + 2208988800
+    sec = int(now); frac = int((now - sec) * 2**32)
+    s.sendto(bytes([0x24, 1, d[2], 0xEC]) + bytes(8) + b"GPS\0" + struct.pack(">II", sec, frac) + d[40:48] + struct.pack(">IIII", sec, frac, sec, frac), a)
+' &
+sleep 1
+
+$NTPCLI -host 10.231.0.2 -interval 4 -form short -transport mmap -interface $HOST -poll 50 > $OUT &
+CLIENT=$!
+sleep 2
+QUEUED=$(ss -uanp | awk '/"ntpcli"/ { q += $2 } END { print q + 0 }')
+wait $CLIENT
+
+REPLIES=$(wc -l < $OUT)
+BAD=$(awk -F, '{ rtt = $2 - $1; if (rtt <= 0 || rtt >= 1000000000) n++ } END { print n + 0 }' $OUT)
+echo "$REPLIES replies, $BAD with a round trip off the send clock, $QUEUED bytes queued on the send sockets"
+[ "$REPLIES" -ge 40 ] && [ "$BAD" -eq 0 ] && [ "$QUEUED" -eq 0 ]
@@ -0,0 +1,236 @@
+#pragma once
+// Zero-copy receive of NTP replies through a PACKET_MMAP (TPACKET_V3) ring.
+//
+// The kernel writes matching frames straight into a ring shared with this
+// process and stamps each one in the frame header, so replies are decoded
+// in place without a recvfrom copy or a trip through the UDP stack. Requests
+// are still sent on the normal UDP sockets; the ring only sees frames with a
+// UDP source port of 123 and the caller picks out those addressed to its own
+// local ports. The replies also reach those UDP sockets, which nothing reads
+// while the ring is in use, so DiscardReceives has the sockets drop them.
+//
+// The frame stamps are the kernel's software receive time, CLOCK_REALTIME
+// like the send times taken with the system clock. Hardware stamps would be
+// in the NIC's PTP clock, which the send times aren't, so they aren't
+// requested; a frame without a software stamp is timed when it is read.
+
+#if defined(__linux__)
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <linux/net_tstamp.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/udp.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <chrono>
+
+class PacketRing
+{
+public:
+    PacketRing(const std::string & Interface) :
+        fd(-1),
+        ring(nullptr),
+        block(0)
+    {
+        int version = TPACKET_V3;
+        tpacket_req3 req = { 0 };
+        sockaddr_ll local = { 0 };
+
+        // "udp src port 123" for IPv4 and IPv6 over an Ethernet header,
+        // as produced by tcpdump -dd.
+        static sock_filter filter[] = {
+            { 0x28, 0, 0, 0x0000000c },
+            { 0x15, 0, 4, 0x000086dd },
+            { 0x30, 0, 0, 0x00000014 },
+            { 0x15, 0, 11, 0x00000011 },
+            { 0x28, 0, 0, 0x00000036 },
+            { 0x15, 8, 9, 0x0000007b },
+            { 0x15, 0, 8, 0x00000800 },
+            { 0x30, 0, 0, 0x00000017 },
+            { 0x15, 0, 6, 0x00000011 },
+            { 0x28, 0, 0, 0x00000014 },
+            { 0x45, 4, 0, 0x00001fff },
+            { 0xb1, 0, 0, 0x0000000e },
+            { 0x48, 0, 0, 0x0000000e },
+            { 0x15, 0, 1, 0x0000007b },
+            { 0x06, 0, 0, 0x00040000 },
+            { 0x06, 0, 0, 0x00000000 },
+        };
+        sock_fprog program = { sizeof(filter) / sizeof(filter[0]), filter };
+
+        fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+        if (fd == -1)
+        {
+            printf("socket AF_PACKET failed %d\n", errno);
+            exit(-1);
+        }
+
+        // Attach the filter before binding so no unrelated traffic is queued
+        if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) == -1)
+        {
+            printf("setsockopt SO_ATTACH_FILTER failed %d\n", errno);
+            exit(-1);
+        }
+
+        if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1)
+        {
+            printf("setsockopt PACKET_VERSION failed %d\n", errno);
+            exit(-1);
+        }
+
+        // Small blocks retired after 1ms keep latency low at NTP packet rates
+        req.tp_block_size = BlockSize;
+        req.tp_block_nr = BlockCount;
+        req.tp_frame_size = FrameSize;
+        req.tp_frame_nr = (BlockSize / FrameSize) * BlockCount;
+        req.tp_retire_blk_tov = 1;
+        if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1)
+        {
+            printf("setsockopt PACKET_RX_RING failed %d\n", errno);
+            exit(-1);
+        }
+
+        ring = static_cast<unsigned char*>(mmap(nullptr, BlockSize * BlockCount, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0));
+        if (ring == MAP_FAILED)
+        {
+            printf("mmap failed %d\n", errno);
+            exit(-1);
+        }
+
+        local.sll_family = AF_PACKET;
+        local.sll_protocol = htons(ETH_P_ALL);
+        local.sll_ifindex = if_nametoindex(Interface.c_str());
+        if (local.sll_ifindex == 0)
+        {
+            printf("unknown interface %s\n", Interface.c_str());
+            exit(-1);
+        }
+        if (bind(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local)) == -1)
+        {
+            printf("bind failed %d\n", errno);
+            exit(-1);
+        }
+    }
+
+    // Walk the ring forever, calling Handler for every NTP payload addressed
+    // to one of Ports (network byte order) with the sender's address and the
+    // frame's kernel timestamp in system clock ns. When Spin is set the ring
+    // is polled without ever sleeping in the kernel.
+    template<typename THandler>
+    void Receive(const std::vector<unsigned short> & Ports, bool Spin, THandler Handler)
+    {
+        for (;;)
+        {
+            tpacket_block_desc* desc = reinterpret_cast<tpacket_block_desc*>(ring + block * BlockSize);
+            if ((__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) == 0)
+            {
+                if (!Spin)
+                {
+                    pollfd p = { fd, POLLIN | POLLERR, 0 };
+                    poll(&p, 1, -1);
+                }
+                continue;
+            }
+
+            tpacket3_hdr* frame = reinterpret_cast<tpacket3_hdr*>(reinterpret_cast<unsigned char*>(desc) + desc->hdr.bh1.offset_to_first_pkt);
+            for (unsigned int i = 0; i < desc->hdr.bh1.num_pkts; i++)
+            {
+                ProcessFrame(frame, Ports, Handler);
+                frame = reinterpret_cast<tpacket3_hdr*>(reinterpret_cast<unsigned char*>(frame) + frame->tp_next_offset);
+            }
+
+            // Hand the block back to the kernel
+            __atomic_store_n(&desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+            block = (block + 1) % BlockCount;
+        }
+    }
+
+private:
+    static const unsigned int BlockSize = 1 << 16;
+    static const unsigned int BlockCount = 64;
+    static const unsigned int FrameSize = 1 << 11;
+
+    template<typename THandler>
+    void ProcessFrame(tpacket3_hdr* Frame, const std::vector<unsigned short> & Ports, THandler & Handler)
+    {
+        const sockaddr_ll* link = reinterpret_cast<const sockaddr_ll*>(reinterpret_cast<unsigned char*>(Frame) + TPACKET_ALIGN(sizeof(tpacket3_hdr)));
+        const unsigned char* net = reinterpret_cast<unsigned char*>(Frame) + Frame->tp_net;
+        const unsigned char* end = reinterpret_cast<unsigned char*>(Frame) + Frame->tp_mac + Frame->tp_snaplen;
+        const udphdr* udp;
+        sockaddr_storage address = { 0 };
+
+        // Our own requests on loopback are not replies
+        if (link->sll_pkttype == PACKET_OUTGOING)
+        {
+            return;
+        }
+
+        // Locate the UDP header and record who sent the datagram
+        switch (net[0] >> 4)
+        {
+        case 4:
+        {
+            const ip* ip4 = reinterpret_cast<const ip*>(net);
+            sockaddr_in* a = reinterpret_cast<sockaddr_in*>(&address);
+            if (ip4->ip_p != IPPROTO_UDP)
+            {
+                return;
+            }
+            a->sin_family = AF_INET;
+            a->sin_addr = ip4->ip_src;
+            udp = reinterpret_cast<const udphdr*>(net + ip4->ip_hl * 4);
+        }
+        break;
+        case 6:
+        {
+            const ip6_hdr* ip6 = reinterpret_cast<const ip6_hdr*>(net);
+            sockaddr_in6* a = reinterpret_cast<sockaddr_in6*>(&address);
+            if (ip6->ip6_nxt != IPPROTO_UDP)
+            {
+                return;
+            }
+            a->sin6_family = AF_INET6;
+            a->sin6_addr = ip6->ip6_src;
+            udp = reinterpret_cast<const udphdr*>(net + sizeof(ip6_hdr));
+        }
+        break;
+        default:
+            return;
+        }
+
+        const unsigned char* payload = reinterpret_cast<const unsigned char*>(udp + 1);
+        if (payload + NtpPacketSize > end ||
+            std::find(Ports.begin(), Ports.end(), udp->uh_dport) == Ports.end())
+        {
+            return;
+        }
+
+        long long recvTime = (Frame->tp_status & TP_STATUS_TS_SOFTWARE) ?
+            std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(
+                std::chrono::seconds(Frame->tp_sec) + std::chrono::nanoseconds(Frame->tp_nsec)).count() :
+            std::chrono::high_resolution_clock::now().time_since_epoch().count();
+        Handler(payload, reinterpret_cast<sockaddr*>(&address), recvTime);
+    }
+
+    int fd;
+    unsigned char* ring;
+    unsigned int block;
+};
+
+// Attach a filter that drops every datagram to a socket that only sends
+inline void DiscardReceives(SOCKET s)
+{
+    static sock_filter drop[] = {
+        { 0x06, 0, 0, 0x00000000 },
+    };
+    sock_fprog program = { 1, drop };
+    if (setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) == -1)
+    {
+        printf("setsockopt SO_ATTACH_FILTER failed %d\n", errno);
+        exit(-1);
+    }
+}
+#endif
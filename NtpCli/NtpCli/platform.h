@@ -29,3 +29,101 @@ inline void PlatformInit()
 }
 
 #endif
+
+#if defined(_MSC_VER)
+inline bool SetThreadAffinity(size_t CpuId)
+{
+    DWORD_PTR affinityMask = 1ull << CpuId;
+    if (!SetThreadAffinityMask(GetCurrentThread(), affinityMask))
+    {
+        return false;
+    }
+    return true;
+}
+#else
+inline bool SetThreadAffinity(size_t CpuId)
+{
+    cpu_set_t cpuset;
+    pthread_t thread;
+    thread = pthread_self();
+    CPU_ZERO(&cpuset);
+    CPU_SET(CpuId, &cpuset);
+    if (0 != pthread_setaffinity_np(thread, sizeof(cpu_set_t), &cpuset))
+    {
+        return false;
+    }
+    CPU_ZERO(&cpuset);
+    if (0 != pthread_getaffinity_np(thread, sizeof(cpu_set_t), &cpuset) ||
+        (!CPU_ISSET(CpuId, &cpuset)))
+    {
+        return false;
+    }
+    return true;
+}
+#endif
+
+#if defined(_MSC_VER)
+inline bool SetNonBlocking(SOCKET s)
+{
+    u_long nonBlocking = 1;
+    return ioctlsocket(s, FIONBIO, &nonBlocking) == 0;
+}
+
+inline bool WouldBlock()
+{
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+#else
+inline bool SetNonBlocking(SOCKET s)
+{
+    int flags = fcntl(s, F_GETFL, 0);
+    return flags != -1 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+inline bool WouldBlock()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+#endif
+
+#if defined(_MSC_VER)
+inline void MyCloseSocket(SOCKET s)
+{
+    closesocket(s);
+}
+
+inline void SetReceiveTimeout(SOCKET s, unsigned long Milliseconds)
+{
+    DWORD timeout = Milliseconds;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<char*>(&timeout), sizeof(timeout));
+}
+#else
+inline void MyCloseSocket(SOCKET s)
+{
+    close(s);
+}
+
+inline void SetReceiveTimeout(SOCKET s, unsigned long Milliseconds)
+{
+    timeval timeout;
+    timeout.tv_sec = Milliseconds / 1000;
+    timeout.tv_usec = (Milliseconds % 1000) * 1000;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<char*>(&timeout), sizeof(timeout));
+}
+#endif
+
+// Ask the kernel to busy poll the device queue on receive, where supported.
+// Raising the value above net.core.busy_read requires CAP_NET_ADMIN, so a
+// failure only costs some latency and is not fatal.
+inline void EnableBusyPoll(SOCKET s)
+{
+#if defined(SO_BUSY_POLL)
+    int usec = 50;
+    if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, reinterpret_cast<char*>(&usec), sizeof(usec)) == SOCKET_ERROR)
+    {
+        printf("setsockopt SO_BUSY_POLL failed %d, continuing without it\n", MyGetLastError());
+    }
+#else
+    (void)s;
+#endif
+}
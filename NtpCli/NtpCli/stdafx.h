@@ -11,12 +11,20 @@
 #include <Ws2tcpip.h>
 #include <winsock.h>
 #include <tchar.h>
+#include <intrin.h>
 
 #else
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <x86intrin.h>
 
 #define SOCKET int
 #define INVALID_SOCKET -1
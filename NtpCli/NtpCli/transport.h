@@ -0,0 +1,325 @@
+#pragma once
+// Dual-stack UDP transport for polling many NTP servers.
+//
+// Each shard owns one socket per address family. On platforms that support
+// SO_REUSEPORT all shards of a family share one local port, so the kernel
+// spreads replies across the shard sockets and their receive threads can be
+// pinned to separate cores. Because a reply may land on any shard, requests
+// are tagged with a cookie in the transmit timestamp and matched back to the
+// originating exchange through a shared, lock free exchange table.
+
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <string>
+#include <vector>
+
+struct NtpServer
+{
+    std::string Name;
+    sockaddr_storage Address;
+    socklen_t AddressLength;
+};
+
+struct Exchange
+{
+    std::atomic<unsigned long long> Cookie;
+    long long SendTime;
+    unsigned long long SendTsc;
+    size_t Server;
+};
+
+// Outstanding requests, indexed by the sequence number carried in the cookie.
+// The table only has to be larger than the number of requests in flight
+// within one reply timeout; older slots are silently recycled.
+class ExchangeTable
+{
+public:
+    ExchangeTable(size_t Size = 0x10000) :
+        table(Size),
+        mask(Size - 1),
+        sequence(0)
+    {
+        std::random_device rd;
+        nonce = rd() & 0xFFFFFFFF;
+    }
+
+    // Reserve a slot for a new request and return the cookie to send
+    unsigned long long Begin(size_t Server)
+    {
+        unsigned long long seq = sequence.fetch_add(1) & 0xFFFFFFFF;
+        Exchange & e = table[seq & mask];
+        e.Cookie.store(0, std::memory_order_relaxed);
+        e.Server = Server;
+        return (seq << 32) | nonce;
+    }
+
+    // Record the send time as late as possible before the request goes out,
+    // then publish the exchange to the receive threads.
+    void Stamp(unsigned long long Cookie, long long SendTime, unsigned long long SendTsc)
+    {
+        Exchange & e = table[(Cookie >> 32) & mask];
+        e.SendTime = SendTime;
+        e.SendTsc = SendTsc;
+        e.Cookie.store(Cookie, std::memory_order_release);
+    }
+
+    // Match a reply to its request. Each exchange completes at most once, so
+    // duplicated or replayed responses are dropped. The cookie is claimed
+    // before the fields are read: once it is cleared no other reply can
+    // match the slot, and only a request a full table later reuses it.
+    bool Complete(unsigned long long Cookie, long long & SendTime, unsigned long long & SendTsc, size_t & Server)
+    {
+        if ((Cookie & 0xFFFFFFFF) != nonce)
+        {
+            return false;
+        }
+        Exchange & e = table[(Cookie >> 32) & mask];
+        if (!e.Cookie.compare_exchange_strong(Cookie, 0, std::memory_order_acquire))
+        {
+            return false;
+        }
+        SendTime = e.SendTime;
+        SendTsc = e.SendTsc;
+        Server = e.Server;
+        return true;
+    }
+
+private:
+    std::vector<Exchange> table;
+    size_t mask;
+    std::atomic<unsigned long long> sequence;
+    unsigned long long nonce;
+};
+
+inline NtpTimeStamp CookieToNtpTimeStamp(unsigned long long Cookie)
+{
+    NtpTimeStamp ts;
+    ts.Seconds = static_cast<unsigned long>(Cookie >> 32);
+    ts.Fraction = static_cast<unsigned long>(Cookie & 0xFFFFFFFF);
+    return ts;
+}
+
+inline unsigned long long NtpTimeStampToCookie(NtpTimeStamp & TimeStamp)
+{
+    return (static_cast<unsigned long long>(TimeStamp.Seconds & 0xFFFFFFFF) << 32) | (TimeStamp.Fraction & 0xFFFFFFFF);
+}
+
+// Resolve a comma separated list of host names. If AllAddresses is false only
+// the first address of each name is kept, matching the original behavior.
+inline std::vector<NtpServer> ResolveServers(const std::string & Hosts, int Family, bool AllAddresses)
+{
+    std::vector<NtpServer> servers;
+    size_t start = 0;
+    while (start <= Hosts.length())
+    {
+        size_t end = Hosts.find(',', start);
+        if (end == std::string::npos)
+        {
+            end = Hosts.length();
+        }
+        std::string name = Hosts.substr(start, end - start);
+        start = end + 1;
+        if (name.empty())
+        {
+            continue;
+        }
+
+        addrinfo hints = { 0 };
+        addrinfo * addr = nullptr;
+        hints.ai_family = Family;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_protocol = IPPROTO_UDP;
+        int err = getaddrinfo(name.c_str(), "123", &hints, &addr);
+        if (err != 0)
+        {
+            printf("getaddrinfo failed %d\n", err);
+            exit(err);
+        }
+        for (addrinfo * a = addr; a != nullptr; a = a->ai_next)
+        {
+            NtpServer server;
+            server.Name = name;
+            memset(&server.Address, 0, sizeof(server.Address));
+            memcpy(&server.Address, a->ai_addr, a->ai_addrlen);
+            server.AddressLength = static_cast<socklen_t>(a->ai_addrlen);
+            servers.push_back(server);
+            if (!AllAddresses)
+            {
+                break;
+            }
+        }
+        freeaddrinfo(addr);
+    }
+    return servers;
+}
+
+class Transport
+{
+public:
+    // Create Shards sockets for each address family in use. Sources is an
+    // optional list of local addresses (at most one per family) to bind to,
+    // Interface an optional device name to restrict traffic to.
+    Transport(size_t Shards, bool Ipv4, bool Ipv6, const std::string & Sources, const std::string & Interface) :
+        shards(Shards)
+    {
+        sockaddr_storage source4 = { 0 };
+        sockaddr_storage source6 = { 0 };
+        ParseSources(Sources, source4, source6);
+
+        for (size_t i = 0; i < shards; i++)
+        {
+            sockets4.push_back(Ipv4 ? CreateSocket(AF_INET, source4, Interface) : INVALID_SOCKET);
+            sockets6.push_back(Ipv6 ? CreateSocket(AF_INET6, source6, Interface) : INVALID_SOCKET);
+        }
+    }
+
+    size_t Shards() const
+    {
+        return shards;
+    }
+
+    SOCKET Socket(size_t Shard, int Family) const
+    {
+        return Family == AF_INET6 ? sockets6[Shard] : sockets4[Shard];
+    }
+
+    // Sockets to service with receive threads
+    std::vector<SOCKET> Sockets() const
+    {
+        std::vector<SOCKET> all;
+        for (size_t i = 0; i < shards; i++)
+        {
+            if (sockets4[i] != INVALID_SOCKET)
+            {
+                all.push_back(sockets4[i]);
+            }
+            if (sockets6[i] != INVALID_SOCKET)
+            {
+                all.push_back(sockets6[i]);
+            }
+        }
+        return all;
+    }
+
+    // Local ports in network byte order that replies will be addressed to
+    const std::vector<unsigned short> & LocalPorts() const
+    {
+        return ports;
+    }
+
+private:
+    static void ParseSources(const std::string & Sources, sockaddr_storage & Source4, sockaddr_storage & Source6)
+    {
+        size_t start = 0;
+        while (start < Sources.length())
+        {
+            size_t end = Sources.find(',', start);
+            if (end == std::string::npos)
+            {
+                end = Sources.length();
+            }
+            std::string source = Sources.substr(start, end - start);
+            start = end + 1;
+
+            sockaddr_in * a4 = reinterpret_cast<sockaddr_in*>(&Source4);
+            sockaddr_in6 * a6 = reinterpret_cast<sockaddr_in6*>(&Source6);
+            if (inet_pton(AF_INET, source.c_str(), &a4->sin_addr) == 1)
+            {
+                a4->sin_family = AF_INET;
+            }
+            else if (inet_pton(AF_INET6, source.c_str(), &a6->sin6_addr) == 1)
+            {
+                a6->sin6_family = AF_INET6;
+            }
+            else
+            {
+                printf("invalid source address %s\n", source.c_str());
+                exit(-1);
+            }
+        }
+    }
+
+    SOCKET CreateSocket(int Family, sockaddr_storage & Source, const std::string & Interface)
+    {
+        int one = 1;
+        unsigned short & port = Family == AF_INET6 ? port6 : port4;
+        SOCKET s = socket(Family, SOCK_DGRAM, IPPROTO_UDP);
+        if (s == INVALID_SOCKET)
+        {
+            printf("socket failed %d\n", MyGetLastError());
+            exit(-1);
+        }
+
+        if (Family == AF_INET6)
+        {
+            // Keep the families on separate sockets so replies are routed
+            // consistently regardless of the system's v4-mapped default.
+            setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<char*>(&one), sizeof(one));
+        }
+
+        if (!Interface.empty())
+        {
+#if defined(SO_BINDTODEVICE)
+            if (setsockopt(s, SOL_SOCKET, SO_BINDTODEVICE, Interface.c_str(), static_cast<socklen_t>(Interface.length())) == SOCKET_ERROR)
+            {
+                printf("setsockopt SO_BINDTODEVICE failed %d\n", MyGetLastError());
+                exit(-1);
+            }
+#else
+            printf("binding to an interface is not supported on this platform\n");
+            exit(-1);
+#endif
+        }
+
+#if defined(SO_REUSEPORT)
+        if (shards > 1 &&
+            setsockopt(s, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<char*>(&one), sizeof(one)) == SOCKET_ERROR)
+        {
+            printf("setsockopt SO_REUSEPORT failed %d\n", MyGetLastError());
+            exit(-1);
+        }
+#endif
+
+        // Bind to the source address (or the wildcard), sharing the port
+        // picked for the first shard of this family with the later shards.
+        sockaddr_storage local = Source;
+        socklen_t localLength;
+        local.ss_family = static_cast<decltype(local.ss_family)>(Family);
+        if (Family == AF_INET6)
+        {
+            reinterpret_cast<sockaddr_in6*>(&local)->sin6_port = port;
+            localLength = sizeof(sockaddr_in6);
+        }
+        else
+        {
+            reinterpret_cast<sockaddr_in*>(&local)->sin_port = port;
+            localLength = sizeof(sockaddr_in);
+        }
+        if (bind(s, reinterpret_cast<sockaddr*>(&local), localLength) == SOCKET_ERROR)
+        {
+            printf("bind failed %d\n", MyGetLastError());
+            exit(-1);
+        }
+
+        getsockname(s, reinterpret_cast<sockaddr*>(&local), &localLength);
+        unsigned short bound = Family == AF_INET6 ?
+            reinterpret_cast<sockaddr_in6*>(&local)->sin6_port :
+            reinterpret_cast<sockaddr_in*>(&local)->sin_port;
+        if (std::find(ports.begin(), ports.end(), bound) == ports.end())
+        {
+            ports.push_back(bound);
+        }
+#if defined(SO_REUSEPORT)
+        port = bound;
+#endif
+        return s;
+    }
+
+    size_t shards;
+    unsigned short port4 = 0;
+    unsigned short port6 = 0;
+    std::vector<SOCKET> sockets4;
+    std::vector<SOCKET> sockets6;
+    std::vector<unsigned short> ports;
+};
@@ -0,0 +1,987 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    ntpmonitor.cpp
+
+Abstract:
+
+    Native Linux counterpart of NtpMonitoringService. The servers to
+    monitor come from a configuration file instead of the registry; the
+    file is watched with inotify and reloaded (names resolved again) when it
+    changes, on SIGHUP and every -resolve seconds. Instead of a thread,
+    timer and socket per server, one worker per core owns a shard of NtpCli's
+    transport (sockets sharing one port through SO_REUSEPORT), polls its
+    share of the servers from a schedule and drains its sockets with poll().
+    Samples go to a dedicated writer thread through one lock free ring per
+    worker, and the writer produces the service's log format: one line per
+    sample, "IP,RDTSC_START,RDTSC_END,NTP_TIME,RTT_DELAY,ConfiguredName,IP,
+    ResolvedName", in files named BasePath/<instance>.yyyyMMddHHmm.csv that
+    roll over every hour, ready for RecordSplitter. A server named localhost
+    is sampled in process the way OsTimeSampler does.
+
+--*/
+
+#include "../../NtpCli/NtpCli/stdafx.h"
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "../../NtpCli/NtpCli/platform.h"
+#include "../../NtpCli/NtpCli/ntp.h"
+#include "../../NtpCli/NtpCli/transport.h"
+#include "../../OsTimeSampler/OsTimeSampler/platform.h"
+#include "CommandLine/CommandLine.h"
+#include "Ring/SpscRing.h"
+
+const unsigned long DefaultInterval = 5000;
+const unsigned long LocalInterval = 1000;
+
+// The configuration file: BasePath and LogPath as in the service's Config
+// key, then one "server <name>[:port] [interval ms]" line per server.
+struct Configuration
+{
+    std::string BasePath;
+    std::string LogPath;
+    std::vector<std::pair<std::string, unsigned long>> Servers;     // 0 for the default interval
+};
+
+bool ReadConfiguration(const std::string & FileName, Configuration & Config)
+{
+    FILE * file = fopen(FileName.c_str(), "r");
+    if (!file)
+    {
+        fprintf(stderr, "Unable to open %s: %s\n", FileName.c_str(), strerror(errno));
+        return false;
+    }
+
+    Config = Configuration();
+    char line[1024];
+    unsigned int number = 0;
+    bool valid = true;
+    while (fgets(line, sizeof(line), file))
+    {
+        number++;
+        char * comment = strchr(line, '#');
+        if (comment)
+        {
+            *comment = 0;
+        }
+        char key[64];
+        char value[960];
+        unsigned long interval = 0;
+        int fields = sscanf(line, "%63s %959s %lu", key, value, &interval);
+        if (fields <= 0)
+        {
+            continue;
+        }
+        std::string name = key;
+        for (auto & c : name)
+        {
+            c = tolower(c);
+        }
+        if (name == "basepath" && fields == 2)
+        {
+            Config.BasePath = value;
+        }
+        else if (name == "logpath" && fields == 2)
+        {
+            Config.LogPath = value;
+        }
+        else if (name == "server" && (fields == 2 || interval > 0))
+        {
+            Config.Servers.push_back(std::make_pair(std::string(value), interval));
+        }
+        else
+        {
+            fprintf(stderr, "%s:%u: expected basepath <dir>, logpath <dir> or server <name>[:port] [interval ms]\n", FileName.c_str(), number);
+            valid = false;
+        }
+    }
+    fclose(file);
+    return valid;
+}
+
+// One address to monitor. A name resolving to several addresses gives one
+// target each, and an address listed under several names is monitored once,
+// under the first, as the service keys its servers by IP.
+struct Target
+{
+    unsigned int Id;
+    bool Local;
+    unsigned long Interval;
+    sockaddr_storage Address;
+    socklen_t AddressLength;
+    std::string Prefix;         // IP, the first column
+    std::string Suffix;         // ConfiguredName,IP,ResolvedName
+};
+
+// Split "name", "name:port", "[v6]:port" or a bare v6 literal
+void SplitHostPort(const std::string & Name, std::string & Host, std::string & Port)
+{
+    Port = "123";
+    size_t colon = Name.rfind(':');
+    if (!Name.empty() && Name[0] == '[')
+    {
+        size_t close = Name.find(']');
+        Host = Name.substr(1, close == std::string::npos ? std::string::npos : close - 1);
+        if (close != std::string::npos && close + 1 < Name.length() && Name[close + 1] == ':')
+        {
+            Port = Name.substr(close + 2);
+        }
+    }
+    else if (colon != std::string::npos && Name.find(':') == colon)
+    {
+        Host = Name.substr(0, colon);
+        Port = Name.substr(colon + 1);
+    }
+    else
+    {
+        Host = Name;
+    }
+}
+
+struct Resolution
+{
+    std::string Name;
+    unsigned long Interval;
+    int Error;
+    std::vector<Target> Targets;
+};
+
+// Forward and reverse lookups of one configured name. The service keeps the
+// name the address resolves back to next to the configured one.
+void Resolve(Resolution & Entry, bool Reverse)
+{
+    std::string host;
+    std::string port;
+    SplitHostPort(Entry.Name, host, port);
+    Entry.Error = 0;
+
+    if (host == "localhost")
+    {
+        char self[256] = { 0 };
+        gethostname(self, sizeof(self) - 1);
+        Target target = {};
+        target.Local = true;
+        target.Interval = Entry.Interval ? Entry.Interval : LocalInterval;
+        target.Prefix = "127.0.0.1";
+        target.Suffix = Entry.Name + ",127.0.0.1," + self;
+        Entry.Targets.push_back(target);
+        return;
+    }
+
+    addrinfo hints = { 0 };
+    addrinfo * addr = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    Entry.Error = getaddrinfo(host.c_str(), port.c_str(), &hints, &addr);
+    if (Entry.Error != 0)
+    {
+        return;
+    }
+    for (addrinfo * a = addr; a != nullptr; a = a->ai_next)
+    {
+        char ip[INET6_ADDRSTRLEN] = { 0 };
+        char resolved[NI_MAXHOST] = { 0 };
+        getnameinfo(a->ai_addr, a->ai_addrlen, ip, sizeof(ip), nullptr, 0, NI_NUMERICHOST);
+        if (!Reverse || getnameinfo(a->ai_addr, a->ai_addrlen, resolved, sizeof(resolved), nullptr, 0, NI_NAMEREQD) != 0)
+        {
+            strncpy(resolved, host.c_str(), sizeof(resolved) - 1);
+        }
+
+        Target target = {};
+        target.Local = false;
+        target.Interval = Entry.Interval ? Entry.Interval : DefaultInterval;
+        memcpy(&target.Address, a->ai_addr, a->ai_addrlen);
+        target.AddressLength = static_cast<socklen_t>(a->ai_addrlen);
+        target.Prefix = ip;
+        target.Suffix = Entry.Name + "," + ip + "," + resolved;
+        Entry.Targets.push_back(target);
+    }
+    freeaddrinfo(addr);
+}
+
+// Resolve all names on a few threads, thousands of serial lookups would
+// hold a reload up for minutes.
+void ResolveAll(std::vector<Resolution> & Entries, bool Reverse)
+{
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    size_t count = std::min<size_t>(32, Entries.size());
+    for (size_t i = 0; i < count; i++)
+    {
+        threads.push_back(std::thread([&] {
+            for (size_t e = next++; e < Entries.size(); e = next++)
+            {
+                Resolve(Entries[e], Reverse);
+            }
+        }));
+    }
+    for (auto & t : threads)
+    {
+        t.join();
+    }
+}
+
+std::string FormatLocalTime(time_t Time, const char * Format)
+{
+    tm local;
+    char buffer[64];
+    localtime_r(&Time, &local);
+    strftime(buffer, sizeof(buffer), Format, &local);
+    return buffer;
+}
+
+// The current target list. The control thread publishes a new list with a
+// new generation; workers and the writer only take the lock to fetch it when
+// they see the generation change, never per poll or sample.
+class TargetList
+{
+public:
+    TargetList() :
+        generation(0)
+    {
+    }
+
+    void Publish(std::vector<Target> Targets)
+    {
+        auto list = std::make_shared<const std::vector<Target>>(std::move(Targets));
+        std::lock_guard<std::mutex> hold(lock);
+        current = list;
+        generation.fetch_add(1, std::memory_order_release);
+    }
+
+    unsigned long long Generation() const
+    {
+        return generation.load(std::memory_order_acquire);
+    }
+
+    std::shared_ptr<const std::vector<Target>> Current() const
+    {
+        std::lock_guard<std::mutex> hold(lock);
+        return current;
+    }
+
+private:
+    mutable std::mutex lock;
+    std::shared_ptr<const std::vector<Target>> current;
+    std::atomic<unsigned long long> generation;
+};
+
+// One exchange or local clock reading, in the columns of the log line:
+// RDTSC_START, RDTSC_END, NTP_TIME, RTT_DELAY for a server, TSC_START,
+// TSC_END, SYSTEM_TIME, FREQ, TICK, STATUS for localhost.
+struct Sample
+{
+    unsigned int Id;
+    bool Local;
+    long long Values[6];
+};
+
+std::atomic<bool> Stopping(false);
+std::atomic<bool> Hangup(false);
+
+void OnSignal(int Signal)
+{
+    if (Signal == SIGHUP)
+    {
+        Hangup = true;
+    }
+    else
+    {
+        Stopping = true;
+    }
+}
+
+long long NowMilliseconds()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Polls the targets whose Id falls in its shard and receives the replies
+// arriving on its shard's sockets, which may answer another shard's polls.
+class Worker
+{
+public:
+    Worker(size_t Index, size_t Count, Transport & Transport, ExchangeTable & Exchanges, TargetList & Targets) :
+        Ring(0x10000),
+        Dropped(0),
+        SendErrors(0),
+        index(Index),
+        count(Count),
+        transport(Transport),
+        exchanges(Exchanges),
+        targets(Targets),
+        seen(0)
+    {
+    }
+
+    void Run()
+    {
+        SetThreadAffinity(index % std::max(1u, std::thread::hardware_concurrency()));
+
+        std::vector<pollfd> fds;
+        for (int family : { AF_INET, AF_INET6 })
+        {
+            SOCKET s = transport.Socket(index, family);
+            if (s != INVALID_SOCKET)
+            {
+                int size = 4 << 20;
+                setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+                SetNonBlocking(s);
+                fds.push_back(pollfd{ s, POLLIN, 0 });
+            }
+        }
+
+        std::vector<unsigned char> buffer;
+        while (!Stopping)
+        {
+            if (targets.Generation() != seen)
+            {
+                Reload();
+            }
+
+            // Send the polls that are due; a schedule that fell behind by a
+            // whole interval restarts from now rather than bursting.
+            long long now = NowMilliseconds();
+            while (!schedule.empty() && schedule.top().first <= now)
+            {
+                Slot slot = schedule.top();
+                schedule.pop();
+                const Target & target = *mine[slot.second];
+                Poll(target, buffer);
+                long long next = slot.first + target.Interval;
+                schedule.push(Slot(next > now ? next : now + target.Interval, slot.second));
+            }
+
+            long long wait = schedule.empty() ? 100 : schedule.top().first - now;
+            wait = std::max(0ll, std::min(100ll, wait));
+            if (fds.empty())
+            {
+                SleepMilliseconds(static_cast<unsigned long>(wait));
+                continue;
+            }
+            if (poll(fds.data(), fds.size(), static_cast<int>(wait)) > 0)
+            {
+                for (auto & fd : fds)
+                {
+                    if (fd.revents & POLLIN)
+                    {
+                        Drain(fd.fd, buffer);
+                    }
+                }
+            }
+        }
+    }
+
+    SpscRing<Sample> Ring;
+    std::atomic<unsigned long long> Dropped;
+    std::atomic<unsigned long long> SendErrors;
+
+private:
+    typedef std::pair<long long, size_t> Slot;
+
+    // Take this shard's part of the new list, keeping the place in the
+    // schedule of the targets that stay. New ones start at an offset within
+    // their interval derived from the Id, so a list of thousands doesn't
+    // fire at once.
+    void Reload()
+    {
+        seen = targets.Generation();
+        std::shared_ptr<const std::vector<Target>> next = targets.Current();
+
+        std::unordered_map<unsigned int, long long> due;
+        while (!schedule.empty())
+        {
+            due[mine[schedule.top().second]->Id] = schedule.top().first;
+            schedule.pop();
+        }
+
+        mine.clear();
+        long long now = NowMilliseconds();
+        if (next)
+        {
+            for (const Target & target : *next)
+            {
+                if (target.Id % count != index)
+                {
+                    continue;
+                }
+                auto kept = due.find(target.Id);
+                long long start = kept != due.end() ?
+                    std::min(kept->second, now + static_cast<long long>(target.Interval)) :
+                    now + (target.Id * 2654435761ull) % target.Interval;
+                schedule.push(Slot(start, mine.size()));
+                mine.push_back(&target);
+            }
+        }
+        list = next;
+    }
+
+    void Poll(const Target & Target, std::vector<unsigned char> & Buffer)
+    {
+        Sample sample;
+        sample.Id = Target.Id;
+        sample.Local = Target.Local;
+        if (Target.Local)
+        {
+            timex tx = { 0 };
+            sample.Values[0] = __rdtsc();
+            sample.Values[2] = ReadSystemTime();
+            sample.Values[1] = __rdtsc();
+            adjtimex(&tx);
+            sample.Values[3] = tx.freq;
+            sample.Values[4] = tx.tick;
+            sample.Values[5] = tx.status;
+            if (!Ring.Push(sample))
+            {
+                Dropped++;
+            }
+            return;
+        }
+
+        SOCKET s = transport.Socket(index, Target.Address.ss_family);
+        if (s == INVALID_SOCKET)
+        {
+            SendErrors++;
+            return;
+        }
+        NtpPacket request{ 0 };
+        request.Version = 4;
+        request.Mode = 3;
+        unsigned long long cookie = exchanges.Begin(Target.Id);
+        request.Transmit = CookieToNtpTimeStamp(cookie);
+        Buffer.clear();
+        PushBack(Buffer, request);
+        exchanges.Stamp(cookie, ReadSystemTime(), __rdtsc());
+        if (sendto(s, (char*)Buffer.data(), static_cast<int>(Buffer.size()), 0, reinterpret_cast<const sockaddr*>(&Target.Address), Target.AddressLength) == SOCKET_ERROR)
+        {
+            SendErrors++;
+        }
+    }
+
+    // Read until the socket is empty, a sample per matched reply
+    void Drain(SOCKET Socket, std::vector<unsigned char> & Buffer)
+    {
+        for (;;)
+        {
+            Buffer.resize(NtpPacketSize * 2);
+            int received = recv(Socket, (char*)Buffer.data(), static_cast<int>(Buffer.size()), 0);
+            unsigned long long recvTsc = __rdtsc();
+            long long recvTime = ReadSystemTime();
+            if (received == SOCKET_ERROR)
+            {
+                return;
+            }
+            if (received < NtpPacketSize)
+            {
+                continue;
+            }
+
+            NtpPacket response{ 0 };
+            size_t offset = 0;
+            long long sendTime;
+            unsigned long long sendTsc;
+            size_t server;
+            Extract(Buffer, offset, response);
+            if (!exchanges.Complete(NtpTimeStampToCookie(response.Origin), sendTime, sendTsc, server))
+            {
+                continue;
+            }
+
+            // As NtpSampler: the server time halfway between its receive
+            // and transmit, and the round trip as the client saw it
+            Sample sample;
+            sample.Id = static_cast<unsigned int>(server);
+            sample.Local = false;
+            sample.Values[0] = static_cast<long long>(sendTsc);
+            sample.Values[1] = static_cast<long long>(recvTsc);
+            sample.Values[2] = NtpToFileTime(response.Receive) / 2 + NtpToFileTime(response.Transmit) / 2;
+            sample.Values[3] = recvTime - sendTime;
+            if (!Ring.Push(sample))
+            {
+                Dropped++;
+            }
+        }
+    }
+
+    size_t index;
+    size_t count;
+    Transport & transport;
+    ExchangeTable & exchanges;
+    TargetList & targets;
+    unsigned long long seen;
+    std::shared_ptr<const std::vector<Target>> list;
+    std::vector<const Target*> mine;
+    std::priority_queue<Slot, std::vector<Slot>, std::greater<Slot>> schedule;
+};
+
+// Formats the samples of all workers into the hourly log files. Lines are
+// batched per pass over the rings and flushed once per batch.
+class Writer
+{
+public:
+    Writer(const std::string & BaseFileName, std::vector<std::unique_ptr<Worker>> & Workers, TargetList & Targets) :
+        Lines(0),
+        baseFileName(BaseFileName),
+        workers(Workers),
+        targets(Targets),
+        seen(0),
+        file(nullptr),
+        hour(-1),
+        stop(false)
+    {
+    }
+
+    // Called once the workers have exited, so nothing is pushed after it
+    void Stop()
+    {
+        stop = true;
+    }
+
+    void Run()
+    {
+        std::string buffer;
+        for (;;)
+        {
+            // Read the stop flag before the pass, so the last pass after it
+            // is set finds everything the workers pushed before exiting
+            bool last = stop;
+            if (targets.Generation() != seen)
+            {
+                Reload();
+            }
+
+            for (auto & worker : workers)
+            {
+                Sample sample;
+                for (size_t n = 0; n < 4096 && worker->Ring.Pop(sample); n++)
+                {
+                    Format(sample, buffer);
+                }
+            }
+
+            if (!buffer.empty())
+            {
+                Rollover();
+                if (file)
+                {
+                    fwrite(buffer.data(), 1, buffer.size(), file);
+                    fflush(file);
+                }
+                buffer.clear();
+            }
+            else if (last)
+            {
+                break;
+            }
+            else
+            {
+                SleepMilliseconds(10);
+            }
+        }
+        if (file)
+        {
+            fclose(file);
+        }
+    }
+
+    std::atomic<unsigned long long> Lines;
+
+private:
+    void Reload()
+    {
+        seen = targets.Generation();
+        list = targets.Current();
+        labels.clear();
+        if (list)
+        {
+            for (const Target & target : *list)
+            {
+                labels[target.Id] = &target;
+            }
+        }
+    }
+
+    // Samples of a target dropped by a reload while in flight are discarded
+    void Format(const Sample & Sample, std::string & Buffer)
+    {
+        auto found = labels.find(Sample.Id);
+        if (found == labels.end())
+        {
+            return;
+        }
+        const Target & target = *found->second;
+        char line[160];
+        if (Sample.Local)
+        {
+            snprintf(line, sizeof(line), ",%lld, %lld, %lld, %ld, %ld, 0x%x,",
+                Sample.Values[0], Sample.Values[1], Sample.Values[2],
+                (long)Sample.Values[3], (long)Sample.Values[4], (unsigned int)Sample.Values[5]);
+        }
+        else
+        {
+            snprintf(line, sizeof(line), ",%llu,%llu,%llu,%llu,",
+                (unsigned long long)Sample.Values[0], (unsigned long long)Sample.Values[1],
+                (unsigned long long)Sample.Values[2], (unsigned long long)Sample.Values[3]);
+        }
+        Buffer += target.Prefix;
+        Buffer += line;
+        Buffer += target.Suffix;
+        Buffer += '\n';
+        Lines++;
+    }
+
+    // A new file when the hour changes, named after the minute it opened
+    void Rollover()
+    {
+        time_t now = time(nullptr);
+        tm local;
+        localtime_r(&now, &local);
+        if (file && local.tm_hour == hour)
+        {
+            return;
+        }
+        if (file)
+        {
+            fclose(file);
+        }
+        hour = local.tm_hour;
+        std::string name = baseFileName + FormatLocalTime(now, "%Y%m%d%H%M") + ".csv";
+        file = fopen(name.c_str(), "w");
+        if (file)
+        {
+            fprintf(stderr, "Writing to file: %s\n", name.c_str());
+        }
+        else
+        {
+            fprintf(stderr, "Unable to create %s: %s\n", name.c_str(), strerror(errno));
+        }
+    }
+
+    std::string baseFileName;
+    std::vector<std::unique_ptr<Worker>> & workers;
+    TargetList & targets;
+    unsigned long long seen;
+    std::shared_ptr<const std::vector<Target>> list;
+    std::unordered_map<unsigned int, const Target*> labels;
+    FILE * file;
+    int hour;
+    std::atomic<bool> stop;
+};
+
+// A random instance name, like the service's Guid, so several monitors can
+// share BasePath
+std::string InstanceName()
+{
+    std::random_device rd;
+    unsigned int words[4] = { rd(), rd(), rd(), rd() };
+    char name[40];
+    snprintf(name, sizeof(name), "%08x-%04x-4%03x-%04x-%04x%08x",
+        words[0], words[1] >> 16, words[1] & 0xfff, (words[2] >> 16 & 0x3fff) | 0x8000, words[2] & 0xffff, words[3]);
+    return name;
+}
+
+// Keeps the target list in step with the configuration file
+class Control
+{
+public:
+    Control(const std::string & ConfigFile, const std::string & Instance, bool Reverse, TargetList & Targets) :
+        configFile(ConfigFile),
+        instance(Instance),
+        reverse(Reverse),
+        targets(Targets),
+        nextId(0)
+    {
+    }
+
+    // Read and resolve the configuration and publish the targets. A file
+    // that fails to parse, or that leaves nothing to monitor where there was
+    // something, leaves the current list in place. The logs stay where they
+    // were opened until a restart.
+    bool Reload(Configuration & Config)
+    {
+        if (!ReadConfiguration(configFile, Config))
+        {
+            fprintf(stderr, "Configuration not reloaded\n");
+            return false;
+        }
+
+        std::vector<Resolution> entries;
+        for (auto & server : Config.Servers)
+        {
+            Resolution entry;
+            entry.Name = server.first;
+            entry.Interval = server.second;
+            entries.push_back(entry);
+        }
+        time_t start = time(nullptr);
+        ResolveAll(entries, reverse);
+        LogResolution(Config.LogPath, entries, start);
+
+        // Ids stay with a name and address across reloads, so workers keep
+        // the schedule and the writer the labels of in-flight exchanges
+        std::vector<Target> list;
+        std::unordered_set<std::string> listed;
+        size_t failed = 0;
+        for (auto & entry : entries)
+        {
+            failed += entry.Error != 0;
+            for (auto & target : entry.Targets)
+            {
+                std::string address = target.Local ? "localhost" : std::string(reinterpret_cast<char*>(&target.Address), target.AddressLength);
+                if (!listed.insert(address).second)
+                {
+                    continue;
+                }
+                std::string key = entry.Name + "," + target.Prefix;
+                auto id = ids.find(key);
+                if (id == ids.end())
+                {
+                    id = ids.insert(std::make_pair(key, nextId++)).first;
+                }
+                target.Id = id->second;
+                list.push_back(target);
+            }
+        }
+        auto current = targets.Current();
+        if (list.empty() && current && !current->empty())
+        {
+            fprintf(stderr, "No addresses to monitor, %zu servers, %zu not resolved; keeping the current %zu\n", entries.size(), failed, current->size());
+            return false;
+        }
+        if (basePath.empty())
+        {
+            basePath = Config.BasePath;
+        }
+        else if (!Config.BasePath.empty() && Config.BasePath != basePath)
+        {
+            fprintf(stderr, "basepath changed to %s, logs stay in %s until a restart\n", Config.BasePath.c_str(), basePath.c_str());
+        }
+        fprintf(stderr, "Monitoring %zu addresses of %zu servers, %zu not resolved\n", list.size(), entries.size(), failed);
+        targets.Publish(std::move(list));
+        return true;
+    }
+
+    // Watch the directory rather than the file, editors replace files by
+    // renaming over them. A file is read once written and closed, not when
+    // created, so a reload never sees it empty.
+    int Watch()
+    {
+        std::string directory = ".";
+        size_t slash = configFile.rfind('/');
+        if (slash != std::string::npos)
+        {
+            directory = slash == 0 ? "/" : configFile.substr(0, slash);
+        }
+        fileName = slash == std::string::npos ? configFile : configFile.substr(slash + 1);
+
+        int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0 || inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        {
+            fprintf(stderr, "Unable to watch %s: %s\n", directory.c_str(), strerror(errno));
+            exit(-1);
+        }
+        return fd;
+    }
+
+    // True if the pending events touch the configuration file
+    bool Changed(int Fd)
+    {
+        bool changed = false;
+        alignas(inotify_event) char events[4096];
+        ssize_t length;
+        while ((length = read(Fd, events, sizeof(events))) > 0)
+        {
+            for (char * p = events; p < events + length; )
+            {
+                inotify_event * event = reinterpret_cast<inotify_event*>(p);
+                if (event->len > 0 && fileName == event->name)
+                {
+                    changed = true;
+                }
+                p += sizeof(inotify_event) + event->len;
+            }
+        }
+        return changed;
+    }
+
+private:
+    void LogResolution(const std::string & LogPath, const std::vector<Resolution> & Entries, time_t Start)
+    {
+        if (LogPath.empty())
+        {
+            return;
+        }
+        std::string name = LogPath + "/" + instance + "." + FormatLocalTime(Start, "%Y%m%d%H") + ".resolver.csv";
+        FILE * log = fopen(name.c_str(), "a");
+        if (!log)
+        {
+            return;
+        }
+        fprintf(log, "Starting name resolution at %s\n", FormatLocalTime(Start, "%Y-%m-%d %H:%M:%S").c_str());
+        for (auto & entry : Entries)
+        {
+            fprintf(log, "%s,", entry.Name.c_str());
+            if (entry.Error != 0)
+            {
+                fprintf(log, "FAILED %d,%s", entry.Error, gai_strerror(entry.Error));
+            }
+            for (auto & target : entry.Targets)
+            {
+                fprintf(log, "%s,", target.Prefix.c_str());
+            }
+            fprintf(log, "\n");
+        }
+        fprintf(log, "Ending name resolution at %s\n", FormatLocalTime(time(nullptr), "%Y-%m-%d %H:%M:%S").c_str());
+        fclose(log);
+    }
+
+    std::string configFile;
+    std::string fileName;
+    std::string basePath;
+    std::string instance;
+    bool reverse;
+    TargetList & targets;
+    std::unordered_map<std::string, unsigned int> ids;
+    unsigned int nextId;
+};
+
+void Usage()
+{
+    printf("Usage: ntpmonitor -config <file> [-cores <n>] [-resolve <seconds>] [-reverse yes|no]\n");
+    printf("    -config    configuration file, reloaded when it changes or on SIGHUP:\n");
+    printf("                   basepath <dir>       where the hourly logs are written\n");
+    printf("                   logpath <dir>        optional, name resolution logs\n");
+    printf("                   server <name>[:port] [interval ms]\n");
+    printf("               one server line per server, polled every 5000 ms by default;\n");
+    printf("               localhost samples the local clock like OsTimeSampler, every 1000 ms\n");
+    printf("    -cores     workers, each with its own socket, default one per core\n");
+    printf("    -resolve   seconds between name resolutions, default 3600\n");
+    printf("    -reverse   look up the name of each address for the log, default yes\n");
+}
+
+int main(int argc, char ** argv)
+{
+    auto args = ParseCommandLine(argc, argv, 1);
+    if (args.find("config") == args.end())
+    {
+        Usage();
+        return -1;
+    }
+    std::string configFile = args["config"];
+    size_t cores = args.find("cores") != args.end() ? strtoul(args["cores"].c_str(), nullptr, 0) : std::thread::hardware_concurrency();
+    long long resolve = args.find("resolve") != args.end() ? strtoll(args["resolve"].c_str(), nullptr, 0) : 3600;
+    bool reverse = args.find("reverse") == args.end() || args["reverse"] != "no";
+    cores = std::max<size_t>(1, cores);
+
+    struct sigaction action = {};
+    action.sa_handler = OnSignal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    sigaction(SIGHUP, &action, nullptr);
+
+    std::string instance = InstanceName();
+    TargetList targets;
+    Control control(configFile, instance, reverse, targets);
+    Configuration config;
+    if (!control.Reload(config))
+    {
+        return -1;
+    }
+    if (config.BasePath.empty())
+    {
+        fprintf(stderr, "%s: basepath is required\n", configFile.c_str());
+        return -1;
+    }
+    int watch = control.Watch();
+
+    // The exchange table only has to outlast a reply timeout: a quarter
+    // million slots last 25 s at 10000 polls a second
+    SOCKET probe = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+    bool ipv6 = probe != INVALID_SOCKET;
+    if (ipv6)
+    {
+        MyCloseSocket(probe);
+    }
+    Transport transport(cores, true, ipv6, "", "");
+    ExchangeTable exchanges(0x40000);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (size_t i = 0; i < cores; i++)
+    {
+        workers.push_back(std::unique_ptr<Worker>(new Worker(i, cores, transport, exchanges, targets)));
+    }
+    Writer writer(config.BasePath + "/" + instance + ".", workers, targets);
+
+    std::vector<std::thread> threads;
+    for (auto & worker : workers)
+    {
+        Worker * w = worker.get();
+        threads.push_back(std::thread([w] { w->Run(); }));
+    }
+    std::thread writerThread([&writer] { writer.Run(); });
+
+    // Reload on changes to the file, on SIGHUP and when the names are due
+    // to be resolved again; report losses once a minute
+    long long resolved = NowMilliseconds();
+    long long reported = resolved;
+    while (!Stopping)
+    {
+        pollfd fd = { watch, POLLIN, 0 };
+        poll(&fd, 1, 1000);
+        long long now = NowMilliseconds();
+        bool changed = (fd.revents & POLLIN) && control.Changed(watch);
+        bool hangup = Hangup.exchange(false);
+        if (changed || hangup || (resolve > 0 && now - resolved >= resolve * 1000))
+        {
+            Configuration next;
+            if (changed)
+            {
+                fprintf(stderr, "%s changed\n", configFile.c_str());
+            }
+            control.Reload(next);
+            resolved = now;
+        }
+        if (now - reported >= 60000)
+        {
+            unsigned long long dropped = 0;
+            unsigned long long errors = 0;
+            for (auto & worker : workers)
+            {
+                dropped += worker->Dropped;
+                errors += worker->SendErrors;
+            }
+            fprintf(stderr, "%llu samples written, %llu dropped, %llu send errors\n", writer.Lines.load(), dropped, errors);
+            reported = now;
+        }
+    }
+
+    for (auto & t : threads)
+    {
+        t.join();
+    }
+    writer.Stop();
+    writerThread.join();
+    fprintf(stderr, "%llu samples written\n", writer.Lines.load());
+    return 0;
+}
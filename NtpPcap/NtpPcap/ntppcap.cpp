@@ -0,0 +1,760 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    ntppcap.cpp
+
+Abstract:
+
+    Reconstructs NTP exchanges from a pcap or pcapng capture and prints them
+    in the same record format as NtpCli, so a capture can be compared with
+    what NtpCli saw. The capture is memory mapped and split into chunks that
+    are decoded in parallel; requests and replies are then paired in
+    parallel by hashing each exchange to a partition.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../../NtpCli/NtpCli/ntp.h"
+#include "CommandLine/CommandLine.h"
+
+enum Form {
+    Short,
+    Long
+};
+
+// Link layer types from the tcpdump.org registry that NTP is commonly captured on
+enum LinkType {
+    LinkNull = 0,
+    LinkEthernet = 1,
+    LinkRaw = 101,
+    LinkLoop = 108,
+    LinkLinuxSll = 113,
+    LinkIpv4 = 228,
+    LinkIpv6 = 229,
+    LinkLinuxSll2 = 276,
+};
+
+struct Endpoint
+{
+    unsigned char Family;
+    unsigned char Address[16];
+    unsigned short Port;
+
+    bool operator==(const Endpoint & Other) const
+    {
+        return Family == Other.Family && Port == Other.Port && memcmp(Address, Other.Address, sizeof(Address)) == 0;
+    }
+};
+
+// One decoded NTP packet and the time it was captured (ns since 1970)
+struct CapturedPacket
+{
+    long long Time;
+    Endpoint Source;
+    Endpoint Destination;
+    NtpPacket Packet;
+};
+
+struct CapturedExchange
+{
+    long long SendTime;
+    long long RecvTime;
+    Endpoint Server;
+    NtpPacket Response;
+};
+
+// Capture time stamp resolution of an interface, as units per second
+struct Interface
+{
+    unsigned short LinkType;
+    unsigned long long UnitsPerSecond;
+    long long OffsetSeconds;
+};
+
+class Capture
+{
+public:
+    Capture(const unsigned char * Data, size_t Length) :
+        data(Data),
+        length(Length),
+        swap(false),
+        ng(false),
+        nanoseconds(false),
+        snapLength(0),
+        headerLength(0)
+    {
+    }
+
+    // Read the file header and, for pcapng, the leading section and
+    // interface blocks that describe the packets.
+    bool ParseHeader()
+    {
+        if (length < 24)
+        {
+            return false;
+        }
+        unsigned int magic = Read32(0);
+        switch (magic)
+        {
+        case 0xA1B2C3D4:
+        case 0xA1B23C4D:
+        case 0xD4C3B2A1:
+        case 0x4D3CB2A1:
+            swap = magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1;
+            nanoseconds = magic == 0xA1B23C4D || magic == 0x4D3CB2A1;
+            snapLength = Read32(16);
+            interfaces.push_back({ static_cast<unsigned short>(Read32(20) & 0xFFFF), nanoseconds ? 1000000000ull : 1000000ull, 0 });
+            headerLength = 24;
+            return true;
+        case 0x0A0D0D0A:
+            ng = true;
+            headerLength = 0;
+            while (headerLength < length)
+            {
+                unsigned int type = Read32(headerLength);
+                if (type != 0x0A0D0D0A && type != 1)
+                {
+                    break;
+                }
+                size_t blockLength;
+                if (!ParseNgMetadata(headerLength, blockLength))
+                {
+                    return false;
+                }
+                headerLength += blockLength;
+            }
+            return !interfaces.empty();
+        default:
+            return false;
+        }
+    }
+
+    // Find the first record boundary at or after Offset. A candidate is
+    // accepted once a chain of plausible records follows it.
+    size_t Synchronize(size_t Offset) const
+    {
+        if (Offset <= headerLength)
+        {
+            return headerLength;
+        }
+        if (ng)
+        {
+            Offset = (Offset + 3) & ~static_cast<size_t>(3);
+        }
+        for (; Offset < length; Offset += ng ? 4 : 1)
+        {
+            size_t next = Offset;
+            size_t chained = 0;
+            while (chained < 8 && next < length)
+            {
+                size_t recordLength = ng ? PlausibleNgBlock(next) : PlausibleRecord(next);
+                if (recordLength == 0)
+                {
+                    break;
+                }
+                next += recordLength;
+                chained++;
+            }
+            if (chained == 8 || (chained > 0 && next == length))
+            {
+                return Offset;
+            }
+        }
+        return length;
+    }
+
+    // Decode every record starting in [Start, End). Returns false if the
+    // range holds pcapng metadata that has to be processed in file order.
+    bool Decode(size_t Start, size_t End, bool Sequential, std::vector<CapturedPacket> & Packets, size_t & Frames)
+    {
+        size_t offset = Start;
+        Frames = 0;
+        while (offset < End && offset < length)
+        {
+            size_t recordLength;
+            if (!ng)
+            {
+                recordLength = PlausibleRecord(offset);
+                if (recordLength == 0)
+                {
+                    break;
+                }
+                unsigned long long sec = Read32(offset);
+                unsigned long long frac = Read32(offset + 4);
+                size_t captured = Read32(offset + 8);
+                long long time = static_cast<long long>(sec * 1000000000ull + (nanoseconds ? frac : frac * 1000));
+                DecodeFrame(interfaces[0].LinkType, data + offset + 16, captured, time, Packets);
+                Frames++;
+            }
+            else
+            {
+                if (offset + 12 > length)
+                {
+                    break;
+                }
+                unsigned int type = Read32(offset);
+                recordLength = Read32(offset + 4);
+                if (recordLength < 12 || offset + recordLength > length)
+                {
+                    break;
+                }
+                if (type == 0x0A0D0D0A || type == 1)
+                {
+                    if (!Sequential)
+                    {
+                        return false;
+                    }
+                    if (!ParseNgMetadata(offset, recordLength))
+                    {
+                        break;
+                    }
+                }
+                else if (type == 6 && recordLength >= 32)
+                {
+                    // Enhanced packet block
+                    unsigned int id = Read32(offset + 8);
+                    unsigned long long ts = (static_cast<unsigned long long>(Read32(offset + 12)) << 32) | Read32(offset + 16);
+                    size_t captured = Read32(offset + 20);
+                    if (id < interfaces.size() && 28 + captured <= recordLength)
+                    {
+                        const Interface & i = interfaces[id];
+                        long long time = static_cast<long long>(ts / i.UnitsPerSecond) * 1000000000ll +
+                            static_cast<long long>((ts % i.UnitsPerSecond) * 1000000000ull / i.UnitsPerSecond) +
+                            i.OffsetSeconds * 1000000000ll;
+                        DecodeFrame(i.LinkType, data + offset + 28, captured, time, Packets);
+                    }
+                    Frames++;
+                }
+            }
+            offset += recordLength;
+        }
+        return true;
+    }
+
+    size_t HeaderLength() const
+    {
+        return headerLength;
+    }
+
+private:
+    unsigned int Read32(size_t Offset) const
+    {
+        unsigned int v;
+        memcpy(&v, data + Offset, sizeof(v));
+        return swap ? __builtin_bswap32(v) : v;
+    }
+
+    unsigned short Read16(size_t Offset) const
+    {
+        unsigned short v;
+        memcpy(&v, data + Offset, sizeof(v));
+        return swap ? __builtin_bswap16(v) : v;
+    }
+
+    // Length of the pcap record at Offset, or 0 if it can't be one
+    size_t PlausibleRecord(size_t Offset) const
+    {
+        if (Offset + 16 > length)
+        {
+            return 0;
+        }
+        unsigned int frac = Read32(Offset + 4);
+        unsigned int captured = Read32(Offset + 8);
+        unsigned int original = Read32(Offset + 12);
+        unsigned int limit = snapLength != 0 ? snapLength : 0x40000;
+        if (frac >= (nanoseconds ? 1000000000u : 1000000u) ||
+            captured > limit ||
+            captured > original ||
+            Offset + 16 + captured > length)
+        {
+            return 0;
+        }
+        return 16 + captured;
+    }
+
+    // Length of the pcapng block at Offset, or 0 if it can't be one
+    size_t PlausibleNgBlock(size_t Offset) const
+    {
+        if (Offset + 12 > length)
+        {
+            return 0;
+        }
+        unsigned int type = Read32(Offset);
+        size_t blockLength = Read32(Offset + 4);
+        if ((type > 0xB && type != 0x0A0D0D0A) ||
+            blockLength < 12 ||
+            (blockLength & 3) != 0 ||
+            Offset + blockLength > length ||
+            Read32(Offset + blockLength - 4) != blockLength)
+        {
+            return 0;
+        }
+        return blockLength;
+    }
+
+    // Process a section header or interface description block
+    bool ParseNgMetadata(size_t Offset, size_t & BlockLength)
+    {
+        unsigned int type = Read32(Offset);
+        if (type == 0x0A0D0D0A)
+        {
+            unsigned int order;
+            memcpy(&order, data + Offset + 8, sizeof(order));
+            if (order == 0x1A2B3C4D)
+            {
+                swap = false;
+            }
+            else if (order == 0x4D3C2B1A)
+            {
+                swap = true;
+            }
+            else
+            {
+                return false;
+            }
+            // A new section starts a new set of interfaces
+            interfaces.clear();
+            BlockLength = Read32(Offset + 4);
+            return BlockLength >= 28 && Offset + BlockLength <= length;
+        }
+
+        BlockLength = Read32(Offset + 4);
+        if (BlockLength < 20 || Offset + BlockLength > length)
+        {
+            return false;
+        }
+        Interface i = { Read16(Offset + 8), 1000000ull, 0 };
+        size_t option = Offset + 16;
+        while (option + 4 <= Offset + BlockLength - 4)
+        {
+            unsigned short code = Read16(option);
+            unsigned short optionLength = Read16(option + 2);
+            if (code == 0)
+            {
+                break;
+            }
+            if (code == 9 && optionLength >= 1)
+            {
+                // if_tsresol: negative power of 10, or of 2 if the top bit is set
+                unsigned char resolution = data[option + 4];
+                unsigned long long units = 1;
+                for (unsigned int p = 0; p < (resolution & 0x7F) && units < (1ull << 62); p++)
+                {
+                    units *= (resolution & 0x80) ? 2 : 10;
+                }
+                i.UnitsPerSecond = units;
+            }
+            else if (code == 14 && optionLength >= 8)
+            {
+                // if_tsoffset: seconds to add to every time stamp
+                unsigned long long offset = (static_cast<unsigned long long>(Read32(option + 4)) << 32) | Read32(option + 8);
+                if (!swap)
+                {
+                    offset = (static_cast<unsigned long long>(Read32(option + 8)) << 32) | Read32(option + 4);
+                }
+                i.OffsetSeconds = static_cast<long long>(offset);
+            }
+            option += 4 + ((optionLength + 3) & ~3);
+        }
+        interfaces.push_back(i);
+        return true;
+    }
+
+    // Strip the link, network and transport headers and decode NTP payloads
+    static void DecodeFrame(unsigned short Link, const unsigned char * Frame, size_t Length, long long Time, std::vector<CapturedPacket> & Packets)
+    {
+        size_t offset = 0;
+        unsigned short etherType = 0;
+        switch (Link)
+        {
+        case LinkEthernet:
+            if (Length < 14)
+            {
+                return;
+            }
+            etherType = (Frame[12] << 8) | Frame[13];
+            offset = 14;
+            // Skip 802.1Q and 802.1ad tags
+            while ((etherType == 0x8100 || etherType == 0x88A8) && offset + 4 <= Length)
+            {
+                etherType = (Frame[offset + 2] << 8) | Frame[offset + 3];
+                offset += 4;
+            }
+            break;
+        case LinkLinuxSll:
+            if (Length < 16)
+            {
+                return;
+            }
+            etherType = (Frame[14] << 8) | Frame[15];
+            offset = 16;
+            break;
+        case LinkLinuxSll2:
+            if (Length < 20)
+            {
+                return;
+            }
+            etherType = (Frame[0] << 8) | Frame[1];
+            offset = 20;
+            break;
+        case LinkNull:
+        case LinkLoop:
+        case LinkRaw:
+        case LinkIpv4:
+        case LinkIpv6:
+            offset = (Link == LinkNull || Link == LinkLoop) ? 4 : 0;
+            if (offset >= Length)
+            {
+                return;
+            }
+            etherType = (Frame[offset] >> 4) == 6 ? 0x86DD : 0x0800;
+            break;
+        default:
+            return;
+        }
+
+        CapturedPacket p;
+        memset(&p.Source, 0, sizeof(p.Source));
+        memset(&p.Destination, 0, sizeof(p.Destination));
+        const unsigned char * net = Frame + offset;
+        size_t remaining = Length - offset;
+        size_t udp;
+        if (etherType == 0x0800)
+        {
+            if (remaining < 20 || (net[0] >> 4) != 4 || net[9] != 17)
+            {
+                return;
+            }
+            // Only the first fragment carries the UDP header
+            if (((net[6] << 8) | net[7]) & 0x1FFF)
+            {
+                return;
+            }
+            p.Source.Family = p.Destination.Family = 4;
+            memcpy(p.Source.Address, net + 12, 4);
+            memcpy(p.Destination.Address, net + 16, 4);
+            udp = (net[0] & 0xF) * 4;
+        }
+        else if (etherType == 0x86DD)
+        {
+            if (remaining < 40 || (net[0] >> 4) != 6 || net[6] != 17)
+            {
+                return;
+            }
+            p.Source.Family = p.Destination.Family = 6;
+            memcpy(p.Source.Address, net + 8, 16);
+            memcpy(p.Destination.Address, net + 24, 16);
+            udp = 40;
+        }
+        else
+        {
+            return;
+        }
+
+        if (udp + 8 + NtpPacketSize > remaining)
+        {
+            return;
+        }
+        p.Source.Port = (net[udp] << 8) | net[udp + 1];
+        p.Destination.Port = (net[udp + 2] << 8) | net[udp + 3];
+        if (p.Source.Port != 123 && p.Destination.Port != 123)
+        {
+            return;
+        }
+
+        static thread_local std::vector<unsigned char> buffer(NtpPacketSize);
+        size_t extractOffset = 0;
+        buffer.assign(net + udp + 8, net + udp + 8 + NtpPacketSize);
+        Extract(buffer, extractOffset, p.Packet);
+        p.Time = Time;
+        Packets.push_back(p);
+    }
+
+    const unsigned char * data;
+    size_t length;
+    bool swap;
+    bool ng;
+    bool nanoseconds;
+    unsigned int snapLength;
+    size_t headerLength;
+    std::vector<Interface> interfaces;
+};
+
+// Key identifying an exchange: the client, the server and the client's
+// transmit time stamp, which the server echoes as the origin.
+struct ExchangeKey
+{
+    Endpoint Client;
+    Endpoint Server;
+    unsigned long long Cookie;
+
+    bool operator==(const ExchangeKey & Other) const
+    {
+        return Cookie == Other.Cookie && Client == Other.Client && Server == Other.Server;
+    }
+};
+
+struct ExchangeKeyHash
+{
+    size_t operator()(const ExchangeKey & Key) const
+    {
+        // FNV-1a over the fields that identify the exchange
+        unsigned long long h = 14695981039346656037ull;
+        auto mix = [&h](const void * p, size_t n) {
+            const unsigned char * b = static_cast<const unsigned char *>(p);
+            for (size_t i = 0; i < n; i++)
+            {
+                h = (h ^ b[i]) * 1099511628211ull;
+            }
+        };
+        mix(Key.Client.Address, sizeof(Key.Client.Address));
+        mix(&Key.Client.Port, sizeof(Key.Client.Port));
+        mix(Key.Server.Address, sizeof(Key.Server.Address));
+        mix(&Key.Cookie, sizeof(Key.Cookie));
+        return static_cast<size_t>(h);
+    }
+};
+
+bool KeyOf(const CapturedPacket & p, ExchangeKey & Key)
+{
+    NtpTimeStamp ts;
+    if (p.Packet.Mode == 3)
+    {
+        Key.Client = p.Source;
+        Key.Server = p.Destination;
+        ts = p.Packet.Transmit;
+    }
+    else if (p.Packet.Mode == 4)
+    {
+        Key.Client = p.Destination;
+        Key.Server = p.Source;
+        ts = p.Packet.Origin;
+    }
+    else
+    {
+        return false;
+    }
+    Key.Cookie = (static_cast<unsigned long long>(ts.Seconds & 0xFFFFFFFF) << 32) | (ts.Fraction & 0xFFFFFFFF);
+    return true;
+}
+
+// Pair requests with replies for the exchanges that hash to Partition
+void PairExchanges(const std::vector<std::vector<CapturedPacket>> & Chunks, size_t Partition, size_t Partitions, std::vector<CapturedExchange> & Exchanges)
+{
+    std::unordered_map<ExchangeKey, long long, ExchangeKeyHash> pending;
+    ExchangeKeyHash hash;
+    for (auto & chunk : Chunks)
+    {
+        for (auto & p : chunk)
+        {
+            ExchangeKey key;
+            if (!KeyOf(p, key) || hash(key) % Partitions != Partition)
+            {
+                continue;
+            }
+            if (p.Packet.Mode == 3)
+            {
+                pending[key] = p.Time;
+                continue;
+            }
+            auto request = pending.find(key);
+            if (request == pending.end())
+            {
+                continue;
+            }
+            Exchanges.push_back({ request->second, p.Time, p.Source, p.Packet });
+            pending.erase(request);
+        }
+    }
+}
+
+void PrintExchange(FILE * Output, const CapturedExchange & e, Form Form)
+{
+    const NtpPacket & response = e.Response;
+    NtpTimeStamp receive = response.Receive;
+    NtpTimeStamp transmit = response.Transmit;
+    char ip[INET6_ADDRSTRLEN] = { 0 };
+    char reference[128] = { 0 };
+
+    switch (Form)
+    {
+    case Short:
+        fprintf(Output, "%llu,%lld,%lld\n",
+            e.SendTime,
+            e.RecvTime,
+            NtpTimeStampToFileTime(transmit) / 2 + NtpTimeStampToFileTime(receive) / 2
+        );
+        break;
+    case Long:
+        inet_ntop(e.Server.Family == 6 ? AF_INET6 : AF_INET, e.Server.Address, ip, sizeof(ip));
+        // If this is a straum 1 clock, print the refid as text
+        if (response.Stratum == 1)
+        {
+            memcpy(reference, response.ReferenceId, 4);
+        }
+        else
+        {
+            inet_ntop(AF_INET, &response.ReferenceId, reference, sizeof(reference));
+        }
+        fprintf(Output, "%s,%llu,%llu,%lu,%lu,%lu,%ld,%ld,0.%.6lu,0.%.6lu,%s,%lld,%lld\n",
+            ip,
+            e.SendTime,
+            e.RecvTime,
+            (unsigned long)response.LeapIndicator,
+            (unsigned long)response.Version,
+            (unsigned long)response.Stratum,
+            (unsigned long)response.Poll,
+            (long)response.Precision,
+            NtpShortFormToNanoSecond(response.RootDelay) / 1000,
+            NtpShortFormToNanoSecond(response.RootDispersion) / 1000,
+            reference,
+            NtpTimeStampToFileTime(receive),
+            NtpTimeStampToFileTime(transmit)
+        );
+        break;
+    }
+}
+
+int main(int argc, char ** argv)
+{
+    Form form = Short;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+
+    std::map<std::string, std::string> args = ParseCommandLine(argc, argv);
+    if (args.find("file") == args.end())
+    {
+        printf("usage: %s -file <capture.pcap/pcapng> [-form <short/long>] [-threads <count>]\n", argv[0]);
+        exit(-1);
+    }
+    if (args.find("form") != args.end() && args["form"] == "long")
+    {
+        form = Long;
+    }
+    if (args.find("threads") != args.end())
+    {
+        threads = std::max(1, atoi(args["threads"].c_str()));
+    }
+
+    int fd = open(args["file"].c_str(), O_RDONLY);
+    if (fd == -1)
+    {
+        printf("open failed %d\n", errno);
+        exit(-1);
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0)
+    {
+        printf("fstat failed %d\n", errno);
+        exit(-1);
+    }
+    size_t length = static_cast<size_t>(st.st_size);
+    const unsigned char * data = static_cast<const unsigned char *>(mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0));
+    if (data == MAP_FAILED)
+    {
+        printf("mmap failed %d\n", errno);
+        exit(-1);
+    }
+    madvise(const_cast<unsigned char *>(data), length, MADV_SEQUENTIAL);
+
+    Capture capture(data, length);
+    if (!capture.ParseHeader())
+    {
+        printf("%s is not a pcap or pcapng file\n", args["file"].c_str());
+        exit(-1);
+    }
+
+    // Split the file into one chunk per thread, each starting at the first
+    // record boundary after its nominal offset.
+    std::vector<size_t> bounds(threads + 1);
+    for (size_t i = 0; i <= threads; i++)
+    {
+        bounds[i] = i == threads ? length : capture.Synchronize(capture.HeaderLength() + (length - capture.HeaderLength()) * i / threads);
+    }
+
+    std::vector<std::vector<CapturedPacket>> chunks(threads);
+    std::vector<size_t> frames(threads);
+    std::vector<char> complete(threads);
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < threads; i++)
+    {
+        workers.push_back(std::thread([&, i] {
+            Capture local = capture;
+            complete[i] = local.Decode(bounds[i], bounds[i + 1], false, chunks[i], frames[i]);
+        }));
+    }
+    for (auto & w : workers)
+    {
+        w.join();
+    }
+    workers.clear();
+
+    // Interface or section blocks in the middle of a pcapng file change how
+    // later packets are read, so such files are decoded in order instead.
+    if (std::find(complete.begin(), complete.end(), 0) != complete.end())
+    {
+        chunks.assign(1, std::vector<CapturedPacket>());
+        frames.assign(1, 0);
+        capture.Decode(capture.HeaderLength(), length, true, chunks[0], frames[0]);
+    }
+
+    std::vector<std::vector<CapturedExchange>> partitions(threads);
+    for (size_t i = 0; i < threads; i++)
+    {
+        workers.push_back(std::thread([&, i] {
+            PairExchanges(chunks, i, threads, partitions[i]);
+        }));
+    }
+    for (auto & w : workers)
+    {
+        w.join();
+    }
+
+    std::vector<CapturedExchange> exchanges;
+    size_t ntpPackets = 0;
+    size_t totalFrames = 0;
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        ntpPackets += chunks[i].size();
+        totalFrames += frames[i];
+    }
+    for (auto & p : partitions)
+    {
+        exchanges.insert(exchanges.end(), p.begin(), p.end());
+    }
+    std::sort(exchanges.begin(), exchanges.end(), [](const CapturedExchange & a, const CapturedExchange & b) {
+        return a.SendTime < b.SendTime;
+    });
+
+    static char outputBuffer[1 << 20];
+    setvbuf(stdout, outputBuffer, _IOFBF, sizeof(outputBuffer));
+    if (form == Long)
+    {
+        printf("ip,recvTime,LeapIndicator,Version,Stratum,Poll,Precision,RootDelay,RootDispersion,Reference,ReceiveTx,TransmitTx\n");
+    }
+    for (auto & e : exchanges)
+    {
+        PrintExchange(stdout, e, form);
+    }
+    fflush(stdout);
+
+    fprintf(stderr, "%zu frames, %zu NTP packets, %zu exchanges\n", totalFrames, ntpPackets, exchanges.size());
+    return 0;
+}
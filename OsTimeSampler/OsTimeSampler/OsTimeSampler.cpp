@@ -7,7 +7,7 @@ Module Name:
     TimeSampler.c
 
 Abstract:
-    
+
     This module captures the system time and the current RDTSC at configured intervals.
 
 Author:
@@ -18,39 +18,258 @@ Author:
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <windows.h>
+#include <string.h>
+#include <vector>
+#include "platform.h"
+#include "CpuInfo/CpuInfo.h"
+#include "TscCalibration/TscCalibration.h"
+
+enum Serialization {
+    NoSerialization,
+    LfenceSerialization,
+    RdtscpSerialization
+};
+
+// One TSC / system time / TSC bracket. The narrower the TSC window, the
+// less uncertainty about when the system time was actually read.
+struct Bracket
+{
+    TTsc TscStart;
+    TTsc TscEnd;
+    long long SystemTime;
+};
+
+// Take a bracket, optionally fencing the TSC reads so they can't be
+// reordered around the system time read.
+template<Serialization S>
+inline Bracket TakeBracket()
+{
+    Bracket b;
+    unsigned int aux;
+    switch (S)
+    {
+    case NoSerialization:
+        b.TscStart = __rdtsc();
+        b.SystemTime = ReadSystemTime();
+        b.TscEnd = __rdtsc();
+        break;
+    case LfenceSerialization:
+        _mm_lfence();
+        b.TscStart = __rdtsc();
+        _mm_lfence();
+        b.SystemTime = ReadSystemTime();
+        _mm_lfence();
+        b.TscEnd = __rdtsc();
+        _mm_lfence();
+        break;
+    case RdtscpSerialization:
+        b.TscStart = __rdtscp(&aux);
+        _mm_lfence();
+        b.SystemTime = ReadSystemTime();
+        b.TscEnd = __rdtscp(&aux);
+        _mm_lfence();
+        break;
+    }
+    return b;
+}
+
+// Distribution of bracket widths in TSC ticks. Widths below LinearLimit are
+// counted exactly, larger ones in power of two buckets, so long runs don't
+// need to keep every sample.
+class WindowHistogram
+{
+public:
+    WindowHistogram() :
+        linear(LinearLimit),
+        log2(64),
+        count(0),
+        max(0)
+    {
+    }
+
+    void Add(TTsc Width)
+    {
+        if (Width < LinearLimit)
+        {
+            linear[static_cast<size_t>(Width)]++;
+        }
+        else
+        {
+            size_t bucket = 0;
+            while ((Width >> bucket) > 1)
+            {
+                bucket++;
+            }
+            log2[bucket]++;
+        }
+        max = Width > max ? Width : max;
+        count++;
+    }
+
+    // Width at or below which Fraction of the samples fall
+    TTsc Percentile(double Fraction) const
+    {
+        unsigned long long target = static_cast<unsigned long long>(Fraction * (count - 1)) + 1;
+        unsigned long long seen = 0;
+        for (size_t i = 0; i < linear.size(); i++)
+        {
+            seen += linear[i];
+            if (seen >= target)
+            {
+                return i;
+            }
+        }
+        for (size_t i = 0; i < log2.size(); i++)
+        {
+            seen += log2[i];
+            if (seen >= target)
+            {
+                // Upper bound of the bucket
+                return (2ull << i) - 1 < max ? (2ull << i) - 1 : max;
+            }
+        }
+        return max;
+    }
+
+    void Print(FILE * Output, const char * Name) const
+    {
+        if (count == 0)
+        {
+            return;
+        }
+        fprintf(Output, "%s\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\n",
+            Name,
+            count,
+            Percentile(0),
+            Percentile(0.5),
+            Percentile(0.9),
+            Percentile(0.99),
+            max);
+    }
+
+private:
+    static const size_t LinearLimit = 1 << 16;
+    std::vector<unsigned long long> linear;
+    std::vector<unsigned long long> log2;
+    unsigned long long count;
+    TTsc max;
+};
+
+// Take Burst brackets back to back and keep the narrowest one. An interrupt
+// or VM exit inside a bracket only widens that bracket, so the minimum is
+// almost always an undisturbed read.
+template<Serialization S>
+Bracket TakeBestBracket(size_t Burst, WindowHistogram & All)
+{
+    Bracket best = TakeBracket<S>();
+    All.Add(best.TscEnd - best.TscStart);
+    for (size_t i = 1; i < Burst; i++)
+    {
+        Bracket b = TakeBracket<S>();
+        All.Add(b.TscEnd - b.TscStart);
+        if (b.TscEnd - b.TscStart < best.TscEnd - best.TscStart)
+        {
+            best = b;
+        }
+    }
+    return best;
+}
 
 int main(int argc, char ** argv)
 {
-    DWORD64 tscStart;
-    DWORD64 tscEnd;
-    FILETIME ft;
     size_t interations;
-    DWORD interval;
+    double interval;
+    size_t burst = 1;
+    Serialization serialization = NoSerialization;
+    WindowHistogram allWindows;
+    WindowHistogram keptWindows;
 
-    if (argc != 3) {
-        printf("Usage: %s interval count\n", argv[0]);
+    if (argc < 3 || argc > 5) {
+        printf("Usage: %s interval count [burst [none|lfence|rdtscp|auto]]\n", argv[0]);
+        printf("interval is in milliseconds and may be fractional, e.g. 0.1 for 10kHz\n");
+        printf("burst takes that many samples per interval and keeps the narrowest TSC window\n");
         return -1;
     }
 
-    printf("TSC_START, TSC_END, SYSTEM_TIME, TIME_ADJ, TIME_INC, TIME_ADJ_ACTIVE\n");
-    interval = atoi(argv[1]);
-    interations = atoi(argv[2]);
+    interval = atof(argv[1]);
+    interations = strtoull(argv[2], nullptr, 10);
+    if (argc > 3)
+    {
+        burst = strtoull(argv[3], nullptr, 10);
+        burst = burst == 0 ? 1 : burst;
+    }
+    if (argc > 4)
+    {
+        if (strcmp(argv[4], "auto") == 0)
+        {
+            // rdtscp orders the read without a separate fence where it exists
+            serialization = InstructionSet::RDTSCP() ? RdtscpSerialization : LfenceSerialization;
+        }
+        else if (strcmp(argv[4], "lfence") == 0)
+        {
+            serialization = LfenceSerialization;
+        }
+        else if (strcmp(argv[4], "rdtscp") == 0)
+        {
+            serialization = RdtscpSerialization;
+        }
+        else if (strcmp(argv[4], "none") != 0)
+        {
+            printf("Unknown serialization %s\n", argv[4]);
+            return -1;
+        }
+    }
+    printf(SAMPLE_HEADER);
+
+    TscFrequency calibration = TscCalibration::Calibrate();
+    double tscFrequency = calibration.Frequency;
+    fprintf(stderr, "TSC frequency %.0f Hz +/- %.0f Hz (%s, %.1fms)\n",
+        calibration.Frequency, calibration.Uncertainty, calibration.Source, calibration.Milliseconds);
+    TTsc intervalTicks = static_cast<TTsc>(interval * tscFrequency / 1000);
+    SampleWriter writer(tscFrequency);
 
+    // Deadlines advance by whole intervals from a fixed start, so the
+    // sampling rate doesn't drift with the time spent taking each sample.
+    TTsc deadline = __rdtsc() + intervalTicks;
     for (size_t i = 0; i < interations; i++) {
-        DWORD timeAdjustment = 0;
-        DWORD timeIncrement = 0;
-        BOOL timeAdjEnabled = FALSE;
-        Sleep(interval);
-        tscStart = __rdtsc();
-        GetSystemTimePreciseAsFileTime(&ft);
-        tscEnd = __rdtsc();
-        GetSystemTimeAdjustment(&timeAdjustment, &timeIncrement, &timeAdjEnabled);
+        Bracket sample;
+        WaitForTsc(deadline, tscFrequency);
+        switch (serialization)
+        {
+        case NoSerialization:
+            sample = TakeBestBracket<NoSerialization>(burst, allWindows);
+            break;
+        case LfenceSerialization:
+            sample = TakeBestBracket<LfenceSerialization>(burst, allWindows);
+            break;
+        case RdtscpSerialization:
+            sample = TakeBestBracket<RdtscpSerialization>(burst, allWindows);
+            break;
+        }
+        keptWindows.Add(sample.TscEnd - sample.TscStart);
+        char * line = writer.Reserve();
+        size_t length = snprintf(line, SampleWriter::MaxLine, "%llu, %llu, %lld", sample.TscStart, sample.TscEnd, sample.SystemTime);
+        length += FormatTimeAdjustment(line + length, SampleWriter::MaxLine - length - 1);
+        line[length++] = '\n';
+        writer.Commit(length, sample.TscEnd);
 
-        printf("%lld, %lld, %lld, %d, %d, %s\n", tscStart, tscEnd, *(DWORD64*)&ft, timeAdjustment, timeIncrement, !timeAdjEnabled ? "true" : "false");
-		fflush(NULL);
+        deadline += intervalTicks;
+        if (sample.TscEnd > deadline + intervalTicks)
+        {
+            // Fell more than an interval behind, e.g. after being descheduled
+            deadline = sample.TscEnd + intervalTicks;
+        }
+    }
+    writer.Flush();
+
+    // Window width distribution in TSC ticks, on stderr so the samples on
+    // stdout stay a plain CSV
+    if (burst > 1)
+    {
+        fprintf(stderr, "Window\tSamples\tMin\tP50\tP90\tP99\tMax\n");
+        allWindows.Print(stderr, "All");
+        keptWindows.Print(stderr, "Kept");
     }
 
     return 0;
 }
-
@@ -0,0 +1,145 @@
+#pragma once
+// Platform specific clock access for OsTimeSampler, and the TSC paced wait
+// and buffered writer the samplers share. SYSTEM_TIME is always reported in
+// FILETIME units (100ns since 1601) so host and guest samples from either
+// OS can be fed to TimeSampleCorrelation unchanged.
+
+#include <stdio.h>
+
+#if defined(_MSC_VER)
+#include <windows.h>
+#include <intrin.h>
+
+#define SAMPLE_HEADER "TSC_START, TSC_END, SYSTEM_TIME, TIME_ADJ, TIME_INC, TIME_ADJ_ACTIVE\n"
+
+inline long long ReadSystemTime()
+{
+    FILETIME ft;
+    GetSystemTimePreciseAsFileTime(&ft);
+    return *(long long*)&ft;
+}
+
+// Append the system time adjustment columns to a sample line
+inline int FormatTimeAdjustment(char * Buffer, size_t Length)
+{
+    DWORD timeAdjustment = 0;
+    DWORD timeIncrement = 0;
+    BOOL timeAdjEnabled = FALSE;
+    GetSystemTimeAdjustment(&timeAdjustment, &timeIncrement, &timeAdjEnabled);
+    return _snprintf_s(Buffer, Length, _TRUNCATE, ", %d, %d, %s", timeAdjustment, timeIncrement, !timeAdjEnabled ? "true" : "false");
+}
+
+inline void SleepMilliseconds(unsigned long Milliseconds)
+{
+    Sleep(Milliseconds);
+}
+#else
+#include <time.h>
+#include <sys/timex.h>
+#include <x86intrin.h>
+
+#define SAMPLE_HEADER "TSC_START, TSC_END, SYSTEM_TIME, FREQ, TICK, STATUS\n"
+
+// CLOCK_REALTIME in ns since 1970, as the kernel reports it in cross
+// timestamps, in FILETIME units
+inline long long RealtimeToSystemTime(long long Ns)
+{
+    return Ns / 100 + 116444736000000000ll;
+}
+
+inline long long ReadSystemTime()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return RealtimeToSystemTime(static_cast<long long>(ts.tv_sec) * 1000000000ll + ts.tv_nsec);
+}
+
+// Append the kernel clock discipline state from adjtimex: the frequency
+// offset (ppm with a 16 bit fraction), the tick length in us and the
+// STA_* status bits.
+inline int FormatTimeAdjustment(char * Buffer, size_t Length)
+{
+    timex tx = { 0 };
+    adjtimex(&tx);
+    return snprintf(Buffer, Length, ", %ld, %ld, 0x%x", (long)tx.freq, (long)tx.tick, (unsigned int)tx.status);
+}
+
+inline void SleepMilliseconds(unsigned long Milliseconds)
+{
+    timespec ts = { static_cast<time_t>(Milliseconds / 1000), static_cast<long>(Milliseconds % 1000) * 1000000l };
+    nanosleep(&ts, nullptr);
+}
+#endif
+
+typedef unsigned long long TTsc;
+
+// Wait until the TSC reaches Deadline. Long waits sleep until shortly before
+// the deadline and the remainder is spun, so the sample is taken on time
+// without burning a core for the whole interval.
+inline void WaitForTsc(TTsc Deadline, double TscFrequency)
+{
+    const TTsc spinTicks = static_cast<TTsc>(TscFrequency * 0.002);
+    TTsc now = __rdtsc();
+    if (now + spinTicks < Deadline)
+    {
+        SleepMilliseconds(static_cast<unsigned long>((Deadline - now - spinTicks) * 1000 / TscFrequency));
+    }
+    while (__rdtsc() < Deadline)
+    {
+    }
+}
+
+// Collects sample lines in memory and writes them out in large blocks.
+// The block is also written once it holds data older than a second, so a
+// slow sampler still feeds a pipe reader such as the monitoring service
+// promptly. A line is formatted into the MaxLine bytes Reserve returns and
+// added by Commit.
+class SampleWriter
+{
+public:
+    static const size_t MaxLine = 256;
+
+    SampleWriter(double TscFrequency) :
+        used(0),
+        flushTicks(static_cast<TTsc>(TscFrequency)),
+        lastFlush(__rdtsc())
+    {
+    }
+
+    ~SampleWriter()
+    {
+        Flush();
+    }
+
+    char * Reserve()
+    {
+        if (sizeof(buffer) - used < MaxLine)
+        {
+            Flush();
+        }
+        return buffer + used;
+    }
+
+    void Commit(size_t Length, TTsc TscEnd)
+    {
+        used += Length;
+        if (TscEnd - lastFlush > flushTicks)
+        {
+            Flush();
+        }
+    }
+
+    void Flush()
+    {
+        fwrite(buffer, 1, used, stdout);
+        fflush(stdout);
+        used = 0;
+        lastFlush = __rdtsc();
+    }
+
+private:
+    char buffer[1 << 16];
+    size_t used;
+    TTsc flushTicks;
+    TTsc lastFlush;
+};
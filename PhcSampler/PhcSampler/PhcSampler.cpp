@@ -0,0 +1,452 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    PhcSampler.cpp
+
+Abstract:
+
+    This module captures cross timestamps between a PTP hardware clock and the
+    system clock at configured intervals, bracketed by RDTSC. In a KVM guest the
+    ptp_kvm device exposes the host's clock, so the samples relate guest and
+    host time directly instead of going through the network.
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/ptp_clock.h>
+#include <x86intrin.h>
+#include "TscCalibration/TscCalibration.h"
+#include "../../OsTimeSampler/OsTimeSampler/platform.h"
+
+// The kernel reports cross timestamps in ns since the Unix epoch
+inline long long PtpToNs(const ptp_clock_time & Time)
+{
+    return static_cast<long long>(Time.sec) * 1000000000ll + Time.nsec;
+}
+
+inline ptp_clock_time NsToPtp(long long Time)
+{
+    ptp_clock_time t = { 0 };
+    t.sec = Time / 1000000000ll;
+    t.nsec = static_cast<unsigned int>(Time % 1000000000ll);
+    return t;
+}
+
+inline long long ReadClock(clockid_t Clock)
+{
+    timespec ts;
+    clock_gettime(Clock, &ts);
+    return static_cast<long long>(ts.tv_sec) * 1000000000ll + ts.tv_nsec;
+}
+
+enum Method {
+    PreciseMethod,
+    ExtendedMethod,
+    BasicMethod
+};
+
+// Cross timestamp between the PHC and CLOCK_REALTIME. For the precise method
+// the device latches both clocks at the same instant and SystemWindow is 0;
+// otherwise it is the width of the system time reads around the PHC read.
+struct CrossTimestamp
+{
+    long long PhcTime;
+    long long SystemTime;
+    long long SystemWindow;
+};
+
+// Access to the PTP_SYS_OFFSET* ioctls. Samples is the number of readings
+// requested from the extended and basic methods; the one with the narrowest
+// system time window is returned.
+class PhcDevice
+{
+public:
+    virtual ~PhcDevice()
+    {
+    }
+
+    virtual int Ioctl(unsigned long Request, void * Argument) = 0;
+
+    bool Read(Method Mode, unsigned int Samples, CrossTimestamp & Sample)
+    {
+        switch (Mode)
+        {
+        case PreciseMethod:
+        {
+            ptp_sys_offset_precise precise = { 0 };
+            if (Ioctl(PTP_SYS_OFFSET_PRECISE, &precise) != 0)
+            {
+                return false;
+            }
+            Sample.PhcTime = PtpToNs(precise.device);
+            Sample.SystemTime = PtpToNs(precise.sys_realtime);
+            Sample.SystemWindow = 0;
+            return true;
+        }
+        case ExtendedMethod:
+        {
+            ptp_sys_offset_extended extended = { 0 };
+            extended.n_samples = Samples;
+            if (Ioctl(PTP_SYS_OFFSET_EXTENDED, &extended) != 0)
+            {
+                return false;
+            }
+            Sample.SystemWindow = -1;
+            for (unsigned int i = 0; i < extended.n_samples; i++)
+            {
+                long long before = PtpToNs(extended.ts[i][0]);
+                long long after = PtpToNs(extended.ts[i][2]);
+                if (Sample.SystemWindow < 0 || after - before < Sample.SystemWindow)
+                {
+                    Sample.PhcTime = PtpToNs(extended.ts[i][1]);
+                    Sample.SystemTime = before + (after - before) / 2;
+                    Sample.SystemWindow = after - before;
+                }
+            }
+            return true;
+        }
+        case BasicMethod:
+        {
+            // ts holds system, phc, system, phc, ..., system
+            ptp_sys_offset basic = { 0 };
+            basic.n_samples = Samples;
+            if (Ioctl(PTP_SYS_OFFSET, &basic) != 0)
+            {
+                return false;
+            }
+            Sample.SystemWindow = -1;
+            for (unsigned int i = 0; i < basic.n_samples; i++)
+            {
+                long long before = PtpToNs(basic.ts[2 * i]);
+                long long after = PtpToNs(basic.ts[2 * i + 2]);
+                if (Sample.SystemWindow < 0 || after - before < Sample.SystemWindow)
+                {
+                    Sample.PhcTime = PtpToNs(basic.ts[2 * i + 1]);
+                    Sample.SystemTime = before + (after - before) / 2;
+                    Sample.SystemWindow = after - before;
+                }
+            }
+            return true;
+        }
+        }
+        return false;
+    }
+};
+
+class IoctlDevice : public PhcDevice
+{
+public:
+    IoctlDevice(const char * Path)
+    {
+        fd = open(Path, O_RDONLY);
+        if (fd == -1)
+        {
+            printf("open %s failed %d\n", Path, errno);
+            exit(-1);
+        }
+    }
+
+    ~IoctlDevice()
+    {
+        close(fd);
+    }
+
+    int Ioctl(unsigned long Request, void * Argument) override
+    {
+        return ioctl(fd, Request, Argument);
+    }
+
+private:
+    int fd;
+};
+
+// Stand-in for a PHC so the sampler can be exercised on machines without
+// one. The fake clock is CLOCK_REALTIME plus a fixed offset drifting at a
+// fixed rate, and answers the ioctls the way the kernel does, including
+// EOPNOTSUPP from drivers without a precise cross timestamp.
+class FakeDevice : public PhcDevice
+{
+public:
+    FakeDevice(long long OffsetNs, double DriftPpm, bool Precise) :
+        offset(OffsetNs),
+        drift(DriftPpm * 1e-6),
+        precise(Precise),
+        start(ReadClock(CLOCK_REALTIME))
+    {
+    }
+
+    // PHC minus CLOCK_REALTIME at SystemTime
+    long long Offset(long long SystemTime) const
+    {
+        return Phc(SystemTime) - SystemTime;
+    }
+
+    int Ioctl(unsigned long Request, void * Argument) override
+    {
+        switch (Request)
+        {
+        case PTP_SYS_OFFSET_PRECISE:
+        {
+            if (!precise)
+            {
+                errno = EOPNOTSUPP;
+                return -1;
+            }
+            ptp_sys_offset_precise * p = static_cast<ptp_sys_offset_precise*>(Argument);
+            long long now = ReadClock(CLOCK_REALTIME);
+            p->device = NsToPtp(Phc(now));
+            p->sys_realtime = NsToPtp(now);
+            p->sys_monoraw = NsToPtp(ReadClock(CLOCK_MONOTONIC_RAW));
+            return 0;
+        }
+        case PTP_SYS_OFFSET_EXTENDED:
+        {
+            ptp_sys_offset_extended * p = static_cast<ptp_sys_offset_extended*>(Argument);
+            if (p->n_samples == 0 || p->n_samples > PTP_MAX_SAMPLES)
+            {
+                errno = EINVAL;
+                return -1;
+            }
+            for (unsigned int i = 0; i < p->n_samples; i++)
+            {
+                long long before = ReadClock(CLOCK_REALTIME);
+                long long now = ReadClock(CLOCK_REALTIME);
+                long long after = ReadClock(CLOCK_REALTIME);
+                p->ts[i][0] = NsToPtp(before);
+                p->ts[i][1] = NsToPtp(Phc(now));
+                p->ts[i][2] = NsToPtp(after);
+            }
+            return 0;
+        }
+        case PTP_SYS_OFFSET:
+        {
+            ptp_sys_offset * p = static_cast<ptp_sys_offset*>(Argument);
+            if (p->n_samples == 0 || p->n_samples > PTP_MAX_SAMPLES)
+            {
+                errno = EINVAL;
+                return -1;
+            }
+            p->ts[0] = NsToPtp(ReadClock(CLOCK_REALTIME));
+            for (unsigned int i = 0; i < p->n_samples; i++)
+            {
+                p->ts[2 * i + 1] = NsToPtp(Phc(ReadClock(CLOCK_REALTIME)));
+                p->ts[2 * i + 2] = NsToPtp(ReadClock(CLOCK_REALTIME));
+            }
+            return 0;
+        }
+        }
+        errno = ENOTTY;
+        return -1;
+    }
+
+private:
+    long long Phc(long long SystemTime) const
+    {
+        return SystemTime + offset + static_cast<long long>((SystemTime - start) * drift);
+    }
+
+    long long offset;
+    double drift;
+    bool precise;
+    long long start;
+};
+
+// Writes one sample: SYSTEM_TIME in FILETIME units like OsTimeSampler's, so
+// the same tools read it, and the PHC time, window and offset in ns.
+void WriteSample(SampleWriter & Writer, TTsc TscStart, TTsc TscEnd, const CrossTimestamp & Sample)
+{
+    char * line = Writer.Reserve();
+    size_t length = snprintf(line, SampleWriter::MaxLine, "%llu, %llu, %lld, %lld, %lld, %lld\n",
+        TscStart,
+        TscEnd,
+        RealtimeToSystemTime(Sample.SystemTime),
+        Sample.PhcTime,
+        Sample.SystemWindow,
+        Sample.PhcTime - Sample.SystemTime);
+    Writer.Commit(length, TscEnd);
+}
+
+// Reads fake clocks with a known offset and drift through every method and
+// checks the fallback when the precise method isn't supported, that each
+// cross timestamp's offset is the fake clock's within half its system time
+// window, and that SYSTEM_TIME converts to the FILETIME ReadSystemTime gives.
+int Check()
+{
+    const long long offset = 37000000123ll;
+    const double drift = 150;
+    const unsigned int count = 10000;
+    int failures = 0;
+    for (int precise = 1; precise >= 0; precise--)
+    {
+        FakeDevice device(offset, drift, precise != 0);
+        for (int m = PreciseMethod; m <= BasicMethod; m++)
+        {
+            Method method = static_cast<Method>(m);
+            const char * name = method == PreciseMethod ? "precise" : method == ExtendedMethod ? "extended" : "basic";
+            CrossTimestamp sample;
+            bool ok = device.Read(method, 5, sample);
+            if (method == PreciseMethod && !precise)
+            {
+                bool refused = !ok && errno == EOPNOTSUPP;
+                printf("%s: noprecise device %s\n", refused ? "passed" : "FAILED", refused ? "refuses precise cross timestamps" : "answered a precise cross timestamp");
+                failures += refused ? 0 : 1;
+                continue;
+            }
+
+            long long worst = 0;
+            long long widest = 0;
+            long long skew = 0;
+            unsigned int bad = 0;
+            for (unsigned int i = 0; i < count && ok; i++)
+            {
+                long long before = ReadSystemTime();
+                ok = device.Read(method, 5, sample);
+                long long after = ReadSystemTime();
+                long long error = (sample.PhcTime - sample.SystemTime) - device.Offset(sample.SystemTime);
+                long long system = RealtimeToSystemTime(sample.SystemTime);
+                error = error < 0 ? -error : error;
+                worst = error > worst ? error : worst;
+                widest = sample.SystemWindow > widest ? sample.SystemWindow : widest;
+                skew = system < before ? before - system : system > after ? system - after : 0;
+                if (error > sample.SystemWindow / 2 + 1 || skew > 0)
+                {
+                    bad++;
+                }
+            }
+            bool passed = ok && bad == 0;
+            printf("%s: %s on a %s device, %u samples, %u bad, worst offset error %lldns, widest window %lldns\n",
+                passed ? "passed" : "FAILED",
+                name,
+                precise ? "precise" : "noprecise",
+                count,
+                bad,
+                worst,
+                widest);
+            failures += passed ? 0 : 1;
+        }
+    }
+    return failures == 0 ? 0 : -1;
+}
+
+int main(int argc, char ** argv)
+{
+    size_t interations;
+    double interval;
+    unsigned int samples = 5;
+    Method method = PreciseMethod;
+    PhcDevice * device;
+
+    if (argc == 2 && strcmp(argv[1], "check") == 0)
+    {
+        return Check();
+    }
+    if (argc < 4 || argc > 6) {
+        printf("Usage: %s device interval count [precise|extended|basic [samples]]\n", argv[0]);
+        printf("       %s check\n", argv[0]);
+        printf("device is a PTP clock such as /dev/ptp0, or fake[:offset_ns[:drift_ppm[:noprecise]]]\n");
+        printf("interval is in milliseconds and may be fractional, e.g. 0.1 for 10kHz\n");
+        printf("samples is the number of PHC reads per extended or basic sample, up to %d\n", PTP_MAX_SAMPLES);
+        return -1;
+    }
+
+    if (strncmp(argv[1], "fake", 4) == 0)
+    {
+        long long offset = 0;
+        double drift = 0;
+        char precise[16] = "";
+        sscanf(argv[1], "fake:%lld:%lf:%15s", &offset, &drift, precise);
+        device = new FakeDevice(offset, drift, strcmp(precise, "noprecise") != 0);
+    }
+    else
+    {
+        device = new IoctlDevice(argv[1]);
+    }
+    interval = atof(argv[2]);
+    interations = strtoull(argv[3], nullptr, 10);
+    if (argc > 4)
+    {
+        if (strcmp(argv[4], "extended") == 0)
+        {
+            method = ExtendedMethod;
+        }
+        else if (strcmp(argv[4], "basic") == 0)
+        {
+            method = BasicMethod;
+        }
+        else if (strcmp(argv[4], "precise") != 0)
+        {
+            printf("Unknown method %s\n", argv[4]);
+            return -1;
+        }
+    }
+    if (argc > 5)
+    {
+        samples = static_cast<unsigned int>(strtoul(argv[5], nullptr, 10));
+        if (samples == 0 || samples > PTP_MAX_SAMPLES)
+        {
+            printf("samples must be between 1 and %d\n", PTP_MAX_SAMPLES);
+            return -1;
+        }
+    }
+
+    // Not every driver supports every ioctl (ptp_kvm only has the precise
+    // cross timestamp on some hosts), so fall back to the next best method.
+    CrossTimestamp probe;
+    while (!device->Read(method, samples, probe))
+    {
+        if (method == BasicMethod)
+        {
+            printf("PTP_SYS_OFFSET failed %d\n", errno);
+            return -1;
+        }
+        method = static_cast<Method>(method + 1);
+    }
+    fprintf(stderr, "Using %s cross timestamps\n",
+        method == PreciseMethod ? "precise" : method == ExtendedMethod ? "extended" : "basic");
+    printf("TSC_START, TSC_END, SYSTEM_TIME, PHC_TIME, SYSTEM_WINDOW, OFFSET\n");
+
+    TscFrequency calibration = TscCalibration::Calibrate();
+    double tscFrequency = calibration.Frequency;
+    fprintf(stderr, "TSC frequency %.0f Hz +/- %.0f Hz (%s, %.1fms)\n",
+        calibration.Frequency, calibration.Uncertainty, calibration.Source, calibration.Milliseconds);
+    TTsc intervalTicks = static_cast<TTsc>(interval * tscFrequency / 1000);
+    SampleWriter writer(tscFrequency);
+
+    TTsc deadline = __rdtsc() + intervalTicks;
+    for (size_t i = 0; i < interations; i++) {
+        CrossTimestamp sample;
+        WaitForTsc(deadline, tscFrequency);
+        TTsc tscStart = __rdtsc();
+        bool ok = device->Read(method, samples, sample);
+        TTsc tscEnd = __rdtsc();
+        if (ok)
+        {
+            WriteSample(writer, tscStart, tscEnd, sample);
+        }
+        else
+        {
+            fprintf(stderr, "cross timestamp failed %d\n", errno);
+        }
+
+        deadline += intervalTicks;
+        if (tscEnd > deadline + intervalTicks)
+        {
+            // Fell more than an interval behind, e.g. after being descheduled
+            deadline = tscEnd + intervalTicks;
+        }
+    }
+    writer.Flush();
+    delete device;
+
+    return 0;
+}
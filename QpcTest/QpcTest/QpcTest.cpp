@@ -5,7 +5,7 @@
 #include <math.h>
 #include <Windows.h>
 #include <intrin.h>  
-#include "CpuId.h"
+#include "CpuInfo/CpuInfo.h"
 
 double StdDevAsFractionOfMean(DWORD64 * Samples, size_t SampleSize)
 {
@@ -60,6 +60,15 @@ int main(int argc, char ** argv)
     }
     printf("\n");
     printf("CPU Info: Vendor: %s Brand: %s\n", InstructionSet::Vendor().c_str(), InstructionSet::Brand().c_str());
+    const char * source;
+    double tscFrequency = InstructionSet::NominalTscFrequency(&source);
+    printf("Nominal TSC frequency: %.0f Hz (%s)\n", tscFrequency, source);
+    if (InstructionSet::Hypervisor())
+    {
+        printf("Hypervisor: %s%s\n",
+            InstructionSet::HypervisorVendor().c_str(),
+            InstructionSet::HyperVReferenceTsc() ? ", reference TSC page" : "");
+    }
     if (!InstructionSet::TscInvariant())
     {
         printf("CPU doesn't support invariant TSC\n");
@@ -0,0 +1,400 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    recordsplitter.cpp
+
+Abstract:
+
+    Native counterpart of SplitRecords. Reads the monitoring service logs
+    between two file names and writes the records of each server to a file
+    of its own, named CONFIG-IP-RESOLVED.out, keeping the IP, RDTSC_START,
+    RDTSC_END, NTP_TIME and RTT_DELAY columns. Lines from localhost are
+    copied whole to localhost.out.
+
+    The logs are memory mapped and cut into chunks that are split by server
+    in parallel, each chunk collecting the output of every server in one
+    block. The blocks of a batch of chunks are then written per server in
+    file order, servers spread across threads, so each output file sees one
+    large write per batch instead of one per field.
+
+    With -format binary the server files hold fixed size records instead,
+    see BinaryRecord.
+
+--*/
+
+#include <dirent.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <unordered_map>
+#include "TimeSamples/TimeSamples.h"
+
+enum Columns {
+    IP_ADDRESS = 0,
+    RDTSC_START = 1,
+    RDTSC_END = 2,
+    NTP_TIME = 3,
+    RTT_DELAY = 4,
+    CONFIG_NAME = 5,
+    RESOLVED_NAME = 7,
+    COLUMN_COUNT = 8
+};
+
+// Binary server files start with BinaryMagic followed by these records
+#pragma pack(push, 1)
+struct BinaryRecord
+{
+    long long RdtscStart;
+    long long RdtscEnd;
+    long long NtpTime;
+    double RttDelay;
+};
+#pragma pack(pop)
+
+static const char BinaryMagic[8] = { 'N', 'T', 'P', 'S', 'P', 'L', 'T', '1' };
+
+// Output of one server from one chunk
+struct Block
+{
+    std::string FileName;
+    std::string Data;
+};
+
+// The output of one chunk, keyed by server address
+typedef std::unordered_map<std::string, Block> ChunkOutput;
+
+struct Chunk
+{
+    const MappedFile * File;
+    const char * Begin;
+    const char * End;
+};
+
+inline bool Contains(const char * Begin, const char * End, const char * Text)
+{
+    size_t length = strlen(Text);
+    for (const char * p = Begin; End - p >= static_cast<ptrdiff_t>(length); p++)
+    {
+        p = static_cast<const char *>(memchr(p, Text[0], End - p));
+        if (p == nullptr || End - p < static_cast<ptrdiff_t>(length))
+        {
+            return false;
+        }
+        if (memcmp(p, Text, length) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+class Splitter
+{
+public:
+    Splitter(bool Binary) :
+        binary(Binary)
+    {
+    }
+
+    void SplitChunk(const Chunk & Input, ChunkOutput & Output) const
+    {
+        const char * start[COLUMN_COUNT];
+        const char * end[COLUMN_COUNT];
+        DelimiterScanner scanner(Input.Begin, Input.End);
+
+        for (const char * p = Input.Begin; p < Input.End; )
+        {
+            // Split the line, remembering the first COLUMN_COUNT fields
+            const char * line = p;
+            const char * eol;
+            size_t count = 0;
+            for (;;)
+            {
+                const char * d = scanner.Next();
+                if (count < COLUMN_COUNT)
+                {
+                    start[count] = p;
+                    end[count] = d;
+                }
+                count++;
+                p = d + 1;
+                if (d == Input.End || *d == '\n')
+                {
+                    eol = d;
+                    break;
+                }
+            }
+            p = eol == Input.End ? Input.End : eol + 1;
+
+            if (Contains(line, eol, "START"))
+            {
+                continue;
+            }
+            if (Contains(line, eol, "localhost"))
+            {
+                Block & block = Output["localhost"];
+                if (block.FileName.empty())
+                {
+                    block.FileName = "localhost.out";
+                }
+                block.Data.append(line, eol > line && eol[-1] == '\r' ? eol - 1 : eol);
+                block.Data.push_back('\n');
+                continue;
+            }
+            if (count < COLUMN_COUNT)
+            {
+                continue;
+            }
+
+            Block & block = Output[std::string(start[IP_ADDRESS], end[IP_ADDRESS])];
+            if (block.FileName.empty())
+            {
+                block.FileName.assign(start[CONFIG_NAME], end[CONFIG_NAME]);
+                block.FileName += "-";
+                block.FileName.append(start[IP_ADDRESS], end[IP_ADDRESS]);
+                block.FileName += "-";
+                block.FileName.append(start[RESOLVED_NAME], TrimLineEnd(start[RESOLVED_NAME], end[RESOLVED_NAME]));
+                block.FileName += binary ? ".bin" : ".out";
+            }
+
+            if (binary)
+            {
+                BinaryRecord record;
+                if (!ParseInteger(start[RDTSC_START], end[RDTSC_START], record.RdtscStart) ||
+                    !ParseInteger(start[RDTSC_END], end[RDTSC_END], record.RdtscEnd) ||
+                    !ParseInteger(start[NTP_TIME], end[NTP_TIME], record.NtpTime) ||
+                    !ParseSeconds(start[RTT_DELAY], end[RTT_DELAY], record.RttDelay))
+                {
+                    continue;
+                }
+                block.Data.append(reinterpret_cast<const char *>(&record), sizeof(record));
+            }
+            else
+            {
+                static const int columns[] = { IP_ADDRESS, RDTSC_START, RDTSC_END, NTP_TIME, RTT_DELAY };
+                for (size_t i = 0; i < sizeof(columns) / sizeof(columns[0]); i++)
+                {
+                    if (i > 0)
+                    {
+                        block.Data += ", ";
+                    }
+                    block.Data.append(start[columns[i]], end[columns[i]]);
+                }
+                block.Data.push_back('\n');
+            }
+        }
+    }
+
+    // Append the blocks of a batch of chunks, given in file order, to the
+    // server files. Files are created on first use and reopened for each
+    // batch, so thousands of servers don't exhaust the descriptor limit.
+    void WriteBatch(std::vector<ChunkOutput> & Outputs, size_t Threads)
+    {
+        // Gather each server's blocks in chunk order
+        std::unordered_map<std::string, std::vector<Block *>> servers;
+        for (auto & output : Outputs)
+        {
+            for (auto & block : output)
+            {
+                servers[block.first].push_back(&block.second);
+            }
+        }
+
+        std::vector<decltype(servers)::value_type *> work;
+        std::vector<bool> create;
+        for (auto & s : servers)
+        {
+            // The first line seen for a server names its file
+            bool first = fileNames.find(s.first) == fileNames.end();
+            if (first)
+            {
+                fileNames.insert(std::make_pair(s.first, s.second[0]->FileName));
+            }
+            create.push_back(first);
+            work.push_back(&s);
+        }
+
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < Threads; t++)
+        {
+            workers.push_back(std::thread([&, t]()
+            {
+                for (size_t i = t; i < work.size(); i += Threads)
+                {
+                    const std::string & fileName = fileNames.at(work[i]->first);
+                    FILE * out = fopen(fileName.c_str(), create[i] ? "wb" : "ab");
+                    if (out == nullptr)
+                    {
+                        fprintf(stderr, "unable to open %s\n", fileName.c_str());
+                        continue;
+                    }
+                    if (create[i] && binary && work[i]->first != "localhost")
+                    {
+                        fwrite(BinaryMagic, 1, sizeof(BinaryMagic), out);
+                    }
+                    for (Block * block : work[i]->second)
+                    {
+                        fwrite(block->Data.data(), 1, block->Data.size(), out);
+                    }
+                    fclose(out);
+                }
+            }));
+        }
+        for (auto & w : workers)
+        {
+            w.join();
+        }
+    }
+
+    size_t Servers() const
+    {
+        return fileNames.size();
+    }
+
+private:
+    static const char * TrimLineEnd(const char * Begin, const char * End)
+    {
+        while (End > Begin && IsBlank(End[-1]))
+        {
+            End--;
+        }
+        return End;
+    }
+
+    bool binary;
+    std::unordered_map<std::string, std::string> fileNames;
+};
+
+// The log files in the folder of First whose names sort between First and
+// Last, ignoring case, in name order
+std::vector<std::string> ListFiles(const std::string & First, const std::string & Last)
+{
+    std::vector<std::string> files;
+    size_t slash = First.find_last_of("/\\");
+    std::string folder = slash == std::string::npos ? "." : First.substr(0, slash);
+    auto upper = [](std::string s)
+    {
+        size_t slash = s.find_last_of("/\\");
+        s = slash == std::string::npos ? s : s.substr(slash + 1);
+        for (auto & c : s)
+        {
+            c = toupper(c);
+        }
+        return s;
+    };
+    std::string first = upper(First);
+    std::string last = upper(Last);
+
+    DIR * dir = opendir(folder.c_str());
+    if (dir == nullptr)
+    {
+        printf("unable to open %s\n", folder.c_str());
+        exit(-1);
+    }
+    for (dirent * entry = readdir(dir); entry != nullptr; entry = readdir(dir))
+    {
+        std::string name = upper(entry->d_name);
+        if (entry->d_name[0] != '.' && name.compare(first) >= 0 && name.compare(last) <= 0)
+        {
+            files.push_back(folder + "/" + entry->d_name);
+        }
+    }
+    closedir(dir);
+    std::sort(files.begin(), files.end(), [&](const std::string & a, const std::string & b)
+    {
+        return upper(a) < upper(b);
+    });
+    return files;
+}
+
+int main(int argc, char ** argv)
+{
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t chunkSize = 16 << 20;
+    bool binary = false;
+
+    if (argc < 3 || argc % 2 == 0)
+    {
+        printf("Usage: %s FirstFile LastFile [-format <csv/binary>] [-threads <count>]\n", argv[0]);
+        return -1;
+    }
+    for (int i = 3; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "-format") == 0)
+        {
+            binary = strcmp(argv[i + 1], "binary") == 0;
+        }
+        else if (strcmp(argv[i], "-threads") == 0)
+        {
+            threads = std::max(1, atoi(argv[i + 1]));
+        }
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+    std::vector<std::string> names = ListFiles(argv[1], argv[2]);
+    std::vector<std::unique_ptr<MappedFile>> files;
+    std::vector<Chunk> chunks;
+    size_t bytes = 0;
+    for (auto & name : names)
+    {
+        files.emplace_back(new MappedFile(name));
+        const MappedFile & file = *files.back();
+        if (!file.IsOpen())
+        {
+            continue;
+        }
+        bytes += file.Length();
+
+        // Cut the file into chunks ending at line boundaries
+        const char * begin = file.Data();
+        const char * end = file.Data() + file.Length();
+        while (begin < end)
+        {
+            const char * chunkEnd = begin + std::min<size_t>(chunkSize, end - begin);
+            if (chunkEnd < end)
+            {
+                const char * eol = static_cast<const char *>(memchr(chunkEnd, '\n', end - chunkEnd));
+                chunkEnd = eol == nullptr ? end : eol + 1;
+            }
+            chunks.push_back(Chunk{ &file, begin, chunkEnd });
+            begin = chunkEnd;
+        }
+    }
+
+    // Split a batch of chunks in parallel, then write it out, keeping the
+    // memory held to a few chunks per thread
+    Splitter splitter(binary);
+    size_t batch = threads * 4;
+    for (size_t first = 0; first < chunks.size(); first += batch)
+    {
+        size_t count = std::min(batch, chunks.size() - first);
+        std::vector<ChunkOutput> outputs(count);
+        std::vector<std::thread> workers;
+        std::atomic<size_t> next(0);
+        for (size_t t = 0; t < std::min(threads, count); t++)
+        {
+            workers.push_back(std::thread([&]()
+            {
+                for (size_t i = next++; i < count; i = next++)
+                {
+                    splitter.SplitChunk(chunks[first + i], outputs[i]);
+                }
+            }));
+        }
+        for (auto & w : workers)
+        {
+            w.join();
+        }
+        splitter.WriteBatch(outputs, threads);
+    }
+
+    fprintf(stderr, "%zu files, %.1f MB, %zu servers in %.3fs\n",
+        files.size(),
+        bytes / 1e6,
+        splitter.Servers(),
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count());
+    return 0;
+}
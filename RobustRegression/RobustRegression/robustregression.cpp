@@ -0,0 +1,126 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    robustregression.cpp
+
+Abstract:
+
+    Fits OS time against TSC for a time sample file, like LinearRegression
+    does for a pair of CSV columns, but with the estimators of
+    Lib/Robust/RobustFit.h so delayed samples don't skew the slope. The TSC
+    midpoint of each sample is x and the OS time is y, so the slope is the
+    TSC period in 100ns units and gives the TSC frequency. The sample delay
+    used by the minimum delay fit is the RTT column of stripchart files and
+    the TSC window of the others.
+
+--*/
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include "CommandLine/CommandLine.h"
+#include "TimeSamples/TimeSamples.h"
+#include "Robust/RobustFit.h"
+
+void PrintFit(const char * Method, const LineFit & Fit, double Seconds)
+{
+    printf("%s: data set fitted to f(x)= beta * x + alpha where:\n", Method);
+    printf("    alpha=%.17g beta=%.17g RMS=%.6g\n", Fit.Alpha, Fit.Beta, Fit.Rms);
+    printf("    TSC frequency=%.1f Hz, %zu samples used, %.3fs\n",
+        Fit.Beta != 0 ? 1e7 / Fit.Beta : 0,
+        Fit.Used,
+        Seconds);
+}
+
+int main(int argc, char ** argv)
+{
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t column = 0;
+    size_t pairs = 4000000;
+    size_t bins = 1000;
+    std::string method = "all";
+
+    std::map<std::string, std::string> args = ParseCommandLine(argc, argv);
+    if (args.find("file") == args.end())
+    {
+        printf("usage: %s -file <samples.csv> [-method <all/ls/theilsen/irls/mindelay>] [-column <first sample column>]\n"
+            "       [-pairs <Theil-Sen pairs>] [-bins <minimum delay bins>] [-threads <count>]\n", argv[0]);
+        exit(-1);
+    }
+    if (args.find("method") != args.end())
+    {
+        method = args["method"];
+    }
+    if (args.find("column") != args.end())
+    {
+        column = strtoul(args["column"].c_str(), nullptr, 10);
+    }
+    if (args.find("pairs") != args.end())
+    {
+        pairs = std::max(1ul, strtoul(args["pairs"].c_str(), nullptr, 10));
+    }
+    if (args.find("bins") != args.end())
+    {
+        bins = std::max(1ul, strtoul(args["bins"].c_str(), nullptr, 10));
+    }
+    if (args.find("threads") != args.end())
+    {
+        threads = std::max(1, atoi(args["threads"].c_str()));
+    }
+
+    MappedFile file(args["file"]);
+    if (!file.IsOpen())
+    {
+        printf("unable to read %s\n", args["file"].c_str());
+        exit(-1);
+    }
+    SampleParser parser(column);
+    SampleColumns samples;
+    if (!parser.Parse(file, threads, samples) || samples.Size() < 2)
+    {
+        printf("%s does not contain time samples\n", args["file"].c_str());
+        exit(-1);
+    }
+
+    size_t n = samples.Size();
+    std::vector<long long> x(n);
+    std::vector<long long> y(n);
+    std::vector<double> delay(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        // Midpoint without overflowing the sum of two large TSC values
+        x[i] = samples.TscStart[i] + (samples.TscEnd[i] - samples.TscStart[i]) / 2;
+        y[i] = samples.OsTime[i];
+        delay[i] = samples.Format == StripchartFormat ? samples.Rtt[i] : static_cast<double>(samples.TscEnd[i] - samples.TscStart[i]);
+    }
+
+    RobustFit fit(x.data(), y.data(), n, threads);
+    auto timed = [](const char * Method, std::function<LineFit()> Fit)
+    {
+        auto start = std::chrono::steady_clock::now();
+        LineFit result = Fit();
+        PrintFit(Method, result, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    };
+
+    fprintf(stderr, "%s: %zu samples\n", SampleFormatName(samples.Format), n);
+    if (method == "all" || method == "ls")
+    {
+        timed("Least squares", [&]() { return fit.LeastSquaresFit(); });
+    }
+    if (method == "all" || method == "theilsen")
+    {
+        timed("Theil-Sen", [&]() { return fit.TheilSenFit(pairs); });
+    }
+    if (method == "all" || method == "irls")
+    {
+        timed("Tukey IRLS", [&]() { return fit.ReweightedFit(); });
+    }
+    if (method == "all" || method == "mindelay")
+    {
+        timed("Minimum delay", [&]() { return fit.MinimumDelayFit(delay.data(), bins); });
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    sampleparser.cpp
+
+Abstract:
+
+    Reads a time sample file in any of the formats TimeSampleCorrelation
+    accepts, reports the detected format and parse rate, and optionally
+    writes the samples back out as a normalized CSV so the other tools don't
+    have to deal with the different formats.
+
+--*/
+
+#include <chrono>
+#include <map>
+#include "CommandLine/CommandLine.h"
+#include "TimeSamples/TimeSamples.h"
+
+void WriteSamples(const SampleColumns & Samples)
+{
+    std::vector<char> buffer(1 << 20);
+    size_t used = 0;
+    bool stripchart = Samples.Format == StripchartFormat;
+
+    printf(stripchart ? "TSC_START, TSC_END, OS_TIME, RTT, OFFSET\n" : "TSC_START, TSC_END, OS_TIME\n");
+    for (size_t i = 0; i < Samples.Size(); i++)
+    {
+        if (buffer.size() - used < 256)
+        {
+            fwrite(buffer.data(), 1, used, stdout);
+            used = 0;
+        }
+        used += snprintf(buffer.data() + used, buffer.size() - used, "%lld, %lld, %lld",
+            Samples.TscStart[i], Samples.TscEnd[i], Samples.OsTime[i]);
+        if (stripchart)
+        {
+            used += snprintf(buffer.data() + used, buffer.size() - used, ", %.9f, %.9f", Samples.Rtt[i], Samples.Offset[i]);
+        }
+        buffer[used++] = '\n';
+    }
+    fwrite(buffer.data(), 1, used, stdout);
+}
+
+int main(int argc, char ** argv)
+{
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t column = 0;
+
+    std::map<std::string, std::string> args = ParseCommandLine(argc, argv);
+    if (args.find("file") == args.end())
+    {
+        printf("usage: %s -file <samples.csv> [-column <first sample column>] [-threads <count>] [-output <yes/no>]\n", argv[0]);
+        exit(-1);
+    }
+    if (args.find("column") != args.end())
+    {
+        column = strtoul(args["column"].c_str(), nullptr, 10);
+    }
+    if (args.find("threads") != args.end())
+    {
+        threads = std::max(1, atoi(args["threads"].c_str()));
+    }
+
+    MappedFile file(args["file"]);
+    if (!file.IsOpen())
+    {
+        printf("unable to read %s\n", args["file"].c_str());
+        exit(-1);
+    }
+
+    SampleParser parser(column);
+    SampleColumns samples;
+    auto start = std::chrono::steady_clock::now();
+    if (!parser.Parse(file, threads, samples))
+    {
+        printf("%s does not contain time samples\n", args["file"].c_str());
+        exit(-1);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    fprintf(stderr, "%s: %zu samples, %.1f MB in %.3fs (%.0f MB/s)\n",
+        SampleFormatName(samples.Format),
+        samples.Size(),
+        file.Length() / 1e6,
+        seconds,
+        file.Length() / 1e6 / seconds);
+
+    if (args.find("output") != args.end() && args["output"] == "yes")
+    {
+        WriteSamples(samples);
+    }
+    return 0;
+}
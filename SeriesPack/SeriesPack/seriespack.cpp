@@ -0,0 +1,565 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    seriespack.cpp
+
+Abstract:
+
+    Converts the CSV logs of OsTimeSampler, NtpCli and the other samplers
+    to and from the block codec of Lib/Codec/SeriesCodec.h. Every column is
+    stored as 64 bit integers: decimal and 0x hex integers as themselves,
+    fixed point decimals such as NtpCli's 0.000123 root delay scaled to
+    integers, and text such as server addresses and true/false as indices
+    into a table of the distinct values. A type is only chosen for a column
+    when every value of it prints back to the same text, so unpacking gives
+    the original file byte for byte, which pack verifies before writing.
+
+    The unpack mode reads a range of rows by decoding only the blocks that
+    hold them, and the scan mode decodes everything and prints the range
+    of each column with the decode rate.
+
+--*/
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include "Codec/SeriesCodec.h"
+#include "CommandLine/CommandLine.h"
+
+bool ReadFile(const std::string & FileName, std::string & Data)
+{
+    FILE * file = fopen(FileName.c_str(), "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    char chunk[65536];
+    for (size_t read; (read = fread(chunk, 1, sizeof(chunk), file)) > 0;)
+    {
+        Data.append(chunk, read);
+    }
+    fclose(file);
+    return true;
+}
+
+enum class ColumnKind
+{
+    Integer,
+    Hex,
+    Fixed,
+    Text,
+};
+
+struct Column
+{
+    ColumnKind Kind;
+    unsigned int Decimals;  // Fixed: digits after the point
+    std::string Prefix;     // Spaces after the comma, shared by every row
+};
+
+// The text of one value of a column
+void Format(const Column & Kind, int64_t Value, const std::vector<std::string> & Dictionary, std::string & Out)
+{
+    char buffer[64];
+    switch (Kind.Kind)
+    {
+    case ColumnKind::Integer:
+        snprintf(buffer, sizeof(buffer), "%" PRId64, Value);
+        break;
+    case ColumnKind::Hex:
+        snprintf(buffer, sizeof(buffer), "0x%" PRIx64, static_cast<uint64_t>(Value));
+        break;
+    case ColumnKind::Fixed:
+    {
+        uint64_t scale = 1;
+        for (unsigned int i = 0; i < Kind.Decimals; i++)
+        {
+            scale *= 10;
+        }
+        uint64_t magnitude = Value < 0 ? 0 - static_cast<uint64_t>(Value) : static_cast<uint64_t>(Value);
+        snprintf(buffer, sizeof(buffer), "%s%" PRIu64 ".%0*" PRIu64, Value < 0 ? "-" : "", magnitude / scale, static_cast<int>(Kind.Decimals), magnitude % scale);
+        break;
+    }
+    default:
+        Out += static_cast<uint64_t>(Value) < Dictionary.size() ? Dictionary[static_cast<size_t>(Value)] : std::string();
+        return;
+    }
+    Out += buffer;
+}
+
+// The value of Text as Kind, false when Text isn't one
+bool Parse(const Column & Kind, const std::string & Text, int64_t & Value)
+{
+    const char * start = Text.c_str();
+    char * end = nullptr;
+    errno = 0;
+    switch (Kind.Kind)
+    {
+    case ColumnKind::Integer:
+        if (!(isdigit(static_cast<unsigned char>(start[0])) || (start[0] == '-' && isdigit(static_cast<unsigned char>(start[1])))))
+        {
+            return false;
+        }
+        Value = strtoll(start, &end, 10);
+        break;
+    case ColumnKind::Hex:
+        if (Text.compare(0, 2, "0x") != 0 || !isxdigit(static_cast<unsigned char>(start[2])))
+        {
+            return false;
+        }
+        Value = static_cast<int64_t>(strtoull(start + 2, &end, 16));
+        break;
+    case ColumnKind::Fixed:
+    {
+        size_t point = Text.find('.');
+        if (point == std::string::npos || Text.size() - point - 1 != Kind.Decimals || Kind.Decimals > 18 ||
+            !(isdigit(static_cast<unsigned char>(start[0])) || (start[0] == '-' && isdigit(static_cast<unsigned char>(start[1])))))
+        {
+            return false;
+        }
+        std::string digits = Text.substr(0, point) + Text.substr(point + 1);
+        if (digits.find_first_not_of("-0123456789") != std::string::npos || digits.find('-', 1) != std::string::npos)
+        {
+            return false;
+        }
+        Value = strtoll(digits.c_str(), &end, 10);
+        return errno == 0 && *end == '\0';
+    }
+    default:
+        return false;
+    }
+    return errno == 0 && end != nullptr && *end == '\0';
+}
+
+// A CSV file split into lines of fields, the spaces after each comma kept
+// apart from the value
+struct CsvText
+{
+    std::vector<std::string> Header;    // Lines before the first with a number
+    std::vector<std::vector<std::string>> Rows;
+    std::vector<std::vector<std::string>> Prefixes;
+    bool Crlf = false;
+    bool FinalNewline = true;
+};
+
+bool SplitCsv(const std::string & Data, CsvText & Csv, std::string & Error)
+{
+    size_t lines = 0;
+    size_t crlf = 0;
+    for (size_t position = 0; position < Data.size();)
+    {
+        size_t end = Data.find('\n', position);
+        Csv.FinalNewline = end != std::string::npos;
+        end = end == std::string::npos ? Data.size() : end;
+        std::string line = Data.substr(position, end - position);
+        position = end + 1;
+        lines++;
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+            crlf++;
+        }
+
+        std::vector<std::string> fields;
+        std::vector<std::string> prefixes;
+        bool numeric = false;
+        for (size_t start = 0;;)
+        {
+            size_t comma = line.find(',', start);
+            std::string field = line.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+            size_t spaces = field.find_first_not_of(' ');
+            spaces = spaces == std::string::npos ? 0 : spaces;
+            prefixes.push_back(field.substr(0, spaces));
+            fields.push_back(field.substr(spaces));
+            numeric = numeric || isdigit(static_cast<unsigned char>(fields.back()[0]));
+            if (comma == std::string::npos)
+            {
+                break;
+            }
+            start = comma + 1;
+        }
+        if (!numeric && Csv.Rows.empty())
+        {
+            Csv.Header.push_back(line);
+            continue;
+        }
+        if (!Csv.Rows.empty() && fields.size() != Csv.Rows[0].size())
+        {
+            Error = "line " + std::to_string(lines) + " has " + std::to_string(fields.size()) + " fields, the first row " + std::to_string(Csv.Rows[0].size());
+            return false;
+        }
+        Csv.Rows.push_back(fields);
+        Csv.Prefixes.push_back(prefixes);
+    }
+    if (crlf != 0 && crlf != lines - (Csv.FinalNewline ? 0 : 1))
+    {
+        Error = "the file mixes CRLF and LF line ends";
+        return false;
+    }
+    Csv.Crlf = crlf != 0;
+    if (Csv.Rows.empty())
+    {
+        Error = "no rows with numbers";
+        return false;
+    }
+    return true;
+}
+
+// The narrowest kind every value of column C prints back to exactly, text
+// when none does; rows disagreeing on the spaces before it keep them in the
+// value
+Column ChooseColumn(const CsvText & Csv, size_t C)
+{
+    Column column;
+    column.Prefix = Csv.Prefixes[0][C];
+    for (const std::vector<std::string> & prefixes : Csv.Prefixes)
+    {
+        if (prefixes[C] != column.Prefix)
+        {
+            column.Prefix.clear();
+            column.Kind = ColumnKind::Text;
+            return column;
+        }
+    }
+    const std::string & first = Csv.Rows[0][C];
+    size_t point = first.find('.');
+    column.Decimals = point == std::string::npos ? 0 : static_cast<unsigned int>(first.size() - point - 1);
+    std::vector<std::string> dictionary;
+    for (ColumnKind kind : { ColumnKind::Integer, ColumnKind::Hex, ColumnKind::Fixed })
+    {
+        column.Kind = kind;
+        bool fits = true;
+        for (size_t r = 0; r < Csv.Rows.size() && fits; r++)
+        {
+            int64_t value;
+            std::string text;
+            fits = Parse(column, Csv.Rows[r][C], value);
+            if (fits)
+            {
+                Format(column, value, dictionary, text);
+                fits = text == Csv.Rows[r][C];
+            }
+        }
+        if (fits)
+        {
+            return column;
+        }
+    }
+    column.Kind = ColumnKind::Text;
+    return column;
+}
+
+const char PackMagic[] = "SERIESPACK1\n";
+
+// The CSV layout, then the codec's data:
+//   magic, varint header length, header text, varint flags (1 CRLF, 2 final
+//   newline), varint columns, per column varint kind, varint decimals,
+//   varint prefix length and prefix, varint dictionary size, per entry
+//   varint length and text
+struct PackLayout
+{
+    std::string Header;
+    bool Crlf = false;
+    bool FinalNewline = true;
+    std::vector<Column> Columns;
+    std::vector<std::string> Dictionary;
+    size_t CodecOffset = 0;
+};
+
+void WriteText(std::string & Out, const std::string & Text)
+{
+    WriteVarint(Out, Text.size());
+    Out += Text;
+}
+
+bool ReadText(const unsigned char * Data, size_t Size, size_t & Position, std::string & Text)
+{
+    uint64_t length;
+    if (!ReadVarint(Data, Size, Position, length) || length > Size - Position)
+    {
+        return false;
+    }
+    Text.assign(reinterpret_cast<const char *>(Data + Position), static_cast<size_t>(length));
+    Position += static_cast<size_t>(length);
+    return true;
+}
+
+bool ReadLayout(const std::string & Data, PackLayout & Layout)
+{
+    const unsigned char * bytes = reinterpret_cast<const unsigned char *>(Data.data());
+    size_t position = sizeof(PackMagic) - 1;
+    uint64_t flags;
+    uint64_t count;
+    if (Data.compare(0, position, PackMagic) != 0 || !ReadText(bytes, Data.size(), position, Layout.Header) ||
+        !ReadVarint(bytes, Data.size(), position, flags) || !ReadVarint(bytes, Data.size(), position, count))
+    {
+        return false;
+    }
+    Layout.Crlf = (flags & 1) != 0;
+    Layout.FinalNewline = (flags & 2) != 0;
+    for (uint64_t c = 0; c < count; c++)
+    {
+        Column column;
+        uint64_t kind;
+        uint64_t decimals;
+        if (!ReadVarint(bytes, Data.size(), position, kind) || !ReadVarint(bytes, Data.size(), position, decimals) ||
+            !ReadText(bytes, Data.size(), position, column.Prefix) || kind > static_cast<uint64_t>(ColumnKind::Text))
+        {
+            return false;
+        }
+        column.Kind = static_cast<ColumnKind>(kind);
+        column.Decimals = static_cast<unsigned int>(decimals);
+        Layout.Columns.push_back(column);
+    }
+    if (!ReadVarint(bytes, Data.size(), position, count))
+    {
+        return false;
+    }
+    for (uint64_t i = 0; i < count; i++)
+    {
+        std::string text;
+        if (!ReadText(bytes, Data.size(), position, text))
+        {
+            return false;
+        }
+        Layout.Dictionary.push_back(text);
+    }
+    Layout.CodecOffset = position;
+    return true;
+}
+
+// The CSV text of rows [From, From + Count)
+std::string Unpack(const PackLayout & Layout, SeriesReader & Reader, uint64_t From, uint64_t Count, bool Header)
+{
+    const char * newline = Layout.Crlf ? "\r\n" : "\n";
+    std::string out;
+    if (Header)
+    {
+        out = Layout.Header;
+    }
+    uint64_t end = std::min(Reader.Rows(), From + std::min(Count, Reader.Rows()));
+    std::vector<int64_t> block;
+    for (uint64_t row = From; row < end;)
+    {
+        size_t index = static_cast<size_t>(row / Reader.BlockRows());
+        size_t rows = Reader.DecodeBlock(index, block);
+        if (rows == 0)
+        {
+            break;
+        }
+        uint64_t base = static_cast<uint64_t>(index) * Reader.BlockRows();
+        for (; row < end && row < base + rows; row++)
+        {
+            for (size_t c = 0; c < Layout.Columns.size(); c++)
+            {
+                if (c > 0)
+                {
+                    out += ',';
+                }
+                out += Layout.Columns[c].Prefix;
+                Format(Layout.Columns[c], block[c * rows + static_cast<size_t>(row - base)], Layout.Dictionary, out);
+            }
+            out += newline;
+        }
+    }
+    if (!Layout.FinalNewline && end == Reader.Rows() && !out.empty())
+    {
+        out.resize(out.size() - strlen(newline));
+    }
+    return out;
+}
+
+int Pack(std::map<std::string, std::string> & Args)
+{
+    std::string input;
+    if (!ReadFile(Args["file"], input))
+    {
+        printf("can't read %s: %s\n", Args["file"].c_str(), strerror(errno));
+        return -1;
+    }
+    CsvText csv;
+    std::string error;
+    if (!SplitCsv(input, csv, error))
+    {
+        printf("%s: %s\n", Args["file"].c_str(), error.c_str());
+        return -1;
+    }
+
+    PackLayout layout;
+    layout.Crlf = csv.Crlf;
+    layout.FinalNewline = csv.FinalNewline;
+    for (const std::string & line : csv.Header)
+    {
+        layout.Header += line + (csv.Crlf ? "\r\n" : "\n");
+    }
+    size_t columns = csv.Rows[0].size();
+    for (size_t c = 0; c < columns; c++)
+    {
+        layout.Columns.push_back(ChooseColumn(csv, c));
+    }
+
+    size_t blockRows = Args.find("block") != Args.end() ? strtoul(Args["block"].c_str(), nullptr, 10) : 1024;
+    SeriesEncoder encoder(columns, blockRows);
+    std::map<std::string, int64_t> indices;
+    std::vector<int64_t> values(columns);
+    for (size_t r = 0; r < csv.Rows.size(); r++)
+    {
+        for (size_t c = 0; c < columns; c++)
+        {
+            if (layout.Columns[c].Kind == ColumnKind::Text)
+            {
+                // A column without a shared prefix keeps its spaces
+                std::string text = (layout.Columns[c].Prefix.empty() ? csv.Prefixes[r][c] : std::string()) + csv.Rows[r][c];
+                auto found = indices.insert(std::make_pair(text, static_cast<int64_t>(layout.Dictionary.size())));
+                if (found.second)
+                {
+                    layout.Dictionary.push_back(text);
+                }
+                values[c] = found.first->second;
+            }
+            else
+            {
+                Parse(layout.Columns[c], csv.Rows[r][c], values[c]);
+            }
+        }
+        encoder.Add(values.data());
+    }
+
+    std::string output(PackMagic, sizeof(PackMagic) - 1);
+    WriteText(output, layout.Header);
+    WriteVarint(output, (layout.Crlf ? 1 : 0) | (layout.FinalNewline ? 2 : 0));
+    WriteVarint(output, columns);
+    for (const Column & column : layout.Columns)
+    {
+        WriteVarint(output, static_cast<uint64_t>(column.Kind));
+        WriteVarint(output, column.Decimals);
+        WriteText(output, column.Prefix);
+    }
+    WriteVarint(output, layout.Dictionary.size());
+    for (const std::string & text : layout.Dictionary)
+    {
+        WriteText(output, text);
+    }
+    layout.CodecOffset = output.size();
+    output += encoder.Finish();
+
+    // Nothing is written unless it unpacks to the input
+    SeriesReader reader(output.data() + layout.CodecOffset, output.size() - layout.CodecOffset);
+    if (!reader.IsValid() || Unpack(layout, reader, 0, reader.Rows(), true) != input)
+    {
+        printf("%s doesn't round trip, not written\n", Args["file"].c_str());
+        return -1;
+    }
+
+    std::string outName = Args.find("output") != Args.end() ? Args["output"] : Args["file"] + ".spk";
+    FILE * file = fopen(outName.c_str(), "wb");
+    if (file == nullptr || fwrite(output.data(), 1, output.size(), file) != output.size())
+    {
+        printf("can't write %s: %s\n", outName.c_str(), strerror(errno));
+        return -1;
+    }
+    fclose(file);
+
+    static const char * kinds[] = { "integer", "hex", "fixed", "text" };
+    printf("%zu rows of %zu columns (", csv.Rows.size(), columns);
+    for (size_t c = 0; c < columns; c++)
+    {
+        printf("%s%s", c > 0 ? ", " : "", kinds[static_cast<int>(layout.Columns[c].Kind)]);
+    }
+    printf("), %zu values in the text table\n", layout.Dictionary.size());
+    printf("%zu bytes to %zu bytes, %.1fx, %.2f bytes per row\n", input.size(), output.size(),
+        static_cast<double>(input.size()) / output.size(), static_cast<double>(output.size()) / csv.Rows.size());
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    std::map<std::string, std::string> args = ParseCommandLine(argc, argv, 2);
+    std::string mode = argc > 1 ? argv[1] : "";
+    if ((mode != "pack" && mode != "unpack" && mode != "scan") || args.find("file") == args.end())
+    {
+        printf("usage: %s pack -file <in.csv> [-output <out.spk>] [-block <rows>]\n", argv[0]);
+        printf("       %s unpack -file <in.spk> [-output <out.csv>] [-from <row>] [-count <rows>]\n", argv[0]);
+        printf("       %s scan -file <in.spk>\n", argv[0]);
+        exit(-1);
+    }
+    if (mode == "pack")
+    {
+        return Pack(args);
+    }
+
+    std::string data;
+    PackLayout layout;
+    if (!ReadFile(args["file"], data) || !ReadLayout(data, layout))
+    {
+        printf("%s is not a seriespack file\n", args["file"].c_str());
+        exit(-1);
+    }
+    SeriesReader reader(data.data() + layout.CodecOffset, data.size() - layout.CodecOffset);
+    if (!reader.IsValid() || reader.Columns() != layout.Columns.size())
+    {
+        printf("%s is damaged\n", args["file"].c_str());
+        exit(-1);
+    }
+
+    if (mode == "unpack")
+    {
+        uint64_t from = args.find("from") != args.end() ? strtoull(args["from"].c_str(), nullptr, 10) : 0;
+        uint64_t count = args.find("count") != args.end() ? strtoull(args["count"].c_str(), nullptr, 10) : reader.Rows();
+        std::string text = Unpack(layout, reader, from, count, from == 0);
+        FILE * file = args.find("output") != args.end() ? fopen(args["output"].c_str(), "wb") : stdout;
+        if (file == nullptr)
+        {
+            printf("can't write %s: %s\n", args["output"].c_str(), strerror(errno));
+            exit(-1);
+        }
+        fwrite(text.data(), 1, text.size(), file);
+        if (file != stdout)
+        {
+            fclose(file);
+        }
+        return 0;
+    }
+
+    // Decode every block; the range of each column shows what's in the file
+    auto start = std::chrono::steady_clock::now();
+    std::vector<int64_t> minimum(reader.Columns(), INT64_MAX);
+    std::vector<int64_t> maximum(reader.Columns(), INT64_MIN);
+    std::vector<int64_t> block;
+    for (size_t b = 0; b < reader.Blocks(); b++)
+    {
+        size_t rows = reader.DecodeBlock(b, block);
+        for (size_t c = 0; c < reader.Columns(); c++)
+        {
+            for (size_t i = 0; i < rows; i++)
+            {
+                minimum[c] = std::min(minimum[c], block[c * rows + i]);
+                maximum[c] = std::max(maximum[c], block[c * rows + i]);
+            }
+        }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%" PRIu64 " rows in %zu blocks of %zu, decoded in %.3fms, %.0f rows/s\n", reader.Rows(), reader.Blocks(), reader.BlockRows(),
+        seconds * 1e3, reader.Rows() / seconds);
+    printf("Column\tMin\tMax\n");
+    for (size_t c = 0; c < reader.Columns(); c++)
+    {
+        std::string low;
+        std::string high;
+        Format(layout.Columns[c], minimum[c], layout.Dictionary, low);
+        Format(layout.Columns[c], maximum[c], layout.Dictionary, high);
+        printf("%zu\t%s\t%s\n", c, low.c_str(), high.c_str());
+    }
+    return 0;
+}
@@ -0,0 +1,419 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    slewtracker.cpp
+
+Abstract:
+
+    Shows how the time service disciplines the Linux clocks. The record
+    mode reads CLOCK_MONOTONIC_RAW, CLOCK_MONOTONIC and CLOCK_REALTIME, each
+    bracketed by TSC reads and projected to a common TSC instant, together
+    with the adjtimex state, at a fixed interval. MONOTONIC runs at RAW's
+    rate times the frequency the kernel applies, so the slope of MONOTONIC
+    minus RAW over each second is that frequency, and REALTIME minus
+    MONOTONIC only changes when the clock is stepped. Each second's measured
+    frequency is printed next to the one adjtimex reports (freq and tick);
+    the difference is the phase slew of the kernel PLL/FLL amortizing the
+    adjtimex offset. Frequency changes, steps and adjtimex changes are
+    printed as events, and the samples are stored delta encoded, about 16
+    bytes each at a 100ms interval, for the print and replay modes.
+
+--*/
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timex.h>
+#include <x86intrin.h>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Codec/Varint.h"
+#include "CommandLine/CommandLine.h"
+#include "TscCalibration/TscCalibration.h"
+
+// One observation of the clocks, all times in ns at the TSC instant Tsc
+struct ClockSample
+{
+    long long Tsc;
+    long long Raw;
+    long long MonoMinusRaw;
+    long long RealMinusMono;
+    long long Window;       // TSC ticks the three brackets spanned
+    long long Freq;         // adjtimex freq, ppm << 16
+    long long Tick;         // adjtimex tick, us per clock tick
+    long long Status;       // adjtimex status
+    long long Offset;       // adjtimex offset, ns or us (STA_NANO)
+};
+
+const size_t SampleFields = 9;
+static_assert(sizeof(ClockSample) == SampleFields * sizeof(long long), "ClockSample must be only its fields");
+
+inline long long * Fields(ClockSample & Sample)
+{
+    return &Sample.Tsc;
+}
+
+const char SlewMagic[] = "SLEWTRACK1\n";
+
+class SampleWriter
+{
+public:
+    explicit SampleWriter(FILE * File) :
+        file(File),
+        previous()
+    {
+        fwrite(SlewMagic, 1, sizeof(SlewMagic) - 1, file);
+    }
+
+    // Every field as the zigzag varint of its change since the last sample
+    void Write(ClockSample Sample)
+    {
+        std::string buffer;
+        long long * fields = Fields(Sample);
+        long long * last = Fields(previous);
+        for (size_t i = 0; i < SampleFields; i++)
+        {
+            WriteVarint(buffer, ZigZag(fields[i] - last[i]));
+        }
+        fwrite(buffer.data(), 1, buffer.size(), file);
+        previous = Sample;
+    }
+
+private:
+    FILE * file;
+    ClockSample previous;
+};
+
+bool ReadSamples(const std::string & FileName, std::vector<ClockSample> & Samples)
+{
+    FILE * file = fopen(FileName.c_str(), "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    std::string data;
+    char chunk[65536];
+    for (size_t read; (read = fread(chunk, 1, sizeof(chunk), file)) > 0;)
+    {
+        data.append(chunk, read);
+    }
+    fclose(file);
+    if (data.compare(0, sizeof(SlewMagic) - 1, SlewMagic) != 0)
+    {
+        return false;
+    }
+
+    const unsigned char * bytes = reinterpret_cast<const unsigned char *>(data.data());
+    size_t position = sizeof(SlewMagic) - 1;
+    ClockSample sample = ClockSample();
+    while (position < data.size())
+    {
+        long long * fields = Fields(sample);
+        for (size_t i = 0; i < SampleFields; i++)
+        {
+            uint64_t value;
+            if (!ReadVarint(bytes, data.size(), position, value))
+            {
+                return !Samples.empty();
+            }
+            fields[i] += UnZigZag(value);
+        }
+        Samples.push_back(sample);
+    }
+    return true;
+}
+
+class ClockReader
+{
+public:
+    explicit ClockReader(double TscFrequency) :
+        nsPerTick(1e9 / TscFrequency)
+    {
+    }
+
+    // The narrowest of a few tries, each clock bracketed by TSC reads and
+    // moved to the TSC midpoint of the RAW read
+    ClockSample Read(int Tries = 5)
+    {
+        ClockSample best = ClockSample();
+        best.Window = -1;
+        for (int i = 0; i < Tries; i++)
+        {
+            unsigned long long tsc[4];
+            timespec ts[3];
+            tsc[0] = ReadTsc();
+            clock_gettime(CLOCK_MONOTONIC_RAW, &ts[0]);
+            tsc[1] = ReadTsc();
+            clock_gettime(CLOCK_MONOTONIC, &ts[1]);
+            tsc[2] = ReadTsc();
+            clock_gettime(CLOCK_REALTIME, &ts[2]);
+            tsc[3] = ReadTsc();
+            long long window = static_cast<long long>(tsc[3] - tsc[0]);
+            if (best.Window >= 0 && window >= best.Window)
+            {
+                continue;
+            }
+
+            double middle[3];
+            for (int c = 0; c < 3; c++)
+            {
+                middle[c] = 0.5 * static_cast<double>(tsc[c] + tsc[c + 1]);
+            }
+            long long raw = Nanoseconds(ts[0]);
+            long long mono = Nanoseconds(ts[1]);
+            long long real = Nanoseconds(ts[2]);
+            best.Tsc = static_cast<long long>(middle[0]);
+            best.Raw = raw;
+            best.MonoMinusRaw = llround((mono - raw) - (middle[1] - middle[0]) * nsPerTick);
+            best.RealMinusMono = llround((real - mono) - (middle[2] - middle[1]) * nsPerTick);
+            best.Window = window;
+        }
+
+        timex tx;
+        memset(&tx, 0, sizeof(tx));
+        adjtimex(&tx);
+        best.Freq = tx.freq;
+        best.Tick = tx.tick;
+        best.Status = tx.status;
+        best.Offset = tx.offset;
+        return best;
+    }
+
+private:
+    static unsigned long long ReadTsc()
+    {
+        _mm_lfence();
+        unsigned long long tsc = __rdtsc();
+        _mm_lfence();
+        return tsc;
+    }
+
+    static long long Nanoseconds(const timespec & Ts)
+    {
+        return static_cast<long long>(Ts.tv_sec) * 1000000000ll + Ts.tv_nsec;
+    }
+
+    double nsPerTick;
+};
+
+// Rebuilds the kernel's adjustments from the samples, one second at a time
+class SlewReconstructor
+{
+public:
+    SlewReconstructor(double StepThreshold, double PpmThreshold, bool Verbose) :
+        stepThreshold(StepThreshold),
+        ppmThreshold(PpmThreshold),
+        verbose(Verbose),
+        havePrevious(false),
+        haveRate(false),
+        rate(0),
+        steps(0),
+        changes(0),
+        minimum(HUGE_VAL),
+        maximum(-HUGE_VAL),
+        nominalTick(1e6 / sysconf(_SC_CLK_TCK))
+    {
+        if (verbose)
+        {
+            printf("RAW_S, MEASURED_PPM, ADJTIMEX_PPM, SLEW_PPM, ADJ_OFFSET, STATUS\n");
+        }
+    }
+
+    void Add(const ClockSample & Sample)
+    {
+        if (havePrevious)
+        {
+            long long step = Sample.RealMinusMono - previous.RealMinusMono;
+            if (fabs(static_cast<double>(step)) > stepThreshold)
+            {
+                steps++;
+                printf("%.3f: REALTIME stepped by %+.3fus\n", Sample.Raw / 1e9, step / 1e3);
+            }
+            if (Sample.Freq != previous.Freq || Sample.Tick != previous.Tick || Sample.Status != previous.Status)
+            {
+                printf("%.3f: adjtimex freq %.3fppm -> %.3fppm, tick %lld -> %lld, status 0x%llx -> 0x%llx\n",
+                    Sample.Raw / 1e9,
+                    previous.Freq / 65536.0,
+                    Sample.Freq / 65536.0,
+                    previous.Tick,
+                    Sample.Tick,
+                    previous.Status,
+                    Sample.Status);
+            }
+        }
+        previous = Sample;
+        havePrevious = true;
+
+        if (!second.empty() && Sample.Raw - second.front().Raw >= 1000000000ll)
+        {
+            Second();
+            second.clear();
+        }
+        second.push_back(Sample);
+    }
+
+    void Finish()
+    {
+        if (second.size() > 2)
+        {
+            Second();
+        }
+        printf("%zu steps, %zu frequency changes, MONOTONIC ran %.3f to %.3fppm from RAW\n",
+            steps,
+            changes,
+            minimum == HUGE_VAL ? 0 : minimum,
+            maximum == -HUGE_VAL ? 0 : maximum);
+    }
+
+private:
+    // Least squares slope of MONOTONIC - RAW over the second, in ppm
+    void Second()
+    {
+        double n = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+        const ClockSample & first = second.front();
+        for (const ClockSample & s : second)
+        {
+            double x = static_cast<double>(s.Raw - first.Raw);
+            double y = static_cast<double>(s.MonoMinusRaw - first.MonoMinusRaw);
+            n++;
+            sx += x;
+            sy += y;
+            sxx += x * x;
+            sxy += x * y;
+        }
+        double dxx = sxx - sx * sx / n;
+        if (n < 3 || dxx <= 0)
+        {
+            return;
+        }
+        double measured = (sxy - sx * sy / n) / dxx * 1e6;
+        const ClockSample & last = second.back();
+        double stated = last.Freq / 65536.0 + (last.Tick - nominalTick) / nominalTick * 1e6;
+        minimum = std::min(minimum, measured);
+        maximum = std::max(maximum, measured);
+        if (verbose)
+        {
+            printf("%.3f, %.4f, %.4f, %.4f, %lld, 0x%llx\n", first.Raw / 1e9, measured, stated, measured - stated, last.Offset, last.Status);
+        }
+        if (haveRate && fabs(measured - rate) > ppmThreshold)
+        {
+            changes++;
+            printf("%.3f: MONOTONIC frequency %.4fppm -> %.4fppm (adjtimex %.4fppm, slew %+.4fppm)\n",
+                first.Raw / 1e9, rate, measured, stated, measured - stated);
+        }
+        rate = measured;
+        haveRate = true;
+    }
+
+    double stepThreshold;
+    double ppmThreshold;
+    bool verbose;
+    bool havePrevious;
+    bool haveRate;
+    ClockSample previous;
+    std::vector<ClockSample> second;
+    double rate;
+    size_t steps;
+    size_t changes;
+    double minimum;
+    double maximum;
+    double nominalTick;
+};
+
+int main(int argc, char ** argv)
+{
+    std::map<std::string, std::string> args = ParseCommandLine(argc, argv, 2);
+    std::string mode = argc > 1 ? argv[1] : "";
+    if ((mode != "record" && mode != "print" && mode != "replay") || (mode != "record" && args.find("file") == args.end()))
+    {
+        printf("usage: %s record [-file <out.slew>] [-interval <ms>] [-duration <s>] [-step <us>] [-ppm <threshold>] [-verbose yes]\n", argv[0]);
+        printf("       %s replay -file <in.slew> [-step <us>] [-ppm <threshold>] [-verbose yes]\n", argv[0]);
+        printf("       %s print -file <in.slew>\n", argv[0]);
+        exit(-1);
+    }
+    double step = args.find("step") != args.end() ? atof(args["step"].c_str()) * 1e3 : 1000;
+    double ppm = args.find("ppm") != args.end() ? atof(args["ppm"].c_str()) : 0.1;
+    bool verbose = args.find("verbose") != args.end() && args["verbose"] == "yes";
+
+    if (mode != "record")
+    {
+        std::vector<ClockSample> samples;
+        if (!ReadSamples(args["file"], samples))
+        {
+            printf("%s is not a slewtracker file\n", args["file"].c_str());
+            exit(-1);
+        }
+        if (mode == "print")
+        {
+            printf("TSC, RAW_NS, MONO_MINUS_RAW_NS, REAL_MINUS_MONO_NS, WINDOW, FREQ, TICK, STATUS, OFFSET\n");
+            for (const ClockSample & s : samples)
+            {
+                printf("%lld, %lld, %lld, %lld, %lld, %lld, %lld, 0x%llx, %lld\n",
+                    s.Tsc, s.Raw, s.MonoMinusRaw, s.RealMinusMono, s.Window, s.Freq, s.Tick, s.Status, s.Offset);
+            }
+            return 0;
+        }
+        SlewReconstructor reconstructor(step, ppm, verbose);
+        for (const ClockSample & s : samples)
+        {
+            reconstructor.Add(s);
+        }
+        reconstructor.Finish();
+        return 0;
+    }
+
+    double interval = args.find("interval") != args.end() ? std::max(1.0, atof(args["interval"].c_str())) : 100;
+    double duration = args.find("duration") != args.end() ? atof(args["duration"].c_str()) : 0;
+    FILE * file = nullptr;
+    std::unique_ptr<SampleWriter> writer;
+    if (args.find("file") != args.end())
+    {
+        file = fopen(args["file"].c_str(), "wb");
+        if (file == nullptr)
+        {
+            printf("can't write %s: %s\n", args["file"].c_str(), strerror(errno));
+            exit(-1);
+        }
+        writer.reset(new SampleWriter(file));
+    }
+
+    TscFrequency tsc = TscCalibration::Calibrate();
+    fprintf(stderr, "TSC frequency %.0f Hz +/- %.0f Hz (%s)\n", tsc.Frequency, tsc.Uncertainty, tsc.Source);
+    ClockReader reader(tsc.Frequency);
+    SlewReconstructor reconstructor(step, ppm, verbose);
+    auto start = std::chrono::steady_clock::now();
+    auto next = start;
+    for (size_t count = 0; duration <= 0 || std::chrono::steady_clock::now() - start < std::chrono::duration<double>(duration); count++)
+    {
+        ClockSample sample = reader.Read();
+        reconstructor.Add(sample);
+        if (writer)
+        {
+            writer->Write(sample);
+            if (count % 100 == 0)
+            {
+                fflush(file);
+            }
+        }
+        fflush(stdout);
+        next += std::chrono::microseconds(static_cast<long long>(interval * 1e3));
+        std::this_thread::sleep_until(next);
+    }
+    reconstructor.Finish();
+    if (file != nullptr)
+    {
+        fclose(file);
+    }
+    return 0;
+}
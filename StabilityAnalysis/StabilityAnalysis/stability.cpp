@@ -0,0 +1,336 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    stability.cpp
+
+Abstract:
+
+    Computes the overlapping Allan deviation, modified Allan deviation and
+    time deviation of a clock offset (phase) series at every octave tau.
+
+    For phase samples x spaced tau0 apart and m = tau / tau0:
+
+        AVAR(tau) = sum (x[i+2m] - 2x[i+m] + x[i])^2 / (2 tau^2 (N - 2m))
+
+        MVAR(tau) = sum (S[j+3m] - 3S[j+2m] + 3S[j+m] - S[j])^2 / (2 m^2 tau^2 (N - 3m + 1))
+
+        TVAR(tau) = tau^2 / 3 * MVAR(tau)
+
+    where S is the prefix sum of x, which turns the inner m-term sums of the
+    modified Allan variance into four lookups. Each tau is then O(N), and
+    with log2(N) octave taus the whole sweep is O(N log N). The sums over i
+    and j are split across threads.
+
+    A least squares line is removed from the series first. Second differences
+    are unaffected by it, but it keeps the prefix sums small enough that the
+    differences of them don't lose precision to a constant frequency offset.
+
+--*/
+
+#include <chrono>
+#include <map>
+#include "CommandLine/CommandLine.h"
+#include "TimeSamples/TimeSamples.h"
+
+// Run Body(Begin, End, Thread) over [0, Count) split into Threads ranges
+template<typename TBody>
+void ParallelFor(size_t Threads, size_t Count, TBody Body)
+{
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < Threads; t++)
+    {
+        size_t begin = Count * t / Threads;
+        size_t end = Count * (t + 1) / Threads;
+        workers.push_back(std::thread([=, &Body]() { Body(begin, end, t); }));
+    }
+    for (auto & w : workers)
+    {
+        w.join();
+    }
+}
+
+// Extract the numeric value of Column from every line in [Begin, End).
+// Lines where that field isn't a number, such as headers, are skipped.
+void ParseLines(const char * Begin, const char * End, size_t Column, std::vector<double> & Values)
+{
+    const char * p = Begin;
+    while (p < End)
+    {
+        const char * eol = static_cast<const char *>(memchr(p, '\n', End - p));
+        eol = eol == nullptr ? End : eol;
+        for (size_t c = 0; c < Column && p < eol; c++)
+        {
+            p = static_cast<const char *>(memchr(p, ',', eol - p));
+            p = p == nullptr ? eol : p + 1;
+        }
+        double value;
+        if (p < eol && ParseDouble(p, eol, value))
+        {
+            Values.push_back(value);
+        }
+        p = eol + 1;
+    }
+}
+
+// Read one column of a CSV or plain list of numbers, parsing chunks of the
+// file in parallel.
+std::vector<double> ReadSeries(const char * Data, size_t Length, size_t Column, size_t Threads)
+{
+    std::vector<const char *> bounds(Threads + 1);
+    for (size_t t = 0; t <= Threads; t++)
+    {
+        const char * b = Data + Length * t / Threads;
+        if (t > 0 && t < Threads)
+        {
+            // Start each chunk at the beginning of a line
+            const char * eol = static_cast<const char *>(memchr(b, '\n', Data + Length - b));
+            b = eol == nullptr ? Data + Length : eol + 1;
+        }
+        bounds[t] = std::max(b, t > 0 ? bounds[t - 1] : Data);
+    }
+
+    std::vector<std::vector<double>> chunks(Threads);
+    ParallelFor(Threads, Threads, [&](size_t Begin, size_t End, size_t)
+    {
+        for (size_t t = Begin; t < End; t++)
+        {
+            ParseLines(bounds[t], bounds[t + 1], Column, chunks[t]);
+        }
+    });
+
+    std::vector<double> series;
+    size_t total = 0;
+    for (auto & c : chunks)
+    {
+        total += c.size();
+    }
+    series.reserve(total);
+    for (auto & c : chunks)
+    {
+        series.insert(series.end(), c.begin(), c.end());
+        std::vector<double>().swap(c);
+    }
+    return series;
+}
+
+// Remove the least squares line through (i, x[i]) in place
+void Detrend(std::vector<double> & X, size_t Threads)
+{
+    std::vector<long double> sumX(Threads);
+    std::vector<long double> sumIX(Threads);
+    size_t n = X.size();
+
+    ParallelFor(Threads, n, [&](size_t Begin, size_t End, size_t Thread)
+    {
+        long double sx = 0;
+        long double six = 0;
+        for (size_t i = Begin; i < End; i++)
+        {
+            sx += X[i];
+            six += static_cast<long double>(i) * X[i];
+        }
+        sumX[Thread] = sx;
+        sumIX[Thread] = six;
+    });
+
+    long double sx = 0;
+    long double six = 0;
+    for (size_t t = 0; t < Threads; t++)
+    {
+        sx += sumX[t];
+        six += sumIX[t];
+    }
+    long double N = static_cast<long double>(n);
+    long double si = N * (N - 1) / 2;
+    long double sii = (N - 1) * N * (2 * N - 1) / 6;
+    long double slope = (N * six - si * sx) / (N * sii - si * si);
+    long double intercept = (sx - slope * si) / N;
+
+    ParallelFor(Threads, n, [&](size_t Begin, size_t End, size_t)
+    {
+        for (size_t i = Begin; i < End; i++)
+        {
+            X[i] = static_cast<double>(X[i] - (intercept + slope * static_cast<long double>(i)));
+        }
+    });
+}
+
+// S[k] = x[0] + ... + x[k-1], computed as a two pass parallel scan
+std::vector<double> PrefixSums(const std::vector<double> & X, size_t Threads)
+{
+    size_t n = X.size();
+    std::vector<double> s(n + 1);
+    std::vector<long double> blocks(Threads + 1);
+
+    ParallelFor(Threads, n, [&](size_t Begin, size_t End, size_t Thread)
+    {
+        long double sum = 0;
+        for (size_t i = Begin; i < End; i++)
+        {
+            sum += X[i];
+        }
+        blocks[Thread + 1] = sum;
+    });
+    for (size_t t = 1; t <= Threads; t++)
+    {
+        blocks[t] += blocks[t - 1];
+    }
+    ParallelFor(Threads, n, [&](size_t Begin, size_t End, size_t Thread)
+    {
+        long double sum = blocks[Thread];
+        for (size_t i = Begin; i < End; i++)
+        {
+            sum += X[i];
+            s[i + 1] = static_cast<double>(sum);
+        }
+    });
+    s[0] = 0;
+    return s;
+}
+
+// Sum of Term(i) over [0, Count) across threads
+template<typename TTerm>
+long double ParallelSum(size_t Threads, size_t Count, TTerm Term)
+{
+    std::vector<long double> partial(Threads);
+    ParallelFor(Threads, Count, [&](size_t Begin, size_t End, size_t Thread)
+    {
+        // Accumulate in double in short runs for speed, and the runs in
+        // long double so ten million terms don't lose precision.
+        long double total = 0;
+        for (size_t i = Begin; i < End; )
+        {
+            size_t runEnd = std::min(End, i + 4096);
+            double run = 0;
+            for (; i < runEnd; i++)
+            {
+                run += Term(i);
+            }
+            total += run;
+        }
+        partial[Thread] = total;
+    });
+    long double sum = 0;
+    for (auto p : partial)
+    {
+        sum += p;
+    }
+    return sum;
+}
+
+int main(int argc, char ** argv)
+{
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t column = 0;
+    double tau0 = 1;
+    double scale = 1;
+
+    std::map<std::string, std::string> args = ParseCommandLine(argc, argv);
+    if (args.find("file") == args.end())
+    {
+        printf("usage: %s -file <offsets.csv> [-column <index>] [-tau0 <seconds>] [-units <s/ms/us/ns>] [-threads <count>]\n", argv[0]);
+        printf("column is the zero based CSV column holding the clock offset, tau0 the sample spacing\n");
+        exit(-1);
+    }
+    if (args.find("column") != args.end())
+    {
+        column = strtoul(args["column"].c_str(), nullptr, 10);
+    }
+    if (args.find("tau0") != args.end())
+    {
+        tau0 = atof(args["tau0"].c_str());
+        if (!(tau0 > 0))
+        {
+            printf("tau0 must be positive\n");
+            exit(-1);
+        }
+    }
+    if (args.find("units") != args.end())
+    {
+        const std::string & units = args["units"];
+        if (units == "ms")
+        {
+            scale = 1e-3;
+        }
+        else if (units == "us")
+        {
+            scale = 1e-6;
+        }
+        else if (units == "ns")
+        {
+            scale = 1e-9;
+        }
+        else if (units != "s")
+        {
+            printf("unknown units %s\n", units.c_str());
+            exit(-1);
+        }
+    }
+    if (args.find("threads") != args.end())
+    {
+        threads = std::max(1, atoi(args["threads"].c_str()));
+    }
+
+    MappedFile file(args["file"]);
+    if (!file.IsOpen())
+    {
+        printf("unable to read %s\n", args["file"].c_str());
+        exit(-1);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<double> x = ReadSeries(file.Data(), file.Length(), column, threads);
+    size_t n = x.size();
+    if (n < 3)
+    {
+        printf("need at least 3 samples, found %zu\n", n);
+        exit(-1);
+    }
+    auto parsed = std::chrono::steady_clock::now();
+
+    ParallelFor(threads, n, [&](size_t Begin, size_t End, size_t)
+    {
+        for (size_t i = Begin; i < End; i++)
+        {
+            x[i] *= scale;
+        }
+    });
+    Detrend(x, threads);
+    std::vector<double> s = PrefixSums(x, threads);
+
+    printf("TAU, M, ADEV, MDEV, TDEV, N\n");
+    // MDEV and TDEV average n - 3m + 1 terms, so 3m can be at most n
+    for (size_t m = 1; 3 * m <= n; m *= 2)
+    {
+        double tau = m * tau0;
+        const double * px = x.data();
+        const double * ps = s.data();
+
+        long double adevSum = ParallelSum(threads, n - 2 * m, [=](size_t i)
+        {
+            double d = px[i + 2 * m] - 2 * px[i + m] + px[i];
+            return d * d;
+        });
+        long double mdevSum = ParallelSum(threads, n - 3 * m + 1, [=](size_t j)
+        {
+            double d = ps[j + 3 * m] - 3 * ps[j + 2 * m] + 3 * ps[j + m] - ps[j];
+            return d * d;
+        });
+
+        double avar = static_cast<double>(adevSum / (2.0L * tau * tau * (n - 2 * m)));
+        double mvar = static_cast<double>(mdevSum / (2.0L * m * m * tau * tau * (n - 3 * m + 1)));
+        double tvar = tau * tau / 3 * mvar;
+        printf("%.9g, %zu, %.6e, %.6e, %.6e, %zu\n", tau, m, sqrt(avar), sqrt(mvar), sqrt(tvar), n - 2 * m);
+    }
+
+    auto done = std::chrono::steady_clock::now();
+    fprintf(stderr, "%zu samples, parsed in %.3fs, analyzed in %.3fs\n",
+        n,
+        std::chrono::duration<double>(parsed - start).count(),
+        std::chrono::duration<double>(done - parsed).count());
+
+    return 0;
+}
@@ -1,93 +1,244 @@
-// Simple tool to measure the TSC offset between two CPU cores.
-// Reports the offset as mean, median and stdev, along with the round trip time of the measure.
-
-#include "stdafx.h"
-#include <atomic>
-#include <thread>
-#include <vector>
-#include <algorithm>
-
-void CollectSamples(std::atomic<bool> & Signal, bool Client, std::vector<unsigned long long> & Samples)
-{
-    unsigned int i;
-    for (size_t index = 0; index < Samples.size(); index++)
-    {
-        while (Signal.load() != Client)
-        {
-        }
-        unsigned long long ts = __rdtscp(&i);
-        Signal.store(!Client);
-        Samples[index] = ts;
-    }
-}
-
-void ComputeStats(std::vector<long long> Samples, long long & Mean, long long & Median, long long & StdDev)
-{
-    Mean = 0;
-    Median = 0;
-    StdDev = 0;
-    std::sort(Samples.begin(), Samples.end());
-    std::for_each(Samples.begin(), Samples.end(), [&](long long Sample)
-    {
-        Mean += Sample;
-    });
-    Mean /= static_cast<long long>(Samples.size());
-    std::for_each(Samples.begin(), Samples.end(), [&](long long Sample) 
-    {
-        StdDev += (Sample - Mean) * (Sample - Mean);
-    });
-    StdDev /= static_cast<long long>(Samples.size());
-    StdDev = std::sqrt(StdDev);
-    Median = Samples[Samples.size() / 2];
-}
-
-int main(int argc, char ** argv)
-{
-    if (argc != 4)
-    {
-        printf("Usage: %s cpu# cpu# iterations\n", argv[0]);
-        printf("Example: %s 0 1 1000000\n", argv[0]);
-        exit(-1);
-    }
-    size_t serverCpuId = atoi(argv[1]);
-    size_t clientCpuId = atoi(argv[2]);
-    size_t samples = atoi(argv[3]);
-    std::vector<unsigned long long> tsClient(samples);
-    std::vector<unsigned long long> tsServer(samples);
-    std::atomic<bool> clientOwns;
-
-    printf("O-Mean\tO-Med\tO-STDEV\tR-Mean\tR-Med\tR-STDEV\n");
-    for (size_t i = 0; i < 10; i++)
-    {
-        clientOwns.store(false);
-        // Client and server are arbitrary
-        auto client = std::thread([&tsClient, &clientOwns, samples, clientCpuId]() {
-            SetThreadAffinity(clientCpuId);
-            CollectSamples(clientOwns, true, tsClient);
-        });
-        auto server = std::thread([&tsServer, &clientOwns, samples, serverCpuId]() {
-            SetThreadAffinity(serverCpuId);
-            CollectSamples(clientOwns, false, tsServer);
-        });
-        client.join();
-        server.join();
-
-        std::vector<long long> offsets;
-        std::vector<long long> rtts;
-        long long avgOffset = 0;
-        for (size_t i = 0; i < samples - 1; i++)
-        {
-            // If the TSC was synchronized, then tsClient[i] would be half way betweem tsServer[i] and tsServer[i+1]
-            long long offset = (2 * (long long)tsClient[i] - (long long)tsServer[i] - (long long)tsServer[i + 1]) / 2;
-            long long rtt = (long long)tsServer[i + 1] - (long long)tsServer[i];
-            offsets.push_back(offset);
-            rtts.push_back(rtt);
-        }
-
-        long long mean, median, stddev;
-        ComputeStats(offsets, mean, median, stddev);
-        printf("%lld\t%lld\t%lld\t", mean, median, stddev);
-        ComputeStats(rtts, mean, median, stddev);
-        printf("%lld\t%lld\t%lld\n", mean, median, stddev);
-    }
-}
\ No newline at end of file
+// Simple tool to measure the TSC offset between two CPU cores.
+// Reports the offset as mean, median and stdev, along with the round trip time of the measure.
+// With -rtt it instead compares the mailbox layouts of Lib/Mailbox/Mailbox.h, printing the
+// round trip time distribution of each layout for a CPU pair of each latency class.
+
+#include "stdafx.h"
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "CommandLine/CommandLine.h"
+#include "Mailbox/Mailbox.h"
+#include "Topology/Topology.h"
+
+// Each side posts its TSC in its own mailbox slot before handing the turn
+// over, so the layout decides which lines move with the state
+void CollectSamples(Mailbox & Box, bool Client, std::vector<unsigned long long> & Samples)
+{
+    std::atomic<unsigned long long> & signal = Box.State();
+    std::atomic<unsigned long long> & slot = Box.Slot(Client ? Mailbox::Client : Mailbox::Server, 0);
+    unsigned int i;
+    for (size_t index = 0; index < Samples.size(); index++)
+    {
+        while (signal.load() != Client)
+        {
+        }
+        unsigned long long ts = __rdtscp(&i);
+        slot.store(ts, std::memory_order_relaxed);
+        signal.store(!Client);
+        Samples[index] = ts;
+    }
+}
+
+void ComputeStats(std::vector<long long> Samples, long long & Mean, long long & Median, long long & StdDev)
+{
+    Mean = 0;
+    Median = 0;
+    StdDev = 0;
+    std::sort(Samples.begin(), Samples.end());
+    std::for_each(Samples.begin(), Samples.end(), [&](long long Sample)
+    {
+        Mean += Sample;
+    });
+    Mean /= static_cast<long long>(Samples.size());
+    std::for_each(Samples.begin(), Samples.end(), [&](long long Sample)
+    {
+        StdDev += (Sample - Mean) * (Sample - Mean);
+    });
+    StdDev /= static_cast<long long>(Samples.size());
+    StdDev = static_cast<long long>(std::sqrt(static_cast<double>(StdDev)));
+    Median = Samples[Samples.size() / 2];
+}
+
+// One ping-pong per iteration: the client posts T1 in its slot and raises
+// the state, the server answers with T2 and T3 in its slots, the client
+// reads them at T4 and posts it too, as TscOffset's message does. With one
+// line per side the client's line is the state's neighbour, the one the
+// adjacent line prefetcher pulls along.
+void Exchange(Mailbox & Box, int ClientCpu, int ServerCpu, size_t Iterations, std::vector<long long> & Rtts, std::vector<long long> & Offsets)
+{
+    Rtts.resize(Iterations);
+    Offsets.resize(Iterations);
+    Box.State().store(0);
+    std::thread server([&]()
+    {
+        Mailbox::Pin(ServerCpu);
+        unsigned int aux;
+        for (size_t i = 0; i < Iterations; i++)
+        {
+            while (Box.State().load(std::memory_order_acquire) != 1)
+            {
+            }
+            Box.Slot(Mailbox::Server, 0).store(__rdtscp(&aux), std::memory_order_relaxed);
+            Box.Slot(Mailbox::Server, 1).store(__rdtscp(&aux), std::memory_order_relaxed);
+            Box.State().store(2, std::memory_order_release);
+        }
+    });
+
+    Mailbox::Pin(ClientCpu);
+    unsigned int aux;
+    for (size_t i = 0; i < Iterations; i++)
+    {
+        long long t1 = static_cast<long long>(__rdtscp(&aux));
+        Box.Slot(Mailbox::Client, 0).store(t1, std::memory_order_relaxed);
+        Box.State().store(1, std::memory_order_release);
+        while (Box.State().load(std::memory_order_acquire) != 2)
+        {
+        }
+        long long t4 = static_cast<long long>(__rdtscp(&aux));
+        Box.Slot(Mailbox::Client, 1).store(t4, std::memory_order_relaxed);
+        long long t2 = static_cast<long long>(Box.Slot(Mailbox::Server, 0).load(std::memory_order_relaxed));
+        long long t3 = static_cast<long long>(Box.Slot(Mailbox::Server, 1).load(std::memory_order_relaxed));
+        Rtts[i] = (t4 - t1) - (t3 - t2);
+        Offsets[i] = ((t2 - t1) + (t3 - t4)) / 2;
+    }
+    server.join();
+}
+
+int CompareLayouts(std::map<std::string, std::string> & Args)
+{
+    size_t iterations = Args["iterations"].empty() ? 100000 : strtoul(Args["iterations"].c_str(), nullptr, 10);
+    std::vector<MailboxLayout> layouts;
+    if (Args["layout"].empty() || Args["layout"] == "all")
+    {
+        layouts = { MailboxLayout::SingleLine, MailboxLayout::SplitLine, MailboxLayout::Padded128 };
+    }
+    else
+    {
+        MailboxLayout layout;
+        if (!ParseMailboxLayout(Args["layout"], layout))
+        {
+            printf("Unknown layout %s, use single, split, 128 or all\n", Args["layout"].c_str());
+            return -1;
+        }
+        layouts.push_back(layout);
+    }
+    std::string home = Args["home"].empty() ? "server" : Args["home"];
+
+    // -pairs 0:1,0:8 or a pair per latency class of this machine or of an
+    // hwloc XML export
+    Topology topology = Args["topology"].empty() ? Topology::FromSystem() : Topology::FromHwlocXml(Args["topology"]);
+    std::vector<CpuPair> pairs;
+    const char * list = Args["pairs"].c_str();
+    int client;
+    int server;
+    int consumed;
+    while (sscanf(list, "%d:%d%n", &client, &server, &consumed) == 2)
+    {
+        const CpuLocation * first = topology.Find(client);
+        const CpuLocation * second = topology.Find(server);
+        pairs.push_back({ client, server, first && second ? Topology::Classify(*first, *second) : PairClass::CrossSocket });
+        list += consumed;
+        list += *list == ',' ? 1 : 0;
+    }
+    if (pairs.empty())
+    {
+        pairs = topology.RepresentativePairs();
+    }
+    if (pairs.empty())
+    {
+        printf("No pairs of CPUs to measure, pass -pairs\n");
+        return -1;
+    }
+
+    printf("Client\tServer\tClass\tLayout\tHome\tR-Min\tR-P1\tR-P10\tR-Med\tR-P90\tR-P99\tR-Max\tO-Med\n");
+    for (auto & pair : pairs)
+    {
+        for (MailboxLayout layout : layouts)
+        {
+            Mailbox box(layout, home == "client" ? pair.First : home == "server" ? pair.Second : -1);
+            std::vector<long long> rtts;
+            std::vector<long long> offsets;
+            Exchange(box, pair.First, pair.Second, iterations, rtts, offsets);
+            std::sort(rtts.begin(), rtts.end());
+            std::sort(offsets.begin(), offsets.end());
+            auto percentile = [&](double P)
+            {
+                return rtts[std::min(rtts.size() - 1, static_cast<size_t>(P * rtts.size()))];
+            };
+            printf("%d\t%d\t%s\t%s\t%s\t%lld\t%lld\t%lld\t%lld\t%lld\t%lld\t%lld\t%lld\n",
+                pair.First,
+                pair.Second,
+                PairClassName(pair.Class),
+                MailboxLayoutName(layout),
+                home.c_str(),
+                rtts.front(),
+                percentile(0.01),
+                percentile(0.1),
+                percentile(0.5),
+                percentile(0.9),
+                percentile(0.99),
+                rtts.back(),
+                offsets[offsets.size() / 2]);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc > 1 && strcmp(argv[1], "-rtt") == 0)
+    {
+        std::map<std::string, std::string> args = ParseCommandLine(argc, argv);
+        exit(CompareLayouts(args));
+    }
+    if (argc != 4 && argc != 5)
+    {
+        printf("Usage: %s cpu# cpu# iterations [single|split|128]\n", argv[0]);
+        printf("Example: %s 0 1 1000000\n", argv[0]);
+        printf("       %s -rtt [-pairs client:server,... | -topology hwloc.xml] [-layout single|split|128|all] [-home server|client|any] [-iterations n]\n", argv[0]);
+        exit(-1);
+    }
+    size_t serverCpuId = atoi(argv[1]);
+    size_t clientCpuId = atoi(argv[2]);
+    size_t samples = atoi(argv[3]);
+    MailboxLayout layout = MailboxLayout::SingleLine;
+    if (argc == 5 && !ParseMailboxLayout(argv[4], layout))
+    {
+        printf("Unknown layout %s\n", argv[4]);
+        exit(-1);
+    }
+    std::vector<unsigned long long> tsClient(samples);
+    std::vector<unsigned long long> tsServer(samples);
+    Mailbox box(layout, static_cast<int>(serverCpuId));
+    std::atomic<unsigned long long> & clientOwns = box.State();
+
+    printf("O-Mean\tO-Med\tO-STDEV\tR-Mean\tR-Med\tR-STDEV\n");
+    for (size_t i = 0; i < 10; i++)
+    {
+        clientOwns.store(false);
+        // Client and server are arbitrary
+        auto client = std::thread([&tsClient, &box, clientCpuId]() {
+            SetThreadAffinity(clientCpuId);
+            CollectSamples(box, true, tsClient);
+        });
+        auto server = std::thread([&tsServer, &box, serverCpuId]() {
+            SetThreadAffinity(serverCpuId);
+            CollectSamples(box, false, tsServer);
+        });
+        client.join();
+        server.join();
+
+        std::vector<long long> offsets;
+        std::vector<long long> rtts;
+        long long avgOffset = 0;
+        for (size_t i = 0; i < samples - 1; i++)
+        {
+            // If the TSC was synchronized, then tsClient[i] would be half way betweem tsServer[i] and tsServer[i+1]
+            long long offset = (2 * (long long)tsClient[i] - (long long)tsServer[i] - (long long)tsServer[i + 1]) / 2;
+            long long rtt = (long long)tsServer[i + 1] - (long long)tsServer[i];
+            offsets.push_back(offset);
+            rtts.push_back(rtt);
+        }
+
+        long long mean, median, stddev;
+        ComputeStats(offsets, mean, median, stddev);
+        printf("%lld\t%lld\t%lld\t", mean, median, stddev);
+        ComputeStats(rtts, mean, median, stddev);
+        printf("%lld\t%lld\t%lld\n", mean, median, stddev);
+    }
+}
@@ -17,9 +17,10 @@ inline bool SetThreadAffinity(size_t CpuId)
 #else
 
 #define CACHE_ALIGN(x) \
-x __attribute((alligned(64)))
+x __attribute__((aligned(64)))
 
 #include <pthread.h>
+#include <x86intrin.h>
 inline bool SetThreadAffinity(size_t CpuId)
 {
     cpu_set_t cpuset;
@@ -0,0 +1,239 @@
+/*++
+
+Copyright (c) Microsoft Corporation
+
+Module Name:
+
+    tscdelta.cpp
+
+Abstract:
+
+    Estimates the TSC delta between a root and a guest sample set, the value
+    TimeSampleCorrelation otherwise needs supplied by hand, with confidence
+    bounds; see Lib/TimeSamples/TscDelta.h for the method. With -correlate
+    yes the guest samples are then correlated against the root ones using the
+    estimate, printing the same date, skew, rtt lines as
+    TimeSampleCorrelation, so a fleet of VMs can be processed unattended.
+    -check yes runs the estimator on synthetic sets with a known delta and
+    fails unless every bound holds the truth.
+
+--*/
+
+#include <chrono>
+#include <map>
+#include <random>
+#include "CommandLine/CommandLine.h"
+#include "TimeSamples/TimeSamples.h"
+#include "TimeSamples/TimeCorrelation.h"
+#include "TimeSamples/TscDelta.h"
+
+bool ReadSamples(const std::string & FileName, size_t Column, size_t Threads, SampleColumns & Samples)
+{
+    MappedFile file(FileName);
+    SampleParser parser(Column);
+    if (!file.IsOpen() || !parser.Parse(file, Threads, Samples) || Samples.Size() == 0)
+    {
+        printf("%s does not contain time samples\n", FileName.c_str());
+        return false;
+    }
+    return true;
+}
+
+// TimeSampleCorrelation's output for the guest shifted by Delta, from
+// LiveCorrelation's correlator fed both files in TSC order. Nothing expires,
+// root samples wait until the guest passes them.
+void Correlate(const SampleColumns & Root, const SampleColumns & Guest, long long Delta)
+{
+    Correlator<TimeSample> correlator(Delta);
+    auto never = [](const TimeSample &) { return false; };
+    auto sample = [](const SampleColumns & Samples, size_t Index)
+    {
+        TimeSample s;
+        s.TscStart = Samples.TscStart[Index];
+        s.TscEnd = Samples.TscEnd[Index];
+        s.TimeStamp = Samples.OsTime[Index];
+        return s;
+    };
+    size_t r = 0;
+    size_t g = 0;
+    while (r < Root.Size() || g < Guest.Size())
+    {
+        if (g == Guest.Size() || (r < Root.Size() && Root.TscStart[r] <= Guest.TscStart[g] - Delta))
+        {
+            correlator.AddRoot(sample(Root, r++), never);
+        }
+        else
+        {
+            correlator.AddGuest(sample(Guest, g++), never);
+        }
+    }
+}
+
+// Root and guest samples of one clock with a known delta. The root reads
+// true time plus the steps (at whole seconds or random times) every 10ms;
+// the guest reads the root clock plus Offset, starting 3.1ms later, through
+// a TSC Delta ticks ahead, the two read with Noise (100ns units) each.
+struct Scenario
+{
+    const char * Name;
+    size_t Steps;
+    bool WholeSeconds;
+    double Noise;
+    double GuestSpacing;
+    bool Refinable;
+};
+
+void Synthesize(const Scenario & Scenario, long long Delta, long long Offset, SampleColumns & Root, SampleColumns & Guest)
+{
+    const double Frequency = 3e9;
+    const double Seconds = 600;
+    const double Spacing = 0.01;
+    const double Phase = 0.0031;
+    const long long TscBase = 1000000000000ll;
+    const long long TimeBase = 134368836480000000ll;
+
+    std::mt19937_64 random(7);
+    Root.Reserve(static_cast<size_t>(Seconds / Spacing) + 1);
+    Guest.Reserve(static_cast<size_t>(Seconds / Scenario.GuestSpacing) + 1);
+    std::uniform_real_distribution<double> size(200, 2000);
+    std::uniform_real_distribution<double> when(0, Seconds);
+    std::normal_distribution<double> noise(0, Scenario.Noise > 0 ? Scenario.Noise : 1);
+    std::vector<std::pair<double, double>> steps;
+    for (size_t k = 0; k < Scenario.Steps; k++)
+    {
+        double t = Scenario.WholeSeconds ? static_cast<double>(k + 1) : when(random);
+        steps.push_back(std::make_pair(t, random() & 1 ? size(random) : -size(random)));
+    }
+    std::sort(steps.begin(), steps.end());
+
+    auto clock = [&](double T)
+    {
+        double time = T * 1e7;
+        for (size_t k = 0; k < steps.size() && steps[k].first <= T; k++)
+        {
+            time += steps[k].second;
+        }
+        return time;
+    };
+    auto read = [&](SampleColumns & Samples, double T, long long Tsc, long long Shift)
+    {
+        double error = Scenario.Noise > 0 ? noise(random) : 0;
+        Samples.TscStart.push_back(Tsc + llround(T * Frequency) - 100);
+        Samples.TscEnd.push_back(Tsc + llround(T * Frequency) + 100);
+        Samples.OsTime.push_back(TimeBase + Shift + llround(clock(T) + error));
+    };
+    for (double t = 0; t < Seconds; t += Spacing)
+    {
+        read(Root, t, TscBase, 0);
+    }
+    for (double t = Phase; t < Seconds; t += Scenario.GuestSpacing)
+    {
+        read(Guest, t, TscBase + Delta, Offset);
+    }
+}
+
+// The estimator against the truth of a few synthetic pairs: the bounds
+// must hold the delta, and refined bounds must not be narrower than the
+// 10ms sample spacing, however exact the steps line up.
+int Check(size_t Threads)
+{
+    const long long Delta = -123456789;
+    const long long Offset = 65000;
+    const double Spacing = 3e7;
+    static const Scenario scenarios[] = {
+        { "no steps, no noise", 0, false, 0, 0.01, false },
+        { "steps at whole seconds", 599, true, 10, 0.01, true },
+        { "steps at random times", 600, false, 10, 0.01, true },
+        { "steps at random times, no noise", 600, false, 0, 0.01, true },
+        { "guest sampling every 7ms", 600, false, 10, 0.007, true },
+    };
+    int failed = 0;
+    for (const Scenario & scenario : scenarios)
+    {
+        SampleColumns root;
+        SampleColumns guest;
+        Synthesize(scenario, Delta, Offset, root, guest);
+        TscDeltaEstimate estimate = TscDeltaEstimator(root, guest, Threads).Estimate(100000);
+        bool pass = estimate.Low <= Delta && Delta <= estimate.High &&
+            estimate.Refined == scenario.Refinable &&
+            (!estimate.Refined || estimate.High - estimate.Low + 1 >= Spacing);
+        printf("%-32s delta=%.0f error=%.0f (%.0f to %.0f), %zu steps, %s %s\n",
+            scenario.Name,
+            estimate.Delta,
+            estimate.Delta - Delta,
+            estimate.Low,
+            estimate.High,
+            estimate.Steps,
+            estimate.Refined ? "refined" : "not refined",
+            pass ? "ok" : "FAILED");
+        failed += !pass;
+    }
+    return failed;
+}
+
+int main(int argc, char ** argv)
+{
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    size_t column = 0;
+    double range = 10000;
+
+    std::map<std::string, std::string> args = ParseCommandLine(argc, argv);
+    if (args.find("check") != args.end() && args["check"] == "yes")
+    {
+        return Check(threads);
+    }
+    if (args.find("root") == args.end() || args.find("guest") == args.end())
+    {
+        printf("usage: %s -root <root.csv> -guest <guest.csv> [-range <max clock offset in us>]\n"
+            "       [-column <first sample column>] [-threads <count>] [-correlate <yes/no>]\n"
+            "       %s -check yes\n", argv[0], argv[0]);
+        exit(-1);
+    }
+    if (args.find("range") != args.end())
+    {
+        range = std::max(1.0, atof(args["range"].c_str()));
+    }
+    if (args.find("column") != args.end())
+    {
+        column = strtoul(args["column"].c_str(), nullptr, 10);
+    }
+    if (args.find("threads") != args.end())
+    {
+        threads = std::max(1, atoi(args["threads"].c_str()));
+    }
+
+    SampleColumns root;
+    SampleColumns guest;
+    if (!ReadSamples(args["root"], column, threads, root) || !ReadSamples(args["guest"], column, threads, guest))
+    {
+        exit(-1);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    TscDeltaEstimator estimator(root, guest, threads);
+    TscDeltaEstimate estimate = estimator.Estimate(range * 10);
+    long long delta = llround(estimate.Delta);
+
+    // The estimate goes to stderr when the correlation follows on stdout
+    bool correlate = args.find("correlate") != args.end() && args["correlate"] == "yes";
+    FILE * out = correlate ? stderr : stdout;
+    fprintf(out, "TSC delta=%lld (%.0f to %.0f), coarse=%.0f, %zu matching steps, correlation=%.3f%s in %.3fs\n",
+        delta,
+        estimate.Low,
+        estimate.High,
+        estimate.Coarse,
+        estimate.Steps,
+        estimate.Correlation,
+        estimate.Refined ? "" : ", not refined, the clock steps don't pin it down",
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    fprintf(out, "TimeSampleCorrelation %s %s %llu\n",
+        args["root"].c_str(),
+        args["guest"].c_str(),
+        static_cast<unsigned long long>(delta));
+
+    if (correlate)
+    {
+        Correlate(root, guest, delta);
+    }
+    return estimate.Refined ? 0 : 1;
+}
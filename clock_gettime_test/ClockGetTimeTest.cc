@@ -21,18 +21,14 @@ Alan Jowett (alanjo) 19-March-2016
 #include <math.h>
 #include <time.h>
 #include <string.h>
-#include "CpuInfo.h"
+#include <sched.h>
+#include "CpuInfo/CpuInfo.h"
+#include "TscCalibration/TscCalibration.h"
+#include "VdsoClock/VdsoClock.h"
+#include "PerfCounters/PerfCounters.h"
 
 typedef unsigned long long DWORD64;
 
-unsigned long long __rdtsc()
-{
-	unsigned long low;
-	unsigned long high;
-	asm volatile("rdtsc" : "=a" (low), "=d" (high));
-	return low | ((unsigned long long)high) << 32;
-}
-
 double StdDevAsFractionOfMean(DWORD64 * Samples, size_t SampleSize)
 {
 	double mean = 0;
@@ -67,7 +63,7 @@ double TimeFromTimeSpec(timespec t)
 }
 
 
-void ScaleAndPrintResults(timespec Start, timespec End, size_t SampleSize, DWORD64* Samples, const char * Name)
+void ScaleAndPrintResults(timespec Start, timespec End, size_t SampleSize, DWORD64* Samples, const char * Name, const PerfCounters & Counters)
 {
 
 	double queryTime = TimeFromTimeSpec(End) - TimeFromTimeSpec(Start);
@@ -75,6 +71,7 @@ void ScaleAndPrintResults(timespec Start, timespec End, size_t SampleSize, DWORD
         queryTime /= SampleSize;
 	double stdev = StdDevAsFractionOfMean(Samples, SampleSize) * queryTime;
 	printf("%s latency %.1fns STDEV %.1fns\n", Name, queryTime, stdev);
+	printf("%s %s\n", Name, Counters.Format(static_cast<double>(SampleSize)).c_str());
 }
 
 void SetCpuAffinity()
@@ -82,9 +79,10 @@ void SetCpuAffinity()
         int cpu = sched_getcpu();
         cpu_set_t *cpuSet;
         size_t cpuSetSize;
-        cpuSetSize = CPU_ALLOC_SIZE(cpu);
-	cpuSet = CPU_ALLOC(cpu);
+        cpuSetSize = CPU_ALLOC_SIZE(cpu + 1);
+	cpuSet = CPU_ALLOC(cpu + 1);
         CPU_ZERO_S(cpuSetSize, cpuSet);
+        CPU_SET_S(cpu, cpuSetSize, cpuSet);
         sched_setaffinity(0, cpuSetSize, cpuSet);
         printf("Affinitizing to CPU %d\n", cpu);
         CPU_FREE(cpuSet);
@@ -103,12 +101,23 @@ int main(int argc, char ** argv)
 	}
 	printf("\n");
 	printf("CPU Info: Vendor: %s Brand: %s\n", InstructionSet::Vendor().c_str(), InstructionSet::Brand().c_str());
+	const char * source;
+	double tscFrequency = InstructionSet::NominalTscFrequency(&source);
+	printf("Nominal TSC frequency: %.0f Hz (%s)\n", tscFrequency, source);
+	TscFrequency calibration = TscCalibration::Calibrate();
+	printf("Calibrated TSC frequency: %.0f Hz +/- %.0f Hz (%s, %.1fms)\n",
+		calibration.Frequency, calibration.Uncertainty, calibration.Source, calibration.Milliseconds);
+	if (InstructionSet::Hypervisor())
+	{
+		printf("Hypervisor: %s\n", InstructionSet::HypervisorVendor().c_str());
+	}
 	if (!InstructionSet::TscInvariant())
 	{
 		printf("CPU doesn't support invariant TSC\n");
 		exit(-1);
 	}
 	SetCpuAffinity();
+	PerfCounters counters;
 
 	size_t sampleSize = atoll(argv[1]);
 	size_t iterations = atol(argv[2]);
@@ -120,6 +129,7 @@ int main(int argc, char ** argv)
 	{
 		timespec ts;
 		timespec start, end;
+		counters.Start();
 		clock_gettime(CLOCK_REALTIME, &start);
 		for (long long i = 0; i < sampleSize; i++)
 		{
@@ -127,19 +137,62 @@ int main(int argc, char ** argv)
 			samples[i] = __rdtsc();
 		}
 		clock_gettime(CLOCK_REALTIME, &end);
-		ScaleAndPrintResults(start, end, sampleSize, samples, "clock_gettime");
+		counters.Stop();
+		ScaleAndPrintResults(start, end, sampleSize, samples, "clock_gettime", counters);
+	}
+
+	// The same clocks converted from the TSC inline
+	VdsoClock vdsoClock;
+	printf("VdsoClock source: %s\n", vdsoClock.Source());
+	const clockid_t clocks[] = { CLOCK_REALTIME, CLOCK_MONOTONIC };
+	const char * clockNames[] = { "VdsoClock REALTIME", "VdsoClock MONOTONIC" };
+	for (int c = 0; c < 2; c++)
+	{
+		// The reads are summed and the sum printed so none can be dropped
+		unsigned long long sink = 0;
+		for (int j = 0; j < iterations; j++)
+		{
+			timespec start, end;
+			counters.Start();
+			clock_gettime(CLOCK_REALTIME, &start);
+			for (long long i = 0; i < sampleSize; i++)
+			{
+				sink += vdsoClock.Read(clocks[c]);
+				samples[i] = __rdtsc();
+			}
+			clock_gettime(CLOCK_REALTIME, &end);
+			counters.Stop();
+			ScaleAndPrintResults(start, end, sampleSize, samples, clockNames[c], counters);
+		}
+
+		// Largest difference from clock_gettime bracketing each read
+		long long worst = 0;
+		for (long long i = 0; i < sampleSize; i++)
+		{
+			timespec before, after;
+			clock_gettime(clocks[c], &before);
+			long long ns = vdsoClock.Read(clocks[c]);
+			clock_gettime(clocks[c], &after);
+			long long low = before.tv_sec * 1000000000ll + before.tv_nsec;
+			long long high = after.tv_sec * 1000000000ll + after.tv_nsec;
+			long long outside = ns < low ? low - ns : ns > high ? ns - high : 0;
+			worst = outside > worst ? outside : worst;
+		}
+		printf("%s outside clock_gettime bracket by at most %lldns (sum of timed reads %llx)\n", clockNames[c], worst, sink);
 	}
 
 	for (int j = 0; j < iterations; j++)
 	{
 		timespec start, end;
+		counters.Start();
 		clock_gettime(CLOCK_REALTIME, &start);
 		for (long long i = 0; i < sampleSize; i++)
 		{
 			samples[i] = __rdtsc();
 		}
 		clock_gettime(CLOCK_REALTIME, &end);
-		ScaleAndPrintResults(start, end, sampleSize, samples, "__rdtsc");
+		counters.Stop();
+		ScaleAndPrintResults(start, end, sampleSize, samples, "__rdtsc", counters);
 	}
 
 	return 0;
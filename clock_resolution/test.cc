@@ -2,6 +2,8 @@
 #include <chrono>
 #include <algorithm>
 #include <vector>
+#include <math.h>
+#include "PerfCounters/PerfCounters.h"
 
 #if defined(_MSC_VER)
 #include <windows.h>
@@ -19,6 +21,7 @@
     }
 #else
 #include <pthread.h>
+#include <x86intrin.h>
     inline bool SetThreadAffinity(size_t CpuId)
     {
         cpu_set_t cpuset;
@@ -86,10 +89,11 @@ unsigned long long MeasureClockResolution()
 }
 
 template <typename clock>
-void MeasureTimeStampLatency(long long & Latency, long long & StDev)
+void MeasureTimeStampLatency(long long & Latency, long long & StDev, PerfCounters & Counters)
 {
     const size_t iteration = 100000000;
     std::vector<unsigned long long> timeStamps(iteration);
+    Counters.Start();
     auto start = clock::now();
     auto end = clock::now();
     for (auto & ts : timeStamps)
@@ -97,6 +101,7 @@ void MeasureTimeStampLatency(long long & Latency, long long & StDev)
         end = clock::now();
         ts = __rdtsc();
     }
+    Counters.Stop();
     Latency = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / iteration;
     StDev = (long long)(StdDevAsFractionOfMean(timeStamps) * Latency);
 }
@@ -109,12 +114,16 @@ int main()
     std::cout << "std::chrono::steady_clock resolution on this platform is: " << MeasureClockResolution<std::chrono::steady_clock>() << "ns" << std::endl;
     long long latency;
     long long stdev;
-    MeasureTimeStampLatency<std::chrono::high_resolution_clock>(latency, stdev);
+    PerfCounters counters;
+    MeasureTimeStampLatency<std::chrono::high_resolution_clock>(latency, stdev, counters);
     std::cout << "Timestamp latency for std::chrono::high_resolution_clock resolution on this platform is: " << latency << "ns with STDEV " << stdev << "ns" << std::endl;
-    MeasureTimeStampLatency<std::chrono::system_clock>(latency, stdev);
+    std::cout << "std::chrono::high_resolution_clock " << counters.Format(100000000) << std::endl;
+    MeasureTimeStampLatency<std::chrono::system_clock>(latency, stdev, counters);
     std::cout << "Timestamp latency for std::chrono::system_clock resolution on this platform is: " << latency << "ns with STDEV " << stdev << "ns" << std::endl;
-    MeasureTimeStampLatency<std::chrono::steady_clock>(latency, stdev);
+    std::cout << "std::chrono::system_clock " << counters.Format(100000000) << std::endl;
+    MeasureTimeStampLatency<std::chrono::steady_clock>(latency, stdev, counters);
     std::cout << "Timestamp latency for std::chrono::steady_clock resolution on this platform is: " << latency << "ns with STDEV " << stdev << "ns" << std::endl;
+    std::cout << "std::chrono::steady_clock " << counters.Format(100000000) << std::endl;
 
     return 0;
 }